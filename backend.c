@@ -0,0 +1,250 @@
+#include "config.h"
+#include "nbd-debug.h"
+
+#include <backend.h>
+#include <cimage.h>
+#include <nbdsrv.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#if HAVE_DLOPEN
+#include <dlfcn.h>
+#endif
+
+/**
+ * What the compressed backend keeps for a connection
+ **/
+struct compressed {
+	int fhandle;	/**< the image */
+	CIMAGE *img;	/**< what cimage_open() made of it */
+};
+
+static int compressed_open(CLIENT *client, GError **err) {
+	struct compressed *c = g_new0(struct compressed, 1);
+	uint32_t blocksize;
+	CIMAGE_CODEC codec;
+	uint64_t packed;
+
+	if((c->fhandle = open(client->exportname, O_RDONLY)) < 0) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "Could not open exported file %s: %s",
+			    client->exportname, strerror(errno));
+		g_free(c);
+		return -1;
+	}
+	if(!(c->img = cimage_open(c->fhandle, client->server->cache, err))) {
+		close(c->fhandle);
+		g_free(c);
+		return -1;
+	}
+	client->exportsize = cimage_size(c->img);
+	client->backend_data = c;
+
+	cimage_info(c->img, &blocksize, &codec, &packed);
+	msg(LOG_INFO, "Compressed image, %s in blocks of %u bytes, %llu bytes on disk",
+	    cimage_codec_name(codec), (unsigned int)blocksize, (unsigned long long)packed);
+	return 0;
+}
+
+static int compressed_read(CLIENT *client, off_t a, char *buf, size_t len) {
+	struct compressed *c = client->backend_data;
+
+	return cimage_read(c->img, a, buf, len);
+}
+
+/* writes go to the copy-on-write file, or nowhere; the export is
+ * read-only otherwise */
+static int compressed_write(CLIENT *client G_GNUC_UNUSED, off_t a G_GNUC_UNUSED,
+			    char *buf G_GNUC_UNUSED, size_t len G_GNUC_UNUSED,
+			    int fua G_GNUC_UNUSED) {
+	errno = EROFS;
+	return -1;
+}
+
+static int compressed_flush(CLIENT *client G_GNUC_UNUSED) {
+	return 0;
+}
+
+static void compressed_prefetch(CLIENT *client, off_t a, off_t len) {
+	struct compressed *c = client->backend_data;
+
+	cimage_prefetch(c->img, a, len);
+}
+
+static void compressed_close(CLIENT *client) {
+	struct compressed *c = client->backend_data;
+
+	cimage_close(c->img);
+	close(c->fhandle);
+	g_free(c);
+	client->backend_data = NULL;
+}
+
+const BACKEND compressed_backend = {
+	BACKEND_ABI,
+	"compressed",
+	TRUE,
+	compressed_open,
+	compressed_read,
+	compressed_write,
+	compressed_flush,
+	NULL,
+	compressed_prefetch,
+	compressed_close,
+};
+
+/*
+ * The memory backend maps anonymous memory, so that the kernel only
+ * hands us pages when they are written to, and we can give them back
+ * when they are trimmed.
+ */
+
+static int memory_open(CLIENT *client, GError **err) {
+	uint64_t size = client->server->expected_size;
+	void *mem;
+
+	if(!size) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_CFILE_KEY_MISSING,
+			    "The memory backend needs a filesize");
+		return -1;
+	}
+	if(size > SIZE_MAX) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "A filesize of %llu is too big for the memory backend",
+			    (unsigned long long)size);
+		return -1;
+	}
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(mem == MAP_FAILED) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "Could not map %llu bytes of memory: %s",
+			    (unsigned long long)size, strerror(errno));
+		return -1;
+	}
+	client->exportsize = size;
+	client->backend_data = mem;
+	return 0;
+}
+
+static int memory_read(CLIENT *client, off_t a, char *buf, size_t len) {
+	memcpy(buf, (char *)client->backend_data + a, len);
+	return 0;
+}
+
+static int memory_write(CLIENT *client, off_t a, char *buf, size_t len,
+			int fua G_GNUC_UNUSED) {
+	memcpy((char *)client->backend_data + a, buf, len);
+	return 0;
+}
+
+static int memory_flush(CLIENT *client G_GNUC_UNUSED) {
+	return 0;
+}
+
+/* Whole pages are given back to the kernel, and read as zeroes after
+ * that; the rest is zeroed by hand, so that a trim always does the
+ * same thing. */
+static int memory_trim(CLIENT *client, off_t a, size_t len) {
+	char *mem = client->backend_data;
+	size_t pagesize = getpagesize();
+	off_t start = (a + pagesize - 1) / pagesize * pagesize;
+	off_t end = (a + len) / pagesize * pagesize;
+
+	if(start >= end) {
+		memset(mem + a, 0, len);
+		return 0;
+	}
+	memset(mem + a, 0, start - a);
+	madvise(mem + start, end - start, MADV_DONTNEED);
+	memset(mem + end, 0, a + len - end);
+	return 0;
+}
+
+static void memory_close(CLIENT *client) {
+	munmap(client->backend_data, client->exportsize);
+	client->backend_data = NULL;
+}
+
+const BACKEND memory_backend = {
+	BACKEND_ABI,
+	"memory",
+	FALSE,
+	memory_open,
+	memory_read,
+	memory_write,
+	memory_flush,
+	memory_trim,
+	NULL,
+	memory_close,
+};
+
+/** The backends that come with nbd-server */
+static const BACKEND *builtin[] = {
+	&file_backend,
+	&compressed_backend,
+	&memory_backend,
+};
+
+/**
+ * Load a backend from a shared object. The object stays loaded.
+ **/
+static const BACKEND* backend_load(const char* path, GError** err) {
+#if HAVE_DLOPEN
+	const BACKEND *backend;
+	void *handle;
+
+	if(!(handle = dlopen(path, RTLD_NOW | RTLD_LOCAL))) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "Could not load backend %s: %s", path, dlerror());
+		return NULL;
+	}
+	if(!(backend = dlsym(handle, BACKEND_SYMBOL))) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "%s does not export a backend: %s", path, dlerror());
+		dlclose(handle);
+		return NULL;
+	}
+	if(backend->abi != BACKEND_ABI) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "Backend %s was built for version %d of the backend interface, not %d",
+			    path, backend->abi, BACKEND_ABI);
+		dlclose(handle);
+		return NULL;
+	}
+	if(!backend->open || !backend->read || !backend->write
+	   || !backend->flush || !backend->close) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "Backend %s lacks a function it needs", path);
+		dlclose(handle);
+		return NULL;
+	}
+	msg(LOG_INFO, "Loaded backend %s from %s", backend->name, path);
+	return backend;
+#else
+	g_set_error(err, NBDS_ERR, NBDS_ERR_CFILE_VALUE_UNSUPPORTED,
+		    "This nbd-server was built without support for loading backends");
+	return NULL;
+#endif
+}
+
+const BACKEND* backend_find(const char* name, GError** err) {
+	int i;
+
+	if(strchr(name, '/'))
+		return backend_load(name, err);
+	for(i = 0; i < sizeof(builtin) / sizeof(builtin[0]); i++) {
+		if(!strcmp(builtin[i]->name, name))
+			return builtin[i];
+	}
+	g_set_error(err, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID,
+		    "There is no backend called %s", name);
+	return NULL;
+}
@@ -0,0 +1,133 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include "lfs.h"
+#include "nbdsrv.h"
+
+#include <glib.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+
+/**
+ * Backends: where the data of an export lives. Everything that is not
+ * particular to that (the block cache, the copy-on-write file, the
+ * journal, read-ahead detection) sits on top of the backend in expio.c
+ * and nbd-server.c, and works the same for every backend.
+ *
+ * A backend is a table of functions. The ones that come with nbd-server
+ * are looked up by name; others can be built as a shared object that
+ * exports a BACKEND called nbd_backend, and are loaded by giving the
+ * path of that shared object instead of a name (see the backend option
+ * in nbd-server(5)). Such a backend sees the CLIENT and SERVER
+ * structures, which are not a stable interface, so these headers are
+ * not installed: it is built in the source tree of the nbd-server that
+ * loads it, like tests/run/testbackend.c.
+ *
+ * Every client connection is served by a process of its own, so the
+ * functions get the CLIENT they work for, and a backend keeps the state
+ * of a connection in client->backend_data. The write, flush and trim
+ * functions can be called from the journal's destager thread, but never
+ * concurrently with each other.
+ **/
+
+/**
+ * The version of the BACKEND structure. A backend that is loaded from a
+ * shared object is only used if it was built for this version.
+ **/
+#define BACKEND_ABI 1
+
+/**
+ * The name of the BACKEND that a shared object exports
+ **/
+#define BACKEND_SYMBOL "nbd_backend"
+
+typedef struct _backend {
+	int abi;		/**< BACKEND_ABI */
+	const char* name;	/**< name for the config file and the log */
+	gboolean shared;	/**< whether all connections to an export see
+				  the same data; the block cache is only
+				  used if so */
+	/**
+	 * Open the export for a client: client->exportname and
+	 * client->server are filled in. Sets client->exportsize; the
+	 * server may then make it smaller, if the config asks for a
+	 * filesize.
+	 * @return 0 on success, -1 on failure (with err set)
+	 **/
+	int (*open)(CLIENT* client, GError** err);
+	/**
+	 * Read all of a range. The range is always inside the export.
+	 * @return 0 on success, -1 on failure (with errno set)
+	 **/
+	int (*read)(CLIENT* client, off_t a, char* buf, size_t len);
+	/**
+	 * Write all of a range. If fua is set, or F_SYNC is, the data must
+	 * be on stable storage before this returns.
+	 * @return 0 on success, -1 on failure (with errno set)
+	 **/
+	int (*write)(CLIENT* client, off_t a, char* buf, size_t len, int fua);
+	/**
+	 * Make everything that was written so far stable.
+	 * @return 0 on success, -1 on failure (with errno set)
+	 **/
+	int (*flush)(CLIENT* client);
+	/**
+	 * Discard a range; afterwards it may read as anything. May be
+	 * NULL if the backend can't.
+	 * @return 0 on success, -1 on failure (with errno set)
+	 **/
+	int (*trim)(CLIENT* client, off_t a, size_t len);
+	/**
+	 * Start reading a range that is likely to be read soon, without
+	 * waiting for it. May be NULL.
+	 **/
+	void (*prefetch)(CLIENT* client, off_t a, off_t len);
+	/**
+	 * Release what open() set up. Called when the client disconnects
+	 * cleanly.
+	 **/
+	void (*close)(CLIENT* client);
+} BACKEND;
+
+/**
+ * Files and block devices, optionally spread over several files
+ * (multifile, stripe) or created for the connection (temporary). This
+ * is the default.
+ **/
+extern const BACKEND file_backend;
+
+/**
+ * Compressed images, as written by nbd-compress (see cimage.h). They
+ * can't be written to, except through a copy-on-write file.
+ **/
+extern const BACKEND compressed_backend;
+
+/**
+ * Memory that the connection allocates, of the size given by filesize,
+ * and that starts out as zeroes. It is gone when the client
+ * disconnects; useful for scratch space and for benchmarking the rest
+ * of the server.
+ **/
+extern const BACKEND memory_backend;
+
+/**
+ * Look up a backend.
+ *
+ * @param name the name of a backend that comes with nbd-server, or the
+ * path of a shared object (anything with a slash in it)
+ * @param err set if there is no such backend
+ * @return the backend, or NULL on failure
+ **/
+const BACKEND* backend_find(const char* name, GError** err);
+
+/**
+ * Get the backend of a client's export.
+ **/
+static inline const BACKEND* backend_of(CLIENT* client) {
+	const BACKEND* backend = client->server->backend;
+
+	return backend ? backend : &file_backend;
+}
+
+#endif //BACKEND_H
@@ -0,0 +1,212 @@
+#include "config.h"
+#include "nbd-debug.h"
+
+#include <blockcache.h>
+#include <nbdsrv.h>
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#define CACHE_KIN (CACHE_WAYS / 4) /**< number of blocks of a set that we
+				      keep on probation, if we can */
+#define CACHE_SPIN 100		   /**< number of times we try to take a set's
+				      lock before we yield the CPU */
+
+/**
+ * An entry in the cache, in shared memory
+ **/
+struct centry {
+	gint seq;	/**< even when the entry is stable, odd while it changes */
+	gint stamp;	/**< value of the set's clock when it was last used */
+	gint hot;	/**< nonzero if the block has been hit since it came in */
+	gint pad;
+	uint64_t block;	/**< the block number plus one, or 0 if empty */
+};
+
+/**
+ * A set of the cache, in shared memory
+ **/
+struct cset {
+	gint lock;	/**< spinlock for writers */
+	gint clock;	/**< ticks on every use of an entry in the set */
+	gint gen;	/**< bumped whenever a block of the set is written */
+	gint pad;
+	struct centry e[CACHE_WAYS];
+};
+
+struct _blockcache {
+	uint64_t nsets;	    /**< number of sets */
+	struct cset *sets;  /**< the sets, in shared memory */
+	char *data;	    /**< the data of the entries, in shared memory */
+	uint64_t hits;	    /**< lookups that hit, in this process */
+	uint64_t misses;    /**< lookups that missed, in this process */
+};
+
+BLOCKCACHE* cache_new(uint64_t size, GError** err) {
+	BLOCKCACHE *cache = g_new0(BLOCKCACHE, 1);
+	size_t setsize, datasize;
+	void *mem;
+
+	cache->nsets = size / ((uint64_t)CACHE_BLOCKSIZE * CACHE_WAYS);
+	if(!cache->nsets)
+		cache->nsets = 1;
+	setsize = cache->nsets * sizeof(struct cset);
+	setsize = (setsize + CACHE_BLOCKSIZE - 1) / CACHE_BLOCKSIZE * CACHE_BLOCKSIZE;
+	datasize = cache->nsets * CACHE_WAYS * CACHE_BLOCKSIZE;
+	mem = mmap(NULL, setsize + datasize, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(mem == MAP_FAILED) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "Could not allocate %llu bytes of shared memory for the cache: %s",
+			    (unsigned long long)(setsize + datasize), strerror(errno));
+		g_free(cache);
+		return NULL;
+	}
+	/* anonymous mappings are zeroed, which is an empty cache */
+	cache->sets = mem;
+	cache->data = (char *)mem + setsize;
+	return cache;
+}
+
+static inline struct cset *get_set(BLOCKCACHE *cache, uint64_t block) {
+	/* spread neighbouring blocks, so that a sequential stream does not
+	 * wipe out a single set */
+	return &cache->sets[(block * 0x9e3779b97f4a7c15ULL >> 16) % cache->nsets];
+}
+
+static inline char *entry_data(BLOCKCACHE *cache, struct cset *set, int way) {
+	return cache->data + ((set - cache->sets) * CACHE_WAYS + way) * (size_t)CACHE_BLOCKSIZE;
+}
+
+static void lock_set(struct cset *set) {
+	int i = 0;
+
+	while(!g_atomic_int_compare_and_exchange(&set->lock, 0, 1)) {
+		if(++i >= CACHE_SPIN) {
+			sched_yield();
+			i = 0;
+		}
+	}
+}
+
+static void unlock_set(struct cset *set) {
+	g_atomic_int_set(&set->lock, 0);
+}
+
+/**
+ * Change an entry; the set's lock must be held.
+ *
+ * @param buf the new data, or NULL to empty the entry
+ **/
+static void set_entry(BLOCKCACHE *cache, struct cset *set, int way, uint64_t block, const char *buf) {
+	struct centry *e = &set->e[way];
+
+	g_atomic_int_inc(&e->seq);
+	if(buf) {
+		memcpy(entry_data(cache, set, way), buf, CACHE_BLOCKSIZE);
+		e->block = block + 1;
+	} else {
+		e->block = 0;
+	}
+	g_atomic_int_inc(&e->seq);
+}
+
+uint32_t cache_generation(BLOCKCACHE* cache, uint64_t block) {
+	return g_atomic_int_get(&get_set(cache, block)->gen);
+}
+
+gboolean cache_lookup(BLOCKCACHE* cache, uint64_t block, char* buf) {
+	struct cset *set = get_set(cache, block);
+	struct centry *e;
+	gint seq;
+	int i;
+
+	for(i = 0; i < CACHE_WAYS; i++) {
+		e = &set->e[i];
+		seq = g_atomic_int_get(&e->seq);
+		if((seq & 1) || e->block != block + 1)
+			continue;
+		memcpy(buf, entry_data(cache, set, i), CACHE_BLOCKSIZE);
+		__sync_synchronize();
+		if(g_atomic_int_get(&e->seq) != seq) {
+			/* changed while we copied it; don't bother trying
+			 * again, since it is probably gone */
+			break;
+		}
+		g_atomic_int_set(&e->stamp, g_atomic_int_add(&set->clock, 1));
+		if(!e->hot)
+			g_atomic_int_set(&e->hot, 1);
+		cache->hits++;
+		return TRUE;
+	}
+	cache->misses++;
+	return FALSE;
+}
+
+/**
+ * Pick the entry to replace in a set; the set's lock must be held.
+ **/
+static int pick_victim(struct cset *set) {
+	int i, a1 = 0;
+	int oldcold = -1, oldhot = -1;
+
+	for(i = 0; i < CACHE_WAYS; i++) {
+		struct centry *e = &set->e[i];
+
+		if(!e->block)
+			return i;
+		if(e->hot) {
+			if(oldhot < 0 || e->stamp - set->e[oldhot].stamp < 0)
+				oldhot = i;
+		} else {
+			a1++;
+			if(oldcold < 0 || e->stamp - set->e[oldcold].stamp < 0)
+				oldcold = i;
+		}
+	}
+	if(oldcold >= 0 && (a1 >= CACHE_KIN || oldhot < 0))
+		return oldcold;
+	return oldhot;
+}
+
+void cache_insert(BLOCKCACHE* cache, uint64_t block, const char* buf, uint32_t gen) {
+	struct cset *set = get_set(cache, block);
+	int i;
+
+	lock_set(set);
+	if((uint32_t)set->gen != gen)
+		goto out;
+	for(i = 0; i < CACHE_WAYS; i++) {
+		if(set->e[i].block == block + 1)
+			goto out;
+	}
+	i = pick_victim(set);
+	set->e[i].hot = 0;
+	set->e[i].stamp = g_atomic_int_add(&set->clock, 1);
+	set_entry(cache, set, i, block, buf);
+out:
+	unlock_set(set);
+}
+
+void cache_update(BLOCKCACHE* cache, uint64_t block, const char* buf) {
+	struct cset *set = get_set(cache, block);
+	int i;
+
+	lock_set(set);
+	g_atomic_int_inc(&set->gen);
+	for(i = 0; i < CACHE_WAYS; i++) {
+		if(set->e[i].block == block + 1) {
+			set_entry(cache, set, i, block, buf);
+			break;
+		}
+	}
+	unlock_set(set);
+}
+
+void cache_stats(BLOCKCACHE* cache, uint64_t* hits, uint64_t* misses) {
+	*hits = cache->hits;
+	*misses = cache->misses;
+}
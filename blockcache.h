@@ -0,0 +1,79 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include <glib.h>
+#include <stdint.h>
+
+/**
+ * The size of the blocks in the cache
+ **/
+#define CACHE_BLOCKSIZE 4096
+
+/**
+ * The number of blocks in a set of the cache. A block can only be
+ * cached in one set, chosen by its number.
+ **/
+#define CACHE_WAYS 8
+
+/**
+ * A block cache in shared memory. It is created by the parent before it
+ * forks, so that all children serving the same export share it.
+ *
+ * Lookups do not take any lock: every entry is protected by a sequence
+ * counter, which writers make odd while they change the entry, and
+ * readers check before and after copying the data. Writers take a
+ * spinlock per set.
+ *
+ * Replacement approximates 2Q within each set: blocks come in on
+ * probation, and are promoted to the hot part when they are hit again.
+ * As long as enough blocks of a set are on probation, the oldest of
+ * those is evicted; otherwise, the least recently used hot one is.
+ **/
+typedef struct _blockcache BLOCKCACHE;
+
+/**
+ * Create a block cache.
+ *
+ * @param size the amount of data to cache, in bytes
+ * @param err set if the shared memory could not be allocated
+ * @return the cache, or NULL on failure
+ **/
+BLOCKCACHE* cache_new(uint64_t size, GError** err);
+
+/**
+ * Get the current generation of the set that a block lives in. Take
+ * this before reading a block from disk, and pass it to cache_insert(),
+ * so that the block is not cached if it was written in the mean time.
+ **/
+uint32_t cache_generation(BLOCKCACHE* cache, uint64_t block);
+
+/**
+ * Look up a block in the cache.
+ *
+ * @param buf buffer of CACHE_BLOCKSIZE bytes the block is copied into
+ * @return TRUE if the block was found, FALSE otherwise
+ **/
+gboolean cache_lookup(BLOCKCACHE* cache, uint64_t block, char* buf);
+
+/**
+ * Add a block that was read from disk to the cache, unless a block in
+ * its set has been written since gen was taken.
+ *
+ * @param buf the block's data, CACHE_BLOCKSIZE bytes
+ * @param gen the value cache_generation() returned before the read
+ **/
+void cache_insert(BLOCKCACHE* cache, uint64_t block, const char* buf, uint32_t gen);
+
+/**
+ * Tell the cache that a block has been written. If the block is cached,
+ * its data is replaced by buf, or, if buf is NULL (because the write
+ * did not cover the whole block), it is dropped.
+ **/
+void cache_update(BLOCKCACHE* cache, uint64_t block, const char* buf);
+
+/**
+ * Get the number of lookups that hit and missed in this process.
+ **/
+void cache_stats(BLOCKCACHE* cache, uint64_t* hits, uint64_t* misses);
+
+#endif //BLOCKCACHE_H
@@ -0,0 +1,514 @@
+#include "config.h"
+#include "nbd-debug.h"
+
+#include <cimage.h>
+#include <nbdsrv.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <cliserv.h>
+
+#define ZSTD_DEFAULT_LEVEL 3	/**< what zstd itself defaults to */
+
+/**
+ * An open image
+ **/
+struct _cimage {
+	int fd;			/**< the image file */
+	CIMAGE_CODEC codec;
+	uint32_t blocksize;
+	uint64_t size;		/**< size of the data, uncompressed */
+	uint64_t nblocks;
+	void *map;		/**< the mapping of the index */
+	size_t maplen;
+	const uint64_t *index;	/**< nblocks + 1 offsets, in network byte order */
+	BLOCKCACHE *cache;	/**< where decompressed blocks go, if anywhere */
+	char *packed;		/**< a compressed block, as read from the file */
+	char *data;		/**< the block we decompressed last */
+	uint64_t last;		/**< its number, or UINT64_MAX */
+#if HAVE_ZLIB
+	z_stream zs;		/**< reused for every block */
+	gboolean zinit;
+#endif
+#if HAVE_ZSTD
+	ZSTD_DCtx *zd;		/**< reused for every block */
+#endif
+};
+
+/**
+ * An image being written
+ **/
+struct _cimage_writer {
+	int fd;
+	CIMAGE_CODEC codec;
+	uint32_t blocksize;
+	off_t pos;		/**< where the next block goes */
+	GArray *index;		/**< uint64_t; offsets in host byte order */
+};
+
+static const char *codecnames[] = { NULL, "zlib", "zstd" };
+
+const char* cimage_codec_name(CIMAGE_CODEC codec) {
+	if(codec < 1 || codec >= G_N_ELEMENTS(codecnames))
+		return NULL;
+	return codecnames[codec];
+}
+
+CIMAGE_CODEC cimage_codec_by_name(const char* name) {
+	int i;
+
+	for(i = 1; i < G_N_ELEMENTS(codecnames); i++) {
+		if(!strcmp(name, codecnames[i]))
+			return i;
+	}
+	return 0;
+}
+
+gboolean cimage_codec_supported(CIMAGE_CODEC codec) {
+	switch(codec) {
+#if HAVE_ZLIB
+	case CIMAGE_ZLIB:
+		return TRUE;
+#endif
+#if HAVE_ZSTD
+	case CIMAGE_ZSTD:
+		return TRUE;
+#endif
+	default:
+		return FALSE;
+	}
+}
+
+static int pread_full(int fd, char *buf, size_t len, off_t off) {
+	ssize_t ret;
+
+	while(len > 0) {
+		ret = pread(fd, buf, len, off);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0) {
+			if(ret == 0)
+				errno = EIO;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+		off += ret;
+	}
+	return 0;
+}
+
+static int pwrite_full(int fd, const char *buf, size_t len, off_t off) {
+	ssize_t ret;
+
+	while(len > 0) {
+		ret = pwrite(fd, buf, len, off);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret < 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+		off += ret;
+	}
+	return 0;
+}
+
+size_t cimage_bound(CIMAGE_CODEC codec, size_t len) {
+	size_t bound = 0;
+
+	switch(codec) {
+#if HAVE_ZLIB
+	case CIMAGE_ZLIB:
+		bound = compressBound(len);
+		break;
+#endif
+#if HAVE_ZSTD
+	case CIMAGE_ZSTD:
+		bound = ZSTD_compressBound(len);
+		break;
+#endif
+	default:
+		break;
+	}
+	return bound > len ? bound : len;
+}
+
+ssize_t cimage_pack(CIMAGE_CODEC codec, int level, const char* in,
+		    size_t len, char* out) {
+	ssize_t plen = -1;
+
+	if(!len || (!in[0] && !memcmp(in, in + 1, len - 1)))
+		return 0;
+	switch(codec) {
+#if HAVE_ZLIB
+	case CIMAGE_ZLIB: {
+		uLongf zlen = compressBound(len);
+
+		if(compress2((Bytef *)out, &zlen, (const Bytef *)in, len,
+			     level ? level : Z_DEFAULT_COMPRESSION) == Z_OK)
+			plen = zlen;
+		break;
+	}
+#endif
+#if HAVE_ZSTD
+	case CIMAGE_ZSTD: {
+		size_t zlen = ZSTD_compress(out, ZSTD_compressBound(len), in, len,
+					    level ? level : ZSTD_DEFAULT_LEVEL);
+
+		if(!ZSTD_isError(zlen))
+			plen = zlen;
+		break;
+	}
+#endif
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	if(plen < 0) {
+		errno = EIO;
+		return -1;
+	}
+	/* a block as long as its data is stored as is, so a block that
+	 * does not get shorter is stored as is */
+	if(plen >= len) {
+		memcpy(out, in, len);
+		plen = len;
+	}
+	return plen;
+}
+
+CIMAGE* cimage_open(int fd, BLOCKCACHE* cache, GError** err) {
+	struct cimage_header hdr;
+	struct stat st;
+	CIMAGE *img;
+	off_t mapstart;
+	uint64_t indexoff, indexlen;
+	long pagesize = sysconf(_SC_PAGESIZE);
+
+	if(fstat(fd, &st) < 0 || pread_full(fd, (char *)&hdr, sizeof(hdr), 0) < 0) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "Could not read the header of the compressed image: %s",
+			    strerror(errno));
+		return NULL;
+	}
+	if(memcmp(hdr.magic, CIMAGE_MAGIC, sizeof(hdr.magic))) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "Not a compressed image (bad magic)");
+		return NULL;
+	}
+	img = g_new0(CIMAGE, 1);
+	img->fd = fd;
+	img->cache = cache;
+	img->last = UINT64_MAX;
+	img->codec = ntohl(hdr.codec);
+	img->blocksize = ntohl(hdr.blocksize);
+	img->size = ntohll(hdr.size);
+	indexoff = ntohll(hdr.indexoff);
+	if(!cimage_codec_supported(img->codec)) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "The compressed image uses codec %s, which this build does not support",
+			    cimage_codec_name(img->codec) ? cimage_codec_name(img->codec) : "(unknown)");
+		g_free(img);
+		return NULL;
+	}
+	if(!img->blocksize || img->blocksize % CACHE_BLOCKSIZE) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "Invalid block size %u in the compressed image", img->blocksize);
+		g_free(img);
+		return NULL;
+	}
+	img->nblocks = (img->size + img->blocksize - 1) / img->blocksize;
+	indexlen = (img->nblocks + 1) * sizeof(uint64_t);
+	if(indexoff < sizeof(hdr) || indexoff + indexlen > st.st_size) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "The compressed image is truncated");
+		g_free(img);
+		return NULL;
+	}
+	mapstart = indexoff / pagesize * pagesize;
+	img->maplen = indexoff - mapstart + indexlen;
+	img->map = mmap(NULL, img->maplen, PROT_READ, MAP_SHARED, fd, mapstart);
+	if(img->map == MAP_FAILED) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "Could not map the index of the compressed image: %s",
+			    strerror(errno));
+		g_free(img);
+		return NULL;
+	}
+	img->index = (const uint64_t *)((char *)img->map + (indexoff - mapstart));
+	if(ntohll(img->index[0]) < sizeof(hdr) || ntohll(img->index[img->nblocks]) != indexoff) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "The index of the compressed image is corrupt");
+		cimage_close(img);
+		return NULL;
+	}
+	img->packed = g_malloc(cimage_bound(img->codec, img->blocksize));
+	img->data = g_malloc(img->blocksize);
+	return img;
+}
+
+uint64_t cimage_size(CIMAGE* img) {
+	return img->size;
+}
+
+void cimage_info(CIMAGE* img, uint32_t* blocksize, CIMAGE_CODEC* codec,
+		 uint64_t* packed) {
+	*blocksize = img->blocksize;
+	*codec = img->codec;
+	*packed = ntohll(img->index[img->nblocks]) - ntohll(img->index[0]);
+}
+
+/**
+ * Decompress len bytes of packed data into out, which is exactly as long
+ * as the data should be.
+ **/
+static int unpack(CIMAGE *img, char *packed, size_t plen, char *out, size_t len) {
+	switch(img->codec) {
+#if HAVE_ZLIB
+	case CIMAGE_ZLIB:
+		if(!img->zinit) {
+			if(inflateInit(&img->zs) != Z_OK)
+				break;
+			img->zinit = TRUE;
+		} else if(inflateReset(&img->zs) != Z_OK) {
+			break;
+		}
+		img->zs.next_in = (Bytef *)packed;
+		img->zs.avail_in = plen;
+		img->zs.next_out = (Bytef *)out;
+		img->zs.avail_out = len;
+		if(inflate(&img->zs, Z_FINISH) == Z_STREAM_END && !img->zs.avail_out)
+			return 0;
+		break;
+#endif
+#if HAVE_ZSTD
+	case CIMAGE_ZSTD: {
+		size_t ret;
+
+		if(!img->zd && !(img->zd = ZSTD_createDCtx()))
+			break;
+		ret = ZSTD_decompressDCtx(img->zd, out, len, packed, plen);
+		if(!ZSTD_isError(ret) && ret == len)
+			return 0;
+		break;
+	}
+#endif
+	default:
+		break;
+	}
+	errno = EIO;
+	return -1;
+}
+
+/**
+ * Add a block that was just decompressed to the block cache, in pages
+ * of CACHE_BLOCKSIZE. The image is read-only, so nothing can have been
+ * written to these pages since we read them.
+ **/
+static void cache_block(CIMAGE *img, uint64_t n, const char *data, size_t len) {
+	char page[CACHE_BLOCKSIZE];
+	uint64_t first = n * img->blocksize / CACHE_BLOCKSIZE;
+	size_t off;
+
+	for(off = 0; off < len; off += CACHE_BLOCKSIZE) {
+		uint64_t block = first + off / CACHE_BLOCKSIZE;
+		uint32_t gen = cache_generation(img->cache, block);
+
+		if(len - off < CACHE_BLOCKSIZE) {
+			/* the end of the image; like cached_read(), pad it */
+			memcpy(page, data + off, len - off);
+			memset(page + (len - off), 0, CACHE_BLOCKSIZE - (len - off));
+			cache_insert(img->cache, block, page, gen);
+		} else {
+			cache_insert(img->cache, block, data + off, gen);
+		}
+	}
+}
+
+/**
+ * Get block n into out, which has room for the whole block.
+ **/
+static int get_block(CIMAGE *img, uint64_t n, char *out, size_t len) {
+	uint64_t start = ntohll(img->index[n]);
+	uint64_t end = ntohll(img->index[n + 1]);
+	size_t plen = end - start;
+
+	if(end < start || plen > cimage_bound(img->codec, len)) {
+		errno = EIO;
+		return -1;
+	}
+	if(!plen) {
+		memset(out, 0, len);
+	} else if(plen == len) {
+		if(pread_full(img->fd, out, len, start) < 0)
+			return -1;
+	} else {
+		if(pread_full(img->fd, img->packed, plen, start) < 0)
+			return -1;
+		if(unpack(img, img->packed, plen, out, len) < 0)
+			return -1;
+	}
+	if(img->cache)
+		cache_block(img, n, out, len);
+	return 0;
+}
+
+int cimage_read(CIMAGE* img, off_t a, char* buf, size_t len) {
+	uint64_t n;
+	size_t off, blen, cur;
+
+	if(a < 0 || a + len > img->size) {
+		errno = EINVAL;
+		return -1;
+	}
+	while(len > 0) {
+		n = a / img->blocksize;
+		off = a % img->blocksize;
+		blen = img->blocksize;
+		if(img->size - n * img->blocksize < blen)
+			blen = img->size - n * img->blocksize;
+		cur = blen - off;
+		if(cur > len)
+			cur = len;
+		if(n == img->last) {
+			memcpy(buf, img->data + off, cur);
+		} else if(cur == blen) {
+			/* the whole block: straight into buf */
+			if(get_block(img, n, buf, blen) < 0)
+				return -1;
+		} else {
+			img->last = UINT64_MAX;
+			if(get_block(img, n, img->data, blen) < 0)
+				return -1;
+			img->last = n;
+			memcpy(buf, img->data + off, cur);
+		}
+		a += cur;
+		buf += cur;
+		len -= cur;
+	}
+	return 0;
+}
+
+void cimage_prefetch(CIMAGE* img, off_t a, off_t len) {
+#if HAVE_POSIX_FADVISE
+	uint64_t first, last;
+
+	if(a >= img->size || len <= 0)
+		return;
+	if(len > img->size - a)
+		len = img->size - a;
+	first = a / img->blocksize;
+	last = (a + len - 1) / img->blocksize;
+	posix_fadvise(img->fd, ntohll(img->index[first]),
+		      ntohll(img->index[last + 1]) - ntohll(img->index[first]),
+		      POSIX_FADV_WILLNEED);
+#endif
+}
+
+void cimage_close(CIMAGE* img) {
+	munmap(img->map, img->maplen);
+#if HAVE_ZLIB
+	if(img->zinit)
+		inflateEnd(&img->zs);
+#endif
+#if HAVE_ZSTD
+	if(img->zd)
+		ZSTD_freeDCtx(img->zd);
+#endif
+	g_free(img->packed);
+	g_free(img->data);
+	g_free(img);
+}
+
+CIMAGE_WRITER* cimage_writer_new(int fd, CIMAGE_CODEC codec,
+				 uint32_t blocksize, GError** err) {
+	CIMAGE_WRITER *w;
+	uint64_t first = sizeof(struct cimage_header);
+
+	if(!cimage_codec_supported(codec)) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "This build does not support codec %s",
+			    cimage_codec_name(codec) ? cimage_codec_name(codec) : "(unknown)");
+		return NULL;
+	}
+	if(!blocksize || blocksize % CACHE_BLOCKSIZE) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "The block size must be a multiple of %d", CACHE_BLOCKSIZE);
+		return NULL;
+	}
+	w = g_new0(CIMAGE_WRITER, 1);
+	w->fd = fd;
+	w->codec = codec;
+	w->blocksize = blocksize;
+	w->pos = first;
+	w->index = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+	g_array_append_val(w->index, first);
+	return w;
+}
+
+int cimage_writer_add(CIMAGE_WRITER* w, const char* packed, size_t len) {
+	uint64_t end;
+
+	if(pwrite_full(w->fd, packed, len, w->pos) < 0)
+		return -1;
+	w->pos += len;
+	end = w->pos;
+	g_array_append_val(w->index, end);
+	return 0;
+}
+
+int cimage_writer_finish(CIMAGE_WRITER* w, uint64_t size, GError** err) {
+	struct cimage_header hdr;
+	uint64_t nblocks = (size + w->blocksize - 1) / w->blocksize;
+	uint64_t *index;
+	guint i;
+	int retval = -1;
+
+	if(nblocks != w->index->len - 1) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "%llu blocks were written, but the size calls for %llu",
+			    (unsigned long long)(w->index->len - 1),
+			    (unsigned long long)nblocks);
+		goto out;
+	}
+	index = (uint64_t *)w->index->data;
+	for(i = 0; i < w->index->len; i++)
+		index[i] = htonll(index[i]);
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CIMAGE_MAGIC, sizeof(hdr.magic));
+	hdr.codec = htonl(w->codec);
+	hdr.blocksize = htonl(w->blocksize);
+	hdr.size = htonll(size);
+	hdr.indexoff = htonll(w->pos);
+	/* the header goes last, so that an image we did not finish is not
+	 * mistaken for a good one */
+	if(pwrite_full(w->fd, w->index->data, w->index->len * sizeof(uint64_t), w->pos) < 0
+	   || fsync(w->fd) < 0
+	   || pwrite_full(w->fd, (char *)&hdr, sizeof(hdr), 0) < 0) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "Could not write the compressed image: %s", strerror(errno));
+		goto out;
+	}
+	retval = 0;
+out:
+	g_array_free(w->index, TRUE);
+	g_free(w);
+	return retval;
+}
@@ -0,0 +1,180 @@
+#ifndef CIMAGE_H
+#define CIMAGE_H
+
+#include "lfs.h"
+#include "blockcache.h"
+
+#include <glib.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+/**
+ * Compressed images: a read-only export that takes a fraction of the
+ * space of the data it holds, for golden images and the like.
+ *
+ * The data is cut in blocks of a fixed size, and every block is
+ * compressed on its own, so that any of them can be read without
+ * reading the others. The file starts with a header, which is followed
+ * by the compressed blocks, back to back, and then by the index: the
+ * offset in the file of every block, plus the offset where the last
+ * one ends, so that block n is everything between entries n and n+1.
+ * A block that takes no space at all holds only zeroes; a block that
+ * is as long as its uncompressed size did not compress, and is stored
+ * as is. All numbers are in network byte order.
+ *
+ * Use nbd-compress to create images.
+ **/
+
+#define CIMAGE_MAGIC "NBDCIMG1"
+
+/**
+ * Default size of the blocks of an image. Larger blocks compress
+ * better, but a read of a few bytes has to decompress all of it.
+ **/
+#define CIMAGE_BLOCKSIZE (64*1024)
+
+/**
+ * Size of the block cache a compressed export gets if the config file
+ * does not ask for one. Blocks are decompressed as a whole, and all
+ * that was decompressed goes in the cache, so the rest of the block
+ * need not be decompressed again, by any client.
+ **/
+#define CIMAGE_CACHESIZE (64*1024*1024)
+
+/**
+ * The compression algorithms an image can use.
+ **/
+typedef enum {
+	CIMAGE_ZLIB=1,	/**< zlib (deflate) */
+	CIMAGE_ZSTD=2,	/**< Zstandard */
+} CIMAGE_CODEC;
+
+/**
+ * The header at the start of an image
+ **/
+struct cimage_header {
+	char magic[8];		/**< CIMAGE_MAGIC */
+	uint32_t codec;		/**< a CIMAGE_CODEC */
+	uint32_t blocksize;	/**< the size of a block, uncompressed; a
+				  multiple of CACHE_BLOCKSIZE */
+	uint64_t size;		/**< the size of the data, uncompressed */
+	uint64_t indexoff;	/**< offset of the index in the file */
+	char reserved[32];
+} __attribute__((packed));
+
+typedef struct _cimage CIMAGE;
+typedef struct _cimage_writer CIMAGE_WRITER;
+
+/**
+ * Get the name of a codec.
+ *
+ * @return the name, or NULL if codec is not a codec
+ **/
+const char* cimage_codec_name(CIMAGE_CODEC codec);
+
+/**
+ * Look up a codec by name.
+ *
+ * @return the codec, or 0 if there is no such codec
+ **/
+CIMAGE_CODEC cimage_codec_by_name(const char* name);
+
+/**
+ * Check whether this build can compress and decompress with a codec.
+ **/
+gboolean cimage_codec_supported(CIMAGE_CODEC codec);
+
+/**
+ * Open an image. The index is mapped rather than read, so that all
+ * processes serving the image share it.
+ *
+ * @param fd the image, open for reading; it stays open
+ * @param cache if not NULL, every block that is decompressed is added
+ * to this cache in full
+ * @param err set if the image could not be opened
+ * @return the image, or NULL on failure
+ **/
+CIMAGE* cimage_open(int fd, BLOCKCACHE* cache, GError** err);
+
+/**
+ * Get the size of the data in an image, uncompressed.
+ **/
+uint64_t cimage_size(CIMAGE* img);
+
+/**
+ * Get the block size and codec of an image, and the number of bytes
+ * its compressed blocks take.
+ **/
+void cimage_info(CIMAGE* img, uint32_t* blocksize, CIMAGE_CODEC* codec,
+		 uint64_t* packed);
+
+/**
+ * Read from an image. Apart from what is read, the last block that was
+ * decompressed is kept, so that small reads that follow each other
+ * decompress it only once.
+ *
+ * @return 0 on success, -1 on failure (with errno set)
+ **/
+int cimage_read(CIMAGE* img, off_t a, char* buf, size_t len);
+
+/**
+ * Ask the kernel to start reading the compressed blocks that hold a
+ * range of the data into the page cache. This does not wait for them.
+ **/
+void cimage_prefetch(CIMAGE* img, off_t a, off_t len);
+
+/**
+ * Close an image. The file descriptor it was opened on is not closed.
+ **/
+void cimage_close(CIMAGE* img);
+
+/**
+ * Get the most a block of len bytes can take after cimage_pack().
+ **/
+size_t cimage_bound(CIMAGE_CODEC codec, size_t len);
+
+/**
+ * Compress a block for an image. This does not touch any state, so it
+ * can be called from several threads at once.
+ *
+ * @param level the compression level, or 0 for the codec's default
+ * @param out where the block goes, at least cimage_bound() bytes
+ * @return the length of the block in out: 0 if it only holds zeroes,
+ * len if it did not compress and was copied as is, or -1 on failure
+ **/
+ssize_t cimage_pack(CIMAGE_CODEC codec, int level, const char* in,
+		    size_t len, char* out);
+
+/**
+ * Start writing an image.
+ *
+ * @param fd the file to write to, open for writing and empty; it stays
+ * open
+ * @param blocksize the size of a block; a multiple of CACHE_BLOCKSIZE
+ * @param err set on failure
+ * @return the writer, or NULL on failure
+ **/
+CIMAGE_WRITER* cimage_writer_new(int fd, CIMAGE_CODEC codec,
+				 uint32_t blocksize, GError** err);
+
+/**
+ * Append the next block to an image.
+ *
+ * @param packed the block, as cimage_pack() returned it
+ * @param len the length cimage_pack() returned
+ * @return 0 on success, -1 on failure (with errno set)
+ **/
+int cimage_writer_add(CIMAGE_WRITER* w, const char* packed, size_t len);
+
+/**
+ * Write the index and the header of an image, and free the writer.
+ *
+ * @param size the size of the data, uncompressed: all blocks that were
+ * added are full, except perhaps the last one
+ * @param err set on failure
+ * @return 0 on success, -1 on failure
+ **/
+int cimage_writer_finish(CIMAGE_WRITER* w, uint64_t size, GError** err);
+
+#endif //CIMAGE_H
@@ -0,0 +1,1032 @@
+#include "config.h"
+#include "nbd-debug.h"
+
+#include <backend.h>
+#include <expio.h>
+#include <nbdsrv.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#if HAVE_FALLOC_PH
+#include <linux/falloc.h>
+#endif
+
+#include <cliserv.h>
+
+/* slow log timing, see expio.h */
+__thread bool timing = false;
+gint64 phase_mark;
+gint64 phase_time[PHASE_COUNT];
+
+#define MAX_IO_THREADS 16 /**< maximum number of I/O operations on the files
+			       of a multifile export that run concurrently */
+
+/** Types of work that can be handed to the I/O pool */
+typedef enum {
+	IO_READ,	/**< preadv() into the buffers */
+	IO_WRITE,	/**< pwritev() from the buffers */
+	IO_SYNC,	/**< fsync() the file */
+} IO_TYPE;
+
+/**
+ * Bookkeeping for a set of I/O jobs that were handed to the I/O pool
+ * together, and that are waited for together.
+ **/
+struct iogroup {
+	GMutex lock;	  /**< protects the members below */
+	GCond done;	  /**< signalled when pending drops to zero */
+	int pending;	  /**< number of jobs that have not finished yet */
+	int error;	  /**< errno of the first job that failed, or 0 */
+};
+
+/**
+ * One job for a thread of the I/O pool: a single (vectored) read,
+ * write or sync on one file.
+ **/
+struct iojob {
+	IO_TYPE type;		  /**< what to do */
+	FILE_INFO *fi;		  /**< the file to do it on */
+	off_t foffset;		  /**< offset in that file */
+	GArray *iov;		  /**< array of struct iovec; the buffers */
+	int sync;		  /**< for IO_WRITE: 1 to fdatasync() after
+				       writing, 2 to fsync() */
+	struct iogroup *group;	  /**< the group this job belongs to */
+};
+
+static GThreadPool *iopool = NULL; /**< threads that do the I/O of requests
+				        that touch more than one file of a
+				        multifile export */
+
+int get_filepos(CLIENT *client, off_t a, int* fhandle, off_t* foffset, size_t* maxbytes ) {
+	GArray* export = client->export;
+	uint64_t stripesize = client->server->stripesize;
+
+	/* Negative offset not allowed */
+	if(a < 0)
+		return -1;
+
+	if(stripesize) {
+		uint64_t stripe = a / stripesize;
+		int idx = stripe % export->len;
+
+		*fhandle = g_array_index(export, FILE_INFO, idx).fhandle;
+		*foffset = (stripe / export->len) * stripesize + a % stripesize;
+		*maxbytes = stripesize - a % stripesize;
+
+		return idx;
+	}
+
+	/* Binary search for last file with starting offset <= a */
+	FILE_INFO fi;
+	int start = 0;
+	int end = export->len - 1;
+	while( start <= end ) {
+		int mid = (start + end) / 2;
+		fi = g_array_index(export, FILE_INFO, mid);
+		if( fi.startoff < a ) {
+			start = mid + 1;
+		} else if( fi.startoff > a ) {
+			end = mid - 1;
+		} else {
+			start = end = mid;
+			break;
+		}
+	}
+
+	/* end should never go negative, since first startoff is 0 and a >= 0 */
+	assert(end >= 0);
+
+	fi = g_array_index(export, FILE_INFO, end);
+	*fhandle = fi.fhandle;
+	*foffset = a - fi.startoff;
+	*maxbytes = 0;
+	if( end+1 < export->len ) {
+		FILE_INFO fi_next = g_array_index(export, FILE_INFO, end+1);
+		*maxbytes = fi_next.startoff - a;
+	}
+
+	return end;
+}
+
+void myseek(int handle,off_t a) {
+	if (lseek(handle, a, SEEK_SET) < 0) {
+		err("Can not seek locally!\n");
+	}
+}
+
+/**
+ * Do a vectored read or write of all the buffers in iov, retrying on
+ * short transfers.
+ *
+ * @param type IO_READ or IO_WRITE
+ * @param fhandle the file to do it on
+ * @param foffset the offset in fhandle
+ * @param iov the buffers; modified to keep track of progress
+ * @param iovcnt the number of buffers in iov
+ * @return 0 on success, -1 on failure (with errno set)
+ **/
+static int do_iov(IO_TYPE type, int fhandle, off_t foffset, struct iovec *iov, int iovcnt) {
+	ssize_t ret;
+
+	while(iovcnt > 0) {
+		if(type == IO_READ) {
+			ret = preadv(fhandle, iov, iovcnt, foffset);
+		} else {
+			ret = pwritev(fhandle, iov, iovcnt, foffset);
+		}
+		if(ret < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		if(ret == 0) {
+			/* reading past the end of a file */
+			errno = EIO;
+			return -1;
+		}
+		foffset += ret;
+		while(iovcnt > 0 && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(ret) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Do one I/O job. Runs in a thread of the I/O pool.
+ *
+ * On success, the job's group pointer is cleared, so that the
+ * submitter can tell which jobs failed.
+ *
+ * @param data the struct iojob describing what to do
+ * @param user_data unused
+ **/
+static void io_worker(gpointer data, gpointer user_data G_GNUC_UNUSED) {
+	struct iojob *job = data;
+	struct iogroup *group = job->group;
+	int fhandle = job->fi->fhandle;
+	int retval;
+
+	switch(job->type) {
+	case IO_SYNC:
+		retval = fsync(fhandle);
+		break;
+	default:
+		retval = do_iov(job->type, fhandle, job->foffset,
+				&g_array_index(job->iov, struct iovec, 0),
+				job->iov->len);
+		if(!retval && job->sync == 2) {
+			retval = fsync(fhandle);
+		} else if(!retval && job->sync) {
+			retval = fdatasync(fhandle);
+		}
+		break;
+	}
+
+	g_mutex_lock(&group->lock);
+	if(retval < 0) {
+		if(!group->error) {
+			group->error = errno;
+		}
+	} else {
+		job->group = NULL;
+	}
+	if(!--group->pending) {
+		g_cond_signal(&group->done);
+	}
+	g_mutex_unlock(&group->lock);
+}
+
+/**
+ * Get the I/O pool, creating it on first use. The pool is created
+ * lazily so that it is only ever started in the process that serves a
+ * client, i.e., after we fork().
+ *
+ * @return the pool, or NULL if no threads could be started (in which
+ * case the caller should do its I/O serially)
+ **/
+static GThreadPool *get_iopool(void) {
+	static GMutex lock;	/* the journal's destager does I/O, too */
+	static bool failed = false;
+	GError *gerror = NULL;
+
+	g_mutex_lock(&lock);
+	if(!iopool && !failed) {
+		iopool = g_thread_pool_new(io_worker, NULL, MAX_IO_THREADS, FALSE, &gerror);
+		if(!iopool) {
+			msg(LOG_WARNING, "Could not create I/O threads, doing I/O serially: %s",
+			    gerror->message);
+			g_clear_error(&gerror);
+			failed = true;
+		}
+	}
+	g_mutex_unlock(&lock);
+	return iopool;
+}
+
+static void iogroup_init(struct iogroup *group) {
+	g_mutex_init(&group->lock);
+	g_cond_init(&group->done);
+	group->pending = 0;
+	group->error = 0;
+}
+
+/**
+ * Hand a job to the I/O pool as part of a group.
+ **/
+static void iogroup_push(struct iogroup *group, struct iojob *job) {
+	job->group = group;
+	g_mutex_lock(&group->lock);
+	group->pending++;
+	g_mutex_unlock(&group->lock);
+	g_thread_pool_push(iopool, job, NULL);
+}
+
+/**
+ * Wait until all jobs of a group have finished, and clean up the group.
+ * group->error is still valid afterwards.
+ **/
+static void iogroup_wait(struct iogroup *group) {
+	g_mutex_lock(&group->lock);
+	while(group->pending) {
+		g_cond_wait(&group->done, &group->lock);
+	}
+	g_mutex_unlock(&group->lock);
+	g_cond_clear(&group->done);
+	g_mutex_clear(&group->lock);
+}
+
+/**
+ * Check whether a request touches more than one file of the export
+ **/
+static bool spans_files(off_t a, size_t len, CLIENT *client) {
+	int fhandle;
+	off_t foffset;
+	size_t maxbytes;
+
+	if(client->export->len < 2)
+		return false;
+	if(get_filepos(client, a, &fhandle, &foffset, &maxbytes) < 0)
+		return false;
+	return maxbytes && len > maxbytes;
+}
+
+/**
+ * Read or write a request that touches more than one file of a
+ * multifile export. The request is split into one segment per file
+ * (per stripe, for striped exports), segments that are adjacent in the
+ * same file are merged into a single vectored job, and all jobs are
+ * handed to the I/O pool at once. We return when they have all
+ * completed.
+ *
+ * @param type IO_READ or IO_WRITE
+ * @param a The offset where the request starts
+ * @param buf The buffer to read into or write from
+ * @param len The length of buf
+ * @param client The client we're serving for
+ * @param fua Flag to indicate 'Force Unit Access' (writes only)
+ * @return 0 on success, -1 on failure (with errno set)
+ **/
+static int rawexp_parallel(IO_TYPE type, off_t a, char *buf, size_t len, CLIENT *client, int fua) {
+	GArray *export = client->export;
+	GArray *jobs = g_array_new(FALSE, TRUE, sizeof(struct iojob));
+	int *lastjob = g_new(int, export->len);
+	struct iogroup group;
+	int sync = 0;
+	int retval = 0;
+	int i;
+
+	if(type == IO_WRITE) {
+		if(client->server->flags & F_SYNC) {
+			sync = 2;
+		} else if(fua) {
+			sync = 1;
+		}
+	}
+	for(i = 0; i < export->len; i++) {
+		lastjob[i] = -1;
+	}
+	while(len > 0) {
+		int fhandle;
+		off_t foffset;
+		size_t maxbytes;
+		int idx;
+		struct iovec v;
+		struct iojob *job = NULL;
+
+		if((idx = get_filepos(client, a, &fhandle, &foffset, &maxbytes)) < 0) {
+			errno = EINVAL;
+			retval = -1;
+			goto out;
+		}
+		v.iov_base = buf;
+		v.iov_len = (maxbytes && len > maxbytes) ? maxbytes : len;
+		if(lastjob[idx] >= 0) {
+			struct iovec *last;
+			off_t end;
+			int j;
+
+			job = &g_array_index(jobs, struct iojob, lastjob[idx]);
+			last = &g_array_index(job->iov, struct iovec, job->iov->len - 1);
+			end = job->foffset;
+			for(j = 0; j < job->iov->len; j++) {
+				end += g_array_index(job->iov, struct iovec, j).iov_len;
+			}
+			if(end != foffset || job->iov->len >= IOV_MAX) {
+				job = NULL;
+			} else if((char *)last->iov_base + last->iov_len == v.iov_base) {
+				last->iov_len += v.iov_len;
+				goto next;
+			}
+		}
+		if(!job) {
+			struct iojob newjob;
+
+			memset(&newjob, 0, sizeof(newjob));
+			newjob.type = type;
+			newjob.fi = &g_array_index(export, FILE_INFO, idx);
+			newjob.foffset = foffset;
+			newjob.iov = g_array_new(FALSE, FALSE, sizeof(struct iovec));
+			newjob.sync = sync;
+			g_array_append_val(jobs, newjob);
+			lastjob[idx] = jobs->len - 1;
+			job = &g_array_index(jobs, struct iojob, jobs->len - 1);
+		}
+		g_array_append_val(job->iov, v);
+	next:
+		a += v.iov_len;
+		buf += v.iov_len;
+		len -= v.iov_len;
+	}
+
+	iogroup_init(&group);
+	for(i = 0; i < jobs->len; i++) {
+		iogroup_push(&group, &g_array_index(jobs, struct iojob, i));
+	}
+	iogroup_wait(&group);
+	for(i = 0; i < jobs->len; i++) {
+		struct iojob *job = &g_array_index(jobs, struct iojob, i);
+
+		if(type == IO_WRITE && !sync && !job->group) {
+			g_atomic_int_set(&job->fi->dirty, TRUE);
+		}
+	}
+	if(group.error) {
+		errno = group.error;
+		retval = -1;
+	}
+out:
+	for(i = 0; i < jobs->len; i++) {
+		g_array_free(g_array_index(jobs, struct iojob, i).iov, TRUE);
+	}
+	g_array_free(jobs, TRUE);
+	g_free(lastjob);
+	return retval;
+}
+
+ssize_t rawexpwrite(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
+	int fhandle;
+	off_t foffset;
+	size_t maxbytes;
+	ssize_t retval;
+	int fileidx;
+
+	if((fileidx = get_filepos(client, a, &fhandle, &foffset, &maxbytes)) < 0)
+		return -1;
+	if(maxbytes && len > maxbytes)
+		len = maxbytes;
+
+	DEBUG("(WRITE to fd %d offset %llu len %u fua %d), ", fhandle, (long long unsigned)foffset, (unsigned int)len, fua);
+
+	retval = pwrite(fhandle, buf, len, foffset);
+	if(client->server->flags & F_SYNC) {
+		phase_done(PHASE_DISK);
+		fsync(fhandle);
+		phase_done(PHASE_SYNC);
+	} else if (!fua) {
+		/* Remember that this file needs to be synced on the next
+		 * flush; expflush() won't touch files that are clean. */
+		g_atomic_int_set(&g_array_index(client->export, FILE_INFO, fileidx).dirty, TRUE);
+	} else {
+
+	  /* This is where we would do the following
+	   *   #ifdef USE_SYNC_FILE_RANGE
+	   * However, we don't, for the reasons set out below
+	   * by Christoph Hellwig <hch@infradead.org>
+	   *
+	   * [BEGINS] 
+	   * fdatasync is equivalent to fsync except that it does not flush
+	   * non-essential metadata (basically just timestamps in practice), but it
+	   * does flush metadata requried to find the data again, e.g. allocation
+	   * information and extent maps.  sync_file_range does nothing but flush
+	   * out pagecache content - it means you basically won't get your data
+	   * back in case of a crash if you either:
+	   * 
+	   *  a) have a volatile write cache in your disk (e.g. any normal SATA disk)
+	   *  b) are using a sparse file on a filesystem
+	   *  c) are using a fallocate-preallocated file on a filesystem
+	   *  d) use any file on a COW filesystem like btrfs
+	   * 
+	   * e.g. it only does anything useful for you if you do not have a volatile
+	   * write cache, and either use a raw block device node, or just overwrite
+	   * an already fully allocated (and not preallocated) file on a non-COW
+	   * filesystem.
+	   * [ENDS]
+	   *
+	   * What we should do is open a second FD with O_DSYNC set, then write to
+	   * that when appropriate. However, with a Linux client, every REQ_FUA
+	   * immediately follows a REQ_FLUSH, so fdatasync does not cause performance
+	   * problems.
+	   *
+	   */
+#if 0
+		sync_file_range(fhandle, foffset, len,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+				SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+		phase_done(PHASE_DISK);
+		fdatasync(fhandle);
+		phase_done(PHASE_SYNC);
+#endif
+	}
+	return retval;
+}
+
+ssize_t rawexpread(off_t a, char *buf, size_t len, CLIENT *client) {
+	int fhandle;
+	off_t foffset;
+	size_t maxbytes;
+
+	if(get_filepos(client, a, &fhandle, &foffset, &maxbytes) < 0)
+		return -1;
+	if(maxbytes && len > maxbytes)
+		len = maxbytes;
+
+	DEBUG("(READ from fd %d offset %llu len %u), ", fhandle, (long long unsigned int)foffset, (unsigned int)len);
+
+	return pread(fhandle, buf, len, foffset);
+}
+
+/**
+ * Open the files of an export: one, or as many as there are for a
+ * multifile export, or a temporary one that is unlinked right away.
+ * The file is created, with the size from the config, if it does not
+ * exist yet and the config gives one.
+ **/
+static int file_open(CLIENT *client, GError **err) {
+	int i;
+	off_t laststartoff = 0, lastsize = 0;
+	uint64_t minsize = UINT64_MAX;
+	int multifile = (client->server->flags & F_MULTIFILE);
+	int temporary = (client->server->flags & F_TEMPORARY) && !multifile;
+	int cancreate = (client->server->expected_size) && !multifile;
+
+	client->export = g_array_new(TRUE, TRUE, sizeof(FILE_INFO));
+
+	/* If multi-file, open as many files as we can.
+	 * If not, open exactly one file.
+	 * Calculate file sizes as we go to get total size. */
+	for(i=0; ; i++) {
+		FILE_INFO fi;
+		gchar *tmpname;
+
+		if (i)
+		  cancreate = 0;
+		/* if expected_size is specified, and this is the first file, we can create the file */
+		mode_t mode = (client->server->flags & F_READONLY) ?
+		  O_RDONLY : (O_RDWR | (cancreate?O_CREAT:0));
+
+		if (temporary) {
+			tmpname=g_strdup_printf("%s.%d-XXXXXX", client->exportname, i);
+			DEBUG( "Opening %s\n", tmpname );
+			fi.fhandle = mkstemp(tmpname);
+		} else {
+			if(multifile) {
+				tmpname=g_strdup_printf("%s.%d", client->exportname, i);
+			} else {
+				tmpname=g_strdup(client->exportname);
+			}
+			DEBUG( "Opening %s\n", tmpname );
+			fi.fhandle = open(tmpname, mode, 0x600);
+			if(fi.fhandle == -1 && mode == O_RDWR) {
+				/* Try again because maybe media was read-only */
+				fi.fhandle = open(tmpname, O_RDONLY);
+				if(fi.fhandle != -1) {
+					/* Opening the base file in copyonwrite mode is
+					 * okay */
+					if(!(client->server->flags & F_COPYONWRITE)) {
+						client->server->flags |= F_AUTOREADONLY;
+						client->server->flags |= F_READONLY;
+					}
+				}
+			}
+		}
+		if(fi.fhandle == -1) {
+			if(multifile && i>0) {
+				g_free(tmpname);
+				break;
+			}
+			g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+				    "Could not open exported file %s: %s",
+				    tmpname, strerror(errno));
+			g_free(tmpname);
+			return -1;
+		}
+
+		if (temporary)
+			unlink(tmpname); /* File will stick around whilst FD open */
+
+		fi.startoff = laststartoff + lastsize;
+		fi.dirty = FALSE;
+		g_array_append_val(client->export, fi);
+		g_free(tmpname);
+
+		/* Starting offset and size of this file will be used to
+		 * calculate starting offset of next file */
+		laststartoff = fi.startoff;
+		lastsize = size_autodetect(fi.fhandle);
+		if(lastsize < minsize)
+			minsize = lastsize;
+
+		/* If we created the file, it will be length zero */
+		if (!lastsize && cancreate) {
+			assert(!multifile);
+			if(ftruncate (fi.fhandle, client->server->expected_size)<0) {
+				g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+					    "Could not expand file: %s",
+					    strerror(errno));
+				return -1;
+			}
+			lastsize = client->server->expected_size;
+			break; /* don't look for any more files */
+		}
+
+		if(!multifile || temporary)
+			break;
+	}
+
+	/* Set export size to total calculated size */
+	client->exportsize = laststartoff + lastsize;
+
+	/* When striping, every file contributes the same number of whole
+	 * stripes, so the smallest file determines the size */
+	if(multifile && client->server->stripesize) {
+		uint64_t stripesize = client->server->stripesize;
+
+		client->exportsize = (minsize / stripesize) * stripesize * i;
+		if(!client->exportsize) {
+			g_set_error(err, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID,
+				    "Files of striped export are smaller than one stripe of %llu bytes",
+				    (unsigned long long)stripesize);
+			return -1;
+		}
+	}
+
+	if(multifile) {
+		msg(LOG_INFO, "Total number of files: %d", i);
+		if(client->server->stripesize) {
+			msg(LOG_INFO, "Striped in blocks of %llu bytes",
+			    (unsigned long long)client->server->stripesize);
+		}
+	}
+	return 0;
+}
+
+/**
+ * Call rawexpread repeatedly until all data has been read. Requests
+ * that touch more than one file of a multifile export are split and
+ * handed to a pool of I/O threads.
+ **/
+static int file_read(CLIENT *client, off_t a, char *buf, size_t len) {
+	ssize_t ret=0;
+
+	if(spans_files(a, len, client) && get_iopool())
+		return rawexp_parallel(IO_READ, a, buf, len, client, 0);
+
+	while(len > 0 && (ret=rawexpread(a, buf, len, client)) > 0 ) {
+		a += ret;
+		buf += ret;
+		len -= ret;
+	}
+	if(ret < 0)
+		return -1;
+	if(len != 0) {
+		/* reading past the end of a file */
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Call rawexpwrite repeatedly until all data has been written, in
+ * parallel like file_read() does.
+ **/
+static int file_write(CLIENT *client, off_t a, char *buf, size_t len, int fua) {
+	ssize_t ret=0;
+
+	if(spans_files(a, len, client) && get_iopool())
+		return rawexp_parallel(IO_WRITE, a, buf, len, client, fua);
+
+	while(len > 0 && (ret=rawexpwrite(a, buf, len, client, fua)) > 0 ) {
+		a += ret;
+		buf += ret;
+		len -= ret;
+	}
+	if(ret < 0)
+		return -1;
+	if(len != 0) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Sync the files that were written to since the previous flush. If more
+ * than one of them is dirty, the fsync() calls are handed to a small
+ * pool of threads so that they can proceed concurrently; the parts of a
+ * multifile export commonly live on different disks.
+ *
+ * Other threads may write while we sync, so a file's dirty mark is
+ * cleared before its fsync() starts rather than after it is done: a
+ * write that lands in between marks it dirty again, and is synced by
+ * the next flush. The mark is restored if the fsync() fails.
+ **/
+static int file_flush(CLIENT *client) {
+	struct iogroup group;
+	struct iojob *jobs;
+	FILE_INFO *fi = NULL;
+	gint i;
+	gint ndirty = 0;
+
+	for (i = 0; i < client->export->len; i++) {
+		if (g_atomic_int_get(&g_array_index(client->export, FILE_INFO, i).dirty)) {
+			ndirty++;
+		}
+	}
+	if (!ndirty) {
+		return 0;
+	}
+	if (ndirty == 1 || !get_iopool()) {
+		for (i = 0; i < client->export->len; i++) {
+			fi = &g_array_index(client->export, FILE_INFO, i);
+			if (!g_atomic_int_get(&fi->dirty))
+				continue;
+			g_atomic_int_set(&fi->dirty, FALSE);
+			if (fsync(fi->fhandle) < 0) {
+				g_atomic_int_set(&fi->dirty, TRUE);
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	iogroup_init(&group);
+	/* more files may have become dirty since we counted them */
+	jobs = g_new0(struct iojob, client->export->len);
+	ndirty = 0;
+	for (i = 0; i < client->export->len; i++) {
+		fi = &g_array_index(client->export, FILE_INFO, i);
+		if (!g_atomic_int_get(&fi->dirty))
+			continue;
+		g_atomic_int_set(&fi->dirty, FALSE);
+		jobs[ndirty].type = IO_SYNC;
+		jobs[ndirty].fi = fi;
+		iogroup_push(&group, &jobs[ndirty]);
+		ndirty++;
+	}
+	iogroup_wait(&group);
+	for (i = 0; i < ndirty; i++) {
+		if (jobs[i].group)
+			g_atomic_int_set(&jobs[i].fi->dirty, TRUE);
+	}
+	g_free(jobs);
+
+	if (group.error) {
+		errno = group.error;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * If the current system supports it, call fallocate() on the files to
+ * resparsify stuff that isn't needed anymore.
+ **/
+static int file_trim(CLIENT *client, off_t a, size_t len) {
+#if HAVE_FALLOC_PH
+	/* We're running on a system that supports the
+	 * FALLOC_FL_PUNCH_HOLE option to re-sparsify a file */
+	while(len > 0) {
+		int fhandle;
+		off_t foffset;
+		size_t maxbytes;
+		int fileidx;
+		size_t curlen = len;
+
+		if((fileidx = get_filepos(client, a, &fhandle, &foffset, &maxbytes)) < 0)
+			return -1;
+		if(maxbytes && curlen > maxbytes)
+			curlen = maxbytes;
+		fallocate(fhandle, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, foffset, curlen);
+		g_atomic_int_set(&g_array_index(client->export, FILE_INFO, fileidx).dirty, TRUE);
+		a += curlen;
+		len -= curlen;
+	}
+#else
+	DEBUG("Ignoring TRIM request (not supported on current platform");
+#endif
+	return 0;
+}
+
+/**
+ * Ask the kernel to start reading a range of the files into the page
+ * cache.
+ **/
+static void file_prefetch(CLIENT *client, off_t a, off_t len) {
+	int fhandle;
+	off_t foffset;
+	size_t maxbytes;
+	off_t cur;
+
+	while(len > 0) {
+		if(get_filepos(client, a, &fhandle, &foffset, &maxbytes) < 0)
+			return;
+		cur = (maxbytes && len > maxbytes) ? maxbytes : len;
+#if HAVE_POSIX_FADVISE
+		posix_fadvise(fhandle, foffset, cur, POSIX_FADV_WILLNEED);
+#endif
+		a += cur;
+		len -= cur;
+	}
+}
+
+static void file_close(CLIENT *client) {
+	int i;
+
+	for(i = 0; i < client->export->len; i++)
+		close(g_array_index(client->export, FILE_INFO, i).fhandle);
+	g_array_free(client->export, TRUE);
+	client->export = NULL;
+}
+
+const BACKEND file_backend = {
+	BACKEND_ABI,
+	"file",
+	TRUE,
+	file_open,
+	file_read,
+	file_write,
+	file_flush,
+	file_trim,
+	file_prefetch,
+	file_close,
+};
+
+/**
+ * Read from the backend, bypassing the block cache.
+ * @return 0 on success, nonzero on failure
+ **/
+static int rawexpread_uncached(off_t a, char *buf, size_t len, CLIENT *client) {
+	return backend_of(client)->read(client, a, buf, len);
+}
+
+#define CACHE_RUN 32 /**< maximum number of blocks we read from disk at
+			once when the block cache misses */
+
+/**
+ * Read through the block cache. When a block is not in the cache, it is
+ * read from the export together with the blocks that follow it, up to
+ * the end of the request, and they are all added to the cache.
+ *
+ * @return 0 on success, nonzero on failure
+ **/
+static int cached_read(off_t a, char *buf, size_t len, CLIENT *client) {
+	BLOCKCACHE *cache = client->server->cache;
+	char page[CACHE_BLOCKSIZE];
+	char *run = NULL;
+	uint32_t gen[CACHE_RUN];
+	uint64_t block, nblocks, i;
+	off_t start, end;
+	size_t offset, cur;
+	int retval = 0;
+
+	while(len > 0) {
+		block = a / CACHE_BLOCKSIZE;
+		offset = a % CACHE_BLOCKSIZE;
+		if(cache_lookup(cache, block, page)) {
+			cur = CACHE_BLOCKSIZE - offset;
+			if(cur > len)
+				cur = len;
+			memcpy(buf, page + offset, cur);
+		} else {
+			nblocks = (a + len - 1) / CACHE_BLOCKSIZE - block + 1;
+			if(nblocks > CACHE_RUN)
+				nblocks = CACHE_RUN;
+			start = block * CACHE_BLOCKSIZE;
+			end = start + nblocks * CACHE_BLOCKSIZE;
+			if(end > client->exportsize)
+				end = client->exportsize;
+			if(!run)
+				run = g_malloc(CACHE_RUN * CACHE_BLOCKSIZE);
+			/* take the generations before reading, so that we
+			 * don't cache anything that is written meanwhile */
+			for(i = 0; i < nblocks; i++)
+				gen[i] = cache_generation(cache, block + i);
+			if(rawexpread_uncached(start, run, end - start, client)) {
+				retval = -1;
+				break;
+			}
+			memset(run + (end - start), 0, nblocks * CACHE_BLOCKSIZE - (end - start));
+			for(i = 0; i < nblocks; i++)
+				cache_insert(cache, block + i, run + i * CACHE_BLOCKSIZE, gen[i]);
+			cur = end - a;
+			if(cur > len)
+				cur = len;
+			memcpy(buf, run + offset, cur);
+		}
+		a += cur;
+		buf += cur;
+		len -= cur;
+	}
+	g_free(run);
+	return retval;
+}
+
+/**
+ * Tell the block cache about a write (or trim). Blocks that were written
+ * as a whole are updated if they are cached; others are dropped.
+ *
+ * @param buf the data that was written, or NULL to drop all blocks in
+ * the range
+ **/
+static void cache_written(off_t a, char *buf, size_t len, CLIENT *client) {
+	BLOCKCACHE *cache = client->server->cache;
+	size_t offset, cur;
+
+	while(len > 0) {
+		offset = a % CACHE_BLOCKSIZE;
+		cur = CACHE_BLOCKSIZE - offset;
+		if(cur > len)
+			cur = len;
+		cache_update(cache, a / CACHE_BLOCKSIZE,
+			     (buf && cur == CACHE_BLOCKSIZE) ? buf : NULL);
+		a += cur;
+		if(buf)
+			buf += cur;
+		len -= cur;
+	}
+}
+
+int rawexpwrite_fully(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
+	int retval = backend_of(client)->write(client, a, buf, len, fua);
+
+	if(client->server->cache)
+		cache_written(a, retval ? NULL : buf, len, client);
+	return retval;
+}
+
+int rawexpread_fully(off_t a, char *buf, size_t len, CLIENT *client) {
+	if(client->server->cache)
+		return cached_read(a, buf, len, client);
+	return rawexpread_uncached(a, buf, len, client);
+}
+
+int expread(off_t a, char *buf, size_t len, CLIENT *client) {
+	off_t rdlen, offset;
+	off_t mapcnt, mapl, maph, pagestart;
+
+	if (client->journal)
+		return(journal_read(client->journal, a, buf, len));
+	if (!(client->server->flags & F_COPYONWRITE))
+		return(rawexpread_fully(a, buf, len, client));
+	DEBUG("Asked to read %u bytes at %llu.\n", (unsigned int)len, (unsigned long long)a);
+
+	mapl=a/DIFFPAGESIZE; maph=(a+len-1)/DIFFPAGESIZE;
+
+	for (mapcnt=mapl;mapcnt<=maph;mapcnt++) {
+		pagestart=mapcnt*DIFFPAGESIZE;
+		offset=a-pagestart;
+		rdlen=(0<DIFFPAGESIZE-offset && len<(size_t)(DIFFPAGESIZE-offset)) ?
+			len : (size_t)DIFFPAGESIZE-offset;
+		if (client->difmap[mapcnt]!=(u32)(-1)) { /* the block is already there */
+			DEBUG("Page %llu is at %lu\n", (unsigned long long)mapcnt,
+			       (unsigned long)(client->difmap[mapcnt]));
+			myseek(client->difffile, client->difmap[mapcnt]*DIFFPAGESIZE+offset);
+			if (read(client->difffile, buf, rdlen) != rdlen) return -1;
+		} else { /* the block is not there */
+			DEBUG("Page %llu is not here, we read the original one\n",
+			       (unsigned long long)mapcnt);
+			if(rawexpread_fully(a, buf, rdlen, client)) return -1;
+		}
+		len-=rdlen; a+=rdlen; buf+=rdlen;
+	}
+	return 0;
+}
+
+
+int expwrite(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
+	char pagebuf[DIFFPAGESIZE];
+	off_t mapcnt,mapl,maph;
+	off_t wrlen,rdlen; 
+	off_t pagestart;
+	off_t offset;
+
+	if (client->journal)
+		return(journal_write(client->journal, a, buf, len, fua));
+	if (!(client->server->flags & F_COPYONWRITE))
+		return(rawexpwrite_fully(a, buf, len, client, fua)); 
+	DEBUG("Asked to write %u bytes at %llu.\n", (unsigned int)len, (unsigned long long)a);
+
+	mapl=a/DIFFPAGESIZE ; maph=(a+len-1)/DIFFPAGESIZE ;
+
+	for (mapcnt=mapl;mapcnt<=maph;mapcnt++) {
+		pagestart=mapcnt*DIFFPAGESIZE ;
+		offset=a-pagestart ;
+		wrlen=(0<DIFFPAGESIZE-offset && len<(size_t)(DIFFPAGESIZE-offset)) ?
+			len : (size_t)DIFFPAGESIZE-offset;
+
+		if (client->difmap[mapcnt]!=(u32)(-1)) { /* the block is already there */
+			DEBUG("Page %llu is at %lu\n", (unsigned long long)mapcnt,
+			       (unsigned long)(client->difmap[mapcnt])) ;
+			myseek(client->difffile,
+					client->difmap[mapcnt]*DIFFPAGESIZE+offset);
+			if (write(client->difffile, buf, wrlen) != wrlen) return -1 ;
+		} else { /* the block is not there */
+			phase_done(PHASE_DISK);
+			myseek(client->difffile,client->difffilelen*DIFFPAGESIZE) ;
+			client->difmap[mapcnt]=(client->server->flags&F_SPARSE)?mapcnt:client->difffilelen++;
+			DEBUG("Page %llu is not here, we put it at %lu\n",
+			       (unsigned long long)mapcnt,
+			       (unsigned long)(client->difmap[mapcnt]));
+			rdlen=DIFFPAGESIZE ;
+			if (rawexpread_fully(pagestart, pagebuf, rdlen, client))
+				return -1;
+			memcpy(pagebuf+offset,buf,wrlen) ;
+			if (write(client->difffile, pagebuf, DIFFPAGESIZE) !=
+					DIFFPAGESIZE)
+				return -1;
+			if (client->stats)
+				client->stats->cowbytes += DIFFPAGESIZE;
+			phase_done(PHASE_COW);
+		}						    
+		len-=wrlen ; a+=wrlen ; buf+=wrlen ;
+	}
+	if (client->server->flags & F_SYNC) {
+		phase_done(PHASE_DISK);
+		fsync(client->difffile);
+		phase_done(PHASE_SYNC);
+	} else if (fua) {
+		/* open question: would it be cheaper to do multiple sync_file_ranges?
+		   as we iterate through the above?
+		 */
+		phase_done(PHASE_DISK);
+		fdatasync(client->difffile);
+		phase_done(PHASE_SYNC);
+	}
+	return 0;
+}
+
+int expflush(CLIENT *client) {
+        if (client->server->flags & F_COPYONWRITE) {
+		return fsync(client->difffile);
+	}
+	if (client->journal) {
+		return journal_flush(client->journal);
+	}
+	return backend_of(client)->flush(client);
+}
+
+int exptrim(struct nbd_request* req, CLIENT* client) {
+	const BACKEND *backend = backend_of(client);
+	off_t a = req->from;
+	size_t len = ntohl(req->len);
+
+	if(client->server->cache)
+		cache_written(a, NULL, len, client);
+	if(!backend->trim)
+		return 0;
+	DEBUG("Performing TRIM request from %llu to %llu", (unsigned long long) req->from, (unsigned long long) ntohl(req->len));
+	/* the destager writes to the export; leave the trim to it too,
+	 * so that it comes in order with the writes */
+	if(client->journal)
+		return journal_trim(client->journal, a, len);
+	return backend->trim(client, a, len);
+}
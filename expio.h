@@ -0,0 +1,182 @@
+#ifndef EXPIO_H
+#define EXPIO_H
+
+#include <nbdsrv.h>
+
+#include <glib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * The data path of an export: reading and writing its backend (see
+ * backend.h), through the block cache, the copy-on-write file or the
+ * journal, as configured. nbd-server calls these for every request;
+ * they are kept apart from it so that they can also be driven without a
+ * network connection, e.g. by tests/code/iobench. The file backend
+ * lives here too.
+ *
+ * Everything here works on a CLIENT whose export has been opened:
+ * exportsize, server (for its backend, flags, stripesize and cache),
+ * whatever the backend keeps (the export array, for files) and, if
+ * F_COPYONWRITE is set, difffile, difffilelen and difmap must be
+ * filled in.
+ **/
+
+#define DIFFPAGESIZE 4096 /**< diff file uses those chunks */
+
+/**
+ * The phases of handling a request that we time for the slow log
+ **/
+typedef enum {
+	PHASE_NETREAD,	/**< reading the data of a write from the client */
+	PHASE_DISK,	/**< reading from or writing to the export */
+	PHASE_COW,	/**< copying pages into the copy-on-write file */
+	PHASE_SYNC,	/**< syncing to disk */
+	PHASE_NETWRITE,	/**< sending the reply and data to the client */
+	PHASE_COUNT,
+} PHASE;
+
+/**
+ * Timing of the request being handled, for the slow log. We only
+ * serve one client per process, so this is global; timing is only
+ * enabled when there is a slow log, and checked before doing anything
+ * else, so that we don't even read the clock otherwise. It is
+ * thread-local, since the journal's destager thread writes through the
+ * same functions, and is not handling a request.
+ **/
+extern __thread bool timing;		/**< whether to time requests */
+extern gint64 phase_mark;		/**< when the previous phase ended */
+extern gint64 phase_time[PHASE_COUNT];	/**< time spent in every phase, in us */
+
+/**
+ * End a phase of the request being handled: the time since the
+ * previous phase ended is charged to it.
+ **/
+static inline void phase_done(PHASE phase) {
+	gint64 now;
+
+	if (G_LIKELY(!timing))
+		return;
+	now = g_get_monotonic_time();
+	phase_time[phase] += now - phase_mark;
+	phase_mark = now;
+}
+
+struct nbd_request;
+
+/**
+ * Get the file handle and offset, given an export offset.
+ *
+ * The files of a multifile export are either concatenated, in which
+ * case we binary search for the right one, or striped round-robin in
+ * blocks of stripesize bytes, in which case the position follows
+ * directly from the offset.
+ *
+ * @param client The client whose export we're looking at
+ * @param a The offset to get corresponding file/offset for
+ * @param fhandle [out] File descriptor
+ * @param foffset [out] Offset into fhandle
+ * @param maxbytes [out] Tells how many bytes can be read/written
+ * from fhandle starting at foffset (0 if there is no limit)
+ * @return the index of the file in export on success, -1 on failure
+ **/
+int get_filepos(CLIENT *client, off_t a, int* fhandle, off_t* foffset, size_t* maxbytes);
+
+/**
+ * seek to a position in a file, with error handling.
+ * @param handle a filedescriptor
+ * @param a position to seek to
+ * @todo get rid of this.
+ **/
+void myseek(int handle, off_t a);
+
+/**
+ * Write an amount of bytes at a given offset to the right file of the
+ * file backend. This abstracts the write-side of the multiple file
+ * option.
+ *
+ * @param a The offset where the write should start
+ * @param buf The buffer to write from
+ * @param len The length of buf
+ * @param client The client we're serving for
+ * @param fua Flag to indicate 'Force Unit Access'
+ * @return The number of bytes actually written, or -1 in case of an error
+ **/
+ssize_t rawexpwrite(off_t a, char *buf, size_t len, CLIENT *client, int fua);
+
+/**
+ * Read an amount of bytes at a given offset from the right file of the
+ * file backend. This abstracts the read-side of the multiple files
+ * option.
+ *
+ * @param a The offset where the read should start
+ * @param buf A buffer to read into
+ * @param len The size of buf
+ * @param client The client we're serving for
+ * @return The number of bytes actually read, or -1 in case of an
+ * error.
+ **/
+ssize_t rawexpread(off_t a, char *buf, size_t len, CLIENT *client);
+
+/**
+ * Write all data to the backend, and keep the block cache, if any, up
+ * to date.
+ * @return 0 on success, nonzero on failure
+ **/
+int rawexpwrite_fully(off_t a, char *buf, size_t len, CLIENT *client, int fua);
+
+/**
+ * Read all data from the backend, through the block cache if there is
+ * one.
+ * @return 0 on success, nonzero on failure
+ **/
+int rawexpread_fully(off_t a, char *buf, size_t len, CLIENT *client);
+
+/**
+ * Read an amount of bytes at a given offset from the right file. This
+ * abstracts the read-side of the copyonwrite stuff, and calls
+ * rawexpread() with the right parameters to do the actual work.
+ * @param a The offset where the read should start
+ * @param buf A buffer to read into
+ * @param len The size of buf
+ * @param client The client we're going to read for
+ * @return 0 on success, nonzero on failure
+ **/
+int expread(off_t a, char *buf, size_t len, CLIENT *client);
+
+/**
+ * Write an amount of bytes at a given offset to the right file. This
+ * abstracts the write-side of the copyonwrite option, and calls
+ * rawexpwrite() with the right parameters to do the actual work.
+ *
+ * @param a The offset where the write should start
+ * @param buf The buffer to write from
+ * @param len The length of buf
+ * @param client The client we're going to write for.
+ * @param fua Flag to indicate 'Force Unit Access'
+ * @return 0 on success, nonzero on failure
+ **/
+int expwrite(off_t a, char *buf, size_t len, CLIENT *client, int fua);
+
+/**
+ * Flush data to a client: sync the copy-on-write file, the journal or
+ * the backend. The file backend only syncs the files that were written
+ * to since the previous flush, and those concurrently.
+ *
+ * @param client The client we're going to write for.
+ * @return 0 on success, nonzero on failure
+ **/
+int expflush(CLIENT *client);
+
+/**
+ * Drop a range from the block cache, and have the backend discard it,
+ * if it can; for files, this calls fallocate() to resparsify stuff that
+ * isn't needed anymore (see NBD_CMD_TRIM), if the system supports it.
+ *
+ * @param req the request; from in host byte order, len in network byte
+ * order, as mainloop() has them
+ * @return 0 on success, nonzero on failure
+ **/
+int exptrim(struct nbd_request* req, CLIENT* client);
+
+#endif //EXPIO_H
@@ -3,8 +3,19 @@
 
    Most of the stuff cribbed from the nbd package written by Pavel Machek
 
-   Unfortunately quite slow since zlib has to decompress all the stuff between
-   seeks, so only suited to smaller files
+   zlib has to decompress all the stuff between seeks, so on the first
+   start gznbd decompresses the whole file once, and writes a seek index
+   next to it (image.gz.idx) with an access point every MiB (see -i).
+   Later starts read the index instead, and every read only has to
+   decompress from the closest access point before it
+
+   The data between two access points is a chunk. Decompressed chunks
+   are kept in a cache (see -c), so that data that is read over and over
+   again, like filesystem metadata, is only decompressed once, and when
+   the chunks are read in order, the next ones are decompressed by a few
+   threads in the background (see -t and -r) before they are asked for.
+   gznbd -b checks all this against plain gzread(), and then benchmarks
+   it against gzseek()
    
    Could be a neat way to do userland encryption/steganography if you have 
    a crypto library which has a stdiolike interface to replace zlib
@@ -41,10 +52,13 @@
 #include <syslog.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 
 #include <netinet/in.h>
 
@@ -62,13 +76,1024 @@
 /* don't ask me why this value, I only copied it */
 #define CHUNK BLOCK*20
 
+/* the seek index: access points into the compressed stream, after the
+   idea of zran.c in the zlib distribution. At every access point we
+   remember where it is in the compressed and the uncompressed data, and
+   the 32K of uncompressed data before it, which is all that inflate
+   needs to start over from there. A read then only has to decompress
+   from the last access point before it, rather than from the start */
+
+#define WINSIZE 32768		/* the window of deflate */
+#define INCHUNK 16384		/* how much compressed data we read at a time */
+#define IDX_MAGIC "GZNBDIX1"
+#define IDX_SUFFIX ".idx"
+#define DEFAULT_SPAN 1		/* MiB between access points */
+#define DEFAULT_CACHE 64	/* MiB of decompressed chunks we keep */
+#define DEFAULT_THREADS 4	/* threads that decompress ahead */
+#define DEFAULT_READAHEAD 4	/* chunks they decompress ahead */
+#define NOCHUNK ((u32)-1)
+
+struct point {
+  u64 out;			/* offset in the uncompressed data */
+  u64 in;			/* offset in the compressed data of the first
+				   full byte */
+  u32 bits;			/* number of bits of the byte before that
+				   which belong to the point, or 0 */
+  unsigned char *window;	/* uncompressed data before it, or NULL if
+				   it is only in the index file */
+  off_t winoff;			/* where the window is in the index file */
+};
+
+/* a stream we're decompressing, so that reads that follow each other
+   don't have to go back to an access point */
+struct gzstream {
+  FILE *in;
+  z_stream strm;
+  int active;			/* whether strm is initialized */
+  int raw;			/* whether strm started at an access point,
+				   rather than at the start of a member */
+  u64 pos;			/* uncompressed offset strm is at */
+  unsigned char input[INCHUNK];
+};
+
+struct gzindex {
+  u64 gzsize;			/* size and mtime of the .gz we indexed, so */
+  u64 gzmtime;			/* that we notice when it changes */
+  u64 span;			/* bytes of uncompressed data between points */
+  u64 size;			/* size of the uncompressed data */
+  u32 npoints;
+  struct point *points;
+  int idxfd;			/* the index file, or -1 */
+  char *gzname;
+  struct gzstream s;		/* the stream of the request loop */
+};
+
+/* the cache of decompressed chunks */
+#define SLOT_EMPTY 0
+#define SLOT_LOADING 1		/* being decompressed into */
+#define SLOT_READY 2
+
+struct slot {
+  u32 chunk;			/* the chunk it holds, unless it is empty */
+  int state;
+  int pins;			/* readers copying out of it */
+  unsigned char *data;
+  u64 len;
+  u64 alloc;
+  struct slot *older, *newer;	/* the LRU list */
+};
+
+struct worker {
+  struct gzcache *cache;
+  struct gzstream s;
+  pthread_t thread;
+};
+
+struct gzcache {
+  struct gzindex *idx;
+  u32 nslots;
+  struct slot *slots;
+  struct slot **where;		/* the slot of every chunk, or NULL */
+  struct slot *lru, *mru;
+  u32 last;			/* the chunk of the previous read */
+  u32 readahead;
+
+  /* chunks for the workers to decompress, a ring */
+  u32 *queue;
+  u32 qhead, qlen;
+
+  u32 nworkers;
+  struct worker *workers;
+  int quit;
+  pthread_mutex_t lock;
+  pthread_cond_t work;		/* there is something in the queue */
+  pthread_cond_t done;		/* a slot is no longer being loaded */
+
+  u64 hits, misses;
+};
+
+/* header of an index file; all fields in network byte order */
+struct idxheader {
+  char magic[8];
+  u64 gzsize;
+  u64 gzmtime;
+  u64 span;
+  u64 size;
+  u32 npoints;
+  u32 reserved;
+};
+
+/* an access point in an index file, followed by its window */
+struct idxpoint {
+  u64 out;
+  u64 in;
+  u32 bits;
+  u32 reserved;
+};
+
+/* add an access point; window is the circular window of inflate, of
+   which left bytes are at its end, or NULL if the window stays in the
+   index file */
+static int addpoint(struct gzindex *idx, int bits, u64 in, u64 out,
+                    unsigned left, unsigned char *window, off_t winoff)
+{
+  struct point *next;
+
+  if((idx->npoints & (idx->npoints-1))==0){
+    /* grow to the next power of two */
+    next=realloc(idx->points, (idx->npoints ? idx->npoints*2 : 1)*sizeof(struct point));
+    if(next==NULL){
+      return -1;
+    }
+    idx->points=next;
+  }
+  next=&idx->points[idx->npoints];
+  next->bits=bits;
+  next->in=in;
+  next->out=out;
+  next->winoff=winoff;
+  next->window=NULL;
+  if(window==NULL){
+    idx->npoints++;
+    return 0;
+  }
+  if((next->window=malloc(WINSIZE))==NULL){
+    return -1;
+  }
+  idx->npoints++;
+  if(left){
+    memcpy(next->window, window+WINSIZE-left, left);
+  }
+  if(left<WINSIZE){
+    memcpy(next->window+left, window, WINSIZE-left);
+  }
+  return 0;
+}
+
+/* decompress the whole file once, and add an access point about every
+   span bytes. Files of more than one gzip member, as written by bgzip
+   or pigz --independent, or by just concatenating .gz files, are fine:
+   the members simply follow each other */
+static int build_index(FILE *in, struct gzindex *idx)
+{
+  z_stream strm;
+  unsigned char input[INCHUNK];
+  unsigned char window[WINSIZE];
+  u64 totin=0, totout=0, last=0;
+  int ended=0;
+  int ret;
+  int retval=-1;
+
+  memset(&strm, 0, sizeof(strm));
+  memset(window, 0, sizeof(window));
+  /* 47: decode the gzip header, and the largest window */
+  if(inflateInit2(&strm, 47)!=Z_OK){
+    return -1;
+  }
+  strm.avail_out=0;
+  for(;;){
+    if(strm.avail_in==0){
+      strm.avail_in=fread(input, 1, INCHUNK, in);
+      if(ferror(in)){
+        goto out;
+      }
+      if(strm.avail_in==0){
+        if(ended){
+          break;
+        }
+        goto out;
+      }
+      strm.next_in=input;
+    }
+    if(ended){
+      /* another member follows the one that just ended */
+      if(inflateReset(&strm)!=Z_OK){
+        goto out;
+      }
+      ended=0;
+    }
+    if(strm.avail_out==0){
+      strm.avail_out=WINSIZE;
+      strm.next_out=window;
+    }
+    totin+=strm.avail_in;
+    totout+=strm.avail_out;
+    ret=inflate(&strm, Z_BLOCK);
+    totin-=strm.avail_in;
+    totout-=strm.avail_out;
+    if(ret==Z_NEED_DICT || ret==Z_MEM_ERROR || ret==Z_DATA_ERROR){
+      goto out;
+    }
+    if(ret==Z_STREAM_END){
+      ended=1;
+      continue;
+    }
+    /* at the end of a block that is not the last one */
+    if((strm.data_type & 128) && !(strm.data_type & 64) &&
+       (totout==0 || totout-last>=idx->span)){
+      if(addpoint(idx, strm.data_type & 7, totin, totout, strm.avail_out, window, 0)){
+        goto out;
+      }
+      last=totout;
+    }
+  }
+
+  idx->size=totout;
+  retval=0;
+out:
+  inflateEnd(&strm);
+  return retval;
+}
+
+static char *index_name(char *gzname)
+{
+  char *name=malloc(strlen(gzname)+strlen(IDX_SUFFIX)+1);
+
+  if(name){
+    strcpy(name, gzname);
+    strcat(name, IDX_SUFFIX);
+  }
+  return name;
+}
+
+static void free_points(struct gzindex *idx)
+{
+  u32 i;
+
+  for(i=0; i<idx->npoints; i++){
+    free(idx->points[i].window);
+  }
+  free(idx->points);
+  idx->points=NULL;
+  idx->npoints=0;
+}
+
+/* load the index of gzname from its index file, if there is one that
+   is up to date and has the span we want. The windows are left in the
+   file, which stays open, and are read when they are needed; an image
+   of many gigabytes has many thousands of them */
+static int load_index(char *gzname, struct gzindex *idx)
+{
+  struct idxheader hdr;
+  struct idxpoint p;
+  char *name=index_name(gzname);
+  off_t pos;
+  u32 i;
+  int fd;
+
+  if(name==NULL || (fd=open(name, O_RDONLY))<0){
+    free(name);
+    return -1;
+  }
+  free(name);
+  if(pread(fd, &hdr, sizeof(hdr), 0)!=sizeof(hdr) || memcmp(hdr.magic, IDX_MAGIC, 8)
+     || ntohll(hdr.gzsize)!=idx->gzsize || ntohll(hdr.gzmtime)!=idx->gzmtime
+     || ntohll(hdr.span)!=idx->span || ntohl(hdr.npoints)==0){
+    goto fail;
+  }
+  idx->size=ntohll(hdr.size);
+  pos=sizeof(hdr);
+  for(i=0; i<ntohl(hdr.npoints); i++){
+    if(pread(fd, &p, sizeof(p), pos)!=sizeof(p)
+       || addpoint(idx, ntohl(p.bits), ntohll(p.in), ntohll(p.out), 0, NULL, pos+sizeof(p))){
+      goto fail;
+    }
+    pos+=sizeof(p)+WINSIZE;
+  }
+  idx->idxfd=fd;
+  return 0;
+
+fail:
+  free_points(idx);
+  close(fd);
+  return -1;
+}
+
+/* write the index next to gzname, so that the next start is instant.
+   It goes to a temporary file first, so that nobody sees half of it */
+static int save_index(char *gzname, struct gzindex *idx)
+{
+  struct idxheader hdr;
+  struct idxpoint p;
+  char *name=index_name(gzname);
+  char *tmpname;
+  FILE *f;
+  u32 i;
+  int fd;
+
+  if(name==NULL || (tmpname=malloc(strlen(name)+8))==NULL){
+    free(name);
+    return -1;
+  }
+  sprintf(tmpname, "%s.XXXXXX", name);
+  if((fd=mkstemp(tmpname))<0 || fchmod(fd, 0644) || (f=fdopen(fd, "wb"))==NULL){
+    if(fd>=0){
+      close(fd);
+      unlink(tmpname);
+    }
+    free(tmpname);
+    free(name);
+    return -1;
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, IDX_MAGIC, 8);
+  hdr.gzsize=htonll(idx->gzsize);
+  hdr.gzmtime=htonll(idx->gzmtime);
+  hdr.span=htonll(idx->span);
+  hdr.size=htonll(idx->size);
+  hdr.npoints=htonl(idx->npoints);
+  fwrite(&hdr, sizeof(hdr), 1, f);
+  for(i=0; i<idx->npoints; i++){
+    memset(&p, 0, sizeof(p));
+    p.out=htonll(idx->points[i].out);
+    p.in=htonll(idx->points[i].in);
+    p.bits=htonl(idx->points[i].bits);
+    fwrite(&p, sizeof(p), 1, f);
+    fwrite(idx->points[i].window, WINSIZE, 1, f);
+  }
+  if(fclose(f)!=0 || rename(tmpname, name)!=0){
+    unlink(tmpname);
+    free(tmpname);
+    free(name);
+    return -1;
+  }
+  free(tmpname);
+  free(name);
+  return 0;
+}
+
+static int stream_open(struct gzstream *s, char *gzname)
+{
+  memset(s, 0, sizeof(*s));
+  s->in=fopen(gzname, "rb");
+  return s->in ? 0 : -1;
+}
+
+/* forget where the stream is, so that the next read starts over */
+static void stream_reset(struct gzstream *s)
+{
+  if(s->active){
+    inflateEnd(&s->strm);
+    s->active=0;
+  }
+}
+
+static void stream_close(struct gzstream *s)
+{
+  stream_reset(s);
+  if(s->in){
+    fclose(s->in);
+    s->in=NULL;
+  }
+}
+
+static int stream_fill(struct gzstream *s)
+{
+  s->strm.avail_in=fread(s->input, 1, INCHUNK, s->in);
+  if(ferror(s->in) || s->strm.avail_in==0){
+    return -1;
+  }
+  s->strm.next_in=s->input;
+  return 0;
+}
+
+/* start decompressing at an access point */
+static int index_restart(struct gzindex *idx, struct gzstream *s, struct point *here)
+{
+  unsigned char window[WINSIZE];
+  int c;
+
+  stream_reset(s);
+  memset(&s->strm, 0, sizeof(s->strm));
+  /* raw inflate: we start in the middle of the deflate stream */
+  if(inflateInit2(&s->strm, -15)!=Z_OK){
+    return -1;
+  }
+  s->active=1;
+  s->raw=1;
+  if(fseeko(s->in, here->in-(here->bits ? 1 : 0), SEEK_SET)){
+    return -1;
+  }
+  if(here->bits){
+    if((c=getc(s->in))==EOF){
+      return -1;
+    }
+    inflatePrime(&s->strm, here->bits, c>>(8-here->bits));
+  }
+  if(here->window){
+    inflateSetDictionary(&s->strm, here->window, WINSIZE);
+  } else {
+    if(pread(idx->idxfd, window, WINSIZE, here->winoff)!=WINSIZE){
+      return -1;
+    }
+    inflateSetDictionary(&s->strm, window, WINSIZE);
+  }
+  s->strm.avail_in=0;
+  s->pos=here->out;
+  return 0;
+}
+
+/* the deflate stream ended before we had all we want, so another gzip
+   member follows: skip the trailer of this one, unless inflate read it
+   itself, and go on with the next */
+static int next_member(struct gzstream *s)
+{
+  unsigned skip=s->raw ? 8 : 0;
+  unsigned cur;
+
+  while(skip>0){
+    if(s->strm.avail_in==0 && stream_fill(s)){
+      return -1;
+    }
+    cur=s->strm.avail_in<skip ? s->strm.avail_in : skip;
+    s->strm.next_in+=cur;
+    s->strm.avail_in-=cur;
+    skip-=cur;
+  }
+  if(inflateReset2(&s->strm, 47)!=Z_OK){
+    return -1;
+  }
+  s->raw=0;
+  return 0;
+}
+
+/* decompress len bytes into buf, or throw them away if buf is NULL */
+static int index_inflate(struct gzstream *s, unsigned char *buf, u64 len)
+{
+  unsigned char discard[WINSIZE];
+  int ret;
+
+  while(len>0){
+    unsigned cur=len>WINSIZE ? WINSIZE : len;
+
+    s->strm.next_out=buf ? buf : discard;
+    s->strm.avail_out=cur;
+    do {
+      if(s->strm.avail_in==0 && stream_fill(s)){
+        return -1;
+      }
+      ret=inflate(&s->strm, Z_NO_FLUSH);
+      if(ret==Z_NEED_DICT || ret==Z_MEM_ERROR || ret==Z_DATA_ERROR){
+        return -1;
+      }
+      if(ret==Z_STREAM_END && s->strm.avail_out && next_member(s)){
+        return -1;
+      }
+    } while(s->strm.avail_out);
+    s->pos+=cur;
+    len-=cur;
+    if(buf){
+      buf+=cur;
+    }
+  }
+  return 0;
+}
+
+/* the chunk that from is in: the last access point at or before it */
+static u32 find_chunk(struct gzindex *idx, u64 from)
+{
+  u32 lo=0, hi=idx->npoints-1;
+
+  while(lo<hi){
+    u32 mid=(lo+hi+1)/2;
+    if(idx->points[mid].out<=from){
+      lo=mid;
+    } else {
+      hi=mid-1;
+    }
+  }
+  return lo;
+}
+
+/* read len bytes at from, starting over at the closest access point
+   unless the stream we have is already closer */
+static int index_read(struct gzindex *idx, struct gzstream *s, u64 from, unsigned char *buf, u64 len)
+{
+  struct point *here=&idx->points[find_chunk(idx, from)];
+
+  if(!s->active || s->pos>from || s->pos<here->out){
+    if(index_restart(idx, s, here)){
+      stream_reset(s);
+      return -1;
+    }
+  }
+  if(index_inflate(s, NULL, from-s->pos) || index_inflate(s, buf, len)){
+    /* we don't know where the stream is now */
+    stream_reset(s);
+    return -1;
+  }
+  return 0;
+}
+
+/* move a slot to the recently used end of the LRU list */
+static void touch(struct gzcache *c, struct slot *slot)
+{
+  if(c->mru==slot){
+    return;
+  }
+  if(slot->older){
+    slot->older->newer=slot->newer;
+  } else {
+    c->lru=slot->newer;
+  }
+  slot->newer->older=slot->older;
+  slot->older=c->mru;
+  slot->newer=NULL;
+  c->mru->newer=slot;
+  c->mru=slot;
+}
+
+/* the least recently used slot that nobody is using; with the lock held */
+static struct slot *grab_slot(struct gzcache *c)
+{
+  struct slot *slot;
+
+  for(slot=c->lru; slot; slot=slot->newer){
+    if(slot->pins==0 && slot->state!=SLOT_LOADING){
+      if(slot->state==SLOT_READY){
+        c->where[slot->chunk]=NULL;
+      }
+      slot->state=SLOT_EMPTY;
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+/* decompress chunk n into a slot we grabbed; without the lock held */
+static int fill_slot(struct gzcache *c, struct gzstream *s, struct slot *slot, u32 n)
+{
+  struct gzindex *idx=c->idx;
+  u64 start=idx->points[n].out;
+  u64 end=n+1<idx->npoints ? idx->points[n+1].out : idx->size;
+  unsigned char *data;
+
+  if(slot->alloc<end-start){
+    if((data=realloc(slot->data, end-start))==NULL){
+      return -1;
+    }
+    slot->data=data;
+    slot->alloc=end-start;
+  }
+  slot->len=end-start;
+  return index_read(idx, s, start, slot->data, slot->len);
+}
+
+static void finish_slot(struct gzcache *c, struct slot *slot, int failed)
+{
+  if(failed){
+    c->where[slot->chunk]=NULL;
+    slot->state=SLOT_EMPTY;
+  } else {
+    slot->state=SLOT_READY;
+  }
+  pthread_cond_broadcast(&c->done);
+}
+
+static void *cache_worker(void *arg)
+{
+  struct worker *w=arg;
+  struct gzcache *c=w->cache;
+  struct slot *slot;
+  u32 n;
+  int ret;
+
+  pthread_mutex_lock(&c->lock);
+  while(!c->quit){
+    if(c->qlen==0){
+      pthread_cond_wait(&c->work, &c->lock);
+      continue;
+    }
+    n=c->queue[c->qhead];
+    c->qhead=(c->qhead+1)%c->readahead;
+    c->qlen--;
+    if(c->where[n] || (slot=grab_slot(c))==NULL){
+      continue;
+    }
+    slot->state=SLOT_LOADING;
+    slot->chunk=n;
+    c->where[n]=slot;
+    touch(c, slot);
+    pthread_mutex_unlock(&c->lock);
+    ret=fill_slot(c, &w->s, slot, n);
+    pthread_mutex_lock(&c->lock);
+    finish_slot(c, slot, ret);
+  }
+  pthread_mutex_unlock(&c->lock);
+  return NULL;
+}
+
+/* when the reader moves on to chunk n, have the workers decompress the
+   chunks after it, if it came from the one before; with the lock held.
+   Whatever was still queued is of no use anymore either way */
+static void readahead(struct gzcache *c, u32 n)
+{
+  u32 i;
+
+  c->qlen=0;
+  if(c->nworkers==0 || n!=c->last+1){
+    return;
+  }
+  for(i=n+1; i<=n+c->readahead && i<c->idx->npoints; i++){
+    if(c->where[i]==NULL){
+      c->queue[(c->qhead+c->qlen)%c->readahead]=i;
+      c->qlen++;
+    }
+  }
+  if(c->qlen){
+    pthread_cond_broadcast(&c->work);
+  }
+}
+
+/* read len bytes at from through the cache */
+static int cache_read(struct gzcache *c, u64 from, unsigned char *buf, u64 len)
+{
+  struct gzindex *idx=c->idx;
+  struct slot *slot;
+  u64 start, cur;
+  u32 n;
+  int ret;
+
+  while(len>0){
+    n=find_chunk(idx, from);
+    start=idx->points[n].out;
+    pthread_mutex_lock(&c->lock);
+    if(n!=c->last){
+      readahead(c, n);
+      c->last=n;
+    }
+    for(;;){
+      slot=c->where[n];
+      if(slot && slot->state==SLOT_READY){
+        c->hits++;
+        break;
+      }
+      if(slot==NULL && (slot=grab_slot(c))!=NULL){
+        c->misses++;
+        slot->state=SLOT_LOADING;
+        slot->chunk=n;
+        c->where[n]=slot;
+        pthread_mutex_unlock(&c->lock);
+        ret=fill_slot(c, &idx->s, slot, n);
+        pthread_mutex_lock(&c->lock);
+        finish_slot(c, slot, ret);
+        if(ret){
+          pthread_mutex_unlock(&c->lock);
+          return -1;
+        }
+        break;
+      }
+      /* a worker is decompressing it, or all slots are busy */
+      pthread_cond_wait(&c->done, &c->lock);
+    }
+    slot->pins++;
+    touch(c, slot);
+    pthread_mutex_unlock(&c->lock);
+
+    cur=start+slot->len-from;
+    if(cur>len){
+      cur=len;
+    }
+    memcpy(buf, slot->data+(from-start), cur);
+    from+=cur;
+    buf+=cur;
+    len-=cur;
+
+    pthread_mutex_lock(&c->lock);
+    slot->pins--;
+    pthread_mutex_unlock(&c->lock);
+  }
+  return 0;
+}
+
+static void cache_free(struct gzcache *c)
+{
+  u32 i;
+
+  pthread_mutex_lock(&c->lock);
+  c->quit=1;
+  pthread_cond_broadcast(&c->work);
+  pthread_mutex_unlock(&c->lock);
+  for(i=0; i<c->nworkers; i++){
+    pthread_join(c->workers[i].thread, NULL);
+    stream_close(&c->workers[i].s);
+  }
+  for(i=0; i<c->nslots; i++){
+    free(c->slots[i].data);
+  }
+  pthread_mutex_destroy(&c->lock);
+  pthread_cond_destroy(&c->work);
+  pthread_cond_destroy(&c->done);
+  free(c->workers);
+  free(c->slots);
+  free(c->where);
+  free(c->queue);
+  free(c);
+}
+
+/* the size of the largest chunk of idx. Chunks end at the first access
+   point after span bytes, so they are usually a bit larger than that */
+static u64 largest_chunk(struct gzindex *idx)
+{
+  u64 len, max=0;
+  u32 i;
+
+  for(i=0; i<idx->npoints; i++){
+    len=(i+1<idx->npoints ? idx->points[i+1].out : idx->size)-idx->points[i].out;
+    if(len>max){
+      max=len;
+    }
+  }
+  return max ? max : 1;
+}
+
+/* a cache of at most cachesize bytes of chunks of idx, with nworkers
+   threads that decompress up to ra chunks ahead of the reader. A slot
+   may have to hold the largest chunk, so that is what we count them as */
+static struct gzcache *cache_new(struct gzindex *idx, u64 cachesize, u32 nworkers, u32 ra)
+{
+  struct gzcache *c;
+  u32 i;
+
+  if((c=calloc(1, sizeof(struct gzcache)))==NULL){
+    return NULL;
+  }
+  c->idx=idx;
+  c->last=NOCHUNK;
+  /* the reader and every worker hold at most one slot at a time, and
+     what we read ahead should not push out what is being read; that
+     many we need, even if they don't fit in cachesize */
+  c->nslots=cachesize/largest_chunk(idx);
+  if(c->nslots<nworkers+ra+2){
+    c->nslots=nworkers+ra+2;
+  }
+  c->readahead=ra ? ra : 1;
+  c->slots=calloc(c->nslots, sizeof(struct slot));
+  c->where=calloc(idx->npoints, sizeof(struct slot *));
+  c->queue=calloc(c->readahead, sizeof(u32));
+  c->workers=calloc(nworkers ? nworkers : 1, sizeof(struct worker));
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->work, NULL);
+  pthread_cond_init(&c->done, NULL);
+  if(c->slots==NULL || c->where==NULL || c->queue==NULL || c->workers==NULL){
+    cache_free(c);
+    return NULL;
+  }
+  for(i=0; i<c->nslots; i++){
+    c->slots[i].older=i ? &c->slots[i-1] : NULL;
+    c->slots[i].newer=i+1<c->nslots ? &c->slots[i+1] : NULL;
+  }
+  c->lru=&c->slots[0];
+  c->mru=&c->slots[c->nslots-1];
+  if(ra==0){
+    nworkers=0;
+  }
+  for(i=0; i<nworkers; i++){
+    c->workers[i].cache=c;
+    if(stream_open(&c->workers[i].s, idx->gzname)){
+      break;
+    }
+    if(pthread_create(&c->workers[i].thread, NULL, cache_worker, &c->workers[i])){
+      stream_close(&c->workers[i].s);
+      break;
+    }
+    c->nworkers++;
+  }
+  return c;
+}
+
+/* get the index of gzname: load it, or build and save it */
+static struct gzindex *get_index(char *argv0, char *gzname, u64 span)
+{
+  struct gzindex *idx;
+  struct stat st;
+
+  if((idx=calloc(1, sizeof(struct gzindex)))==NULL){
+    return NULL;
+  }
+  idx->span=span;
+  idx->idxfd=-1;
+  idx->gzname=gzname;
+  if(stream_open(&idx->s, gzname) || fstat(fileno(idx->s.in), &st)){
+    goto fail;
+  }
+  idx->gzsize=st.st_size;
+  idx->gzmtime=st.st_mtime;
+  if(load_index(gzname, idx)==0){
+    printf("%s: loaded index of %s, %u access points\n",argv0,gzname,idx->npoints);
+    return idx;
+  }
+
+  printf("%s: indexing %s, ",argv0,gzname);
+  fflush(stdout);
+  if(build_index(idx->s.in, idx)){
+    printf("failed\n");
+    goto fail;
+  }
+  printf("%u access points\n",idx->npoints);
+  if(save_index(gzname, idx)){
+    fprintf(stderr,"%s: could not save index of %s: %s\n",argv0,gzname,strerror(errno));
+  } else {
+    /* use the saved index, so that the windows need not stay in memory */
+    free_points(idx);
+    if(load_index(gzname, idx)){
+      fprintf(stderr,"%s: could not reload index of %s\n",argv0,gzname);
+      goto fail;
+    }
+  }
+  return idx;
+
+fail:
+  stream_close(&idx->s);
+  free_points(idx);
+  free(idx);
+  return NULL;
+}
+
+/* where the data comes from: the cache, the index, or gzseek() */
+struct source {
+  gzFile gz;
+  struct gzindex *idx;
+  struct gzcache *cache;
+};
+
+static int source_read(struct source *src, u64 from, unsigned char *buf, u32 len)
+{
+  if(src->cache){
+    return cache_read(src->cache, from, buf, len);
+  }
+  if(src->idx){
+    return index_read(src->idx, &src->idx->s, from, buf, len);
+  }
+  gzseek(src->gz, from, 0);
+  return gzread(src->gz, buf, len)!=len ? -1 : 0;
+}
+
+/* the benchmark reads BENCH_LEN bytes at a time, like a filesystem
+   would; the hot pattern mostly rereads a few small regions, like the
+   metadata of a filesystem */
+#define BENCH_LEN 4096
+#define HOT_REGIONS 16
+#define HOT_LEN 65536
+#define HOT_PERCENT 90
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static u64 bench_random(u64 n)
+{
+  return ((((u64)random())<<31)|random())%n;
+}
+
+/* where the next read of a pattern goes */
+static u64 bench_next(int pattern, u64 prev, u64 size, u64 *hot)
+{
+  switch(pattern){
+    case 0:
+      return prev+2*BENCH_LEN<=size ? prev+BENCH_LEN : 0;
+    case 2:
+      if(random()%100<HOT_PERCENT){
+        return hot[random()%HOT_REGIONS]+bench_random(HOT_LEN/BENCH_LEN)*BENCH_LEN;
+      }
+      /* fall through */
+    default:
+      return bench_random(size/BENCH_LEN)*BENCH_LEN;
+  }
+}
+
+/* read the whole image once with gzread(), and check that the index and
+   the cache return the same, before we time them */
+static int bench_verify(char *argv0, char *gzname, struct gzindex *idx,
+                        u64 cachesize, u32 nworkers, u32 ra)
+{
+  unsigned char want[BENCH_LEN], got[BENCH_LEN];
+  struct gzcache *cache;
+  gzFile gz;
+  u64 from;
+  int len, reader;
+  int retval=-1;
+
+  stream_reset(&idx->s);
+  if((gz=gzopen(gzname, "rb"))==NULL){
+    fprintf(stderr,"%s: unable open compressed file %s\n",argv0,gzname);
+    return -1;
+  }
+  if((cache=cache_new(idx, cachesize, nworkers, ra))==NULL){
+    fprintf(stderr,"%s: unable to set up the cache\n",argv0);
+    gzclose(gz);
+    return -1;
+  }
+  for(from=0; from<idx->size; from+=len){
+    len=gzread(gz, want, BENCH_LEN);
+    if(len<=0){
+      fprintf(stderr,"%s: read at %"PRIu64" failed\n",argv0,from);
+      goto out;
+    }
+    for(reader=1; reader<3; reader++){
+      if((reader==1 ? index_read(idx, &idx->s, from, got, len)
+                    : cache_read(cache, from, got, len))
+         || memcmp(want, got, len)){
+        fprintf(stderr,"%s: the %s reads the wrong data at %"PRIu64"\n",argv0,
+                reader==1 ? "index" : "cache",from);
+        goto out;
+      }
+    }
+  }
+  printf("%s: verified %"PRIu64" bytes\n",argv0,from);
+  retval=0;
+out:
+  cache_free(cache);
+  gzclose(gz);
+  return retval;
+}
+
+/* read the image for secs seconds with every pattern, with gzseek(),
+   with just the index, and through the cache */
+static int benchmark(char *argv0, char *gzname, struct gzindex *idx, int secs,
+                     u64 cachesize, u32 nworkers, u32 ra)
+{
+  static const char *patterns[]={ "seq", "random", "hot" };
+  static const char *readers[]={ "gzseek", "index", "cache" };
+  unsigned char buf[BENCH_LEN];
+  struct source src;
+  u64 hot[HOT_REGIONS];
+  u64 from, reads;
+  double start, elapsed;
+  int pattern, reader, i;
+
+  if(idx->size<HOT_LEN){
+    fprintf(stderr,"%s: %s is too small to benchmark\n",argv0,gzname);
+    return -1;
+  }
+  if(bench_verify(argv0, gzname, idx, cachesize, nworkers, ra)){
+    return -1;
+  }
+  printf("%-8s %-8s %10s %10s %10s %8s\n","pattern","reader","reads","reads/s","MiB/s","hits");
+  for(pattern=0; pattern<3; pattern++){
+    for(reader=0; reader<3; reader++){
+      memset(&src, 0, sizeof(src));
+      stream_reset(&idx->s);
+      switch(reader){
+        case 0:
+          if((src.gz=gzopen(gzname, "rb"))==NULL){
+            fprintf(stderr,"%s: unable open compressed file %s\n",argv0,gzname);
+            return -1;
+          }
+          break;
+        case 1:
+          src.idx=idx;
+          break;
+        case 2:
+          if((src.cache=cache_new(idx, cachesize, nworkers, ra))==NULL){
+            fprintf(stderr,"%s: unable to set up the cache\n",argv0);
+            return -1;
+          }
+          break;
+      }
+      /* every reader gets the same reads */
+      srandom(1);
+      for(i=0; i<HOT_REGIONS; i++){
+        hot[i]=bench_random((idx->size-HOT_LEN)/BENCH_LEN+1)*BENCH_LEN;
+      }
+      from=bench_next(pattern, idx->size, idx->size, hot);
+      reads=0;
+      start=now();
+      do {
+        if(source_read(&src, from, buf, BENCH_LEN)){
+          fprintf(stderr,"%s: read at %"PRIu64" failed\n",argv0,from);
+          return -1;
+        }
+        reads++;
+        from=bench_next(pattern, from, idx->size, hot);
+      } while((elapsed=now()-start)<secs);
+
+      printf("%-8s %-8s %10"PRIu64" %10.1f %10.1f ",patterns[pattern],readers[reader],
+             reads,reads/elapsed,reads*BENCH_LEN/elapsed/1048576);
+      if(src.cache){
+        printf("%7.1f%%\n",100.0*src.cache->hits/(src.cache->hits+src.cache->misses));
+        cache_free(src.cache);
+      } else {
+        printf("%8s\n","-");
+      }
+      if(src.gz){
+        gzclose(src.gz);
+      }
+    }
+  }
+  return 0;
+}
 
 int main(int argc, char **argv)
 {
   int pr[2];
   int sk;
   int nbd;
-  gzFile gz;
+  gzFile gz=NULL;
   int gzerr;
 
   char chunk[CHUNK];
@@ -79,30 +1104,102 @@ int main(int argc, char **argv)
   u64 from;
   u32 len;
 
-  if(argc<3){
-    printf("Usage: %s nbdevice gzfile [size]\n",argv[0]);
+  char *device=NULL;
+  char *gzname;
+  u64 span=DEFAULT_SPAN;
+  u64 cachesize=DEFAULT_CACHE;
+  u32 nworkers=DEFAULT_THREADS;
+  u32 ra=DEFAULT_READAHEAD;
+  int bench=0;
+  struct gzindex *idx=NULL;
+  struct source src;
+  int c;
+
+  while((c=getopt(argc,argv,"i:c:t:r:b:"))>=0){
+    switch(c){
+      case 'i':
+        span=atoll(optarg);
+        break;
+      case 'c':
+        cachesize=atoll(optarg);
+        break;
+      case 't':
+        nworkers=atoi(optarg);
+        break;
+      case 'r':
+        ra=atoi(optarg);
+        break;
+      case 'b':
+        bench=atoi(optarg);
+        if(bench<=0){
+          argc=0;
+        }
+        break;
+      default:
+        argc=0;
+        break;
+    }
+  }
+  if(argc-optind<(bench ? 1 : 2)){
+    printf("Usage: %s [-i MiB] [-c MiB] [-t threads] [-r chunks] nbdevice gzfile [size]\n",argv[0]);
+    printf("       %s -b seconds [-i MiB] [-c MiB] [-t threads] [-r chunks] gzfile\n",argv[0]);
+    printf("  -i MiB      distance between the access points of the seek index, 0 for none\n");
+    printf("  -c MiB      size of the cache of decompressed chunks, 0 for none\n");
+    printf("  -t threads  threads that decompress the next chunks in the background\n");
+    printf("  -r chunks   how many chunks they decompress ahead, 0 for none\n");
+    printf("  -b seconds  check the readers, and benchmark them for this long per pattern, instead of serving\n");
     exit(1);
   }
+  if(bench){
+    gzname=argv[optind];
+  } else {
+    device=argv[optind];
+    gzname=argv[optind+1];
+  }
 
-  gz=gzopen(argv[2], "rb");
-  if(gz==NULL){
-    fprintf(stderr,"%s: unable open compressed file %s\n",argv[0],argv[2]);
-    exit(1);
+  if(span){
+    idx=get_index(argv[0],gzname,span*1048576);
+    if(idx==NULL){
+      fprintf(stderr,"%s: no seek index, reads will be slow\n",argv[0]);
+    }
+  }
+
+  if(bench){
+    if(idx==NULL){
+      fprintf(stderr,"%s: the benchmark needs the seek index\n",argv[0]);
+      exit(1);
+    }
+    exit(benchmark(argv[0],gzname,idx,bench,cachesize*1048576,nworkers,ra) ? 1 : 0);
+  }
+
+  if(idx==NULL){
+    gz=gzopen(gzname, "rb");
+    if(gz==NULL){
+      fprintf(stderr,"%s: unable open compressed file %s\n",argv[0],gzname);
+      exit(1);
+    }
   }
 
-  if(argc>3){
-    size=atoll(argv[3]);
+  if(argc-optind>2){
+    size=atoll(argv[optind+2]);
     if((size==0)||(size%BLOCK)){
-      fprintf(stderr,"%s: %s does not appear to be a valid size\n",argv[0],argv[3]);
+      fprintf(stderr,"%s: %s does not appear to be a valid size\n",argv[0],argv[optind+2]);
+      exit(1);
+    }
+    printf("%s: file=%s, size=%"PRId64"\n",argv[0],gzname,size);
+  } else if(idx){
+    size=idx->size;
+    if(size%BLOCK){
+      fprintf(stderr,"%s: size %"PRId64" of %s is not a multiple of %d\n",argv[0],size,gzname,BLOCK);
       exit(1);
     }
-    printf("%s: file=%s, size=%"PRId64"\n",argv[0],argv[2],size);
+    printf("%s: file=%s, size=%"PRId64"\n",argv[0],gzname,size);
   } else {
     char buffer[BLOCK];
     int result;
 
     size=0;
-    printf("%s: file=%s, seeking, ",argv[0],argv[2]);
+    printf("%s: file=%s, seeking, ",argv[0],gzname);
     fflush(stdout);
 
     /* expensive seek to get file size */
@@ -140,32 +1237,34 @@ int main(int argc, char **argv)
       exit(1);
       break;
     case 0 : /* child */
-      gzclose(gz);
+      if(gz){
+        gzclose(gz);
+      }
 
       close(pr[0]);
 
       sk=pr[1];
 
-      nbd=open(argv[1], O_RDWR);
+      nbd=open(device, O_RDWR);
       if(nbd<0){
-        fprintf(stderr,"%s: unable to open %s: %s\n",argv[0],argv[1],strerror(errno));
+        fprintf(stderr,"%s: unable to open %s: %s\n",argv[0],device,strerror(errno));
         exit(1);
       }
 
       if(ioctl(nbd,NBD_SET_SIZE,size)<0){
-        fprintf(stderr,"%s: failed to set size for %s: %s\n",argv[0],argv[1],strerror(errno));
+        fprintf(stderr,"%s: failed to set size for %s: %s\n",argv[0],device,strerror(errno));
         exit(1);
       }
 
       ioctl(nbd, NBD_CLEAR_SOCK);
 
       if(ioctl(nbd,NBD_SET_SOCK,sk)<0){
-        fprintf(stderr,"%s: failed to set socket for %s: %s\n",argv[0],argv[1],strerror(errno));
+        fprintf(stderr,"%s: failed to set socket for %s: %s\n",argv[0],device,strerror(errno));
         exit(1);
       }
 
       if(ioctl(nbd,NBD_DO_IT)<0){
-        fprintf(stderr,"%s: block device %s terminated: %s\n",argv[0],argv[1],strerror(errno));
+        fprintf(stderr,"%s: block device %s terminated: %s\n",argv[0],device,strerror(errno));
       }
 
       ioctl(nbd, NBD_CLEAR_QUE);
@@ -181,6 +1280,16 @@ int main(int argc, char **argv)
   close(pr[1]);
   sk=pr[0];
 
+  memset(&src, 0, sizeof(src));
+  src.gz=gz;
+  src.idx=idx;
+  if(idx && cachesize){
+    src.cache=cache_new(idx,cachesize*1048576,nworkers,ra);
+    if(src.cache==NULL){
+      fprintf(stderr,"%s: unable to set up the cache, going without\n",argv[0]);
+    }
+  }
+
   reply.magic=htonl(NBD_REPLY_MAGIC);
   reply.error=htonl(0);
 
@@ -220,8 +1329,7 @@ fprintf(stderr,"%s: len=%d, from=%"PRId64"\n",argv[0],len,from);
     }
 
     if(reply.error==htonl(0)){
-      gzseek(gz,from,0);
-      if(gzread(gz,chunk+sizeof(struct nbd_reply),len)!=len){
+      if(source_read(&src,from,(unsigned char *)chunk+sizeof(struct nbd_reply),len)){
         fprintf(stderr,"%s: unable to read\n",argv[0]);
         reply.error=htonl(EIO);
         len=0;
@@ -236,7 +1344,9 @@ fprintf(stderr,"%s: len=%d, from=%"PRId64"\n",argv[0],len,from);
     }
   }
 
-  gzclose(gz);
+  if(gz){
+    gzclose(gz);
+  }
 
   return 0;
 }
@@ -0,0 +1,800 @@
+#include "config.h"
+#include "nbd-debug.h"
+
+#include <journal.h>
+#include <nbdsrv.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define JOURNAL_MAGIC "NBDJRNL1"	/**< magic at the start of a journal file */
+#define JOURNAL_REC_MAGIC 0x4a524543	/**< magic at the start of a record */
+#define JOURNAL_REC_TRIM 1		/**< flag of a record that discards its
+					  pages rather than writing them */
+#define JOURNAL_BATCH 256		/**< maximum number of pages we write back
+					  to the export in one go */
+
+/**
+ * The header of a journal file. The file with the higher generation
+ * holds the more recent writes.
+ **/
+struct jheader {
+	char magic[8];
+	uint64_t generation;
+	uint64_t reserved[2];
+};
+
+/**
+ * The header of a record in a journal file. It is followed by npages
+ * pages of data, to be written at page*JOURNAL_PAGESIZE in the export,
+ * unless flags has JOURNAL_REC_TRIM: then there is no data, and the
+ * pages are to be discarded. The checksum covers both the header (with
+ * checksum set to 0) and the data.
+ **/
+struct jrecord {
+	uint32_t magic;
+	uint32_t checksum;
+	uint64_t seq;
+	uint64_t page;
+	uint32_t npages;
+	uint32_t flags;
+};
+
+/**
+ * Where the most recent copy of a page is, if it is in the journal
+ **/
+struct jentry {
+	uint64_t page;	/**< the page in the export; the key in the index */
+	int file;	/**< which journal file it is in */
+	off_t pos;	/**< where in that file it is */
+};
+
+/**
+ * A range of pages that a journal file discards
+ **/
+struct jtrim {
+	uint64_t page;
+	uint32_t npages;
+};
+
+struct _journal {
+	gchar *path;	      /**< base name of the journal files */
+	uint64_t size;	      /**< size of the export */
+	JOURNAL_OPS ops;      /**< how to access the export */
+	gpointer data;	      /**< passed to ops */
+	int fd[2];	      /**< the journal files */
+	off_t fsize[2];	      /**< how much of each file is in use */
+	int active;	      /**< the file that writes are appended to */
+	int pending;	      /**< the file being written back, or -1 */
+	uint64_t generation;  /**< generation of the active file */
+	uint64_t seq;	      /**< sequence number of the last record */
+	gint64 since;	      /**< when the oldest record in the active file
+				was written, or 0 if it holds none */
+	GHashTable *index;    /**< page number -> struct jentry */
+	GArray *trims[2];     /**< struct jtrim: what each file discards,
+				which is done before its pages are
+				written back */
+	GMutex lock;	      /**< protects everything above */
+	GCond cond;	      /**< signalled when pending, stop or error change */
+	GThread *destager;    /**< the thread that writes back to the export */
+	gboolean stop;	      /**< tells the destager to exit */
+	int error;	      /**< errno of a failed write-back, or 0 */
+};
+
+static uint32_t fnv1a(uint32_t hash, const void *buf, size_t len) {
+	const unsigned char *p = buf;
+
+	while(len--) {
+		hash ^= *p++;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+static uint32_t rec_checksum(struct jrecord *rec, const char *data) {
+	uint32_t save = rec->checksum;
+	uint32_t hash;
+
+	rec->checksum = 0;
+	hash = fnv1a(2166136261U, rec, sizeof(*rec));
+	if(!(rec->flags & JOURNAL_REC_TRIM))
+		hash = fnv1a(hash, data, (size_t)rec->npages * JOURNAL_PAGESIZE);
+	rec->checksum = save;
+	return hash;
+}
+
+static int pread_full(int fd, void *buf, size_t len, off_t pos) {
+	ssize_t ret;
+
+	while(len > 0) {
+		ret = pread(fd, buf, len, pos);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret < 0)
+			return -1;
+		if(ret == 0) {
+			errno = EIO;
+			return -1;
+		}
+		buf = (char *)buf + ret;
+		pos += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, off_t pos) {
+	ssize_t ret;
+
+	while(len > 0) {
+		ret = pwrite(fd, buf, len, pos);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret < 0)
+			return -1;
+		buf = (const char *)buf + ret;
+		pos += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/**
+ * Empty a journal file, and give it a new header
+ **/
+static int start_file(JOURNAL *j, int f, uint64_t generation) {
+	struct jheader hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+	hdr.generation = generation;
+	if(ftruncate(j->fd[f], 0) < 0)
+		return -1;
+	if(pwrite_full(j->fd[f], &hdr, sizeof(hdr), 0) < 0)
+		return -1;
+	j->fsize[f] = sizeof(hdr);
+	return 0;
+}
+
+static void index_add(JOURNAL *j, int f, off_t pos, uint64_t page, uint32_t npages) {
+	struct jentry *e;
+	uint32_t i;
+
+	for(i = 0; i < npages; i++) {
+		e = g_new(struct jentry, 1);
+		e->page = page + i;
+		e->file = f;
+		e->pos = pos + (off_t)i * JOURNAL_PAGESIZE;
+		g_hash_table_replace(j->index, &e->page, e);
+	}
+}
+
+static gboolean entry_in_range(gpointer key G_GNUC_UNUSED, gpointer value, gpointer user_data) {
+	struct jentry *e = value;
+	struct jtrim *t = user_data;
+
+	return e->page >= t->page && e->page - t->page < t->npages;
+}
+
+/**
+ * Forget about the copies of the given pages that are in the journal.
+ * Whichever is smaller of the range and the index is walked.
+ **/
+static void index_remove(JOURNAL *j, struct jtrim *t) {
+	uint64_t page;
+
+	if(t->npages > g_hash_table_size(j->index)) {
+		g_hash_table_foreach_remove(j->index, entry_in_range, t);
+		return;
+	}
+	for(page = t->page; page - t->page < t->npages; page++) {
+		g_hash_table_remove(j->index, &page);
+	}
+}
+
+/**
+ * Discard a range of pages in the export; the last page of the export
+ * may be partial.
+ **/
+static int trim_pages(JOURNAL *j, uint64_t page, uint32_t npages) {
+	off_t a = page * JOURNAL_PAGESIZE;
+	size_t len = (size_t)npages * JOURNAL_PAGESIZE;
+
+	if(!j->ops.trim)
+		return 0;
+	if(a + len > j->size)
+		len = j->size - a;
+	return j->ops.trim(a, len, j->data);
+}
+
+/**
+ * Read from the export through the journal; the lock must be held.
+ **/
+static int read_locked(JOURNAL *j, off_t a, char *buf, size_t len) {
+	struct jentry *e;
+	uint64_t page;
+	size_t cur;
+
+	while(len > 0) {
+		page = a / JOURNAL_PAGESIZE;
+		cur = JOURNAL_PAGESIZE - a % JOURNAL_PAGESIZE;
+		if(cur > len)
+			cur = len;
+		if((e = g_hash_table_lookup(j->index, &page))) {
+			if(pread_full(j->fd[e->file], buf, cur, e->pos + a % JOURNAL_PAGESIZE) < 0)
+				return -1;
+		} else {
+			/* read all the following pages that are not in
+			 * the journal in one go */
+			while(cur < len) {
+				page = (a + cur) / JOURNAL_PAGESIZE;
+				if(g_hash_table_lookup(j->index, &page))
+					break;
+				cur += (len - cur > JOURNAL_PAGESIZE) ? JOURNAL_PAGESIZE : len - cur;
+			}
+			if(j->ops.read(a, buf, cur, j->data))
+				return -1;
+		}
+		a += cur;
+		buf += cur;
+		len -= cur;
+	}
+	return 0;
+}
+
+/**
+ * Read a whole page through the journal, padding it with zeroes if it
+ * is the last, partial, page of the export; the lock must be held.
+ **/
+static int read_page(JOURNAL *j, uint64_t page, char *buf) {
+	off_t a = page * JOURNAL_PAGESIZE;
+	size_t len = JOURNAL_PAGESIZE;
+
+	if(a + len > j->size) {
+		len = j->size - a;
+		memset(buf + len, 0, JOURNAL_PAGESIZE - len);
+	}
+	return read_locked(j, a, buf, len);
+}
+
+/**
+ * Make the other file the active one, and hand the current one to the
+ * destager. The lock must be held, and no file may be pending.
+ **/
+static int switch_files(JOURNAL *j) {
+	int next = !j->active;
+
+	if(start_file(j, next, j->generation + 1) < 0)
+		return -1;
+	j->generation++;
+	j->pending = j->active;
+	j->active = next;
+	j->since = 0;
+	g_cond_broadcast(&j->cond);
+	return 0;
+}
+
+/**
+ * Make sure a record of reclen bytes fits in the active file, switching
+ * files (after waiting for the other one to be written back) if it does
+ * not. The lock must be held.
+ **/
+static int make_room(JOURNAL *j, size_t reclen) {
+	if(j->fsize[j->active] + reclen > JOURNAL_MAXSIZE
+	   && j->fsize[j->active] > (off_t)sizeof(struct jheader)) {
+		while(j->pending >= 0 && !j->error)
+			g_cond_wait(&j->cond, &j->lock);
+		if(j->error) {
+			errno = j->error;
+			return -1;
+		}
+		if(switch_files(j) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Append a record to the active file and account for it. The lock must
+ * be held.
+ **/
+static int append_record(JOURNAL *j, struct jrecord *rec, size_t reclen) {
+	if(pwrite_full(j->fd[j->active], rec, reclen, j->fsize[j->active]) < 0)
+		return -1;
+	j->fsize[j->active] += reclen;
+	if(!j->since) {
+		j->since = g_get_monotonic_time();
+		g_cond_broadcast(&j->cond);
+	}
+	return 0;
+}
+
+/** What writeback() collects from the index */
+struct collect {
+	int file;	  /**< the journal file being written back */
+	GArray *pages;	  /**< the entries in that file */
+};
+
+static void collect_entry(gpointer key G_GNUC_UNUSED, gpointer value, gpointer user_data) {
+	struct collect *c = user_data;
+	struct jentry *e = value;
+
+	if(e->file == c->file) {
+		g_array_append_val(c->pages, *e);
+	}
+}
+
+static gboolean entry_in_file(gpointer key G_GNUC_UNUSED, gpointer value, gpointer user_data) {
+	struct jentry *e = value;
+
+	return e->file == GPOINTER_TO_INT(user_data);
+}
+
+static gint entry_cmp(gconstpointer a, gconstpointer b) {
+	const struct jentry *ea = a;
+	const struct jentry *eb = b;
+
+	if(ea->page < eb->page)
+		return -1;
+	return ea->page > eb->page;
+}
+
+/**
+ * Discard what journal file f discards, then write the pages of which
+ * the most recent copy is in it back to the export, in order of offset,
+ * merging adjacent pages. A page that was written before a trim of it
+ * is no longer in the index, so it is only written if it was written
+ * again after the trim, and the order is kept. Must be called without
+ * the lock held; only the destager (or, once it has exited,
+ * journal_close()) does this.
+ **/
+static int writeback(JOURNAL *j, int f) {
+	GArray *pages = g_array_new(FALSE, FALSE, sizeof(struct jentry));
+	GArray *trims = g_array_new(FALSE, FALSE, sizeof(struct jtrim));
+	struct collect c = { f, pages };
+	struct jentry *e;
+	struct jtrim *t;
+	char *buf = g_malloc(JOURNAL_BATCH * JOURNAL_PAGESIZE);
+	uint64_t first;
+	off_t a;
+	size_t len;
+	guint i, n;
+	int retval = 0;
+
+	g_mutex_lock(&j->lock);
+	g_hash_table_foreach(j->index, collect_entry, &c);
+	g_array_append_vals(trims, j->trims[f]->data, j->trims[f]->len);
+	g_mutex_unlock(&j->lock);
+	g_array_sort(pages, entry_cmp);
+
+	for(i = 0; i < trims->len; i++) {
+		t = &g_array_index(trims, struct jtrim, i);
+		if(trim_pages(j, t->page, t->npages)) {
+			retval = -1;
+			goto out;
+		}
+	}
+	for(i = 0; i < pages->len; i += n) {
+		first = g_array_index(pages, struct jentry, i).page;
+		for(n = 0; n < JOURNAL_BATCH && i + n < pages->len; n++) {
+			e = &g_array_index(pages, struct jentry, i + n);
+			if(e->page != first + n)
+				break;
+			if(pread_full(j->fd[f], buf + n * JOURNAL_PAGESIZE, JOURNAL_PAGESIZE, e->pos) < 0) {
+				retval = -1;
+				goto out;
+			}
+		}
+		a = first * JOURNAL_PAGESIZE;
+		len = n * JOURNAL_PAGESIZE;
+		if(a + len > j->size)
+			len = j->size - a;
+		if(j->ops.write(a, buf, len, j->data)) {
+			retval = -1;
+			goto out;
+		}
+	}
+	if((pages->len || trims->len) && j->ops.sync(j->data))
+		retval = -1;
+out:
+	g_free(buf);
+	g_array_free(pages, TRUE);
+	g_array_free(trims, TRUE);
+	return retval;
+}
+
+/**
+ * Forget about journal file f after it was written back, or record that
+ * writing it back failed. The lock must be held.
+ **/
+static void finish_writeback(JOURNAL *j, int f, int ret) {
+	if(ret) {
+		j->error = errno ? errno : EIO;
+		msg(LOG_ERR, "Could not write journal %s.%d back to the export: %s",
+		    j->path, f, strerror(j->error));
+	} else {
+		g_hash_table_foreach_remove(j->index, entry_in_file, GINT_TO_POINTER(f));
+		g_array_set_size(j->trims[f], 0);
+		if(ftruncate(j->fd[f], 0) < 0) {
+			j->error = errno;
+			msg(LOG_ERR, "Could not truncate journal %s.%d: %m", j->path, f);
+		}
+		j->fsize[f] = 0;
+		j->pending = -1;
+	}
+	g_cond_broadcast(&j->cond);
+}
+
+/**
+ * The destager thread: writes back a journal file when a writer has
+ * switched away from it because it was full, or when the active file
+ * has held data for longer than JOURNAL_IDLE seconds.
+ **/
+static gpointer destager(gpointer data) {
+	JOURNAL *j = data;
+	gint64 deadline;
+	int f, ret;
+
+	g_mutex_lock(&j->lock);
+	while(!j->stop) {
+		if(j->error) {
+			g_cond_wait(&j->cond, &j->lock);
+			continue;
+		}
+		if(j->pending < 0) {
+			deadline = j->since + JOURNAL_IDLE * G_TIME_SPAN_SECOND;
+			if(j->since && g_get_monotonic_time() >= deadline) {
+				if(switch_files(j) < 0) {
+					j->error = errno;
+					msg(LOG_ERR, "Could not switch journal files: %m");
+				}
+				continue;
+			}
+			if(j->since) {
+				g_cond_wait_until(&j->cond, &j->lock, deadline);
+			} else {
+				g_cond_wait(&j->cond, &j->lock);
+			}
+			continue;
+		}
+		f = j->pending;
+		g_mutex_unlock(&j->lock);
+		ret = writeback(j, f);
+		g_mutex_lock(&j->lock);
+		finish_writeback(j, f, ret);
+	}
+	g_mutex_unlock(&j->lock);
+	return NULL;
+}
+
+/**
+ * Write the valid records of journal file f to the export. Stops at the
+ * first record that is incomplete or does not match its checksum, which
+ * is where we crashed while appending to it.
+ *
+ * @return the number of records replayed, or -1 on failure
+ **/
+static int replay_file(JOURNAL *j, int f) {
+	struct jrecord rec;
+	off_t pos = sizeof(struct jheader);
+	char *data;
+	off_t a;
+	size_t len;
+	int count = 0;
+
+	while(pread_full(j->fd[f], &rec, sizeof(rec), pos) == 0) {
+		if(rec.magic != JOURNAL_REC_MAGIC || !rec.npages
+		   || rec.page * JOURNAL_PAGESIZE >= j->size)
+			break;
+		if(rec.flags & JOURNAL_REC_TRIM) {
+			if(rec_checksum(&rec, NULL) != rec.checksum)
+				break;
+			if(trim_pages(j, rec.page, rec.npages))
+				return -1;
+			if(rec.seq > j->seq)
+				j->seq = rec.seq;
+			pos += sizeof(rec);
+			count++;
+			continue;
+		}
+		if(rec.npages > JOURNAL_MAXSIZE / JOURNAL_PAGESIZE)
+			break;
+		len = (size_t)rec.npages * JOURNAL_PAGESIZE;
+		data = g_malloc(len);
+		if(pread_full(j->fd[f], data, len, pos + sizeof(rec)) < 0
+		   || rec_checksum(&rec, data) != rec.checksum) {
+			g_free(data);
+			break;
+		}
+		a = rec.page * JOURNAL_PAGESIZE;
+		if(a + len > j->size)
+			len = j->size - a;
+		if(j->ops.write(a, data, len, j->data)) {
+			g_free(data);
+			return -1;
+		}
+		g_free(data);
+		if(rec.seq > j->seq)
+			j->seq = rec.seq;
+		pos += sizeof(rec) + (off_t)rec.npages * JOURNAL_PAGESIZE;
+		count++;
+	}
+	return count;
+}
+
+/**
+ * Write back whatever a previous connection left in the journal, oldest
+ * generation first, and start over with empty files.
+ **/
+static int replay(JOURNAL *j) {
+	struct jheader hdr[2];
+	gboolean valid[2];
+	int order[2] = { 0, 1 };
+	int f, i, ret;
+	int count = 0;
+
+	for(f = 0; f < 2; f++) {
+		valid[f] = pread_full(j->fd[f], &hdr[f], sizeof(hdr[f]), 0) == 0
+			&& !memcmp(hdr[f].magic, JOURNAL_MAGIC, sizeof(hdr[f].magic));
+		if(valid[f] && hdr[f].generation > j->generation)
+			j->generation = hdr[f].generation;
+	}
+	if(valid[0] && valid[1] && hdr[1].generation < hdr[0].generation) {
+		order[0] = 1;
+		order[1] = 0;
+	}
+	for(i = 0; i < 2; i++) {
+		f = order[i];
+		if(!valid[f])
+			continue;
+		if((ret = replay_file(j, f)) < 0)
+			return -1;
+		count += ret;
+	}
+	if(count) {
+		if(j->ops.sync(j->data))
+			return -1;
+		msg(LOG_INFO, "Replayed %d records from journal %s", count, j->path);
+	}
+	if(ftruncate(j->fd[1], 0) < 0)
+		return -1;
+	j->fsize[1] = 0;
+	j->active = 0;
+	if(start_file(j, 0, j->generation + 1) < 0)
+		return -1;
+	j->generation++;
+	return 0;
+}
+
+JOURNAL* journal_open(const gchar* path, uint64_t size, const JOURNAL_OPS* ops,
+		      gpointer data, GError** err) {
+	JOURNAL *j = g_new0(JOURNAL, 1);
+	gchar *name;
+	int f;
+
+	j->path = g_strdup(path);
+	j->size = size;
+	j->ops = *ops;
+	j->data = data;
+	j->fd[0] = j->fd[1] = -1;
+	j->pending = -1;
+	j->index = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+	j->trims[0] = g_array_new(FALSE, FALSE, sizeof(struct jtrim));
+	j->trims[1] = g_array_new(FALSE, FALSE, sizeof(struct jtrim));
+	g_mutex_init(&j->lock);
+	g_cond_init(&j->cond);
+
+	for(f = 0; f < 2; f++) {
+		name = g_strdup_printf("%s.%d", path, f);
+		j->fd[f] = open(name, O_RDWR | O_CREAT, 0600);
+		if(j->fd[f] < 0) {
+			g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+				    "Could not open journal file %s: %s", name, strerror(errno));
+			g_free(name);
+			goto fail;
+		}
+		g_free(name);
+	}
+	if(flock(j->fd[0], LOCK_EX | LOCK_NB) < 0) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "Journal %s is in use by another connection", path);
+		goto fail;
+	}
+	if(replay(j) < 0) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "Could not replay journal %s: %s", path, strerror(errno));
+		goto fail;
+	}
+	j->destager = g_thread_try_new("journal", destager, j, err);
+	if(!j->destager)
+		goto fail;
+	return j;
+
+fail:
+	for(f = 0; f < 2; f++) {
+		if(j->fd[f] >= 0)
+			close(j->fd[f]);
+	}
+	g_hash_table_destroy(j->index);
+	g_array_free(j->trims[0], TRUE);
+	g_array_free(j->trims[1], TRUE);
+	g_cond_clear(&j->cond);
+	g_mutex_clear(&j->lock);
+	g_free(j->path);
+	g_free(j);
+	return NULL;
+}
+
+int journal_read(JOURNAL* j, off_t a, char *buf, size_t len) {
+	int retval;
+
+	g_mutex_lock(&j->lock);
+	retval = read_locked(j, a, buf, len);
+	g_mutex_unlock(&j->lock);
+	return retval;
+}
+
+int journal_write(JOURNAL* j, off_t a, char *buf, size_t len, int fua) {
+	struct jrecord *rec;
+	char *data;
+	uint64_t first, last;
+	size_t reclen;
+	off_t pos;
+	int retval = -1;
+
+	if(!len)
+		return 0;
+	first = a / JOURNAL_PAGESIZE;
+	last = (a + len - 1) / JOURNAL_PAGESIZE;
+	reclen = sizeof(*rec) + (last - first + 1) * JOURNAL_PAGESIZE;
+	rec = g_malloc(reclen);
+	data = (char *)(rec + 1);
+
+	g_mutex_lock(&j->lock);
+	if(j->error) {
+		errno = j->error;
+		goto out;
+	}
+	/* complete the first and last page if the write does not cover
+	 * them */
+	if(a % JOURNAL_PAGESIZE && read_page(j, first, data) < 0)
+		goto out;
+	if((a + len) % JOURNAL_PAGESIZE && (last != first || !(a % JOURNAL_PAGESIZE))
+	   && read_page(j, last, data + (last - first) * JOURNAL_PAGESIZE) < 0)
+		goto out;
+	memcpy(data + a % JOURNAL_PAGESIZE, buf, len);
+
+	if(make_room(j, reclen) < 0)
+		goto out;
+
+	rec->magic = JOURNAL_REC_MAGIC;
+	rec->seq = ++j->seq;
+	rec->page = first;
+	rec->npages = last - first + 1;
+	rec->flags = 0;
+	rec->checksum = rec_checksum(rec, data);
+	pos = j->fsize[j->active] + sizeof(*rec);
+	if(append_record(j, rec, reclen) < 0)
+		goto out;
+	index_add(j, j->active, pos, first, rec->npages);
+	if(fua && fdatasync(j->fd[j->active]) < 0)
+		goto out;
+	retval = 0;
+out:
+	g_mutex_unlock(&j->lock);
+	g_free(rec);
+	return retval;
+}
+
+int journal_trim(JOURNAL* j, off_t a, size_t len) {
+	struct jrecord rec;
+	struct jtrim t;
+	uint64_t end;
+	int retval = -1;
+
+	/* only whole pages can be discarded; the last page of the export
+	 * counts as whole if the trim reaches its end */
+	t.page = (a + JOURNAL_PAGESIZE - 1) / JOURNAL_PAGESIZE;
+	if(a + len >= j->size)
+		end = (j->size + JOURNAL_PAGESIZE - 1) / JOURNAL_PAGESIZE;
+	else
+		end = (a + len) / JOURNAL_PAGESIZE;
+	if(end <= t.page)
+		return 0;
+	t.npages = end - t.page;
+
+	g_mutex_lock(&j->lock);
+	if(j->error) {
+		errno = j->error;
+		goto out;
+	}
+	if(make_room(j, sizeof(rec)) < 0)
+		goto out;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.magic = JOURNAL_REC_MAGIC;
+	rec.seq = ++j->seq;
+	rec.page = t.page;
+	rec.npages = t.npages;
+	rec.flags = JOURNAL_REC_TRIM;
+	rec.checksum = rec_checksum(&rec, NULL);
+	if(append_record(j, &rec, sizeof(rec)) < 0)
+		goto out;
+	/* earlier writes of these pages must not be written back over
+	 * the trim, nor be read back */
+	index_remove(j, &t);
+	g_array_append_val(j->trims[j->active], t);
+	retval = 0;
+out:
+	g_mutex_unlock(&j->lock);
+	return retval;
+}
+
+int journal_flush(JOURNAL* j) {
+	int retval = -1;
+
+	g_mutex_lock(&j->lock);
+	if(j->error) {
+		errno = j->error;
+		goto out;
+	}
+	/* the file being written back may hold writes that were never
+	 * synced, too */
+	if(j->pending >= 0 && fdatasync(j->fd[j->pending]) < 0)
+		goto out;
+	if(fdatasync(j->fd[j->active]) < 0)
+		goto out;
+	retval = 0;
+out:
+	g_mutex_unlock(&j->lock);
+	return retval;
+}
+
+int journal_close(JOURNAL* j) {
+	int retval = 0;
+	int f;
+
+	g_mutex_lock(&j->lock);
+	j->stop = TRUE;
+	g_cond_broadcast(&j->cond);
+	g_mutex_unlock(&j->lock);
+	g_thread_join(j->destager);
+
+	/* the destager is gone, so write back what is left ourselves */
+	if(!j->error && j->pending >= 0) {
+		f = j->pending;
+		retval = writeback(j, f);
+		g_mutex_lock(&j->lock);
+		finish_writeback(j, f, retval);
+		g_mutex_unlock(&j->lock);
+	}
+	if(!j->error && j->fsize[j->active] > (off_t)sizeof(struct jheader)) {
+		f = j->active;
+		retval = writeback(j, f);
+		g_mutex_lock(&j->lock);
+		finish_writeback(j, f, retval);
+		g_mutex_unlock(&j->lock);
+	}
+	if(j->error)
+		retval = -1;
+
+	for(f = 0; f < 2; f++) {
+		close(j->fd[f]);
+	}
+	g_hash_table_destroy(j->index);
+	g_array_free(j->trims[0], TRUE);
+	g_array_free(j->trims[1], TRUE);
+	g_cond_clear(&j->cond);
+	g_mutex_clear(&j->lock);
+	g_free(j->path);
+	g_free(j);
+	return retval;
+}
@@ -0,0 +1,108 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "lfs.h"
+
+#include <glib.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+/**
+ * The size of the blocks that the journal deals in. Writes that do not
+ * cover a whole page are completed with the current contents of the
+ * page before they are written to the journal.
+ **/
+#define JOURNAL_PAGESIZE 4096
+
+/**
+ * The size a journal file may grow to before we switch to the other one,
+ * and start writing the first one back to the export
+ **/
+#define JOURNAL_MAXSIZE (64*1024*1024)
+
+/**
+ * The number of seconds a journal file may hold data that has not been
+ * written back to the export before we do so, even if it is not full
+ **/
+#define JOURNAL_IDLE 5
+
+/**
+ * How the journal accesses the export it sits in front of. Every
+ * function returns 0 on success, or nonzero (with errno set) on
+ * failure. The write, sync and trim functions are called from the
+ * destager thread, concurrently with calls to the read function from
+ * the thread that serves the client. trim may be NULL.
+ **/
+typedef struct {
+	int (*read)(off_t a, char *buf, size_t len, gpointer data);
+	int (*write)(off_t a, char *buf, size_t len, gpointer data);
+	int (*sync)(gpointer data);
+	int (*trim)(off_t a, size_t len, gpointer data);
+} JOURNAL_OPS;
+
+typedef struct _journal JOURNAL;
+
+/**
+ * Open the journal for an export, and write back whatever a previous
+ * connection left in it.
+ *
+ * The journal consists of two files, path.0 and path.1, that are
+ * written to in turn. While the one is being appended to, the other is
+ * written back to the export, in order of offset, by a background
+ * thread, after which it is truncated.
+ *
+ * @param path base name of the journal files
+ * @param size the size of the export
+ * @param ops how to access the export
+ * @param data passed to the functions in ops
+ * @param err set if the journal could not be opened
+ * @return the journal, or NULL on failure
+ **/
+JOURNAL* journal_open(const gchar* path, uint64_t size, const JOURNAL_OPS* ops,
+		      gpointer data, GError** err);
+
+/**
+ * Read from the export, taking data that has not been written back yet
+ * from the journal.
+ *
+ * @return 0 on success, -1 on failure (with errno set)
+ **/
+int journal_read(JOURNAL* j, off_t a, char *buf, size_t len);
+
+/**
+ * Append a write to the journal.
+ *
+ * @param fua if nonzero, the write is on stable storage when we return
+ * @return 0 on success, -1 on failure (with errno set)
+ **/
+int journal_write(JOURNAL* j, off_t a, char *buf, size_t len, int fua);
+
+/**
+ * Append a trim to the journal. It is done on the export when the
+ * journal is written back, in order with the writes around it; until
+ * then, reads of the range return what the export held. Only the whole
+ * pages in the range are discarded.
+ *
+ * @return 0 on success, -1 on failure (with errno set)
+ **/
+int journal_trim(JOURNAL* j, off_t a, size_t len);
+
+/**
+ * Make sure every write that was appended to the journal so far is on
+ * stable storage.
+ *
+ * @return 0 on success, -1 on failure (with errno set)
+ **/
+int journal_flush(JOURNAL* j);
+
+/**
+ * Write everything that is in the journal back to the export, and close
+ * the journal.
+ *
+ * @return 0 on success, -1 if not everything could be written back (in
+ * which case it will be when the journal is next opened)
+ **/
+int journal_close(JOURNAL* j);
+
+#endif //JOURNAL_H
@@ -0,0 +1,501 @@
+/*
+ * nbd-cachesim.c
+ *
+ * Takes an nbd transaction log file on stdin, and works out how well a
+ * read cache in front of the export would have done: for a number of
+ * replacement policies, cache sizes and block sizes at once, in one pass
+ * over the log, so that logs of any length can be used.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <glib.h>
+#include "config.h"
+/* We don't want to do syslog output in this program */
+#undef ISSERVER
+#include "cliserv.h"
+#include "nbd.h"
+#include "trlog.h"
+
+#define DEFAULT_SIZES "16M,64M,256M,1G"
+#define DEFAULT_BLOCKS "4K,64K"
+#define DEFAULT_POLICIES "lru,arc,2q"
+
+typedef enum {
+	POLICY_LRU,
+	POLICY_ARC,
+	POLICY_2Q,
+} POLICY;
+
+static const char *policynames[] = { "lru", "arc", "2q" };
+
+/**
+ * The lists a cache keeps its entries on. Which of them are used, and
+ * what for, depends on the policy:
+ * - LRU only uses T1, in order of use.
+ * - ARC keeps blocks that were used once in T1 and blocks that were
+ *   used more than once in T2; B1 and B2 remember the blocks that were
+ *   last evicted from either.
+ * - 2Q keeps newly arrived blocks in T1 (its A1in), in order of arrival;
+ *   blocks that are used again after they were evicted from T1 go in
+ *   T2 (its Am), in order of use. B1 (its A1out) remembers the blocks
+ *   that were last evicted from T1.
+ * The lists that remember evicted blocks only hold their numbers, not
+ * their data, so they do not count towards the size of the cache.
+ **/
+typedef enum {
+	LIST_T1,
+	LIST_T2,
+	LIST_B1,
+	LIST_B2,
+	LISTS,
+} LIST;
+
+struct centry {
+	uint64_t block;
+	LIST list;
+	struct centry *prev;	/**< towards the most recently used end */
+	struct centry *next;	/**< towards the least recently used end */
+};
+
+struct clist {
+	struct centry *head;	/**< the most recently used entry */
+	struct centry *tail;	/**< the least recently used entry */
+	uint64_t len;
+};
+
+/**
+ * One cache we simulate
+ **/
+struct cache {
+	POLICY policy;
+	uint64_t size;		/**< size of the cache, in bytes */
+	uint32_t blocksize;
+	uint64_t capacity;	/**< size of the cache, in blocks */
+	double p;		/**< ARC: the target size of T1 */
+	GHashTable *entries;	/**< the entries on any of the lists, by
+				     block number */
+	struct clist lists[LISTS];
+	uint64_t lookups;	/**< blocks looked up */
+	uint64_t hits;		/**< blocks found */
+	uint64_t bytes;		/**< bytes read */
+	uint64_t hitbytes;	/**< bytes read that were found */
+};
+
+static struct cache *caches;
+static int ncaches;
+
+static void list_unlink(struct cache *c, struct centry *e) {
+	struct clist *l = &c->lists[e->list];
+
+	if(e->prev)
+		e->prev->next = e->next;
+	else
+		l->head = e->next;
+	if(e->next)
+		e->next->prev = e->prev;
+	else
+		l->tail = e->prev;
+	l->len--;
+}
+
+static void list_push(struct cache *c, struct centry *e, LIST list) {
+	struct clist *l = &c->lists[list];
+
+	e->list = list;
+	e->prev = NULL;
+	e->next = l->head;
+	if(l->head)
+		l->head->prev = e;
+	else
+		l->tail = e;
+	l->head = e;
+	l->len++;
+}
+
+/**
+ * Move an entry to the most recently used end of a list.
+ **/
+static void list_move(struct cache *c, struct centry *e, LIST list) {
+	list_unlink(c, e);
+	list_push(c, e, list);
+}
+
+static struct centry *add_entry(struct cache *c, uint64_t block, LIST list) {
+	struct centry *e = g_new(struct centry, 1);
+
+	e->block = block;
+	g_hash_table_insert(c->entries, &e->block, e);
+	list_push(c, e, list);
+	return e;
+}
+
+/**
+ * Forget the least recently used entry of a list.
+ **/
+static void drop_tail(struct cache *c, LIST list) {
+	struct centry *e = c->lists[list].tail;
+
+	list_unlink(c, e);
+	g_hash_table_remove(c->entries, &e->block);
+	g_free(e);
+}
+
+static gboolean access_lru(struct cache *c, uint64_t block) {
+	struct centry *e = g_hash_table_lookup(c->entries, &block);
+
+	if(e) {
+		list_move(c, e, LIST_T1);
+		return TRUE;
+	}
+	if(c->lists[LIST_T1].len >= c->capacity)
+		drop_tail(c, LIST_T1);
+	add_entry(c, block, LIST_T1);
+	return FALSE;
+}
+
+/**
+ * ARC: make room in the cache, by moving the least recently used entry
+ * of T1 or of T2 to the matching ghost list.
+ *
+ * @param inb2 whether the block that needs the room was found in B2
+ **/
+static void arc_replace(struct cache *c, gboolean inb2) {
+	uint64_t t1 = c->lists[LIST_T1].len;
+
+	if(t1 && ((inb2 && t1 == (uint64_t)c->p) || t1 > c->p))
+		list_move(c, c->lists[LIST_T1].tail, LIST_B1);
+	else if(c->lists[LIST_T2].len)
+		list_move(c, c->lists[LIST_T2].tail, LIST_B2);
+}
+
+static gboolean access_arc(struct cache *c, uint64_t block) {
+	struct centry *e = g_hash_table_lookup(c->entries, &block);
+	uint64_t len[LISTS];
+	uint64_t l1, total;
+	int i;
+
+	if(e && (e->list == LIST_T1 || e->list == LIST_T2)) {
+		list_move(c, e, LIST_T2);
+		return TRUE;
+	}
+	for(i = 0; i < LISTS; i++)
+		len[i] = c->lists[i].len;
+	if(e && e->list == LIST_B1) {
+		c->p = MIN((double)c->capacity, c->p + MAX((double)len[LIST_B2] / len[LIST_B1], 1.0));
+		arc_replace(c, FALSE);
+		list_move(c, e, LIST_T2);
+		return FALSE;
+	}
+	if(e) {
+		c->p = MAX(0.0, c->p - MAX((double)len[LIST_B1] / len[LIST_B2], 1.0));
+		arc_replace(c, TRUE);
+		list_move(c, e, LIST_T2);
+		return FALSE;
+	}
+	l1 = len[LIST_T1] + len[LIST_B1];
+	total = l1 + len[LIST_T2] + len[LIST_B2];
+	if(l1 >= c->capacity) {
+		if(len[LIST_T1] < c->capacity) {
+			drop_tail(c, LIST_B1);
+			arc_replace(c, FALSE);
+		} else {
+			drop_tail(c, LIST_T1);
+		}
+	} else if(total >= c->capacity) {
+		if(total >= 2 * c->capacity)
+			drop_tail(c, LIST_B2);
+		arc_replace(c, FALSE);
+	}
+	add_entry(c, block, LIST_T1);
+	return FALSE;
+}
+
+/**
+ * 2Q: make room in the cache. Blocks that only came in once leave first,
+ * as long as there are more than a quarter of the cache of them.
+ **/
+static void twoq_reclaim(struct cache *c) {
+	if(c->lists[LIST_T1].len + c->lists[LIST_T2].len < c->capacity)
+		return;
+	if(c->lists[LIST_T1].len > c->capacity / 4 || !c->lists[LIST_T2].len) {
+		list_move(c, c->lists[LIST_T1].tail, LIST_B1);
+		if(c->lists[LIST_B1].len > c->capacity / 2)
+			drop_tail(c, LIST_B1);
+	} else {
+		drop_tail(c, LIST_T2);
+	}
+}
+
+static gboolean access_2q(struct cache *c, uint64_t block) {
+	struct centry *e = g_hash_table_lookup(c->entries, &block);
+
+	if(e && e->list == LIST_T2) {
+		list_move(c, e, LIST_T2);
+		return TRUE;
+	}
+	if(e && e->list == LIST_T1)
+		return TRUE;
+	if(e) {
+		/* seen before, and evicted from T1 since; it's not a
+		 * one-off, so give it a place in T2 */
+		list_unlink(c, e);
+		g_hash_table_remove(c->entries, &e->block);
+		g_free(e);
+		twoq_reclaim(c);
+		add_entry(c, block, LIST_T2);
+		return FALSE;
+	}
+	twoq_reclaim(c);
+	add_entry(c, block, LIST_T1);
+	return FALSE;
+}
+
+/**
+ * Feed a read to a cache.
+ **/
+static void cache_read(struct cache *c, uint64_t offset, uint32_t len) {
+	uint64_t block, first, last, part;
+	gboolean hit;
+
+	if(!len)
+		return;
+	first = offset / c->blocksize;
+	last = (offset + len - 1) / c->blocksize;
+	c->bytes += len;
+	for(block = first; block <= last; block++) {
+		switch(c->policy) {
+		case POLICY_LRU:
+			hit = access_lru(c, block);
+			break;
+		case POLICY_ARC:
+			hit = access_arc(c, block);
+			break;
+		default:
+			hit = access_2q(c, block);
+			break;
+		}
+		c->lookups++;
+		if(!hit)
+			continue;
+		c->hits++;
+		part = MIN(offset + len, (block + 1) * c->blocksize)
+		       - MAX(offset, block * c->blocksize);
+		c->hitbytes += part;
+	}
+}
+
+static void request(uint32_t command, uint64_t offset, uint32_t len) {
+	int i;
+
+	/* writes update the cache in place, as the cache in nbd-server
+	 * does; they don't change what is in it */
+	if((command & NBD_CMD_MASK_COMMAND) != NBD_CMD_READ)
+		return;
+	for(i = 0; i < ncaches; i++)
+		cache_read(&caches[i], offset, len);
+}
+
+static void readlog(void *buf, size_t len) {
+	if(fread(buf, len, 1, stdin) != 1) {
+		fprintf(stderr, "E: transaction log is truncated\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void skiplog(size_t len) {
+	char skip[256];
+
+	while(len) {
+		size_t n = MIN(len, sizeof(skip));
+
+		readlog(skip, n);
+		len -= n;
+	}
+}
+
+/**
+ * Go over the log. The records of the connections in a version 2 log
+ * are interleaved by block rather than by request, which is close
+ * enough for our purposes.
+ *
+ * @return the number of records that were dropped from the log
+ **/
+static uint64_t simulate(void) {
+	struct nbd_request req;
+	struct nbd_reply rep;
+	TRLOG_BLOCK hdr;
+	TRLOG_RECORD rec;
+	uint32_t magic, n, reclen, i;
+	uint64_t dropped = 0;
+
+	while(fread(&magic, sizeof(magic), 1, stdin) == 1) {
+		switch(ntohl(magic)) {
+		case NBD_REQUEST_MAGIC:
+			readlog(sizeof(magic)+(char *)(&req), sizeof(req)-sizeof(magic));
+			request(ntohl(req.type), ntohll(req.from), ntohl(req.len));
+			break;
+		case NBD_REPLY_MAGIC:
+			readlog(sizeof(magic)+(char *)(&rep), sizeof(rep)-sizeof(magic));
+			break;
+		case TRLOG_MAGIC:
+			readlog(sizeof(magic)+(char *)(&hdr), sizeof(hdr)-sizeof(magic));
+			reclen = ntohl(hdr.reclen);
+			n = ntohl(hdr.nrecords);
+			if(ntohs(hdr.version) != TRLOG_VERSION
+			   || ntohs(hdr.hdrlen) < sizeof(hdr) || reclen < sizeof(rec)) {
+				fprintf(stderr, "E: corrupt transaction log block\n");
+				exit(EXIT_FAILURE);
+			}
+			skiplog(ntohs(hdr.hdrlen) - sizeof(hdr));
+			dropped += ntohll(hdr.dropped);
+			for(i = 0; i < n; i++) {
+				readlog(&rec, sizeof(rec));
+				skiplog(reclen - sizeof(rec));
+				if(rec.type == TRLOG_REQUEST)
+					request(ntohl(rec.command), ntohll(rec.offset), ntohl(rec.len));
+			}
+			break;
+		default:
+			fprintf(stderr, "E: unknown transaction type %08x\n", ntohl(magic));
+			exit(EXIT_FAILURE);
+		}
+	}
+	return dropped;
+}
+
+/**
+ * Parse a size, with an optional K, M, G or T suffix.
+ *
+ * @return the size, or 0 if it is not valid
+ **/
+static uint64_t parse_size(const char *s) {
+	char *e;
+	uint64_t v = strtoull(s, &e, 0);
+
+	switch(*e) {
+	case 'T': case 't':
+		v *= 1024;
+		/* fall through */
+	case 'G': case 'g':
+		v *= 1024;
+		/* fall through */
+	case 'M': case 'm':
+		v *= 1024;
+		/* fall through */
+	case 'K': case 'k':
+		v *= 1024;
+		e++;
+	}
+	return *e ? 0 : v;
+}
+
+static uint64_t *parse_list(const char *what, const char *s, int *n) {
+	gchar **parts = g_strsplit(s, ",", 0);
+	uint64_t *v;
+	int i;
+
+	for(*n = 0; parts[*n]; (*n)++)
+		;
+	v = g_new(uint64_t, *n);
+	for(i = 0; i < *n; i++) {
+		if(!(v[i] = parse_size(parts[i]))) {
+			fprintf(stderr, "E: invalid %s %s\n", what, parts[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	g_strfreev(parts);
+	return v;
+}
+
+static void usage(const char *me) {
+	printf("This is nbd-cachesim, part of nbd %s.\n", PACKAGE_VERSION);
+	printf("Use: %s [-p policies] [-s cachesizes] [-b blocksizes] < transactionlog\n", me);
+	printf("Defaults: -p %s -s %s -b %s\n", DEFAULT_POLICIES, DEFAULT_SIZES, DEFAULT_BLOCKS);
+}
+
+int main(int argc, char**argv) {
+	const char *policies = DEFAULT_POLICIES, *sizes = DEFAULT_SIZES, *blocks = DEFAULT_BLOCKS;
+	gchar **pol;
+	uint64_t *size, *block, dropped;
+	int npol, nsize, nblock, i, j, k, c;
+	struct cache *cache;
+
+	while((c = getopt(argc, argv, "p:s:b:h")) >= 0) {
+		switch(c) {
+		case 'p':
+			policies = optarg;
+			break;
+		case 's':
+			sizes = optarg;
+			break;
+		case 'b':
+			blocks = optarg;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(optind < argc) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	pol = g_strsplit(policies, ",", 0);
+	for(npol = 0; pol[npol]; npol++)
+		;
+	size = parse_list("cache size", sizes, &nsize);
+	block = parse_list("block size", blocks, &nblock);
+
+	caches = g_new0(struct cache, npol * nsize * nblock);
+	for(i = 0; i < npol; i++) {
+		for(c = 0; c < (int)G_N_ELEMENTS(policynames); c++) {
+			if(!g_ascii_strcasecmp(pol[i], policynames[c]))
+				break;
+		}
+		if(c == G_N_ELEMENTS(policynames)) {
+			fprintf(stderr, "E: unknown policy %s\n", pol[i]);
+			exit(EXIT_FAILURE);
+		}
+		for(j = 0; j < nblock; j++) {
+			for(k = 0; k < nsize; k++) {
+				cache = &caches[ncaches++];
+				cache->policy = c;
+				cache->size = size[k];
+				cache->blocksize = block[j];
+				cache->capacity = size[k] / block[j];
+				if(!cache->capacity || block[j] > UINT32_MAX) {
+					fprintf(stderr, "E: a cache of %llu bytes can't hold blocks of %llu bytes\n",
+						(unsigned long long)size[k], (unsigned long long)block[j]);
+					exit(EXIT_FAILURE);
+				}
+				cache->entries = g_hash_table_new(g_int64_hash, g_int64_equal);
+			}
+		}
+	}
+
+	setvbuf(stdin, NULL, _IOFBF, 1024 * 1024);
+	dropped = simulate();
+	if(dropped)
+		fprintf(stderr, "W: %llu records were dropped from the log\n",
+			(unsigned long long)dropped);
+
+	printf("%-6s %10s %14s %14s %8s %8s\n", "policy", "block", "cache", "reads", "hit%", "bytehit%");
+	for(i = 0; i < ncaches; i++) {
+		cache = &caches[i];
+		printf("%-6s %10u %14llu %14llu %8.2f %8.2f\n", policynames[cache->policy],
+		       cache->blocksize, (unsigned long long)cache->size,
+		       (unsigned long long)cache->bytes,
+		       cache->lookups ? 100.0 * cache->hits / cache->lookups : 0.0,
+		       cache->bytes ? 100.0 * cache->hitbytes / cache->bytes : 0.0);
+	}
+	return 0;
+}
@@ -44,6 +44,7 @@
 #include <linux/ioctl.h>
 #define MY_NAME "nbd_client"
 #include "cliserv.h"
+#include "nbdclient.h"
 
 #ifdef WITH_SDP
 #include <sdp_inet.h>
@@ -163,205 +164,38 @@ int openunix(const char *path) {
 	return sock;
 }
 
-void ask_list(int sock) {
-	uint32_t opt;
-	uint32_t opt_server;
-	uint32_t len;
-	uint32_t reptype;
-	uint64_t magic;
-	const int BUF_SIZE = 1024;
-	char buf[BUF_SIZE];
-
-	magic = ntohll(opts_magic);
-	if (write(sock, &magic, sizeof(magic)) < 0)
-		err("Failed/2.2: %m");
-
-	/* Ask for the list */
-	opt = htonl(NBD_OPT_LIST);
-	if(write(sock, &opt, sizeof(opt)) < 0) {
-		err("writing list option failed: %m");
-	}
-	/* Send the length (zero) */
-	len = htonl(0);
-	if(write(sock, &len, sizeof(len)) < 0) {
-		err("writing length failed: %m");
-	}
-	/* newline, move away from the "Negotiation:" line */
-	printf("\n");
-	do {
-		memset(buf, 0, 1024);
-		if(read(sock, &magic, sizeof(magic)) < 0) {
-			err("Reading magic from server: %m");
-		}
-		if(read(sock, &opt_server, sizeof(opt_server)) < 0) {
-			err("Reading option: %m");
-		}
-		if(read(sock, &reptype, sizeof(reptype)) <0) {
-			err("Reading reply from server: %m");
-		}
-		if(read(sock, &len, sizeof(len)) < 0) {
-			err("Reading length from server: %m");
-		}
-		magic=ntohll(magic);
-		len=ntohl(len);
-		reptype=ntohl(reptype);
-		if(magic != rep_magic) {
-			err("Not enough magic from server");
-		}
-		if(reptype & NBD_REP_FLAG_ERROR) {
-			switch(reptype) {
-				case NBD_REP_ERR_POLICY:
-					fprintf(stderr, "\nE: listing not allowed by server.\n");
-					break;
-				default:
-					fprintf(stderr, "\nE: unexpected error from server.\n");
-					break;
-			}
-			if(len > 0 && len < BUF_SIZE) {
-				if(len=read(sock, buf, len) < 0) {
-					fprintf(stderr, "\nE: could not read error message from server\n");
-				}
-				buf[len] = '\0';
-				fprintf(stderr, "Server said: %s\n", buf);
-			}
-			exit(EXIT_FAILURE);
-		} else {
-			if(len) {
-				if(reptype != NBD_REP_SERVER) {
-					err("Server sent us a reply we don't understand!");
-				}
-				if(read(sock, &len, sizeof(len)) < 0) {
-					fprintf(stderr, "\nE: could not read export name length from server\n");
-					exit(EXIT_FAILURE);
-				}
-				len=ntohl(len);
-				if (len >= BUF_SIZE) {
-					fprintf(stderr, "\nE: export name on server too long\n");
-					exit(EXIT_FAILURE);
-				}
-				if(read(sock, buf, len) < 0) {
-					fprintf(stderr, "\nE: could not read export name from server\n");
-					exit(EXIT_FAILURE);
-				}
-				buf[len] = 0;
-				printf("%s\n", buf);
-			}
-		}
-	} while(reptype != NBD_REP_ACK);
-	opt=htonl(NBD_OPT_ABORT);
-	len=htonl(0);
-	magic=htonll(opts_magic);
-	if (write(sock, &magic, sizeof(magic)) < 0)
-		err("Failed/2.2: %m");
-	if (write(sock, &opt, sizeof(opt)) < 0)
-		err("Failed writing abort");
-	if (write(sock, &len, sizeof(len)) < 0)
-		err("Failed writing length");
+void print_export(const char* name, void* opaque) {
+	printf("%s\n", name);
 }
 
-void negotiate(int sock, u64 *rsize64, u32 *flags, char* name, uint32_t needed_flags, uint32_t client_flags, uint32_t do_opts) {
-	u64 magic, size64;
-	uint16_t tmp;
-	char buf[256] = "\0\0\0\0\0\0\0\0\0";
+void negotiate(int sock, u64 *rsize64, u32 *flags, char* name, uint32_t do_opts) {
+	u64 size64;
+	uint16_t eflags;
+	int ret;
 
 	printf("Negotiation: ");
-	if (read(sock, buf, 8) < 0)
-		err("Failed/1: %m");
-	if (strlen(buf)==0)
-		err("Server closed connection");
-	if (strcmp(buf, INIT_PASSWD))
-		err("INIT_PASSWD bad");
-	printf(".");
-	if (read(sock, &magic, sizeof(magic)) < 0)
-		err("Failed/2: %m");
-	magic = ntohll(magic);
-	if(name) {
-		uint32_t opt;
-		uint32_t namesize;
-
-		if (magic != opts_magic) {
-			if(magic == cliserv_magic) {
-				err("It looks like you're trying to connect to an oldstyle server with a named export. This won't work.");
-			}
-		}
-		printf(".");
-		if(read(sock, &tmp, sizeof(uint16_t)) < 0) {
-			err("Failed reading flags: %m");
-		}
-		*flags = ((u32)ntohs(tmp));
-		if((needed_flags & *flags) != needed_flags) {
-			/* There's currently really only one reason why this
-			 * check could possibly fail, but we may need to change
-			 * this error message in the future... */
-			fprintf(stderr, "\nE: Server does not support listing exports\n");
+	if(do_opts & NBDC_DO_LIST) {
+		/* newline, move away from the "Negotiation:" line */
+		printf("\n");
+		if((ret = nbdc_list(sock, print_export, NULL))) {
+			fprintf(stderr, "\nE: Could not list exports: %s\n", nbdc_strerror(ret));
 			exit(EXIT_FAILURE);
 		}
-
-		if (*flags & NBD_FLAG_NO_ZEROES) {
-			client_flags |= NBD_FLAG_C_NO_ZEROES;
-		}
-		client_flags = htonl(client_flags);
-		if (write(sock, &client_flags, sizeof(client_flags)) < 0)
-			err("Failed/2.1: %m");
-
-		if(do_opts & NBDC_DO_LIST) {
-			ask_list(sock);
-			exit(EXIT_SUCCESS);
-		}
-
-		/* Write the export name that we're after */
-		magic = htonll(opts_magic);
-		if (write(sock, &magic, sizeof(magic)) < 0)
-			err("Failed/2.2: %m");
-
-		opt = ntohl(NBD_OPT_EXPORT_NAME);
-		if (write(sock, &opt, sizeof(opt)) < 0)
-			err("Failed/2.3: %m");
-		namesize = (u32)strlen(name);
-		namesize = ntohl(namesize);
-		if (write(sock, &namesize, sizeof(namesize)) < 0)
-			err("Failed/2.4: %m");
-		if (write(sock, name, strlen(name)) < 0)
-			err("Failed/2.4: %m");
-	} else {
-		if (magic != cliserv_magic) {
-			if(magic != opts_magic)
-				err("Not enough cliserv_magic");
-			else
-				err("It looks like you're trying to connect to a newstyle server with the oldstyle protocol. Try the -N option.");
-		}
-		printf(".");
+		exit(EXIT_SUCCESS);
 	}
-
-	if (read(sock, &size64, sizeof(size64)) <= 0) {
-		if (!errno)
-			err("Server closed connection");
-		err("Failed/3: %m\n");
+	if((ret = nbdc_negotiate(sock, name, &size64, &eflags))) {
+		fprintf(stderr, "\nE: %s\n", nbdc_strerror(ret));
+		exit(EXIT_FAILURE);
 	}
-	size64 = ntohll(size64);
 
 	if ((size64>>12) > (uint64_t)~0UL) {
 		printf("size = %luMB", (unsigned long)(size64>>20));
 		err("Exported device is too big for me. Get 64-bit machine :-(\n");
 	} else
 		printf("size = %luMB", (unsigned long)(size64>>20));
-
-	if(!name) {
-		if (read(sock, flags, sizeof(*flags)) < 0)
-			err("Failed/4: %m\n");
-		*flags = ntohl(*flags);
-	} else {
-		if(read(sock, &tmp, sizeof(tmp)) < 0)
-			err("Failed/4: %m\n");
-		*flags |= (uint32_t)ntohs(tmp);
-	}
-
-	if (!(*flags & NBD_FLAG_NO_ZEROES)) {
-		if (read(sock, &buf, 124) < 0)
-			err("Failed/5: %m\n");
-	}
 	printf("\n");
 
+	*flags = eflags;
 	*rsize64 = size64;
 }
 
@@ -479,8 +313,6 @@ int main(int argc, char *argv[]) {
 	int nonspecial=0;
 	int b_unix=0;
 	char* name=NULL;
-	uint32_t needed_flags=0;
-	uint32_t cflags=NBD_FLAG_C_FIXED_NEWSTYLE;
 	uint32_t opts=0;
 	sigset_t block, old;
 	struct sigaction sa;
@@ -559,7 +391,6 @@ int main(int argc, char *argv[]) {
 			usage(NULL);
 			exit(EXIT_SUCCESS);
 		case 'l':
-			needed_flags |= NBD_FLAG_FIXED_NEWSTYLE;
 			opts |= NBDC_DO_LIST;
 			name="";
 			nbddev="";
@@ -616,7 +447,7 @@ int main(int argc, char *argv[]) {
 	if (sock < 0)
 		exit(EXIT_FAILURE);
 
-	negotiate(sock, &size64, &flags, name, needed_flags, cflags, opts);
+	negotiate(sock, &size64, &flags, name, opts);
 
 	nbd = open(nbddev, O_RDWR);
 	if (nbd < 0)
@@ -700,7 +531,7 @@ int main(int argc, char *argv[]) {
 					nbd = open(nbddev, O_RDWR);
 					if (nbd < 0)
 						err("Cannot open NBD: %m");
-					negotiate(sock, &new_size, &new_flags, name, needed_flags, cflags, opts);
+					negotiate(sock, &new_size, &new_flags, name, opts);
 					if (size64 != new_size) {
 						err("Size of the device changed. Bye");
 					}
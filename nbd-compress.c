@@ -0,0 +1,313 @@
+/*
+ * nbd-compress.c
+ *
+ * Converts a disk image to a compressed image that nbd-server can
+ * export with the compressed option, and back. The blocks of the image
+ * are compressed on their own, so that is done on as many threads as
+ * there are CPUs.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <glib.h>
+#include "config.h"
+/* We don't want to do syslog output in this program */
+#undef ISSERVER
+#include "cliserv.h"
+#include "cimage.h"
+
+#define BATCH 4	/**< blocks per thread that we read and compress at once */
+
+/**
+ * A block to compress
+ **/
+struct job {
+	char *in;	/**< the data */
+	size_t len;	/**< its length; blocksize, except at the end */
+	char *out;	/**< the compressed block */
+	ssize_t plen;	/**< its length, as cimage_pack() returned it */
+};
+
+static CIMAGE_CODEC codec;
+static int level;
+static GMutex lock;
+static GCond done;
+static int pending;
+
+static void pack_job(gpointer data, gpointer user_data) {
+	struct job *job = data;
+
+	job->plen = cimage_pack(codec, level, job->in, job->len, job->out);
+	g_mutex_lock(&lock);
+	if(!--pending)
+		g_cond_signal(&done);
+	g_mutex_unlock(&lock);
+}
+
+static ssize_t read_full(int fd, char *buf, size_t len) {
+	size_t total = 0;
+	ssize_t ret;
+
+	while(total < len) {
+		ret = read(fd, buf + total, len - total);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret < 0)
+			return -1;
+		if(ret == 0)
+			break;
+		total += ret;
+	}
+	return total;
+}
+
+static int write_full(int fd, const char *buf, size_t len) {
+	ssize_t ret;
+
+	while(len > 0) {
+		ret = write(fd, buf, len);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret < 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static uint64_t parse_size(const char *s) {
+	char *e;
+	uint64_t v = strtoull(s, &e, 0);
+
+	switch(*e) {
+	case 'M': case 'm':
+		v *= 1024;
+		/* fall through */
+	case 'K': case 'k':
+		v *= 1024;
+		e++;
+	}
+	return *e ? 0 : v;
+}
+
+static void compress_image(int in, int out, uint32_t blocksize, int nthreads) {
+	struct job *jobs;
+	CIMAGE_WRITER *w;
+	GThreadPool *pool = NULL;
+	GError *err = NULL;
+	uint64_t size = 0, packed = 0, nblocks = 0;
+	int batch = nthreads * BATCH;
+	int n, i;
+	gboolean eof = FALSE;
+	ssize_t len;
+
+	if(!(w = cimage_writer_new(out, codec, blocksize, &err))) {
+		fprintf(stderr, "E: %s\n", err->message);
+		exit(EXIT_FAILURE);
+	}
+	jobs = g_new0(struct job, batch);
+	for(i = 0; i < batch; i++) {
+		jobs[i].in = g_malloc(blocksize);
+		jobs[i].out = g_malloc(cimage_bound(codec, blocksize));
+	}
+	if(nthreads > 1 && !(pool = g_thread_pool_new(pack_job, NULL, nthreads, FALSE, &err))) {
+		fprintf(stderr, "E: could not start threads: %s\n", err->message);
+		exit(EXIT_FAILURE);
+	}
+	while(!eof) {
+		for(n = 0; n < batch && !eof; n++) {
+			if((len = read_full(in, jobs[n].in, blocksize)) < 0) {
+				perror("E: could not read the input");
+				exit(EXIT_FAILURE);
+			}
+			if(len < blocksize)
+				eof = TRUE;
+			if(!len)
+				break;
+			jobs[n].len = len;
+			size += len;
+		}
+		if(pool) {
+			pending = n;
+			for(i = 0; i < n; i++)
+				g_thread_pool_push(pool, &jobs[i], NULL);
+			g_mutex_lock(&lock);
+			while(pending)
+				g_cond_wait(&done, &lock);
+			g_mutex_unlock(&lock);
+		} else {
+			for(i = 0; i < n; i++)
+				jobs[i].plen = cimage_pack(codec, level, jobs[i].in, jobs[i].len, jobs[i].out);
+		}
+		/* the blocks go out in order, whatever order they were
+		 * compressed in */
+		for(i = 0; i < n; i++) {
+			if(jobs[i].plen < 0) {
+				perror("E: could not compress");
+				exit(EXIT_FAILURE);
+			}
+			if(cimage_writer_add(w, jobs[i].out, jobs[i].plen) < 0) {
+				perror("E: could not write the image");
+				exit(EXIT_FAILURE);
+			}
+			packed += jobs[i].plen;
+			nblocks++;
+		}
+	}
+	if(pool)
+		g_thread_pool_free(pool, FALSE, TRUE);
+	if(cimage_writer_finish(w, size, &err) < 0) {
+		fprintf(stderr, "E: %s\n", err->message);
+		exit(EXIT_FAILURE);
+	}
+	printf("%llu bytes in %llu blocks of %u, compressed to %llu bytes (%.1f%%) with %s\n",
+	       (unsigned long long)size, (unsigned long long)nblocks, blocksize,
+	       (unsigned long long)packed, size ? 100.0 * packed / size : 0.0,
+	       cimage_codec_name(codec));
+}
+
+static CIMAGE *open_image(int fd) {
+	GError *err = NULL;
+	CIMAGE *img = cimage_open(fd, NULL, &err);
+
+	if(!img) {
+		fprintf(stderr, "E: %s\n", err->message);
+		exit(EXIT_FAILURE);
+	}
+	return img;
+}
+
+static void decompress_image(int in, int out) {
+	CIMAGE *img = open_image(in);
+	uint64_t size = cimage_size(img), off;
+	uint64_t packed;
+	uint32_t blocksize;
+	CIMAGE_CODEC c;
+	size_t len;
+	char *buf;
+
+	cimage_info(img, &blocksize, &c, &packed);
+	buf = g_malloc(blocksize);
+	for(off = 0; off < size; off += len) {
+		len = size - off < blocksize ? size - off : blocksize;
+		if(cimage_read(img, off, buf, len) < 0) {
+			fprintf(stderr, "E: could not read block at %llu: %s\n",
+				(unsigned long long)off, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if(write_full(out, buf, len) < 0) {
+			perror("E: could not write the output");
+			exit(EXIT_FAILURE);
+		}
+	}
+	g_free(buf);
+	cimage_close(img);
+}
+
+static void show_info(int in) {
+	CIMAGE *img = open_image(in);
+	uint64_t size = cimage_size(img), packed;
+	uint32_t blocksize;
+	CIMAGE_CODEC c;
+
+	cimage_info(img, &blocksize, &c, &packed);
+	printf("codec: %s\n", cimage_codec_name(c));
+	printf("block size: %u\n", blocksize);
+	printf("size: %llu\n", (unsigned long long)size);
+	printf("compressed: %llu (%.1f%%)\n", (unsigned long long)packed,
+	       size ? 100.0 * packed / size : 0.0);
+	cimage_close(img);
+}
+
+static void usage(const char *me) {
+	fprintf(stderr, "Usage: %s [-c codec] [-l level] [-b blocksize] [-t threads] input image\n", me);
+	fprintf(stderr, "       %s -d image output\n", me);
+	fprintf(stderr, "       %s -i image\n", me);
+	fprintf(stderr, "Compress a disk image for an export with the compressed option.\n");
+	fprintf(stderr, "  -c codec      zlib or zstd (default: zstd if supported, else zlib)\n");
+	fprintf(stderr, "  -l level      compression level (default: the codec's default)\n");
+	fprintf(stderr, "  -b blocksize  size of the blocks that are compressed on their own,\n");
+	fprintf(stderr, "                a multiple of 4K (default 64K)\n");
+	fprintf(stderr, "  -t threads    number of threads that compress (default: one per CPU)\n");
+	fprintf(stderr, "  -d            decompress an image instead\n");
+	fprintf(stderr, "  -i            show what is in an image\n");
+}
+
+int main(int argc, char**argv) {
+	uint64_t blocksize = CIMAGE_BLOCKSIZE;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	gboolean decompress = FALSE, info = FALSE;
+	int in, out, c;
+
+	codec = cimage_codec_supported(CIMAGE_ZSTD) ? CIMAGE_ZSTD : CIMAGE_ZLIB;
+	while((c = getopt(argc, argv, "c:l:b:t:dih")) >= 0) {
+		switch(c) {
+		case 'c':
+			if(!(codec = cimage_codec_by_name(optarg))) {
+				fprintf(stderr, "E: unknown codec %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'l':
+			level = atoi(optarg);
+			break;
+		case 'b':
+			blocksize = parse_size(optarg);
+			if(!blocksize || blocksize > UINT32_MAX / 2) {
+				fprintf(stderr, "E: invalid block size %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'd':
+			decompress = TRUE;
+			break;
+		case 'i':
+			info = TRUE;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(argc - optind != (info ? 1 : 2)) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if(nthreads < 1)
+		nthreads = 1;
+	if((in = open(argv[optind], O_RDONLY)) < 0) {
+		fprintf(stderr, "E: could not open %s: %s\n", argv[optind], strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if(info) {
+		show_info(in);
+		exit(EXIT_SUCCESS);
+	}
+	if((out = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		fprintf(stderr, "E: could not create %s: %s\n", argv[optind + 1], strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if(decompress)
+		decompress_image(in, out);
+	else
+		compress_image(in, out, blocksize, nthreads);
+	if(close(out) < 0) {
+		fprintf(stderr, "E: could not write %s: %s\n", argv[optind + 1], strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return 0;
+}
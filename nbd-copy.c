@@ -0,0 +1,472 @@
+/*
+ * nbd-copy.c
+ *
+ * Copies an image to an NBD export, from one, or from one export to
+ * another, speaking the protocol itself: no nbd-client, no kernel
+ * module, no root. It keeps many requests in flight on several
+ * connections, and doesn't write blocks that are only zeroes where the
+ * destination reads as zeroes already.
+ */
+
+#include "lfs.h"
+/* for SEEK_DATA and SEEK_HOLE */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <glib.h>
+#include "config.h"
+/* We don't want to do syslog output in this program */
+#undef ISSERVER
+#include "cliserv.h"
+#include "nbdclient.h"
+
+#define MAX_CONNECTIONS 64
+
+/**
+ * One end of the copy: a file, or an export
+ **/
+struct end {
+	const char *spec;	/**< as given on the command line */
+	int fd;			/**< the file, or -1 */
+	NBDC *nbdc;		/**< the export, or NULL */
+	uint64_t size;
+	gboolean regular;	/**< whether the file is a regular file */
+};
+
+/**
+ * A buffer on its way from the source to the destination
+ **/
+struct slot {
+	char *buf;
+	uint64_t off;
+	uint32_t len;
+	gboolean busy;
+};
+
+static struct end src, dst;
+static uint32_t blocksize = 256 * 1024;
+static gboolean skip_zeroes;	/**< whether the destination reads as zeroes
+				  where we don't write */
+static uint64_t size;		/**< how much to copy */
+static uint64_t next;		/**< where the next block to copy starts */
+static uint64_t data_end;	/**< the source has no holes from next up to
+				  here */
+static uint64_t done;		/**< how much is copied or skipped */
+static uint64_t skipped;	/**< how much of that was zeroes */
+static int busy;		/**< slots in use */
+
+static ssize_t pread_full(int fd, char *buf, size_t len, off_t off) {
+	size_t total = 0;
+	ssize_t ret;
+
+	while(total < len) {
+		ret = pread(fd, buf + total, len - total, off + total);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret < 0)
+			return -1;
+		if(ret == 0)
+			break;
+		total += ret;
+	}
+	return total;
+}
+
+static int pwrite_full(int fd, const char *buf, size_t len, off_t off) {
+	ssize_t ret;
+
+	while(len > 0) {
+		ret = pwrite(fd, buf, len, off);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret < 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+		off += ret;
+	}
+	return 0;
+}
+
+static uint64_t parse_size(const char *s) {
+	char *e;
+	uint64_t v = strtoull(s, &e, 0);
+
+	switch(*e) {
+	case 'M': case 'm':
+		v *= 1024;
+		/* fall through */
+	case 'K': case 'k':
+		v *= 1024;
+		e++;
+	}
+	return *e ? 0 : v;
+}
+
+static gboolean is_zero(const char *buf, size_t len) {
+	return !len || (!buf[0] && !memcmp(buf, buf + 1, len - 1));
+}
+
+/**
+ * Open an end of the copy.
+ *
+ * @param spec nbd://host[:port][/name], or the name of a file
+ * @param out whether this is the destination
+ **/
+static void open_end(struct end *e, const char *spec, int nconn, gboolean out) {
+	gchar *hostport, *host, *port, *name = NULL;
+	const char *slash;
+	char *colon;
+	struct stat st;
+	int error;
+
+	e->spec = spec;
+	e->fd = -1;
+	if(strncmp(spec, "nbd://", 6)) {
+		if((e->fd = open(spec, out ? O_WRONLY | O_CREAT : O_RDONLY, 0644)) < 0
+		   || fstat(e->fd, &st) < 0) {
+			fprintf(stderr, "E: could not open %s: %s\n", spec, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		e->regular = S_ISREG(st.st_mode);
+		e->size = e->regular ? st.st_size : lseek(e->fd, 0, SEEK_END);
+		return;
+	}
+	spec += 6;
+	if((slash = strchr(spec, '/'))) {
+		hostport = g_strndup(spec, slash - spec);
+		name = g_strdup(slash + 1);
+	} else {
+		hostport = g_strdup(spec);
+	}
+	host = hostport;
+	if(*host == '[' && (colon = strchr(host, ']'))) {
+		/* [address]:port, for IPv6 */
+		host++;
+		*colon++ = '\0';
+		if(*colon != ':')
+			colon = NULL;
+	} else {
+		colon = strrchr(host, ':');
+	}
+	if(colon) {
+		*colon = '\0';
+		port = colon + 1;
+	} else {
+		port = NBD_DEFAULT_PORT;
+	}
+	if(!(e->nbdc = nbdc_open(host, port, name, nconn, &error))) {
+		fprintf(stderr, "E: could not connect to %s: %s\n", e->spec, nbdc_strerror(error));
+		exit(EXIT_FAILURE);
+	}
+	e->size = nbdc_size(e->nbdc);
+	if(out && (nbdc_flags(e->nbdc) & NBDC_FLAG_READ_ONLY)) {
+		fprintf(stderr, "E: %s is read-only\n", e->spec);
+		exit(EXIT_FAILURE);
+	}
+	g_free(hostport);
+	g_free(name);
+}
+
+static void finish(struct slot *s) {
+	done += s->len;
+	s->busy = FALSE;
+	busy--;
+}
+
+static void write_done(void *opaque, int error) {
+	struct slot *s = opaque;
+
+	if(error) {
+		fprintf(stderr, "E: could not write to %s at %llu: %s\n", dst.spec,
+			(unsigned long long)s->off, nbdc_strerror(error));
+		exit(EXIT_FAILURE);
+	}
+	finish(s);
+}
+
+/**
+ * The data of a block is there: write it out, unless there is no need.
+ **/
+static void got_data(struct slot *s) {
+	int ret;
+
+	if(skip_zeroes && is_zero(s->buf, s->len)) {
+		skipped += s->len;
+		finish(s);
+		return;
+	}
+	if(dst.nbdc) {
+		if((ret = nbdc_aio_write(dst.nbdc, s->buf, s->off, s->len, 0, write_done, s))) {
+			fprintf(stderr, "E: could not write to %s: %s\n", dst.spec, nbdc_strerror(ret));
+			exit(EXIT_FAILURE);
+		}
+		return;
+	}
+	if(pwrite_full(dst.fd, s->buf, s->len, s->off) < 0) {
+		fprintf(stderr, "E: could not write to %s at %llu: %s\n", dst.spec,
+			(unsigned long long)s->off, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	finish(s);
+}
+
+static void read_done(void *opaque, int error) {
+	struct slot *s = opaque;
+
+	if(error) {
+		fprintf(stderr, "E: could not read from %s at %llu: %s\n", src.spec,
+			(unsigned long long)s->off, nbdc_strerror(error));
+		exit(EXIT_FAILURE);
+	}
+	got_data(s);
+}
+
+/**
+ * Move next past a hole in the source file, if it is at one. Blocks in
+ * a hole read as zeroes, so where we may skip those, we need not read
+ * them either.
+ **/
+static void skip_hole(void) {
+	off_t data, hole;
+	uint64_t to;
+
+	if(!skip_zeroes || !src.regular || next < data_end)
+		return;
+#ifdef SEEK_DATA
+	if((data = lseek(src.fd, next, SEEK_DATA)) < 0) {
+		if(errno != ENXIO) {
+			/* no SEEK_DATA here; find zeroes by reading */
+			data_end = size;
+			return;
+		}
+		/* a hole up to the end */
+		data = size;
+	}
+	to = (uint64_t)data - (uint64_t)data % blocksize;
+	if(to > size)
+		to = size;
+	if(to > next) {
+		skipped += to - next;
+		done += to - next;
+		next = to;
+	}
+	hole = lseek(src.fd, data, SEEK_HOLE);
+	data_end = hole < 0 ? size : (uint64_t)hole;
+#else
+	data_end = size;
+#endif
+}
+
+static void start_block(struct slot *s) {
+	ssize_t len;
+	int ret;
+
+	s->off = next;
+	s->len = size - next < blocksize ? size - next : blocksize;
+	s->busy = TRUE;
+	busy++;
+	next += s->len;
+	if(src.nbdc) {
+		if((ret = nbdc_aio_read(src.nbdc, s->buf, s->off, s->len, read_done, s))) {
+			fprintf(stderr, "E: could not read from %s: %s\n", src.spec, nbdc_strerror(ret));
+			exit(EXIT_FAILURE);
+		}
+		return;
+	}
+	if((len = pread_full(src.fd, s->buf, s->len, s->off)) < 0) {
+		fprintf(stderr, "E: could not read from %s at %llu: %s\n", src.spec,
+			(unsigned long long)s->off, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	/* a block device may have shrunk under us; what isn't there
+	 * reads as zeroes */
+	memset(s->buf + len, 0, s->len - len);
+	got_data(s);
+}
+
+/**
+ * Wait until requests on either end are done, or a second passed.
+ **/
+static void wait_io(void) {
+	struct pollfd fds[2 * MAX_CONNECTIONS];
+	int ns = 0, nd = 0;
+	int ret = 0;
+
+	if(src.nbdc)
+		ns = nbdc_fds(src.nbdc, fds, MAX_CONNECTIONS);
+	if(dst.nbdc)
+		nd = nbdc_fds(dst.nbdc, fds + ns, MAX_CONNECTIONS);
+	if(poll(fds, ns + nd, 1000) < 0) {
+		if(errno == EINTR)
+			return;
+		perror("E: poll");
+		exit(EXIT_FAILURE);
+	}
+	if(src.nbdc)
+		ret = nbdc_process(src.nbdc, fds, ns);
+	if(!ret && dst.nbdc)
+		ret = nbdc_process(dst.nbdc, fds + ns, nd);
+	if(ret) {
+		/* the requests that failed already said so */
+		fprintf(stderr, "E: connection failed: %s\n", nbdc_strerror(ret));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void progress(gint64 start, gboolean last) {
+	static gint64 shown;
+	gint64 now = g_get_monotonic_time();
+	double secs = (now - start) / 1000000.0;
+
+	if(!last && now - shown < G_TIME_SPAN_SECOND)
+		return;
+	shown = now;
+	fprintf(stderr, "\r%llu of %llu MiB (%d%%), %.1f MiB/s  ",
+		(unsigned long long)(done >> 20), (unsigned long long)(size >> 20),
+		size ? (int)(done * 100 / size) : 100,
+		secs > 0 ? done / secs / 1048576 : 0.0);
+	if(last)
+		fprintf(stderr, "\n");
+}
+
+static void flush_done(void *opaque, int error) {
+	if(error) {
+		fprintf(stderr, "E: could not flush %s: %s\n", dst.spec, nbdc_strerror(error));
+		exit(EXIT_FAILURE);
+	}
+	*(gboolean *)opaque = TRUE;
+}
+
+static void usage(const char *me) {
+	fprintf(stderr, "Usage: %s [-c connections] [-q depth] [-b blocksize] [-z] [-p] source destination\n", me);
+	fprintf(stderr, "Copy an image to or from an NBD export, or between two exports.\n");
+	fprintf(stderr, "source and destination are file names, or nbd://host[:port][/name];\n");
+	fprintf(stderr, "without a name, the server is spoken to with the oldstyle protocol.\n");
+	fprintf(stderr, "  -c connections  connections to every export (default 4)\n");
+	fprintf(stderr, "  -q depth        requests in flight on every connection (default 16)\n");
+	fprintf(stderr, "  -b blocksize    size of the requests (default 256K)\n");
+	fprintf(stderr, "  -z              the destination reads as zeroes already; don't write\n");
+	fprintf(stderr, "                  blocks of zeroes (always so for a regular file)\n");
+	fprintf(stderr, "  -p              show progress\n");
+}
+
+int main(int argc, char**argv) {
+	int nconn = 4, depth = 16;
+	gboolean show = FALSE;
+	gboolean flushed = FALSE;
+	struct slot *slots;
+	gint64 start;
+	double secs;
+	int nslots, i, c, ret;
+
+	while((c = getopt(argc, argv, "c:q:b:zph")) >= 0) {
+		switch(c) {
+		case 'c':
+			nconn = atoi(optarg);
+			if(nconn < 1 || nconn > MAX_CONNECTIONS) {
+				fprintf(stderr, "E: between 1 and %d connections, please\n", MAX_CONNECTIONS);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'q':
+			if((depth = atoi(optarg)) < 1)
+				depth = 1;
+			break;
+		case 'b':
+			blocksize = parse_size(optarg);
+			if(!blocksize || blocksize > 32 * 1024 * 1024) {
+				fprintf(stderr, "E: invalid block size %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'z':
+			skip_zeroes = TRUE;
+			break;
+		case 'p':
+			show = TRUE;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(argc - optind != 2) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	open_end(&src, argv[optind], nconn, FALSE);
+	open_end(&dst, argv[optind + 1], nconn, TRUE);
+	size = src.size;
+	if(dst.regular) {
+		/* what we don't write of a file reads as zeroes */
+		if(ftruncate(dst.fd, 0) < 0 || ftruncate(dst.fd, size) < 0) {
+			fprintf(stderr, "E: could not size %s: %s\n", dst.spec, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		skip_zeroes = TRUE;
+	} else if(dst.size < size) {
+		fprintf(stderr, "E: %s is smaller than %s\n", dst.spec, src.spec);
+		exit(EXIT_FAILURE);
+	}
+
+	nslots = (src.nbdc || dst.nbdc) ? nconn * depth : 1;
+	slots = g_new0(struct slot, nslots);
+	for(i = 0; i < nslots; i++)
+		slots[i].buf = g_malloc(blocksize);
+	start = g_get_monotonic_time();
+	while(next < size || busy) {
+		for(i = 0; i < nslots && next < size; i++) {
+			if(slots[i].busy)
+				continue;
+			skip_hole();
+			if(next < size)
+				start_block(&slots[i]);
+		}
+		if(busy)
+			wait_io();
+		if(show)
+			progress(start, FALSE);
+	}
+
+	if(dst.nbdc) {
+		if(nbdc_flags(dst.nbdc) & NBDC_FLAG_SEND_FLUSH) {
+			if((ret = nbdc_aio_flush(dst.nbdc, flush_done, &flushed))) {
+				fprintf(stderr, "E: could not flush %s: %s\n", dst.spec, nbdc_strerror(ret));
+				exit(EXIT_FAILURE);
+			}
+			while(!flushed)
+				if((ret = nbdc_poll(dst.nbdc, -1))) {
+					fprintf(stderr, "E: connection failed: %s\n", nbdc_strerror(ret));
+					exit(EXIT_FAILURE);
+				}
+		}
+		nbdc_close(dst.nbdc);
+	} else if((dst.regular && fsync(dst.fd) < 0) || close(dst.fd) < 0) {
+		fprintf(stderr, "E: could not write %s: %s\n", dst.spec, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if(src.nbdc)
+		nbdc_close(src.nbdc);
+	if(show)
+		progress(start, TRUE);
+	secs = (g_get_monotonic_time() - start) / 1000000.0;
+	printf("%llu bytes copied (%llu skipped as zeroes) in %.2f s, %.1f MiB/s\n",
+	       (unsigned long long)size, (unsigned long long)skipped, secs,
+	       secs > 0 ? size / secs / 1048576 : 0.0);
+	return 0;
+}
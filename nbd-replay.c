@@ -0,0 +1,627 @@
+/*
+ * nbd-replay.c
+ *
+ * Replays an nbd transaction log against a running server, with the
+ * original timing or faster, and reports how long the requests took.
+ * This allows to benchmark the server with real workloads rather than
+ * synthetic ones. If the data of writes was captured, it is sent as
+ * it was; otherwise writes send zeroes.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <glib.h>
+#include "config.h"
+/* We don't want to do syslog output in this program */
+#undef ISSERVER
+#include "cliserv.h"
+#include "nbd.h"
+#include "trlog.h"
+
+#define REPLAY_CMDS (NBD_CMD_TRIM + 1)	/**< number of commands we know */
+
+/**
+ * A part of the data of a write, as captured in the data file
+ **/
+struct part {
+	uint32_t pos;		/**< where it starts in the data of the write */
+	uint32_t len;
+	uint64_t where;		/**< where it is in the data file */
+};
+
+/**
+ * A request from the log, and what became of it
+ **/
+struct op {
+	uint64_t time;		/**< when it was made, in nanoseconds since
+				     the first request in the log */
+	uint64_t offset;
+	uint32_t len;
+	uint32_t command;	/**< the command, with its flags */
+	char handle[8];		/**< its handle in the log */
+	struct part *parts;	/**< the data of a write, if we have it */
+	guint nparts;
+	uint32_t datalen;	/**< how much of the data the parts cover */
+	uint64_t sent;		/**< when we sent it, or 0 if we didn't */
+	uint64_t latency;	/**< how long the server took to reply */
+	uint32_t error;		/**< what the server replied */
+	gboolean skip;		/**< whether it can't be replayed */
+};
+
+/**
+ * A connection to the server
+ **/
+struct conn {
+	int sock;
+	int n;			/**< the number of the connection */
+	uint64_t nops;		/**< number of requests it replays */
+	int inflight;		/**< requests sent but not replied to */
+	GMutex lock;		/**< protects inflight */
+	GCond cond;		/**< signalled when a reply comes in */
+	GThread *sender;
+	GThread *receiver;
+};
+
+static struct op *ops;		/**< the requests to replay, in the order
+				     in which they were made */
+static uint64_t nops;
+static int nconns = 1;		/**< number of connections to use */
+static int depth = 16;		/**< maximum number of requests in flight
+				     per connection */
+static double speed = 1.0;	/**< how much faster than the original to
+				     go, or 0 for as fast as possible */
+static uint32_t maxlen;		/**< the largest request in the log */
+static uint64_t exportsize;
+static uint16_t exportflags;
+static uint64_t start;		/**< when the replay started */
+static int datafd = -1;		/**< the data file of the log, if we use it */
+static uint64_t npayloads;	/**< payloads in the log that are in a data
+				     file */
+
+static const char *cmdnames[REPLAY_CMDS] = {
+	"NBD_CMD_READ", "NBD_CMD_WRITE", "NBD_CMD_DISC", "NBD_CMD_FLUSH",
+	"NBD_CMD_TRIM",
+};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void readall(int f, void *buf, size_t len) {
+	ssize_t res;
+
+	while(len>0) {
+		if((res=read(f, buf, len)) <= 0) {
+			if(!res)
+				err("Server closed the connection");
+			err("Could not read from server: %m");
+		}
+		len-=res;
+		buf+=res;
+	}
+}
+
+static void sendall(int f, void *buf, size_t len, int flags) {
+	ssize_t res;
+
+	while(len>0) {
+		if((res=send(f, buf, len, flags)) < 0)
+			err("Could not write to server: %m");
+		len-=res;
+		buf+=res;
+	}
+}
+
+/**
+ * Add a request to the ones to replay.
+ *
+ * @return whether it is one we replay
+ **/
+static gboolean add_op(GArray *a, uint64_t time, uint32_t command, const char *handle, uint64_t offset, uint32_t len) {
+	struct op op;
+
+	switch(command & NBD_CMD_MASK_COMMAND) {
+	case NBD_CMD_READ:
+	case NBD_CMD_WRITE:
+	case NBD_CMD_FLUSH:
+	case NBD_CMD_TRIM:
+		break;
+	default:
+		/* we disconnect when we're done, not when the log did */
+		return FALSE;
+	}
+	memset(&op, 0, sizeof(op));
+	op.time = time;
+	op.command = command;
+	memcpy(op.handle, handle, sizeof(op.handle));
+	op.offset = offset;
+	op.len = len;
+	g_array_append_val(a, op);
+	return TRUE;
+}
+
+/**
+ * Note where (part of) the data of a write is in the data file. The
+ * payload records of a connection follow the request they belong to,
+ * but that request may have been dropped from the log; then the
+ * payload is ignored.
+ *
+ * @param op the last request of the connection, or NULL
+ **/
+static void add_payload(struct op *op, TRLOG_RECORD *rec) {
+	struct part *part;
+	uint32_t pos = ntohl(rec->aux), len = ntohl(rec->len);
+
+	if(ntohl(rec->command) != TRLOG_PAYLOAD_FULL)
+		return;
+	npayloads++;
+	if(datafd < 0 || !op || memcmp(op->handle, rec->handle, sizeof(op->handle))
+	   || (op->command & NBD_CMD_MASK_COMMAND) != NBD_CMD_WRITE
+	   || pos > op->len || len > op->len - pos)
+		return;
+	op->parts = g_renew(struct part, op->parts, op->nparts + 1);
+	part = &op->parts[op->nparts++];
+	part->pos = pos;
+	part->len = len;
+	part->where = ntohll(rec->offset);
+	op->datalen += len;
+}
+
+static void readlog(FILE *f, void *buf, size_t len) {
+	if(fread(buf, len, 1, f) != 1) {
+		fprintf(stderr, "E: transaction log is truncated\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * Read a block of a version 2 log, whose magic has been read already.
+ *
+ * @param last for every connection, 1 + the index in a of its last
+ * request
+ * @return the number of records that were dropped from it
+ **/
+static uint64_t load_block(FILE *f, GArray *a, GHashTable *last) {
+	TRLOG_BLOCK hdr;
+	TRLOG_RECORD rec;
+	uint32_t nrecords, reclen, i;
+	uint16_t hdrlen;
+	gpointer connid;
+	guint idx;
+
+	readlog(f, sizeof(hdr.magic)+(char *)(&hdr), sizeof(hdr)-sizeof(hdr.magic));
+	if(ntohs(hdr.version) != TRLOG_VERSION) {
+		fprintf(stderr, "E: unknown transaction log version %d\n", ntohs(hdr.version));
+		exit(EXIT_FAILURE);
+	}
+	hdrlen = ntohs(hdr.hdrlen);
+	reclen = ntohl(hdr.reclen);
+	nrecords = ntohl(hdr.nrecords);
+	if(hdrlen < sizeof(hdr) || reclen < sizeof(rec)) {
+		fprintf(stderr, "E: corrupt transaction log block\n");
+		exit(EXIT_FAILURE);
+	}
+	fseeko(f, hdrlen - sizeof(hdr), SEEK_CUR);
+	connid = GUINT_TO_POINTER(ntohl(hdr.connid));
+	for(i = 0; i < nrecords; i++) {
+		readlog(f, &rec, sizeof(rec));
+		fseeko(f, reclen - sizeof(rec), SEEK_CUR);
+		switch(rec.type) {
+		case TRLOG_REQUEST:
+			if(add_op(a, ntohll(rec.time), ntohl(rec.command), rec.handle,
+				  ntohll(rec.offset), ntohl(rec.len)))
+				g_hash_table_insert(last, connid, GUINT_TO_POINTER(a->len));
+			else
+				g_hash_table_remove(last, connid);
+			break;
+		case TRLOG_PAYLOAD:
+			idx = GPOINTER_TO_UINT(g_hash_table_lookup(last, connid));
+			add_payload(idx ? &g_array_index(a, struct op, idx - 1) : NULL, &rec);
+			break;
+		}
+	}
+	return ntohll(hdr.dropped);
+}
+
+static gint cmp_time(gconstpointer a, gconstpointer b) {
+	const struct op *x = a, *y = b;
+
+	return (x->time > y->time) - (x->time < y->time);
+}
+
+/**
+ * Read the requests of a transaction log, of either version. The
+ * records of the connections in a version 2 log are interleaved by
+ * block, so they are sorted by time afterwards; a version 1 log has no
+ * times, so it is replayed as fast as possible.
+ **/
+static void load(FILE *f) {
+	GArray *a = g_array_new(FALSE, FALSE, sizeof(struct op));
+	GHashTable *last = g_hash_table_new(g_direct_hash, g_direct_equal);
+	struct nbd_request req;
+	struct nbd_reply rep;
+	uint32_t magic;
+	uint64_t dropped = 0, first, i;
+
+	while(fread(&magic, sizeof(magic), 1, f) == 1) {
+		switch(ntohl(magic)) {
+		case NBD_REQUEST_MAGIC:
+			readlog(f, sizeof(magic)+(char *)(&req), sizeof(req)-sizeof(magic));
+			add_op(a, 0, ntohl(req.type), req.handle, ntohll(req.from), ntohl(req.len));
+			break;
+		case NBD_REPLY_MAGIC:
+			readlog(f, sizeof(magic)+(char *)(&rep), sizeof(rep)-sizeof(magic));
+			break;
+		case TRLOG_MAGIC:
+			dropped += load_block(f, a, last);
+			break;
+		default:
+			fprintf(stderr, "E: unknown transaction type %08x\n", ntohl(magic));
+			exit(EXIT_FAILURE);
+		}
+	}
+	g_hash_table_destroy(last);
+	if(dropped)
+		fprintf(stderr, "W: %llu records were dropped from the log; the replay is incomplete\n",
+			(unsigned long long)dropped);
+	if(npayloads && datafd < 0)
+		fprintf(stderr, "W: the log has the data of writes, but no data file was given; writing zeroes\n");
+	g_array_sort(a, cmp_time);
+	nops = a->len;
+	ops = (struct op *)g_array_free(a, FALSE);
+	first = nops ? ops[0].time : 0;
+	for(i = 0; i < nops; i++) {
+		ops[i].time -= first;
+		if(ops[i].len > maxlen)
+			maxlen = ops[i].len;
+	}
+}
+
+static int connect_to(const char *host, const char *port, const char *name) {
+	struct addrinfo hints, *ai, *rp;
+	char buf[128];
+	uint64_t magic;
+	uint32_t tmp32 = 0;
+	uint16_t flags;
+	int sock = -1, e;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if((e = getaddrinfo(host, port, &hints, &ai))) {
+		fprintf(stderr, "E: could not resolve %s: %s\n", host, gai_strerror(e));
+		exit(EXIT_FAILURE);
+	}
+	for(rp = ai; rp; rp = rp->ai_next) {
+		if((sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) < 0)
+			continue;
+		if(!connect(sock, rp->ai_addr, rp->ai_addrlen))
+			break;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(ai);
+	if(sock < 0)
+		err("Could not connect to server: %m");
+	setmysockopt(sock);
+
+	readall(sock, buf, strlen(INIT_PASSWD));
+	if(memcmp(buf, INIT_PASSWD, strlen(INIT_PASSWD)))
+		err("Server does not speak the nbd protocol");
+	readall(sock, &magic, sizeof(magic));
+	if(ntohll(magic) != opts_magic)
+		err("Server does not support named exports");
+	readall(sock, &flags, sizeof(flags));
+	sendall(sock, &tmp32, sizeof(tmp32), 0);
+	magic = htonll(opts_magic);
+	sendall(sock, &magic, sizeof(magic), 0);
+	tmp32 = htonl(NBD_OPT_EXPORT_NAME);
+	sendall(sock, &tmp32, sizeof(tmp32), 0);
+	tmp32 = htonl(strlen(name));
+	sendall(sock, &tmp32, sizeof(tmp32), 0);
+	sendall(sock, (char *)name, strlen(name), 0);
+	readall(sock, &exportsize, sizeof(exportsize));
+	exportsize = ntohll(exportsize);
+	readall(sock, &exportflags, sizeof(exportflags));
+	exportflags = ntohs(exportflags);
+	readall(sock, buf, 124);
+	return sock;
+}
+
+/**
+ * Whether a request can be replayed against the export we got
+ **/
+static gboolean replayable(struct op *op) {
+	switch(op->command & NBD_CMD_MASK_COMMAND) {
+	case NBD_CMD_FLUSH:
+		return !!(exportflags & NBD_FLAG_SEND_FLUSH);
+	case NBD_CMD_TRIM:
+		if(!(exportflags & NBD_FLAG_SEND_TRIM))
+			return FALSE;
+		/* fall through */
+	case NBD_CMD_WRITE:
+		if(exportflags & NBD_FLAG_READ_ONLY)
+			return FALSE;
+		/* fall through */
+	default:
+		return op->offset + op->len <= exportsize;
+	}
+}
+
+/**
+ * Read the data of a write from the data file. What it has no data
+ * for is zeroes.
+ **/
+static void read_data(struct op *op, char *buf) {
+	struct part *part;
+	ssize_t res;
+	guint i;
+
+	if(op->datalen < op->len)
+		memset(buf, 0, op->len);
+	for(i = 0; i < op->nparts; i++) {
+		part = &op->parts[i];
+		if((res = pread(datafd, buf + part->pos, part->len, part->where)) < 0)
+			err("Could not read the data file: %m");
+		if(res != part->len) {
+			fprintf(stderr, "E: the data file is truncated\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/**
+ * Send the requests of a connection: every nconns'th one, from the n'th
+ * on. Writes send the data that was captured, or else zeroes.
+ **/
+static gpointer sender(gpointer data) {
+	struct conn *c = data;
+	struct nbd_request req;
+	struct op *op;
+	char *zeroes = g_malloc0(maxlen ? maxlen : 1);
+	char *buf = datafd >= 0 ? g_malloc(maxlen ? maxlen : 1) : NULL;
+	uint64_t i, when, now;
+	struct timespec ts;
+
+	memset(&req, 0, sizeof(req));
+	req.magic = htonl(NBD_REQUEST_MAGIC);
+	for(i = c->n; i < nops; i += nconns) {
+		op = &ops[i];
+		if(op->skip)
+			continue;
+		g_mutex_lock(&c->lock);
+		while(c->inflight >= depth)
+			g_cond_wait(&c->cond, &c->lock);
+		c->inflight++;
+		g_mutex_unlock(&c->lock);
+		if(speed > 0) {
+			when = start + (uint64_t)(op->time / speed);
+			if((now = now_ns()) < when) {
+				ts.tv_sec = (when - now) / 1000000000ULL;
+				ts.tv_nsec = (when - now) % 1000000000ULL;
+				nanosleep(&ts, NULL);
+			}
+		}
+		if(op->nparts)
+			read_data(op, buf);
+		req.type = htonl(op->command);
+		req.from = htonll(op->offset);
+		req.len = htonl(op->len);
+		memcpy(req.handle, &i, sizeof(req.handle));
+		op->sent = now_ns();
+		if((op->command & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE) {
+			sendall(c->sock, &req, sizeof(req), MSG_MORE);
+			sendall(c->sock, op->nparts ? buf : zeroes, op->len, 0);
+		} else {
+			sendall(c->sock, &req, sizeof(req), 0);
+		}
+	}
+	g_free(zeroes);
+	g_free(buf);
+	return NULL;
+}
+
+/**
+ * Read the replies of a connection, and note how long they took
+ **/
+static gpointer receiver(gpointer data) {
+	struct conn *c = data;
+	struct nbd_reply rep;
+	struct op *op;
+	char *buf = g_malloc(maxlen ? maxlen : 1);
+	uint64_t i, handle;
+
+	for(i = 0; i < c->nops; i++) {
+		readall(c->sock, &rep, sizeof(rep));
+		if(ntohl(rep.magic) != NBD_REPLY_MAGIC)
+			err("Server sent a bad reply");
+		memcpy(&handle, rep.handle, sizeof(handle));
+		if(handle >= nops)
+			err("Server sent a reply to a request we did not make");
+		op = &ops[handle];
+		if((op->command & NBD_CMD_MASK_COMMAND) == NBD_CMD_READ && !rep.error)
+			readall(c->sock, buf, op->len);
+		op->latency = now_ns() - op->sent;
+		op->error = ntohl(rep.error);
+		g_mutex_lock(&c->lock);
+		c->inflight--;
+		g_cond_signal(&c->cond);
+		g_mutex_unlock(&c->lock);
+	}
+	g_free(buf);
+	return NULL;
+}
+
+static int cmp_latency(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t *lat, uint64_t n, double p) {
+	uint64_t i = (uint64_t)(p * n / 100.0);
+
+	return lat[i < n ? i : n - 1];
+}
+
+/**
+ * Print what the replay of one command, or of all of them, did.
+ *
+ * @param cmd the command, or -1 for all of them
+ **/
+static void report(int cmd, double elapsed) {
+	uint64_t *lat = g_new(uint64_t, nops ? nops : 1);
+	uint64_t n = 0, bytes = 0, errors = 0, i;
+	int c;
+
+	for(i = 0; i < nops; i++) {
+		c = ops[i].command & NBD_CMD_MASK_COMMAND;
+		if(!ops[i].sent || (cmd >= 0 && c != cmd))
+			continue;
+		lat[n++] = ops[i].latency;
+		if(ops[i].error)
+			errors++;
+		else if(c == NBD_CMD_READ || c == NBD_CMD_WRITE)
+			bytes += ops[i].len;
+	}
+	if(!n)
+		goto out;
+	qsort(lat, n, sizeof(uint64_t), cmp_latency);
+	printf("%-13s %10llu requests %10.1f req/s %10.2f MiB/s %6llu errors; latency (us) p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+	       cmd >= 0 ? cmdnames[cmd] : "total",
+	       (unsigned long long)n, n / elapsed,
+	       bytes / elapsed / (1024 * 1024), (unsigned long long)errors,
+	       percentile(lat, n, 50) / 1000.0, percentile(lat, n, 90) / 1000.0,
+	       percentile(lat, n, 99) / 1000.0, percentile(lat, n, 99.9) / 1000.0,
+	       lat[n - 1] / 1000.0);
+out:
+	g_free(lat);
+}
+
+static void usage(const char *me) {
+	printf("This is nbd-replay, part of nbd %s.\n", PACKAGE_VERSION);
+	printf("Use: %s [-c connections] [-q depth] [-t original|fast|factor] [-d datafile] host [port] name < transactionlog\n", me);
+}
+
+int main(int argc, char**argv) {
+	struct conn *conns;
+	struct nbd_request req;
+	uint64_t i, skipped = 0, end;
+	const char *host, *port = NBD_DEFAULT_PORT, *name;
+	char *e;
+	int c;
+
+	while((c = getopt(argc, argv, "c:q:t:d:h")) >= 0) {
+		switch(c) {
+		case 'c':
+			nconns = strtol(optarg, &e, 0);
+			if(*e || nconns < 1) {
+				fprintf(stderr, "E: invalid number of connections %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'q':
+			depth = strtol(optarg, &e, 0);
+			if(*e || depth < 1) {
+				fprintf(stderr, "E: invalid queue depth %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 't':
+			if(!strcmp(optarg, "original")) {
+				speed = 1.0;
+			} else if(!strcmp(optarg, "fast")) {
+				speed = 0;
+			} else {
+				speed = strtod(optarg, &e);
+				if(*e || speed <= 0) {
+					fprintf(stderr, "E: invalid timing %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+			}
+			break;
+		case 'd':
+			if((datafd = open(optarg, O_RDONLY)) < 0) {
+				fprintf(stderr, "E: could not open %s: %s\n", optarg, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	switch(argc - optind) {
+	case 2:
+		host = argv[optind];
+		name = argv[optind + 1];
+		break;
+	case 3:
+		host = argv[optind];
+		port = argv[optind + 1];
+		name = argv[optind + 2];
+		break;
+	default:
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	load(stdin);
+	conns = g_new0(struct conn, nconns);
+	for(c = 0; c < nconns; c++) {
+		conns[c].sock = connect_to(host, port, name);
+		conns[c].n = c;
+		g_mutex_init(&conns[c].lock);
+		g_cond_init(&conns[c].cond);
+	}
+	/* requests the export can't take are not sent */
+	for(i = 0; i < nops; i++) {
+		if(!replayable(&ops[i])) {
+			ops[i].skip = TRUE;
+			skipped++;
+		} else {
+			conns[i % nconns].nops++;
+		}
+	}
+	if(skipped)
+		fprintf(stderr, "W: %llu requests do not fit the export, and are skipped\n",
+			(unsigned long long)skipped);
+
+	start = now_ns();
+	for(c = 0; c < nconns; c++) {
+		conns[c].receiver = g_thread_new("receiver", receiver, &conns[c]);
+		conns[c].sender = g_thread_new("sender", sender, &conns[c]);
+	}
+	memset(&req, 0, sizeof(req));
+	req.magic = htonl(NBD_REQUEST_MAGIC);
+	req.type = htonl(NBD_CMD_DISC);
+	for(c = 0; c < nconns; c++) {
+		g_thread_join(conns[c].sender);
+		g_thread_join(conns[c].receiver);
+		sendall(conns[c].sock, &req, sizeof(req), 0);
+		close(conns[c].sock);
+	}
+	end = now_ns();
+
+	for(c = 0; c < REPLAY_CMDS; c++)
+		report(c, (end - start) / 1e9);
+	report(-1, (end - start) / 1e9);
+	printf("replayed %llu requests over %d connections in %.3f s\n",
+	       (unsigned long long)(nops - skipped), nconns, (end - start) / 1e9);
+	return 0;
+}
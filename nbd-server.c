@@ -65,6 +65,8 @@
 #include <sys/stat.h>
 #include <sys/select.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #ifdef HAVE_SYS_IOCTL_H
 #include <sys/ioctl.h>
 #endif
@@ -85,9 +87,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
-#if HAVE_FALLOC_PH
-#include <linux/falloc.h>
-#endif
 #include <arpa/inet.h>
 #include <strings.h>
 #include <dirent.h>
@@ -131,23 +130,6 @@ int dontfork = 0;
  **/
 #define OFFT_MAX ~((off_t)1<<(sizeof(off_t)*8-1))
 #define BUFSIZE ((1024*1024)+sizeof(struct nbd_reply)) /**< Size of buffer that can hold requests */
-#define DIFFPAGESIZE 4096 /**< diff file uses those chunks */
-
-/** Per-export flags: */
-#define F_READONLY 1      /**< flag to tell us a file is readonly */
-#define F_MULTIFILE 2	  /**< flag to tell us a file is exported using -m */
-#define F_COPYONWRITE 4	  /**< flag to tell us a file is exported using
-			    copyonwrite */
-#define F_AUTOREADONLY 8  /**< flag to tell us a file is set to autoreadonly */
-#define F_SPARSE 16	  /**< flag to tell us copyronwrite should use a sparse file */
-#define F_SDP 32	  /**< flag to tell us the export should be done using the Socket Direct Protocol for RDMA */
-#define F_SYNC 64	  /**< Whether to fsync() after a write */
-#define F_FLUSH 128	  /**< Whether server wants FLUSH to be sent by the client */
-#define F_FUA 256	  /**< Whether server wants FUA to be sent by the client */
-#define F_ROTATIONAL 512  /**< Whether server wants the client to implement the elevator algorithm */
-#define F_TEMPORARY 1024  /**< Whether the backing file is temporary and should be created then unlinked */
-#define F_TRIM 2048       /**< Whether server wants TRIM (discard) to be sent by the client */
-#define F_FIXED 4096	  /**< Client supports fixed new-style protocol (and can thus send us extra options */
 
 /** Global flags: */
 #define F_OLDSTYLE 1	  /**< Allow oldstyle (port-based) exports */
@@ -157,17 +139,51 @@ char pidfname[256]; /**< name of our PID file */
 char pidftemplate[256]; /**< template to be used for the filename of the PID file */
 char default_authname[] = SYSCONFDIR "/nbd-server/allow"; /**< default name of allow file */
 
-#define NEG_INIT	(1 << 0)
-#define NEG_OLD		(1 << 1)
-#define NEG_MODERN	(1 << 2)
-
 #include <nbdsrv.h>
+#include <backend.h>
+#include <cimage.h>
+#include <journal.h>
+#include <blockcache.h>
+#include <stats.h>
+#include <trlog.h>
+#include <expio.h>
+#include <nbdserver.h>
 
 static volatile sig_atomic_t is_sighup_caught; /**< Flag set by SIGHUP
                                                     handler to mark a
                                                     reconfiguration
                                                     request */
+static volatile sig_atomic_t is_sigchld_caught; /**< Flag set by SIGCHLD
+                                                     handler to mark that
+                                                     children exited */
+
+int controlsock = -1;	  /**< Socket on which we report statistics, or -1 */
+int metricssock = -1;	  /**< Socket on which we serve metrics, or -1 */
+SERVER_STATS *serverstats = NULL; /**< Counters of the server as a whole, if
+				       we serve metrics */
+
+#define METRICS_CONNS 8	  /**< number of scrapes and control connections we
+			       serve at the same time */
+#define METRICS_TIMEOUT 5 /**< seconds a scrape may take before we drop it */
+#define CONTROL_WAIT 200  /**< milliseconds we wait for a request on the
+			       control socket before we answer with text */
+
+/**
+ * A connection to the metrics socket or the control socket. We're the
+ * parent, so we never block on these: the request is read and the
+ * answer written as the socket allows, from serveloop().
+ **/
+struct metrics_conn {
+	int fd;			/**< the connection, or -1 if the slot is free */
+	gboolean control;	/**< whether it came in on the control socket */
+	gint64 since;		/**< when it was accepted, in monotonic time */
+	char req[1024];		/**< the request, as far as we have it */
+	size_t reqlen;		/**< the length of the request so far */
+	GString *resp;		/**< the response, once the request is complete */
+	size_t sent;		/**< how much of the response was written */
+};
 
+static struct metrics_conn metricsconns[METRICS_CONNS];
 GArray* modernsocks;	  /**< Sockets for the modern handler. Not used
 			       if a client was only specified on the
 			       command line; only port used if
@@ -180,13 +196,19 @@ GArray* modernsocks;	  /**< Sockets for the modern handler. Not used
 
 bool logged_oversized=false;  /**< whether we logged oversized requests already */
 
+#define SLOWLOG_THRESHOLD 100 /**< default threshold of the slow log, in ms */
+
+static const char *phasenames[PHASE_COUNT] = { "netread", "disk", "cow", "sync", "netwrite" };
+
 /**
- * Variables associated with an open file
+ * The slow log. The time spent in every phase of the request being
+ * handled is kept by phase_done(), see expio.h; this is the rest.
  **/
-typedef struct {
-	int fhandle;      /**< file descriptor */
-	off_t startoff;   /**< starting offset of this file */
-} FILE_INFO;
+static int slowlogfd = -1;		/**< where to log slow requests */
+static gint64 slowthreshold;		/**< log requests slower than this, in us */
+static gint64 phase_start;		/**< when the request was read */
+static struct nbd_request slowreq;	/**< the request being timed, with the
+					     offset in host byte order */
 
 /**
  * Type of configuration file values
@@ -224,6 +246,8 @@ struct generic_conf {
         gchar *modernaddr;      /**< address of the modern socket */
         gchar *modernport;      /**< port of the modern socket    */
         gint flags;             /**< global flags                 */
+        gchar *controlsocket;   /**< path of the control socket   */
+        gchar *metricsaddr;     /**< address of the metrics page  */
 };
 
 /**
@@ -250,60 +274,58 @@ static inline const char * getcommandname(uint64_t command) {
 }
 
 /**
- * Read data from a file descriptor into a buffer
+ * Send what the protocol library has queued for a connection.
  *
- * @param f a file descriptor
- * @param buf a buffer
- * @param len the number of bytes to be read
+ * @param net the socket
+ * @param conn the connection
  **/
-static inline void readit(int f, void *buf, size_t len) {
+static void proto_flush(int net, NBDS_CONN *conn) {
+	struct iovec iov[16];
 	ssize_t res;
-	while (len > 0) {
-		DEBUG("*");
-		if ((res = read(f, buf, len)) <= 0) {
-			if(errno != EAGAIN) {
-				err("Read failed: %m");
-			}
-		} else {
-			len -= res;
-			buf += res;
-		}
-	}
-}
+	int n;
 
-/**
- * Consume data from an FD that we don't want
- *
- * @param f a file descriptor
- * @param buf a buffer
- * @param len the number of bytes to consume
- * @param bufsiz the size of the buffer
- **/
-static inline void consume(int f, void * buf, size_t len, size_t bufsiz) {
-	size_t curlen;
-	while (len>0) {
-		curlen = (len>bufsiz)?bufsiz:len;
-		readit(f, buf, curlen);
-		len -= curlen;
+	while ((n = nbds_want_write(conn, iov, 16)) > 0) {
+		DEBUG("+");
+		if ((res = writev(net, iov, n)) < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			err("Send failed: %m");
+		}
+		nbds_wrote(conn, res);
 	}
 }
 
 /**
- * Write data from a buffer into a filedescriptor
+ * Get the next event of a connection, reading from the socket as long
+ * as there is none. Before we wait for the client, everything that was
+ * queued is sent; so the replies to requests that arrived together go
+ * out together.
  *
- * @param f a file descriptor
- * @param buf a buffer containing data
- * @param len the number of bytes to be written
+ * @param net the socket
+ * @param conn the connection
+ * @param ev [out] the event
+ * @return its type; NBDS_EV_NONE if the library doesn't want to read
+ * until the caller has answered
  **/
-static inline void writeit(int f, void *buf, size_t len) {
+static NBDS_EVENT_TYPE proto_next(int net, NBDS_CONN *conn, NBDS_EVENT *ev) {
+	NBDS_EVENT_TYPE type;
 	ssize_t res;
-	while (len > 0) {
-		DEBUG("+");
-		if ((res = write(f, buf, len)) <= 0)
-			err("Send failed: %m");
-		len -= res;
-		buf += res;
+	size_t len;
+	void *buf;
+
+	while ((type = nbds_next_event(conn, ev)) == NBDS_EV_NONE) {
+		proto_flush(net, conn);
+		if (!(len = nbds_want_read(conn, &buf)))
+			break;
+		DEBUG("*");
+		if ((res = read(net, buf, len)) < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			err("Read failed: %m");
+		}
+		nbds_read_done(conn, res);
 	}
+	return type;
 }
 
 /**
@@ -617,6 +639,7 @@ GArray* parse_cfile(gchar* f, struct generic_conf *const genconf, bool expect_ge
 	gchar* cfdir = NULL;
 	SERVER s;
 	gchar *virtstyle=NULL;
+	gchar *trpayload=NULL;
 	PARAM lp[] = {
 		{ "exportname", TRUE,	PARAM_STRING, 	&(s.exportname),	0 },
 		{ "port", 	TRUE,	PARAM_INT, 	&(s.port),		0 },
@@ -626,6 +649,7 @@ GArray* parse_cfile(gchar* f, struct generic_conf *const genconf, bool expect_ge
 		{ "prerun",	FALSE,	PARAM_STRING,	&(s.prerun),		0 },
 		{ "postrun",	FALSE,	PARAM_STRING,	&(s.postrun),		0 },
 		{ "transactionlog", FALSE, PARAM_STRING, &(s.transactionlog),	0 },
+		{ "transactionpayload", FALSE, PARAM_STRING, &(trpayload),	0 },
 		{ "cowdir",	FALSE,	PARAM_STRING,	&(s.cowdir),		0 },
 		{ "readonly",	FALSE,	PARAM_BOOL,	&(s.flags),		F_READONLY },
 		{ "multifile",	FALSE,	PARAM_BOOL,	&(s.flags),		F_MULTIFILE },
@@ -638,8 +662,16 @@ GArray* parse_cfile(gchar* f, struct generic_conf *const genconf, bool expect_ge
 		{ "rotational",	FALSE,  PARAM_BOOL,	&(s.flags),		F_ROTATIONAL },
 		{ "temporary",	FALSE,  PARAM_BOOL,	&(s.flags),		F_TEMPORARY },
 		{ "trim",	FALSE,  PARAM_BOOL,	&(s.flags),		F_TRIM },
+		{ "readahead",	FALSE,  PARAM_BOOL,	&(s.flags),		F_READAHEAD },
+		{ "compressed",	FALSE,  PARAM_BOOL,	&(s.flags),		F_COMPRESSED },
+		{ "backend",	FALSE,	PARAM_STRING,	&(s.backendname),	0 },
 		{ "listenaddr", FALSE,  PARAM_STRING,   &(s.listenaddr),	0 },
 		{ "maxconnections", FALSE, PARAM_INT,	&(s.max_connections),	0 },
+		{ "stripe",	FALSE,	PARAM_OFFT,	&(s.stripesize),	0 },
+		{ "journal",	FALSE,	PARAM_STRING,	&(s.journal),		0 },
+		{ "cachesize",	FALSE,	PARAM_OFFT,	&(s.cachesize),		0 },
+		{ "slowlog",	FALSE,	PARAM_STRING,	&(s.slowlog),		0 },
+		{ "slowthreshold", FALSE, PARAM_INT,	&(s.slowthreshold),	0 },
 	};
 	const int lp_size=sizeof(lp)/sizeof(PARAM);
         struct generic_conf genconftmp;
@@ -651,6 +683,8 @@ GArray* parse_cfile(gchar* f, struct generic_conf *const genconf, bool expect_ge
 		{ "port", 	FALSE, PARAM_STRING,	&(genconftmp.modernport), 0 },
 		{ "includedir", FALSE, PARAM_STRING,	&cfdir,                   0 },
 		{ "allowlist",  FALSE, PARAM_BOOL,	&(genconftmp.flags),      F_LIST },
+		{ "controlsocket", FALSE, PARAM_STRING,	&(genconftmp.controlsocket), 0 },
+		{ "metricsaddr", FALSE, PARAM_STRING,	&(genconftmp.metricsaddr), 0 },
 	};
 	PARAM* p=gp;
 	int p_size=sizeof(gp)/sizeof(PARAM);
@@ -694,6 +728,7 @@ GArray* parse_cfile(gchar* f, struct generic_conf *const genconf, bool expect_ge
 	groups = g_key_file_get_groups(cfile, NULL);
 	for(i=0;groups[i];i++) {
 		memset(&s, '\0', sizeof(SERVER));
+		s.slowthreshold = -1;
 
 		/* After the [generic] group or when we're parsing an include
 		 * directory, start parsing exports */
@@ -792,12 +827,72 @@ GArray* parse_cfile(gchar* f, struct generic_conf *const genconf, bool expect_ge
 		} else {
 			s.virtstyle=VIRT_IPLIT;
 		}
+		if(s.stripesize && (!(s.flags & F_MULTIFILE) || s.stripesize % 512)) {
+			g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID, "Invalid value %llu for parameter stripe in group %s: must be a multiple of 512, and requires multifile", (unsigned long long)s.stripesize, groups[i]);
+			g_array_free(retval, TRUE);
+			g_key_file_free(cfile);
+			return NULL;
+		}
+		if(trpayload) {
+			if(!strcmp(trpayload, "none")) {
+				s.trpayload = TRLOG_PAYLOAD_NONE;
+			} else if(!strcmp(trpayload, "hash")) {
+				s.trpayload = TRLOG_PAYLOAD_HASH;
+			} else if(!strcmp(trpayload, "full")) {
+				s.trpayload = TRLOG_PAYLOAD_FULL;
+			} else {
+				g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID, "Invalid value %s for parameter transactionpayload in group %s", trpayload, groups[i]);
+				g_array_free(retval, TRUE);
+				g_key_file_free(cfile);
+				return NULL;
+			}
+		}
+		if(s.journal && (s.flags & F_COPYONWRITE)) {
+			g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID, "Invalid value %s for parameter journal in group %s: cannot be combined with copyonwrite", s.journal, groups[i]);
+			g_array_free(retval, TRUE);
+			g_key_file_free(cfile);
+			return NULL;
+		}
+		if(s.backendname && !strcmp(s.backendname, "compressed")) {
+			s.flags |= F_COMPRESSED;
+		}
+		if(s.flags & F_COMPRESSED) {
+			if(s.backendname && strcmp(s.backendname, "compressed")) {
+				g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID, "Invalid value for parameter compressed in group %s: cannot be combined with backend %s", groups[i], s.backendname);
+				g_array_free(retval, TRUE);
+				g_key_file_free(cfile);
+				return NULL;
+			}
+			if(s.flags & (F_MULTIFILE | F_TEMPORARY) || s.journal) {
+				g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID, "Invalid value for parameter compressed in group %s: cannot be combined with multifile, temporary or journal", groups[i]);
+				g_array_free(retval, TRUE);
+				g_key_file_free(cfile);
+				return NULL;
+			}
+			/* writes can only go to a copy-on-write file */
+			if(!(s.flags & F_COPYONWRITE))
+				s.flags |= F_READONLY;
+			/* blocks are decompressed as a whole; keep what
+			 * we don't need yet around for later requests */
+			if(!s.cachesize)
+				s.cachesize = CIMAGE_CACHESIZE;
+			s.backend = &compressed_backend;
+		} else if(s.backendname) {
+			if(!(s.backend = backend_find(s.backendname, &err))) {
+				g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID, "Invalid value %s for parameter backend in group %s: %s", s.backendname, groups[i], err->message);
+				g_clear_error(&err);
+				g_array_free(retval, TRUE);
+				g_key_file_free(cfile);
+				return NULL;
+			}
+		}
 		if(s.port && !want_oldstyle(genconftmp, genconf)) {
 			g_warning("A port was specified, but oldstyle exports were not requested. This may not do what you expect.");
 			g_warning("Please read 'man 5 nbd-server' and search for oldstyle for more info");
 		}
 		/* Don't need to free this, it's not our string */
 		virtstyle=NULL;
+		trpayload=NULL;
 		/* Don't append values for the [generic] group */
 		if(i>0 || !expect_generic) {
 			s.socket_family = AF_UNSPEC;
@@ -842,15 +937,27 @@ GArray* parse_cfile(gchar* f, struct generic_conf *const genconf, bool expect_ge
 }
 
 /**
- * Signal handler for SIGCHLD
+ * Signal handler for SIGCHLD. Like SIGHUP, this only sets a flag; the
+ * children are reaped by reap_children() from the main loop, since
+ * neither logging nor the hash table of children are safe to use here,
+ * and a storm of connections makes this run while the main loop is
+ * using them.
  * @param s the signal we're handling (must be SIGCHLD, or something
  * is severely wrong)
  **/
 void sigchld_handler(int s) {
+	is_sigchld_caught = 1;
+}
+
+/**
+ * Reap the children that exited, and forget about them.
+ **/
+static void reap_children(void) {
         int status;
 	int* i;
 	pid_t pid;
 
+	is_sigchld_caught = 0;
 	while((pid=waitpid(-1, &status, WNOHANG)) > 0) {
 		if(WIFEXITED(status)) {
 			msg(LOG_INFO, "Child exited with %d", WEXITSTATUS(status));
@@ -904,562 +1011,285 @@ static void sighup_handler(const int s G_GNUC_UNUSED) {
         is_sighup_caught = 1;
 }
 
+#define RA_MIN_WINDOW (128*1024)	/**< initial read-ahead window */
+#define RA_MAX_WINDOW (4*1024*1024)	/**< largest read-ahead window */
+#define RA_TRIGGER 2			/**< number of reads that must follow a
+					  pattern before we start prefetching */
+
 /**
- * Get the file handle and offset, given an export offset.
+ * Ask the kernel to start reading a range of the export into the page
+ * cache. This does not wait for the data.
  *
- * @param export An array of export files
- * @param a The offset to get corresponding file/offset for
- * @param fhandle [out] File descriptor
- * @param foffset [out] Offset into fhandle
- * @param maxbytes [out] Tells how many bytes can be read/written
- * from fhandle starting at foffset (0 if there is no limit)
- * @return 0 on success, -1 on failure
+ * @param a The offset where the range starts
+ * @param len The length of the range
+ * @param client The client we're prefetching for
  **/
-int get_filepos(GArray* export, off_t a, int* fhandle, off_t* foffset, size_t* maxbytes ) {
-	/* Negative offset not allowed */
-	if(a < 0)
-		return -1;
+static void prefetch(off_t a, off_t len, CLIENT *client) {
+	const BACKEND *backend = backend_of(client);
 
-	/* Binary search for last file with starting offset <= a */
-	FILE_INFO fi;
-	int start = 0;
-	int end = export->len - 1;
-	while( start <= end ) {
-		int mid = (start + end) / 2;
-		fi = g_array_index(export, FILE_INFO, mid);
-		if( fi.startoff < a ) {
-			start = mid + 1;
-		} else if( fi.startoff > a ) {
-			end = mid - 1;
-		} else {
-			start = end = mid;
-			break;
-		}
-	}
-
-	/* end should never go negative, since first startoff is 0 and a >= 0 */
-	assert(end >= 0);
-
-	fi = g_array_index(export, FILE_INFO, end);
-	*fhandle = fi.fhandle;
-	*foffset = a - fi.startoff;
-	*maxbytes = 0;
-	if( end+1 < export->len ) {
-		FILE_INFO fi_next = g_array_index(export, FILE_INFO, end+1);
-		*maxbytes = fi_next.startoff - a;
-	}
-
-	return 0;
-}
-
-/**
- * seek to a position in a file, with error handling.
- * @param handle a filedescriptor
- * @param a position to seek to
- * @todo get rid of this.
- **/
-void myseek(int handle,off_t a) {
-	if (lseek(handle, a, SEEK_SET) < 0) {
-		err("Can not seek locally!\n");
-	}
+	if(!backend->prefetch || a >= client->exportsize)
+		return;
+	if(len > client->exportsize - a)
+		len = client->exportsize - a;
+	client->ra.pfops++;
+	client->ra.pfbytes += len;
+	backend->prefetch(client, a, len);
 }
 
 /**
- * Write an amount of bytes at a given offset to the right file. This
- * abstracts the write-side of the multiple file option.
+ * Feed a read request to the read-ahead stream detector, and prefetch
+ * ahead of the client if it is reading sequentially, or with a fixed
+ * stride. Every time we prefetch, the window doubles, up to
+ * RA_MAX_WINDOW; it starts over from RA_MIN_WINDOW when the client
+ * stops following the pattern.
+ *
+ * To avoid a system call for every request, we only prefetch again
+ * once the client has consumed half of what was prefetched before.
  *
- * @param a The offset where the write should start
- * @param buf The buffer to write from
- * @param len The length of buf
- * @param client The client we're serving for
- * @param fua Flag to indicate 'Force Unit Access'
- * @return The number of bytes actually written, or -1 in case of an error
+ * @param a The offset of the read request
+ * @param len The length of the read request
+ * @param client The client that sent it
  **/
-ssize_t rawexpwrite(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
-	int fhandle;
-	off_t foffset;
-	size_t maxbytes;
-	ssize_t retval;
+static void readahead_update(off_t a, size_t len, CLIENT *client) {
+	READAHEAD *ra = &client->ra;
+	off_t stride = a - ra->last;
+	gboolean sequential = (ra->reads && a == ra->next);
+	off_t from, next, nreq;
+
+	ra->reads++;
+	if(ra->run && a >= ra->pfstart && a + (off_t)len <= ra->pfend) {
+		ra->hits++;
+	}
+	if(sequential || (ra->reads > 1 && stride > 0 && stride == ra->stride)) {
+		ra->run++;
+	} else {
+		ra->run = 0;
+		ra->window = RA_MIN_WINDOW;
+		ra->pfstart = ra->pfend = 0;
+	}
+	ra->stride = stride;
+	ra->last = a;
+	ra->next = a + len;
+	if(ra->run < RA_TRIGGER || !len)
+		return;
 
-	if(get_filepos(client->export, a, &fhandle, &foffset, &maxbytes))
-		return -1;
-	if(maxbytes && len > maxbytes)
-		len = maxbytes;
-
-	DEBUG("(WRITE to fd %d offset %llu len %u fua %d), ", fhandle, (long long unsigned)foffset, (unsigned int)len, fua);
-
-	myseek(fhandle, foffset);
-	retval = write(fhandle, buf, len);
-	if(client->server->flags & F_SYNC) {
-		fsync(fhandle);
-	} else if (fua) {
-
-	  /* This is where we would do the following
-	   *   #ifdef USE_SYNC_FILE_RANGE
-	   * However, we don't, for the reasons set out below
-	   * by Christoph Hellwig <hch@infradead.org>
-	   *
-	   * [BEGINS] 
-	   * fdatasync is equivalent to fsync except that it does not flush
-	   * non-essential metadata (basically just timestamps in practice), but it
-	   * does flush metadata requried to find the data again, e.g. allocation
-	   * information and extent maps.  sync_file_range does nothing but flush
-	   * out pagecache content - it means you basically won't get your data
-	   * back in case of a crash if you either:
-	   * 
-	   *  a) have a volatile write cache in your disk (e.g. any normal SATA disk)
-	   *  b) are using a sparse file on a filesystem
-	   *  c) are using a fallocate-preallocated file on a filesystem
-	   *  d) use any file on a COW filesystem like btrfs
-	   * 
-	   * e.g. it only does anything useful for you if you do not have a volatile
-	   * write cache, and either use a raw block device node, or just overwrite
-	   * an already fully allocated (and not preallocated) file on a non-COW
-	   * filesystem.
-	   * [ENDS]
-	   *
-	   * What we should do is open a second FD with O_DSYNC set, then write to
-	   * that when appropriate. However, with a Linux client, every REQ_FUA
-	   * immediately follows a REQ_FLUSH, so fdatasync does not cause performance
-	   * problems.
-	   *
-	   */
-#if 0
-		sync_file_range(fhandle, foffset, len,
-				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
-				SYNC_FILE_RANGE_WAIT_AFTER);
-#else
-		fdatasync(fhandle);
-#endif
+	if(ra->window < 2 * len) {
+		ra->window = 2 * len;
+	}
+	if(sequential) {
+		if(ra->pfend - ra->next >= (off_t)ra->window / 2)
+			return;
+		from = (ra->pfend > ra->next) ? ra->pfend : ra->next;
+		prefetch(from, ra->next + ra->window - from, client);
+		if(!ra->pfend) {
+			ra->pfstart = from;
+		}
+		ra->pfend = ra->next + ra->window;
+	} else {
+		/* strided: prefetch as many of the next requests as fit in
+		 * the window */
+		nreq = ra->window / len;
+		if(ra->pfend > a && (ra->pfend - a) / stride >= nreq / 2)
+			return;
+		for(next = a + stride; next < a + (nreq + 1) * stride; next += stride) {
+			if(next < ra->pfend)
+				continue;
+			prefetch(next, len, client);
+		}
+		if(!ra->pfend) {
+			ra->pfstart = a + stride;
+		}
+		ra->pfend = a + nreq * stride + len;
+	}
+	if(ra->window < RA_MAX_WINDOW) {
+		ra->window *= 2;
+		if(ra->window > RA_MAX_WINDOW)
+			ra->window = RA_MAX_WINDOW;
 	}
-	return retval;
 }
 
 /**
- * Call rawexpwrite repeatedly until all data has been written.
- *
- * @param a The offset where the write should start
- * @param buf The buffer to write from
- * @param len The length of buf
- * @param client The client we're serving for
- * @param fua Flag to indicate 'Force Unit Access'
- * @return 0 on success, nonzero on failure
+ * Log how well read-ahead did for a client
  **/
-int rawexpwrite_fully(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
-	ssize_t ret=0;
+static void readahead_stats(CLIENT *client) {
+	READAHEAD *ra = &client->ra;
 
-	while(len > 0 && (ret=rawexpwrite(a, buf, len, client, fua)) > 0 ) {
-		a += ret;
-		buf += ret;
-		len -= ret;
-	}
-	return (ret < 0 || len != 0);
+	if(!(client->server->flags & F_READAHEAD) || !ra->reads)
+		return;
+	msg(LOG_INFO, "Read-ahead: %llu of %llu reads prefetched (%llu%%); %llu prefetches, %llu bytes",
+	    (unsigned long long)ra->hits, (unsigned long long)ra->reads,
+	    (unsigned long long)(ra->hits * 100 / ra->reads),
+	    (unsigned long long)ra->pfops, (unsigned long long)ra->pfbytes);
 }
 
 /**
- * Read an amount of bytes at a given offset from the right file. This
- * abstracts the read-side of the multiple files option.
- *
- * @param a The offset where the read should start
- * @param buf A buffer to read into
- * @param len The size of buf
- * @param client The client we're serving for
- * @return The number of bytes actually read, or -1 in case of an
- * error.
+ * Get the flags we tell a client about an export.
  **/
-ssize_t rawexpread(off_t a, char *buf, size_t len, CLIENT *client) {
-	int fhandle;
-	off_t foffset;
-	size_t maxbytes;
-
-	if(get_filepos(client->export, a, &fhandle, &foffset, &maxbytes))
-		return -1;
-	if(maxbytes && len > maxbytes)
-		len = maxbytes;
+static uint16_t export_flags(CLIENT *client) {
+	uint16_t flags = 0;
 
-	DEBUG("(READ from fd %d offset %llu len %u), ", fhandle, (long long unsigned int)foffset, (unsigned int)len);
-
-	myseek(fhandle, foffset);
-	return read(fhandle, buf, len);
+	if (client->server->flags & F_READONLY)
+		flags |= NBDS_FLAG_READ_ONLY;
+	if (client->server->flags & F_FLUSH)
+		flags |= NBDS_FLAG_SEND_FLUSH;
+	if (client->server->flags & F_FUA)
+		flags |= NBDS_FLAG_SEND_FUA;
+	if (client->server->flags & F_ROTATIONAL)
+		flags |= NBDS_FLAG_ROTATIONAL;
+	if (client->server->flags & F_TRIM)
+		flags |= NBDS_FLAG_SEND_TRIM;
+	return flags;
 }
 
 /**
- * Call rawexpread repeatedly until all data has been read.
- * @return 0 on success, nonzero on failure
+ * Do the newstyle negotiation, up to where the client picks an export.
+ * The size and flags of the export are sent once it is set up; see
+ * mainloop().
+ *
+ * @param net the socket of the client
+ * @param servers the exports
+ * @return the client, or NULL if the negotiation failed
  **/
-int rawexpread_fully(off_t a, char *buf, size_t len, CLIENT *client) {
-	ssize_t ret=0;
+static CLIENT* negotiate(int net, GArray* servers) {
+	NBDS_CONN *conn;
+	NBDS_EVENT ev;
+	int i;
 
-	while(len > 0 && (ret=rawexpread(a, buf, len, client)) > 0 ) {
-		a += ret;
-		buf += ret;
-		len -= ret;
+	if (!(conn = nbds_new(NBDS_NEWSTYLE, 0, 0))) {
+		err_nonfatal("Negotiation failed: out of memory");
+		return NULL;
 	}
-	return (ret < 0 || len != 0);
-}
-
-/**
- * Read an amount of bytes at a given offset from the right file. This
- * abstracts the read-side of the copyonwrite stuff, and calls
- * rawexpread() with the right parameters to do the actual work.
- * @param a The offset where the read should start
- * @param buf A buffer to read into
- * @param len The size of buf
- * @param client The client we're going to read for
- * @return 0 on success, nonzero on failure
- **/
-int expread(off_t a, char *buf, size_t len, CLIENT *client) {
-	off_t rdlen, offset;
-	off_t mapcnt, mapl, maph, pagestart;
-
-	if (!(client->server->flags & F_COPYONWRITE))
-		return(rawexpread_fully(a, buf, len, client));
-	DEBUG("Asked to read %u bytes at %llu.\n", (unsigned int)len, (unsigned long long)a);
-
-	mapl=a/DIFFPAGESIZE; maph=(a+len-1)/DIFFPAGESIZE;
-
-	for (mapcnt=mapl;mapcnt<=maph;mapcnt++) {
-		pagestart=mapcnt*DIFFPAGESIZE;
-		offset=a-pagestart;
-		rdlen=(0<DIFFPAGESIZE-offset && len<(size_t)(DIFFPAGESIZE-offset)) ?
-			len : (size_t)DIFFPAGESIZE-offset;
-		if (client->difmap[mapcnt]!=(u32)(-1)) { /* the block is already there */
-			DEBUG("Page %llu is at %lu\n", (unsigned long long)mapcnt,
-			       (unsigned long)(client->difmap[mapcnt]));
-			myseek(client->difffile, client->difmap[mapcnt]*DIFFPAGESIZE+offset);
-			if (read(client->difffile, buf, rdlen) != rdlen) return -1;
-		} else { /* the block is not there */
-			DEBUG("Page %llu is not here, we read the original one\n",
-			       (unsigned long long)mapcnt);
-			if(rawexpread_fully(a, buf, rdlen, client)) return -1;
+	for (;;) {
+		switch (proto_next(net, conn, &ev)) {
+		case NBDS_EV_LIST:
+			if (!(glob_flags & F_LIST)) {
+				nbds_option_done(conn, NBDS_REP_ERR_POLICY);
+				err_nonfatal("Client tried disallowed list option");
+				break;
+			}
+			for (i = 0; i < servers->len; i++) {
+				SERVER* serve = &(g_array_index(servers, SERVER, i));
+				nbds_list_export(conn, serve->servename);
+			}
+			nbds_option_done(conn, 0);
+			break;
+		case NBDS_EV_EXPORT:
+			for (i = 0; i < servers->len; i++) {
+				SERVER* serve = &(g_array_index(servers, SERVER, i));
+				if (!strcmp(serve->servename, ev.name)) {
+					CLIENT* client = g_new0(CLIENT, 1);
+					client->server = serve;
+					client->exportsize = OFFT_MAX;
+					client->net = net;
+					client->modern = TRUE;
+					client->proto = conn;
+					return client;
+				}
+			}
+			nbds_reject(conn);
+			err_nonfatal("Negotiation failed: Requested export not found");
+			goto fail;
+		case NBDS_EV_DISCONNECT:
+			err_nonfatal("Session terminated by client");
+			goto fail;
+		default:
+			msg(LOG_ERR, "Negotiation failed: %s", nbds_error(conn));
+			goto fail;
 		}
-		len-=rdlen; a+=rdlen; buf+=rdlen;
 	}
-	return 0;
+fail:
+	proto_flush(net, conn);
+	nbds_free(conn);
+	return NULL;
 }
 
 /**
- * Write an amount of bytes at a given offset to the right file. This
- * abstracts the write-side of the copyonwrite option, and calls
- * rawexpwrite() with the right parameters to do the actual work.
+ * Queue the reply to a request. It goes out when we next wait for the
+ * client, or with the data of a read.
  *
- * @param a The offset where the write should start
- * @param buf The buffer to write from
- * @param len The length of buf
- * @param client The client we're going to write for.
- * @param fua Flag to indicate 'Force Unit Access'
- * @return 0 on success, nonzero on failure
+ * @param request the request, as it came in
+ * @param error the error, or 0
  **/
-int expwrite(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
-	char pagebuf[DIFFPAGESIZE];
-	off_t mapcnt,mapl,maph;
-	off_t wrlen,rdlen; 
-	off_t pagestart;
-	off_t offset;
-
-	if (!(client->server->flags & F_COPYONWRITE))
-		return(rawexpwrite_fully(a, buf, len, client, fua)); 
-	DEBUG("Asked to write %u bytes at %llu.\n", (unsigned int)len, (unsigned long long)a);
-
-	mapl=a/DIFFPAGESIZE ; maph=(a+len-1)/DIFFPAGESIZE ;
-
-	for (mapcnt=mapl;mapcnt<=maph;mapcnt++) {
-		pagestart=mapcnt*DIFFPAGESIZE ;
-		offset=a-pagestart ;
-		wrlen=(0<DIFFPAGESIZE-offset && len<(size_t)(DIFFPAGESIZE-offset)) ?
-			len : (size_t)DIFFPAGESIZE-offset;
-
-		if (client->difmap[mapcnt]!=(u32)(-1)) { /* the block is already there */
-			DEBUG("Page %llu is at %lu\n", (unsigned long long)mapcnt,
-			       (unsigned long)(client->difmap[mapcnt])) ;
-			myseek(client->difffile,
-					client->difmap[mapcnt]*DIFFPAGESIZE+offset);
-			if (write(client->difffile, buf, wrlen) != wrlen) return -1 ;
-		} else { /* the block is not there */
-			myseek(client->difffile,client->difffilelen*DIFFPAGESIZE) ;
-			client->difmap[mapcnt]=(client->server->flags&F_SPARSE)?mapcnt:client->difffilelen++;
-			DEBUG("Page %llu is not here, we put it at %lu\n",
-			       (unsigned long long)mapcnt,
-			       (unsigned long)(client->difmap[mapcnt]));
-			rdlen=DIFFPAGESIZE ;
-			if (rawexpread_fully(pagestart, pagebuf, rdlen, client))
-				return -1;
-			memcpy(pagebuf+offset,buf,wrlen) ;
-			if (write(client->difffile, pagebuf, DIFFPAGESIZE) !=
-					DIFFPAGESIZE)
-				return -1;
-		}						    
-		len-=wrlen ; a+=wrlen ; buf+=wrlen ;
-	}
-	if (client->server->flags & F_SYNC) {
-		fsync(client->difffile);
-	} else if (fua) {
-		/* open question: would it be cheaper to do multiple sync_file_ranges?
-		   as we iterate through the above?
-		 */
-		fdatasync(client->difffile);
-	}
-	return 0;
+static void send_reply(CLIENT *client, struct nbd_request *request, int error) {
+	uint64_t handle;
+
+	memcpy(&handle, request->handle, sizeof(handle));
+	if (nbds_reply(client->proto, handle, error))
+		err("Could not queue reply: %m");
+	if (client->transactionlog)
+		trlog_reply(client->transactionlog, request->handle, error);
 }
 
+/** sending macro. */
+#define SEND(client,request) send_reply(client, &(request), 0)
+/** error macro. */
+#define ERROR(client,request,errcode) { send_reply(client, &(request), errcode); reqerror = errcode; }
 /**
- * Flush data to a client
+ * Start timing a request for the slow log, if there is one.
  *
- * @param client The client we're going to write for.
- * @return 0 on success, nonzero on failure
+ * @param request the request, with the offset in host byte order
  **/
-int expflush(CLIENT *client) {
-	gint i;
-
-        if (client->server->flags & F_COPYONWRITE) {
-		return fsync(client->difffile);
-	}
-	
-	for (i = 0; i < client->export->len; i++) {
-		FILE_INFO fi = g_array_index(client->export, FILE_INFO, i);
-		if (fsync(fi.fhandle) < 0)
-			return -1;
-	}
-	
-	return 0;
-}
-
-/*
- * If the current system supports it, call fallocate() on the backend
- * file to resparsify stuff that isn't needed anymore (see NBD_CMD_TRIM)
- */
-int exptrim(struct nbd_request* req, CLIENT* client) {
-#if HAVE_FALLOC_PH
-	FILE_INFO prev = g_array_index(client->export, FILE_INFO, 0);
-	FILE_INFO cur = prev;
-	int i = 1;
-	/* We're running on a system that supports the
-	 * FALLOC_FL_PUNCH_HOLE option to re-sparsify a file */
-	do {
-		if(i<client->export->len) {
-			cur = g_array_index(client->export, FILE_INFO, i);
-		}
-		if(prev.startoff <= req->from) {
-			off_t curoff = req->from - prev.startoff;
-			off_t curlen = cur.startoff - prev.startoff - curoff;
-			fallocate(prev.fhandle, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, curoff, curlen);
-		}
-		prev = cur;
-	} while(i < client->export->len && cur.startoff < (req->from + req->len));
-	DEBUG("Performed TRIM request from %llu to %llu", (unsigned long long) req->from, (unsigned long long) req->len);
-#else
-	DEBUG("Ignoring TRIM request (not supported on current platform");
-#endif
-	return 0;
-}
-
-static void send_reply(uint32_t opt, int net, uint32_t reply_type, size_t datasize, void* data) {
-	uint64_t magic = htonll(0x3e889045565a9LL);
-	reply_type = htonl(reply_type);
-	uint32_t datsize = htonl(datasize);
-	opt = htonl(opt);
-	struct iovec v_data[] = {
-		{ &magic, sizeof(magic) },
-		{ &opt, sizeof(opt) },
-		{ &reply_type, sizeof(reply_type) },
-		{ &datsize, sizeof(datsize) },
-		{ data, datasize },
-	};
-	size_t total = sizeof(magic) + sizeof(opt) + sizeof(reply_type) + sizeof(datsize) + datasize;
-	ssize_t sent = writev(net, v_data, 5);
-	if(sent != total) {
-		perror("E: couldn't write enough data:");
-	}
+static inline void timing_start(struct nbd_request *request) {
+	if (G_LIKELY(!timing))
+		return;
+	phase_start = phase_mark = g_get_monotonic_time();
+	memset(phase_time, 0, sizeof(phase_time));
+	memcpy(&slowreq, request, sizeof(slowreq));
 }
 
-static CLIENT* handle_export_name(uint32_t opt, int net, GArray* servers, uint32_t cflags) {
-	uint32_t namelen;
-	char* name;
+/**
+ * Log the request that was timed if it took longer than the threshold.
+ * Whatever time was not charged to a phase yet went into sending the
+ * reply.
+ **/
+static void slowlog_done(CLIENT *client) {
+	GString *line;
+	gint64 total;
+	gint64 now;
+	uint64_t handle;
 	int i;
 
-	if (read(net, &namelen, sizeof(namelen)) < 0) {
-		err("Negotiation failed/7: %m");
-		return NULL;
-	}
-	namelen = ntohl(namelen);
-	name = malloc(namelen+1);
-	name[namelen]=0;
-	if (read(net, name, namelen) < 0) {
-		err("Negotiation failed/8: %m");
-		free(name);
-		return NULL;
-	}
-	for(i=0; i<servers->len; i++) {
-		SERVER* serve = &(g_array_index(servers, SERVER, i));
-		if(!strcmp(serve->servename, name)) {
-			CLIENT* client = g_new0(CLIENT, 1);
-			client->server = serve;
-			client->exportsize = OFFT_MAX;
-			client->net = net;
-			client->modern = TRUE;
-			client->transactionlogfd = -1;
-			client->clientfeats = cflags;
-			free(name);
-			return client;
-		}
-	}
-	err("Negotiation failed/8a: Requested export not found");
-	free(name);
-	return NULL;
-}
-
-static void handle_list(uint32_t opt, int net, GArray* servers, uint32_t cflags) {
-	uint32_t len;
-	int i;
-	char buf[1024];
-	char *ptr = buf + sizeof(len);
-
-	if (read(net, &len, sizeof(len)) < 0)
-		err("Negotiation failed/8: %m");
-	len = ntohl(len);
-	if(len) {
-		send_reply(opt, net, NBD_REP_ERR_INVALID, 0, NULL);
-	}
-	if(!(glob_flags & F_LIST)) {
-		send_reply(opt, net, NBD_REP_ERR_POLICY, 0, NULL);
-		err_nonfatal("Client tried disallowed list option");
+	phase_done(PHASE_NETWRITE);
+	total = phase_mark - phase_start;
+	if (total < slowthreshold)
 		return;
-	}
-	for(i=0; i<servers->len; i++) {
-		SERVER* serve = &(g_array_index(servers, SERVER, i));
-		len = htonl(strlen(serve->servename));
-		memcpy(buf, &len, sizeof(len));
-		strcpy(ptr, serve->servename);
-		send_reply(opt, net, NBD_REP_SERVER, strlen(serve->servename)+sizeof(len), buf);
-	}
-	send_reply(opt, net, NBD_REP_ACK, 0, NULL);
+	memcpy(&handle, slowreq.handle, sizeof(handle));
+	now = g_get_real_time();
+	line = g_string_new("");
+	g_string_append_printf(line, "%lld.%06lld %s handle=%016llx %s from=%llu len=%u total=%lldus",
+			       (long long)(now / G_TIME_SPAN_SECOND),
+			       (long long)(now % G_TIME_SPAN_SECOND),
+			       client->clientname, (unsigned long long)handle,
+			       getcommandname(slowreq.type & NBD_CMD_MASK_COMMAND),
+			       (unsigned long long)slowreq.from, ntohl(slowreq.len),
+			       (long long)total);
+	for (i = 0; i < PHASE_COUNT; i++)
+		g_string_append_printf(line, " %s=%lldus", phasenames[i], (long long)phase_time[i]);
+	g_string_append_c(line, '\n');
+	/* one write, so that lines of different children don't mix */
+	if (write(slowlogfd, line->str, line->len) < 0)
+		DEBUG("Could not write to slow log: %m");
+	g_string_free(line, TRUE);
 }
 
 /**
- * Do the initial negotiation.
+ * Update the statistics, if we keep any, and the slow log, if there is
+ * one, when a request is done.
  *
- * @param client The client we're negotiating with.
+ * @param command the type of request
+ * @param len the amount of data the request read or wrote
+ * @param error the error we replied with, or 0
+ * @param start when we received the request
  **/
-CLIENT* negotiate(int net, CLIENT *client, GArray* servers, int phase) {
-	char zeros[128];
-	uint64_t size_host;
-	uint32_t flags = NBD_FLAG_HAS_FLAGS;
-	uint16_t smallflags = 0;
-	uint64_t magic;
-	uint32_t cflags = 0;
-
-	memset(zeros, '\0', sizeof(zeros));
-	assert(((phase & NEG_INIT) && (phase & NEG_MODERN)) || client);
-	if(phase & NEG_MODERN) {
-		smallflags |= NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES;
-	}
-	if(phase & NEG_INIT) {
-		/* common */
-		if (write(net, INIT_PASSWD, 8) < 0) {
-			err_nonfatal("Negotiation failed/1: %m");
-			if(client)
-				exit(EXIT_FAILURE);
-		}
-		if(phase & NEG_MODERN) {
-			/* modern */
-			magic = htonll(opts_magic);
-		} else {
-			/* oldstyle */
-			magic = htonll(cliserv_magic);
-		}
-		if (write(net, &magic, sizeof(magic)) < 0) {
-			err_nonfatal("Negotiation failed/2: %m");
-			if(phase & NEG_OLD)
-				exit(EXIT_FAILURE);
-		}
-	}
-	if ((phase & NEG_MODERN) && (phase & NEG_INIT)) {
-		/* modern */
-		uint32_t opt;
-
-		if(!servers)
-			err("programmer error");
-		smallflags = htons(smallflags);
-		if (write(net, &smallflags, sizeof(uint16_t)) < 0)
-			err_nonfatal("Negotiation failed/3: %m");
-		if (read(net, &cflags, sizeof(cflags)) < 0)
-			err_nonfatal("Negotiation failed/4: %m");
-		cflags = htonl(cflags);
-		do {
-			if (read(net, &magic, sizeof(magic)) < 0)
-				err_nonfatal("Negotiation failed/5: %m");
-			magic = ntohll(magic);
-			if(magic != opts_magic) {
-				err_nonfatal("Negotiation failed/5a: magic mismatch");
-				return NULL;
-			}
-			if (read(net, &opt, sizeof(opt)) < 0)
-				err_nonfatal("Negotiation failed/6: %m");
-			opt = ntohl(opt);
-			switch(opt) {
-			case NBD_OPT_EXPORT_NAME:
-				// NBD_OPT_EXPORT_NAME must be the last
-				// selected option, so return from here
-				// if that is chosen.
-				return handle_export_name(opt, net, servers, cflags);
-				break;
-			case NBD_OPT_LIST:
-				handle_list(opt, net, servers, cflags);
-				break;
-			case NBD_OPT_ABORT:
-				// handled below
-				break;
-			default:
-				send_reply(opt, net, NBD_REP_ERR_UNSUP, 0, NULL);
-				break;
-			}
-		} while((opt != NBD_OPT_EXPORT_NAME) && (opt != NBD_OPT_ABORT));
-		if(opt == NBD_OPT_ABORT) {
-			err_nonfatal("Session terminated by client");
-			return NULL;
-		}
-	}
-	/* common */
-	size_host = htonll((u64)(client->exportsize));
-	if (write(net, &size_host, 8) < 0)
-		err("Negotiation failed/9: %m");
-	if (client->server->flags & F_READONLY)
-		flags |= NBD_FLAG_READ_ONLY;
-	if (client->server->flags & F_FLUSH)
-		flags |= NBD_FLAG_SEND_FLUSH;
-	if (client->server->flags & F_FUA)
-		flags |= NBD_FLAG_SEND_FUA;
-	if (client->server->flags & F_ROTATIONAL)
-		flags |= NBD_FLAG_ROTATIONAL;
-	if (client->server->flags & F_TRIM)
-		flags |= NBD_FLAG_SEND_TRIM;
-	if (phase & NEG_OLD) {
-		/* oldstyle */
-		flags = htonl(flags);
-		if (write(client->net, &flags, 4) < 0)
-			err("Negotiation failed/10: %m");
-	} else {
-		/* modern */
-		smallflags = (uint16_t)(flags & ~((uint16_t)0));
-		smallflags = htons(smallflags);
-		if (write(client->net, &smallflags, sizeof(smallflags)) < 0) {
-			err("Negotiation failed/11: %m");
-		}
-	}
-	/* common */
-	if (!(cflags & NBD_FLAG_C_NO_ZEROES)) {
-		if (write(client->net, zeros, 124) < 0)
-			err("Negotiation failed/12: %m");
-		return NULL;
-	}
+static inline void request_done(CLIENT *client, uint16_t command, size_t len, int error, gint64 start) {
+	if (G_UNLIKELY(timing))
+		slowlog_done(client);
+	if (!client->server->stats)
+		return;
+	stats_done(client->server->stats, client->stats, command,
+		   error ? 0 : len, error != 0, g_get_monotonic_time() - start);
 }
 
-/** sending macro. */
-#define SEND(net,reply) { writeit( net, &reply, sizeof( reply )); \
-	if (client->transactionlogfd != -1) \
-		writeit(client->transactionlogfd, &reply, sizeof(reply)); }
-/** error macro. */
-#define ERROR(client,reply,errcode) { reply.error = htonl(errcode); SEND(client->net,reply); reply.error = 0; }
 /**
  * Serve a file to a single client.
  *
@@ -1471,54 +1301,70 @@ CLIENT* negotiate(int net, CLIENT *client, GArray* servers, int phase) {
  **/
 int mainloop(CLIENT *client) {
 	struct nbd_request request;
-	struct nbd_reply reply;
+	NBDS_EVENT ev;
 	gboolean go_on=TRUE;
+	EXPORT_STATS *stats;
+	uint16_t command = 0;
+	size_t reqlen = 0;
+	int reqerror = 0;
+	gint64 start = 0;
 #ifdef DODBG
 	int i = 0;
 #endif
-	negotiate(client->net, client, NULL, client->modern ? NEG_MODERN : (NEG_OLD | NEG_INIT));
+	if (client->modern) {
+		if (nbds_accept(client->proto, client->exportsize, export_flags(client)))
+			err("Negotiation failed: %m");
+	} else if (!(client->proto = nbds_new(NBDS_OLDSTYLE, client->exportsize, export_flags(client)))) {
+		err("Negotiation failed: out of memory");
+	}
 	DEBUG("Entering request loop!\n");
-	reply.magic = htonl(NBD_REPLY_MAGIC);
-	reply.error = 0;
-	while (go_on) {
+	request.magic = htonl(NBD_REQUEST_MAGIC);
+	stats = client->server->stats;
+	if (stats)
+		client->stats = stats_connect(stats, client->clientname);
+	/* Every request ends with a continue, so this is where we can
+	 * account for it */
+	for (; go_on; request_done(client, command, reqlen, reqerror, start)) {
 		char buf[BUFSIZE];
-		char* p;
 		size_t len;
-		size_t currlen;
-		size_t writelen;
-		uint16_t command;
+		size_t currlen = 0;
 #ifdef DODBG
 		i++;
 		printf("%d: ", i);
 #endif
-		readit(client->net, &request, sizeof(request));
-		if (client->transactionlogfd != -1)
-			writeit(client->transactionlogfd, &request, sizeof(request));
-
-		request.from = ntohll(request.from);
-		request.type = ntohl(request.type);
-		command = request.type & NBD_CMD_MASK_COMMAND;
-		len = ntohl(request.len);
+		if (proto_next(client->net, client->proto, &ev) != NBDS_EV_REQUEST)
+			err(nbds_error(client->proto));
+
+		/* the request as it was on the wire, except for the offset;
+		 * that is what the logs and exptrim() take */
+		request.from = ev.offset;
+		request.type = ev.command | (ev.flags << 16);
+		request.len = htonl(ev.length);
+		memcpy(request.handle, &ev.handle, sizeof(request.handle));
+		command = ev.command;
+		len = ev.length;
+		timing_start(&request);
+		if (client->transactionlog)
+			trlog_request(client->transactionlog, request.type,
+				      request.handle, request.from, len);
+		if (stats) {
+			start = g_get_monotonic_time();
+			reqlen = (command == NBD_CMD_READ || command == NBD_CMD_WRITE) ? len : 0;
+			reqerror = 0;
+			stats_start(stats, client->stats);
+		}
 
 		DEBUG("%s from %llu (%llu) len %u, ", getcommandname(command),
 				(unsigned long long)request.from,
 				(unsigned long long)request.from / 512, len);
 
-		if (request.magic != htonl(NBD_REQUEST_MAGIC))
-			err("Not enough magic.");
-
-		memcpy(reply.handle, request.handle, sizeof(reply.handle));
-
 		if ((command==NBD_CMD_WRITE) || (command==NBD_CMD_READ)) {
-			if (request.from + len < request.from) { // 64 bit overflow!!
-				DEBUG("[Number too large!]");
-				ERROR(client, reply, EINVAL);
-				continue;
-			}
-
-			if (((off_t)request.from + len) > client->exportsize) {
+			if (request.from + len < request.from ||   // 64 bit overflow!!
+			    ((off_t)request.from + len) > client->exportsize) {
 				DEBUG("[RANGE!]");
-				ERROR(client, reply, EINVAL);
+				if (command == NBD_CMD_WRITE && len)
+					nbds_discard(client->proto);
+				ERROR(client, request, EINVAL);
 				continue;
 			}
 
@@ -1536,39 +1382,68 @@ int mainloop(CLIENT *client) {
 
 		case NBD_CMD_DISC:
 			msg(LOG_INFO, "Disconnect request received.");
+			proto_flush(client->net, client->proto);
+			readahead_stats(client);
+			if (client->server->cache) {
+				uint64_t hits, misses;
+
+				cache_stats(client->server->cache, &hits, &misses);
+				msg(LOG_INFO, "Block cache: %llu hits, %llu misses",
+				    (unsigned long long)hits, (unsigned long long)misses);
+			}
+			if (client->journal && journal_close(client->journal))
+				msg(LOG_ERR, "Could not write back journal; it will be replayed on the next connection");
+			client->journal = NULL;
+			backend_of(client)->close(client);
                 	if (client->server->flags & F_COPYONWRITE) { 
 				if (client->difmap) g_free(client->difmap) ;
                 		close(client->difffile);
 				unlink(client->difffilename);
 				free(client->difffilename);
 			}
+			stats_disconnect(client->stats);
+			client->stats = NULL;
+			phase_done(PHASE_DISK);
 			go_on=FALSE;
 			continue;
 
 		case NBD_CMD_WRITE:
 			DEBUG("wr: net->buf, ");
+			if ((client->server->flags & F_READONLY) ||
+			    (client->server->flags & F_AUTOREADONLY)) {
+				DEBUG("[WRITE to READONLY!]");
+				if (len)
+					nbds_discard(client->proto);
+				ERROR(client, request, EPERM);
+				continue;
+			}
 			while(len > 0) {
-				readit(client->net, buf, currlen);
+				/* the data goes straight into buf */
+				nbds_data_buffer(client->proto, buf, currlen);
+				if (proto_next(client->net, client->proto, &ev) != NBDS_EV_DATA)
+					err(nbds_error(client->proto));
+				phase_done(PHASE_NETREAD);
+				if (client->transactionlog)
+					trlog_payload(client->transactionlog, request.handle,
+						      ntohl(request.len) - len, buf, currlen);
 				DEBUG("buf->exp, ");
-				if ((client->server->flags & F_READONLY) ||
-				    (client->server->flags & F_AUTOREADONLY)) {
-					DEBUG("[WRITE to READONLY!]");
-					ERROR(client, reply, EPERM);
-					consume(client->net, buf, len-currlen, BUFSIZE);
-					continue;
-				}
-				if (expwrite(request.from, buf, currlen, client,
-					     request.type & NBD_CMD_FLAG_FUA)) {
+				if (expwrite(ev.offset, buf, currlen, client,
+					     ev.flags & NBD_CMD_FLAG_FUA)) {
 					DEBUG("Write failed: %m" );
-					ERROR(client, reply, errno);
-					consume(client->net, buf, len-currlen, BUFSIZE);
-					continue;
+					reqerror = errno;
+					if (len > currlen)
+						nbds_discard(client->proto);
+					break;
 				}
+				phase_done(PHASE_DISK);
 				len -= currlen;
-				request.from += currlen;
 				currlen = (len < BUFSIZE) ? len : BUFSIZE;
 			}
-			SEND(client->net, reply);
+			if (len) {
+				ERROR(client, request, reqerror);
+				continue;
+			}
+			SEND(client, request);
 			DEBUG("OK!\n");
 			continue;
 
@@ -1576,35 +1451,46 @@ int mainloop(CLIENT *client) {
 			DEBUG("fl: ");
 			if (expflush(client)) {
 				DEBUG("Flush failed: %m");
-				ERROR(client, reply, errno);
+				ERROR(client, request, errno);
 				continue;
 			}
-			SEND(client->net, reply);
+			phase_done(PHASE_SYNC);
+			SEND(client, request);
 			DEBUG("OK!\n");
 			continue;
 
 		case NBD_CMD_READ:
 			DEBUG("exp->buf, ");
-			if (client->transactionlogfd != -1)
-				writeit(client->transactionlogfd, &reply, sizeof(reply));
-			writeit(client->net, &reply, sizeof(reply));
-			p = buf;
-			writelen = currlen;
+			/* read the first part before we reply, so that we
+			 * can still say if it fails */
+			if (len && expread(request.from, buf, currlen, client)) {
+				DEBUG("Read failed: %m");
+				ERROR(client, request, errno);
+				continue;
+			}
+			phase_done(PHASE_DISK);
+			if (nbds_reply(client->proto, ev.handle, 0))
+				err("Could not queue reply: %m");
 			while(len > 0) {
-				if (expread(request.from, p, currlen, client)) {
-					DEBUG("Read failed: %m");
-					ERROR(client, reply, errno);
-					continue;
-				}
-				
 				DEBUG("buf->net, ");
-				writeit(client->net, buf, writelen);
+				nbds_send(client->proto, buf, currlen, NULL);
+				proto_flush(client->net, client->proto);
+				phase_done(PHASE_NETWRITE);
 				len -= currlen;
 				request.from += currlen;
 				currlen = (len < BUFSIZE) ? len : BUFSIZE;
-				p = buf;
-				writelen = currlen;
+				/* the protocol has no way to fail a read
+				 * once part of its data was sent */
+				if (len && expread(request.from, buf, currlen, client))
+					err("Read failed: %m");
+				phase_done(PHASE_DISK);
 			}
+			/* log the reply once the data is out, so that the
+			 * log shows how long the whole request took */
+			if (client->transactionlog)
+				trlog_reply(client->transactionlog, request.handle, 0);
+			if (client->server->flags & F_READAHEAD)
+				readahead_update(request.from - ntohl(request.len), ntohl(request.len), client);
 			DEBUG("OK!\n");
 			continue;
 
@@ -1613,10 +1499,11 @@ int mainloop(CLIENT *client) {
 			 * so it is okay to do nothing.  */
 			if (exptrim(&request, client)) {
 				DEBUG("Trim failed: %m");
-				ERROR(client, reply, errno);
+				ERROR(client, request, errno);
 				continue;
 			}
-			SEND(client->net, reply);
+			phase_done(PHASE_DISK);
+			SEND(client, request);
 			continue;
 
 		default:
@@ -1624,99 +1511,55 @@ int mainloop(CLIENT *client) {
 			continue;
 		}
 	}
+	nbds_free(client->proto);
+	client->proto = NULL;
 	return 0;
 }
 
-/**
- * Set up client export array, which is an array of FILE_INFO.
- * Also, split a single exportfile into multiple ones, if that was asked.
- * @param client information on the client which we want to setup export for
- **/
-void setupexport(CLIENT* client) {
-	int i;
-	off_t laststartoff = 0, lastsize = 0;
-	int multifile = (client->server->flags & F_MULTIFILE);
-	int temporary = (client->server->flags & F_TEMPORARY) && !multifile;
-	int cancreate = (client->server->expected_size) && !multifile;
-
-	client->export = g_array_new(TRUE, TRUE, sizeof(FILE_INFO));
-
-	/* If multi-file, open as many files as we can.
-	 * If not, open exactly one file.
-	 * Calculate file sizes as we go to get total size. */
-	for(i=0; ; i++) {
-		FILE_INFO fi;
-		gchar *tmpname;
-		gchar* error_string;
-
-		if (i)
-		  cancreate = 0;
-		/* if expected_size is specified, and this is the first file, we can create the file */
-		mode_t mode = (client->server->flags & F_READONLY) ?
-		  O_RDONLY : (O_RDWR | (cancreate?O_CREAT:0));
-
-		if (temporary) {
-			tmpname=g_strdup_printf("%s.%d-XXXXXX", client->exportname, i);
-			DEBUG( "Opening %s\n", tmpname );
-			fi.fhandle = mkstemp(tmpname);
-		} else {
-			if(multifile) {
-				tmpname=g_strdup_printf("%s.%d", client->exportname, i);
-			} else {
-				tmpname=g_strdup(client->exportname);
-			}
-			DEBUG( "Opening %s\n", tmpname );
-			fi.fhandle = open(tmpname, mode, 0x600);
-			if(fi.fhandle == -1 && mode == O_RDWR) {
-				/* Try again because maybe media was read-only */
-				fi.fhandle = open(tmpname, O_RDONLY);
-				if(fi.fhandle != -1) {
-					/* Opening the base file in copyonwrite mode is
-					 * okay */
-					if(!(client->server->flags & F_COPYONWRITE)) {
-						client->server->flags |= F_AUTOREADONLY;
-						client->server->flags |= F_READONLY;
-					}
-				}
-			}
-		}
-		if(fi.fhandle == -1) {
-			if(multifile && i>0)
-				break;
-			error_string=g_strdup_printf(
-				"Could not open exported file %s: %%m",
-				tmpname);
-			err(error_string);
-		}
+static int journal_rawread(off_t a, char *buf, size_t len, gpointer data) {
+	return rawexpread_fully(a, buf, len, data);
+}
 
-		if (temporary)
-			unlink(tmpname); /* File will stick around whilst FD open */
+static int journal_rawwrite(off_t a, char *buf, size_t len, gpointer data) {
+	return rawexpwrite_fully(a, buf, len, data, 0);
+}
 
-		fi.startoff = laststartoff + lastsize;
-		g_array_append_val(client->export, fi);
-		g_free(tmpname);
+static int journal_rawsync(gpointer data) {
+	CLIENT *client = data;
 
-		/* Starting offset and size of this file will be used to
-		 * calculate starting offset of next file */
-		laststartoff = fi.startoff;
-		lastsize = size_autodetect(fi.fhandle);
+	return backend_of(client)->flush(client);
+}
 
-		/* If we created the file, it will be length zero */
-		if (!lastsize && cancreate) {
-			assert(!multifile);
-			if(ftruncate (fi.fhandle, client->server->expected_size)<0) {
-				err("Could not expand file: %m");
-			}
-			lastsize = client->server->expected_size;
-			break; /* don't look for any more files */
-		}
+static int journal_rawtrim(off_t a, size_t len, gpointer data) {
+	CLIENT *client = data;
+	const BACKEND *backend = backend_of(client);
 
-		if(!multifile || temporary)
-			break;
-	}
+	if(!backend->trim)
+		return 0;
+	return backend->trim(client, a, len);
+}
 
-	/* Set export size to total calculated size */
-	client->exportsize = laststartoff + lastsize;
+/** How the journal, if any, reaches the export */
+static const JOURNAL_OPS journal_ops = {
+	journal_rawread,
+	journal_rawwrite,
+	journal_rawsync,
+	journal_rawtrim,
+};
+
+/**
+ * Open the export through its backend, and the journal in front of it,
+ * if any.
+ * @param client information on the client which we want to setup export for
+ **/
+void setupexport(CLIENT* client) {
+	const BACKEND *backend = backend_of(client);
+	GError *gerror = NULL;
+
+	if(backend->open(client, &gerror) < 0) {
+		msg(LOG_ERR, "%s", gerror->message);
+		err("Could not open export");
+	}
 
 	/* Export size may be overridden */
 	if(client->server->expected_size) {
@@ -1729,8 +1572,20 @@ void setupexport(CLIENT* client) {
 	}
 
 	msg(LOG_INFO, "Size of exported file/device is %llu", (unsigned long long)client->exportsize);
-	if(multifile) {
-		msg(LOG_INFO, "Total number of files: %d", i);
+	if(backend != &file_backend) {
+		msg(LOG_INFO, "Serving from the %s backend", backend->name);
+	}
+	if (client->server->journal) {
+		GError *gerror = NULL;
+
+		client->journal = journal_open(client->server->journal,
+					       client->exportsize, &journal_ops,
+					       client, &gerror);
+		if (!client->journal) {
+			msg(LOG_ERR, "%s", gerror->message);
+			err("Could not open journal");
+		}
+		msg(LOG_INFO, "Writing back through journal %s", client->server->journal);
 	}
 }
 
@@ -1786,13 +1641,32 @@ int do_run(gchar* command, gchar* file) {
  * @param client a connected client
  **/
 void serveconnection(CLIENT *client) {
-	if (client->server->transactionlog && (client->transactionlogfd == -1))
+	if (client->server->transactionlog && !client->transactionlog)
 	{
-		if (-1 == (client->transactionlogfd = open(client->server->transactionlog,
-							   O_WRONLY | O_CREAT,
-							   S_IRUSR | S_IWUSR)))
-			g_warning("Could not open transaction log %s",
-				  client->server->transactionlog);
+		GError *gerror = NULL;
+		SERVER *serve = client->server;
+
+		client->transactionlog = trlog_open(serve->transactionlog, getpid(),
+						    trlog_exportid(serve->servename ?
+								   serve->servename :
+								   serve->exportname),
+						    serve->trpayload, &gerror);
+		if (!client->transactionlog) {
+			g_warning("%s", gerror->message);
+			g_error_free(gerror);
+		}
+	}
+	if (client->server->slowlog) {
+		if (-1 == (slowlogfd = open(client->server->slowlog,
+					    O_WRONLY | O_APPEND | O_CREAT,
+					    S_IRUSR | S_IWUSR))) {
+			g_warning("Could not open slow log %s",
+				  client->server->slowlog);
+		} else {
+			slowthreshold = (client->server->slowthreshold < 0 ?
+					 SLOWLOG_THRESHOLD : client->server->slowthreshold) * 1000;
+			timing = true;
+		}
 	}
 
 	if(do_run(client->server->prerun, client->exportname)) {
@@ -1809,10 +1683,20 @@ void serveconnection(CLIENT *client) {
 	mainloop(client);
 	do_run(client->server->postrun, client->exportname);
 
-	if (-1 != client->transactionlogfd)
+	if (client->transactionlog)
+	{
+		uint64_t dropped = trlog_close(client->transactionlog);
+
+		if (dropped)
+			msg(LOG_WARNING, "%llu records were dropped from the transaction log",
+			    (unsigned long long)dropped);
+		client->transactionlog = NULL;
+	}
+	if (-1 != slowlogfd)
 	{
-		close(client->transactionlogfd);
-		client->transactionlogfd = -1;
+		timing = false;
+		close(slowlogfd);
+		slowlogfd = -1;
 	}
 }
 
@@ -1929,6 +1813,7 @@ spawn_child()
         sigemptyset(&newset);
         sigaddset(&newset, SIGCHLD);
         sigaddset(&newset, SIGTERM);
+        sigaddset(&newset, SIGHUP);
         sigprocmask(SIG_BLOCK, &newset, &oldset);
         pid = fork();
         if (pid < 0) {
@@ -1947,11 +1832,46 @@ spawn_child()
         signal(SIGCHLD, SIG_DFL);
         signal(SIGTERM, SIG_DFL);
         signal(SIGHUP, SIG_DFL);
+        /* serveloop() keeps SIGCHLD and SIGHUP blocked outside of
+         * pselect(); the child must not inherit that */
+        sigprocmask(SIG_UNBLOCK, &newset, NULL);
+        return pid;
 out:
         sigprocmask(SIG_SETMASK, &oldset, NULL);
         return pid;
 }
 
+/**
+ * Close a scrape of the metrics page, or a control connection.
+ **/
+static void metrics_conn_close(struct metrics_conn *conn) {
+	close(conn->fd);
+	conn->fd = -1;
+	if(conn->resp) {
+		g_string_free(conn->resp, TRUE);
+		conn->resp = NULL;
+	}
+}
+
+/**
+ * Close the parent's control and metrics sockets, and any connections
+ * to them in progress. Children have no business with them.
+ **/
+static void close_parent_sockets(void) {
+	int i;
+
+	if(controlsock >= 0)
+		close(controlsock);
+	if(metricssock >= 0)
+		close(metricssock);
+	if(controlsock >= 0 || metricssock >= 0) {
+		for(i = 0; i < METRICS_CONNS; i++) {
+			if(metricsconns[i].fd >= 0)
+				metrics_conn_close(&metricsconns[i]);
+		}
+	}
+}
+
 static int
 socket_accept(const int sock)
 {
@@ -1962,6 +1882,8 @@ socket_accept(const int sock)
         net = accept(sock, (struct sockaddr *) &addrin, &addrinlen);
         if (net < 0) {
                 err_nonfatal("Failed to accept socket connection: %m");
+        } else if (serverstats) {
+                serverstats->accepted++;
         }
 
         return net;
@@ -1993,7 +1915,7 @@ handle_modern_connection(GArray *const servers, const int sock)
                 /* Child just continues. */
         }
 
-        client = negotiate(net, NULL, servers, NEG_INIT | NEG_MODERN);
+        client = negotiate(net, servers);
         if (!client) {
                 msg(LOG_ERR, "Modern initial negotiation failed");
                 goto handler_err;
@@ -2042,6 +1964,7 @@ handle_modern_connection(GArray *const servers, const int sock)
                         close(g_array_index(modernsocks, int, i));
                 }
                 g_array_free(modernsocks, TRUE);
+                close_parent_sockets();
 
                 /* Now that we are in the child process after a
                  * succesful negotiation, we do not need the list of
@@ -2066,6 +1989,8 @@ handle_modern_connection(GArray *const servers, const int sock)
         exit(EXIT_SUCCESS);
 
 handler_err:
+        if (serverstats)
+                __sync_fetch_and_add(&serverstats->negfailures, 1);
         g_free(client);
         close(net);
 
@@ -2104,13 +2029,14 @@ handle_oldstyle_connection(GArray *const servers, SERVER *const serve)
 	client->server=serve;
 	client->exportsize=OFFT_MAX;
 	client->net=net;
-	client->transactionlogfd = -1;
 
 	if (set_peername(net, client)) {
 		goto handle_connection_out;
 	}
 	if (!authorized_client(client)) {
 		msg(LOG_INFO, "Unauthorized client");
+		if (serverstats)
+			__sync_fetch_and_add(&serverstats->negfailures, 1);
 		goto handle_connection_out;
 	}
 	msg(LOG_INFO, "Authorized client");
@@ -2124,6 +2050,7 @@ handle_oldstyle_connection(GArray *const servers, SERVER *const serve)
 		sigemptyset(&newset);
 		sigaddset(&newset, SIGCHLD);
 		sigaddset(&newset, SIGTERM);
+		sigaddset(&newset, SIGHUP);
 		sigprocmask(SIG_BLOCK, &newset, &oldset);
 		if ((pid = fork()) < 0) {
 			msg(LOG_INFO, "Could not fork (%s)", strerror(errno));
@@ -2143,7 +2070,7 @@ handle_oldstyle_connection(GArray *const servers, SERVER *const serve)
 		signal(SIGCHLD, SIG_DFL);
 		signal(SIGTERM, SIG_DFL);
 		signal(SIGHUP, SIG_DFL);
-		sigprocmask(SIG_SETMASK, &oldset, NULL);
+		sigprocmask(SIG_UNBLOCK, &newset, NULL);
 
 		g_hash_table_destroy(children);
 		children = NULL;
@@ -2161,6 +2088,7 @@ handle_oldstyle_connection(GArray *const servers, SERVER *const serve)
 			close(g_array_index(modernsocks, int, i));
 		}
 		g_array_free(modernsocks, TRUE);
+		close_parent_sockets();
 	}
 
 	msg(LOG_INFO, "Starting to serve");
@@ -2238,14 +2166,268 @@ out:
         return retval;
 }
 
+/**
+ * Find the statistics of all exports, skipping the copies of an export
+ * that listens on more than one address.
+ *
+ * @param servers the servers
+ * @param names array of const gchar*, to which the names of the exports
+ * are appended
+ * @param stats array of EXPORT_STATS*, to which their statistics are
+ * appended
+ **/
+static void collect_stats(GArray *const servers, GArray *names, GArray *stats) {
+	int i, j;
+
+	for(i = 0; i < servers->len; i++) {
+		SERVER *serve = &g_array_index(servers, SERVER, i);
+		const gchar *name;
+
+		if(!serve->stats)
+			continue;
+		for(j = 0; j < i; j++) {
+			if(g_array_index(servers, SERVER, j).stats == serve->stats)
+				break;
+		}
+		if(j < i)
+			continue;
+		name = serve->servename ? serve->servename : serve->exportname;
+		g_array_append_val(names, name);
+		g_array_append_val(stats, serve->stats);
+	}
+}
+
+/**
+ * Build the answer to a request on the control socket: the statistics
+ * as text, or as JSON.
+ *
+ * @param servers the servers whose statistics to report
+ **/
+static GString *control_page(GArray *const servers, gboolean json) {
+	GArray *names, *stats;
+	GString *out;
+	int i;
+
+	names = g_array_new(FALSE, FALSE, sizeof(const gchar *));
+	stats = g_array_new(FALSE, FALSE, sizeof(EXPORT_STATS *));
+	collect_stats(servers, names, stats);
+	out = g_string_new(json ? "{\"exports\":[" : "");
+	for(i = 0; i < names->len; i++) {
+		if(json && i)
+			g_string_append_c(out, ',');
+		stats_format(out, g_array_index(names, const gchar *, i),
+			     g_array_index(stats, EXPORT_STATS *, i), json);
+	}
+	if(json)
+		g_string_append(out, "]}\n");
+	g_array_free(names, TRUE);
+	g_array_free(stats, TRUE);
+	return out;
+}
+
+/**
+ * Build the metrics page.
+ *
+ * @param servers the servers whose statistics to report
+ **/
+static GString *metrics_page(GArray *const servers) {
+	GString *out = g_string_new("");
+	GArray *names, *stats;
+
+	g_string_append_printf(out,
+		"# HELP nbd_connections Connections that are being served.\n"
+		"# TYPE nbd_connections gauge\n"
+		"nbd_connections %u\n"
+		"# HELP nbd_accepted_connections_total Connections accepted.\n"
+		"# TYPE nbd_accepted_connections_total counter\n"
+		"nbd_accepted_connections_total %llu\n"
+		"# HELP nbd_negotiation_failures_total Connections dropped because negotiation or authorization failed.\n"
+		"# TYPE nbd_negotiation_failures_total counter\n"
+		"nbd_negotiation_failures_total %llu\n",
+		g_hash_table_size(children),
+		(unsigned long long)serverstats->accepted,
+		(unsigned long long)serverstats->negfailures);
+
+	names = g_array_new(FALSE, FALSE, sizeof(const gchar *));
+	stats = g_array_new(FALSE, FALSE, sizeof(EXPORT_STATS *));
+	collect_stats(servers, names, stats);
+	stats_format_metrics(out, (const gchar **)names->data,
+			     (EXPORT_STATS **)stats->data, names->len);
+	g_array_free(names, TRUE);
+	g_array_free(stats, TRUE);
+	return out;
+}
+
+/**
+ * Accept a scrape of the metrics page, or a connection to the control
+ * socket.
+ *
+ * @param sock metricssock or controlsock
+ **/
+static void metrics_accept(int sock) {
+	struct metrics_conn *conn = NULL;
+	int net;
+	int i;
+
+	if((net = accept(sock, NULL, NULL)) < 0) {
+		if(errno != EAGAIN && errno != EWOULDBLOCK)
+			msg(LOG_WARNING, "Could not accept on %s socket: %m",
+			    sock == controlsock ? "control" : "metrics");
+		return;
+	}
+	for(i = 0; i < METRICS_CONNS; i++) {
+		if(metricsconns[i].fd < 0) {
+			conn = &metricsconns[i];
+			break;
+		}
+	}
+	if(!conn || fcntl(net, F_SETFL, fcntl(net, F_GETFL, 0) | O_NONBLOCK) < 0) {
+		close(net);
+		return;
+	}
+	conn->fd = net;
+	conn->control = sock == controlsock;
+	conn->since = g_get_monotonic_time();
+	conn->reqlen = 0;
+	conn->sent = 0;
+}
+
+/**
+ * Read what we can of a scrape's request, and once it is complete,
+ * prepare the response.
+ *
+ * A control client may send "json" to get the statistics as JSON;
+ * anything else, or the end of its side of the connection, gets them
+ * as text. We answer after the first read, as the request is that
+ * short.
+ **/
+static void metrics_read(GArray *const servers, struct metrics_conn *conn) {
+	const char *status = "200 OK";
+	GString *body;
+	ssize_t len;
+
+	len = read(conn->fd, conn->req + conn->reqlen, sizeof(conn->req) - 1 - conn->reqlen);
+	if(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if(conn->control && len >= 0) {
+		conn->reqlen += len;
+		conn->req[conn->reqlen] = '\0';
+		conn->resp = control_page(servers, !strncmp(conn->req, "json", 4));
+		return;
+	}
+	if(len <= 0) {
+		metrics_conn_close(conn);
+		return;
+	}
+	conn->reqlen += len;
+	conn->req[conn->reqlen] = '\0';
+	if(!strstr(conn->req, "\r\n\r\n") && !strstr(conn->req, "\n\n")) {
+		if(conn->reqlen < sizeof(conn->req) - 1)
+			return;
+		status = "400 Bad Request";
+		body = g_string_new("Request too long\n");
+	} else if(strncmp(conn->req, "GET ", 4)) {
+		status = "405 Method Not Allowed";
+		body = g_string_new("Only GET is supported\n");
+	} else {
+		body = metrics_page(servers);
+	}
+	conn->resp = g_string_new("");
+	g_string_append_printf(conn->resp,
+		"HTTP/1.0 %s\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %lu\r\n"
+		"Connection: close\r\n"
+		"\r\n", status, (unsigned long)body->len);
+	g_string_append_len(conn->resp, body->str, body->len);
+	g_string_free(body, TRUE);
+}
+
+/**
+ * Write what we can of a scrape's response, or a control answer.
+ **/
+static void metrics_write(struct metrics_conn *conn) {
+	ssize_t len;
+
+	len = send(conn->fd, conn->resp->str + conn->sent, conn->resp->len - conn->sent, MSG_NOSIGNAL);
+	if(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if(len < 0) {
+		metrics_conn_close(conn);
+		return;
+	}
+	conn->sent += len;
+	if(conn->sent == conn->resp->len)
+		metrics_conn_close(conn);
+}
+
+/**
+ * Add the scrapes and control connections in progress to the sets of
+ * descriptors to select() for.
+ *
+ * @param max the highest descriptor in the sets; updated
+ * @return the number of them in progress
+ **/
+static int metrics_fdset(fd_set *rset, fd_set *wset, int *max) {
+	int busy = 0;
+	int i;
+
+	for(i = 0; i < METRICS_CONNS; i++) {
+		struct metrics_conn *conn = &metricsconns[i];
+
+		if(conn->fd < 0)
+			continue;
+		FD_SET(conn->fd, conn->resp ? wset : rset);
+		*max = conn->fd > *max ? conn->fd : *max;
+		busy++;
+	}
+	return busy;
+}
+
+/**
+ * Make progress on the scrapes of the metrics page and the control
+ * connections, answer control clients that sent nothing, and drop the
+ * ones that take too long.
+ **/
+static void handle_metrics(GArray *const servers, fd_set *rset, fd_set *wset) {
+	gint64 now = g_get_monotonic_time();
+	int i;
+
+	for(i = 0; i < METRICS_CONNS; i++) {
+		struct metrics_conn *conn = &metricsconns[i];
+
+		if(conn->fd < 0)
+			continue;
+		if(!conn->resp && FD_ISSET(conn->fd, rset))
+			metrics_read(servers, conn);
+		else if(conn->resp && FD_ISSET(conn->fd, wset))
+			metrics_write(conn);
+		if(conn->fd >= 0 && conn->control && !conn->resp
+		   && now - conn->since > CONTROL_WAIT * G_TIME_SPAN_MILLISECOND)
+			conn->resp = control_page(servers, FALSE);
+		if(conn->fd >= 0 && now - conn->since > METRICS_TIMEOUT * G_TIME_SPAN_SECOND)
+			metrics_conn_close(conn);
+	}
+	if(metricssock >= 0 && FD_ISSET(metricssock, rset))
+		metrics_accept(metricssock);
+	if(controlsock >= 0 && FD_ISSET(controlsock, rset))
+		metrics_accept(controlsock);
+}
+
 /**
  * Loop through the available servers, and serve them. Never returns.
  **/
 void serveloop(GArray* servers) {
 	int i;
 	int max;
+	int n;
+	int busy;
 	fd_set mset;
 	fd_set rset;
+	fd_set wset;
+	struct timespec ts;
+	sigset_t sigs;
+	sigset_t waitmask;
 
 	/* 
 	 * Set up the master fd_set. The set of descriptors we need
@@ -2268,7 +2450,28 @@ void serveloop(GArray* servers) {
 		FD_SET(sock, &mset);
 		max=sock>max?sock:max;
 	}
+	if(controlsock >= 0) {
+		FD_SET(controlsock, &mset);
+		max=controlsock>max?controlsock:max;
+	}
+	if(metricssock >= 0) {
+		FD_SET(metricssock, &mset);
+		max=metricssock>max?metricssock:max;
+	}
+	/* SIGCHLD and SIGHUP are only let through while we wait in
+	 * pselect(), so that one which arrives after the flags were
+	 * tested below still ends the wait, rather than leaving a dead
+	 * child in the table of children until a client comes by */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	sigaddset(&sigs, SIGHUP);
+	sigprocmask(SIG_BLOCK, &sigs, &waitmask);
+	sigdelset(&waitmask, SIGCHLD);
+	sigdelset(&waitmask, SIGHUP);
 	for(;;) {
+		if (is_sigchld_caught)
+			reap_children();
+
                 /* SIGHUP causes the root server process to reconfigure
                  * itself and add new export servers for each newly
                  * found export configuration group, i.e. spawn new
@@ -2303,7 +2506,17 @@ void serveloop(GArray* servers) {
                 }
 
 		memcpy(&rset, &mset, sizeof(fd_set));
-		if(select(max+1, &rset, NULL, NULL, NULL)>0) {
+		FD_ZERO(&wset);
+		n = max;
+		/* wake up now and then while scraping, to answer control
+		 * clients that send nothing and to drop scrapers that
+		 * went away */
+		ts.tv_sec = 0;
+		ts.tv_nsec = CONTROL_WAIT * 1000000L;
+		busy = 0;
+		if(controlsock >= 0 || metricssock >= 0)
+			busy = metrics_fdset(&rset, &wset, &n);
+		if(pselect(n+1, &rset, &wset, NULL, busy ? &ts : NULL, &waitmask)>=0) {
 
 			DEBUG("accept, ");
 			for(i=0; i < modernsocks->len; i++) {
@@ -2325,6 +2538,9 @@ void serveloop(GArray* servers) {
 					handle_oldstyle_connection(servers, serve);
 				}
 			}
+			if(controlsock >= 0 || metricssock >= 0) {
+				handle_metrics(servers, &rset, &wset);
+			}
 		}
 	}
 }
@@ -2402,6 +2618,23 @@ int setup_serve(SERVER *const serve, GError **const gerror) {
          * TODO: fix server initialization */
         serve->socket = -1;
 
+	if((controlsock >= 0 || metricssock >= 0) && !serve->stats) {
+		if(!(serve->stats = stats_new(gerror)))
+			return -1;
+	}
+
+	if(serve->cachesize && !serve->cache) {
+		if(serve->flags & F_TEMPORARY) {
+			msg(LOG_WARNING, "Not caching temporary export %s", serve->exportname);
+		} else if(strstr(serve->exportname, "%s")) {
+			msg(LOG_WARNING, "Not caching virtualized export %s", serve->exportname);
+		} else if(serve->backend && !serve->backend->shared) {
+			msg(LOG_WARNING, "Not caching export %s, which is different for every connection", serve->exportname);
+		} else if(!(serve->cache = cache_new(serve->cachesize, gerror))) {
+			return -1;
+		}
+	}
+
 	if(!(glob_flags & F_OLDSTYLE)) {
 		return serve->servename ? 1 : 0;
 	}
@@ -2573,6 +2806,191 @@ out:
         return retval;
 }
 
+/**
+ * Create a Unix domain socket and listen on it.
+ *
+ * @param path where to create the socket
+ * @param what what the socket is for, for error messages
+ * @return the socket, or -1 on failure (with gerror set)
+ **/
+static int listen_unix(const gchar *const path, const gchar *const what, GError **const gerror) {
+	struct sockaddr_un addr;
+	int sock;
+
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		g_set_error(gerror, NBDS_ERR, NBDS_ERR_SOCKET,
+			    "failed to open the %s socket: path %s is too long",
+			    what, path);
+		return -1;
+	}
+	if((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		g_set_error(gerror, NBDS_ERR, NBDS_ERR_SOCKET,
+			    "failed to open the %s socket: %s",
+			    what, strerror(errno));
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		g_set_error(gerror, NBDS_ERR, NBDS_ERR_BIND,
+			    "failed to bind the %s socket to %s: %s",
+			    what, path, strerror(errno));
+		close(sock);
+		return -1;
+	}
+	if(listen(sock, 10) < 0) {
+		g_set_error(gerror, NBDS_ERR, NBDS_ERR_LISTEN,
+			    "failed to listen on the %s socket: %s",
+			    what, strerror(errno));
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/**
+ * Open the control socket, on which we report statistics.
+ *
+ * @param path where to create the socket
+ * @return 0 on success, -1 on failure (with gerror set)
+ **/
+int open_control(const gchar *const path, GError **const gerror) {
+	int sock;
+	int i;
+
+	if((sock = listen_unix(path, "control", gerror)) < 0)
+		return -1;
+	if(fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) < 0) {
+		g_set_error(gerror, NBDS_ERR, NBDS_ERR_SOCKET,
+			    "failed to make the control socket non-blocking: %s",
+			    strerror(errno));
+		close(sock);
+		return -1;
+	}
+	for(i = 0; i < METRICS_CONNS; i++)
+		metricsconns[i].fd = -1;
+	controlsock = sock;
+	return 0;
+}
+
+/**
+ * Create a TCP socket and listen on it.
+ *
+ * @param addr host:port, where the host may be in brackets
+ * @return the socket, or -1 on failure (with gerror set)
+ **/
+static int listen_tcp(const gchar *const addr, GError **const gerror) {
+	struct addrinfo hints;
+	struct addrinfo *ai = NULL;
+	struct addrinfo *rp;
+	gchar *host;
+	gchar *port;
+	int yes = 1;
+	int sock = -1;
+	int e;
+
+	if(addr[0] == '[' && (port = strstr(addr, "]:"))) {
+		host = g_strndup(addr + 1, port - addr - 1);
+		port += 2;
+	} else if((port = strrchr(addr, ':'))) {
+		host = g_strndup(addr, port - addr);
+		port++;
+	} else {
+		g_set_error(gerror, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID,
+			    "failed to open the metrics socket: %s is not of the form host:port",
+			    addr);
+		return -1;
+	}
+	memset(&hints, '\0', sizeof(hints));
+	hints.ai_flags = AI_PASSIVE;
+	hints.ai_socktype = SOCK_STREAM;
+	e = getaddrinfo(*host ? host : NULL, port, &hints, &ai);
+	g_free(host);
+	if(e != 0) {
+		g_set_error(gerror, NBDS_ERR, NBDS_ERR_GAI,
+			    "failed to open the metrics socket: "
+			    "failed to get address info: %s",
+			    gai_strerror(e));
+		return -1;
+	}
+	for(rp = ai; rp; rp = rp->ai_next) {
+		if((sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) < 0)
+			continue;
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+		if(bind(sock, rp->ai_addr, rp->ai_addrlen) == 0 && listen(sock, 10) == 0)
+			break;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(ai);
+	if(sock < 0) {
+		g_set_error(gerror, NBDS_ERR, NBDS_ERR_BIND,
+			    "failed to bind the metrics socket to %s: %s",
+			    addr, strerror(errno));
+	}
+	return sock;
+}
+
+/**
+ * Open the socket on which we serve metrics over HTTP.
+ *
+ * @param addr a path for a Unix domain socket, if it starts with a
+ * slash; host:port otherwise
+ * @return 0 on success, -1 on failure (with gerror set)
+ **/
+int open_metrics(const gchar *const addr, GError **const gerror) {
+	int sock;
+	int i;
+
+	if(addr[0] == '/')
+		sock = listen_unix(addr, "metrics", gerror);
+	else
+		sock = listen_tcp(addr, gerror);
+	if(sock < 0)
+		return -1;
+	if(fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) < 0) {
+		g_set_error(gerror, NBDS_ERR, NBDS_ERR_SOCKET,
+			    "failed to make the metrics socket non-blocking: %s",
+			    strerror(errno));
+		close(sock);
+		return -1;
+	}
+	if(!(serverstats = stats_server_new(gerror))) {
+		close(sock);
+		return -1;
+	}
+	for(i = 0; i < METRICS_CONNS; i++)
+		metricsconns[i].fd = -1;
+	metricssock = sock;
+	return 0;
+}
+
+/**
+ * append_serve() adds an export once for every address it listens on.
+ * Make sure those copies share the block cache and statistics that
+ * setup_serve() allocates, rather than each getting their own.
+ *
+ * @param servers the servers
+ * @param n the index of the server that is about to be set up
+ **/
+static void share_with_siblings(GArray *const servers, int n) {
+	SERVER *serve = &g_array_index(servers, SERVER, n);
+	int i;
+
+	for(i = 0; i < n; i++) {
+		SERVER *sibling = &g_array_index(servers, SERVER, i);
+
+		if(g_strcmp0(sibling->servename, serve->servename)
+		   || g_strcmp0(sibling->exportname, serve->exportname))
+			continue;
+		serve->cache = sibling->cache;
+		serve->stats = sibling->stats;
+		return;
+	}
+}
+
 /**
  * Connect our servers.
  **/
@@ -2587,6 +3005,7 @@ void setup_servers(GArray *const servers, const gchar *const modernaddr,
                 SERVER *server = &g_array_index(servers, SERVER, i);
                 int ret;
 
+		share_with_siblings(servers, i);
 		ret = setup_serve(server, &gerror);
                 if (ret == -1) {
                         msg(LOG_ERR, "failed to setup servers: %s",
@@ -2780,7 +3199,7 @@ int main(int argc, char *argv[]) {
 			open("/dev/null", O_WRONLY);
 			g_log_set_default_handler( glib_message_syslog_redirect, NULL );
 #endif
-			client=g_malloc(sizeof(CLIENT));
+			client=g_new0(CLIENT, 1);
 			client->server=serve;
 			client->net=-1;
 			client->exportsize=OFFT_MAX;
@@ -2810,6 +3229,22 @@ int main(int argc, char *argv[]) {
 	}
 	if (!dontfork)
 		daemonize(serve);
+	if (genconf.controlsocket) {
+		GError *gerror = NULL;
+
+		if (open_control(genconf.controlsocket, &gerror) == -1) {
+			msg(LOG_ERR, "%s", gerror->message);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (genconf.metricsaddr) {
+		GError *gerror = NULL;
+
+		if (open_metrics(genconf.metricsaddr, &gerror) == -1) {
+			msg(LOG_ERR, "%s", gerror->message);
+			exit(EXIT_FAILURE);
+		}
+	}
 	setup_servers(servers, genconf.modernaddr, genconf.modernport);
 	dousers(genconf.user, genconf.group);
 
@@ -2,21 +2,31 @@
  * nbd-trdump.c
  *
  * Takes an nbd transaction log file on stdin and translates it into something
- * comprehensible
+ * comprehensible. Both the version 1 format (bare request and reply
+ * headers) and the version 2 format (blocks of timestamped records) are
+ * understood, even mixed in one file.
+ *
+ * With -a, it summarizes the log instead: latencies, request sizes, how
+ * sequential the requests are, and where on the export they go.
  */
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
 #include "config.h"
 /* We don't want to do syslog output in this program */
 #undef ISSERVER
 #include "cliserv.h"
 #include "nbd.h"
+#include "trlog.h"
 
 static inline void doread(int f, void *buf, size_t len) {
         ssize_t res;
@@ -33,6 +43,454 @@ static inline void doread(int f, void *buf, size_t len) {
         }
 }
 
+#define CMDS (NBD_CMD_TRIM + 1)	/**< number of commands we know */
+#define LAT_SUB 16		/**< latency buckets per power of two */
+#define LAT_BUCKETS (61 * LAT_SUB) /**< latency buckets; enough for any
+				     number of nanoseconds */
+#define SIZE_BUCKETS 33		/**< size buckets, one per power of two */
+#define HEAT_ROWS 32		/**< number of rows of the heatmap */
+#define HEAT_WIDTH 50		/**< width of its bars */
+
+/**
+ * What we know of a command, when analysing a log
+ **/
+struct cmdstats {
+	uint64_t requests;
+	uint64_t replies;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t sequential;	/**< requests that start where the previous
+				     one of the connection ended */
+	uint64_t latency[LAT_BUCKETS];
+	uint64_t size[SIZE_BUCKETS];
+};
+
+/**
+ * A request that has not been replied to yet
+ **/
+struct pending {
+	uint32_t connid;
+	uint64_t handle;
+	uint64_t time;		/**< when it was made, or 0 if not known */
+	int cmd;
+};
+
+/**
+ * A connection, when analysing a log
+ **/
+struct connstate {
+	uint64_t next[CMDS];	/**< where the previous request of each
+				     command ended */
+};
+
+static struct cmdstats cmdstats[CMDS];
+static GHashTable *pending;	/**< struct pending, by connection and
+				     handle */
+static GHashTable *conns;	/**< struct connstate, by connection */
+static uint64_t nrecords, dropped, unpaired;
+static uint64_t maxend;		/**< the end of the furthest request */
+static uint64_t rowsize;	/**< how much of the export a row of the
+				     heatmap covers */
+static uint64_t heat[HEAT_ROWS][CMDS];	/**< bytes per row of the heatmap */
+
+static char *getcommandname(uint32_t command) {
+	switch (command & NBD_CMD_MASK_COMMAND) {
+	case NBD_CMD_READ:
+		return "NBD_CMD_READ";
+	case NBD_CMD_WRITE:
+		return "NBD_CMD_WRITE";
+	case NBD_CMD_DISC:
+		return "NBD_CMD_DISC";
+	case NBD_CMD_FLUSH:
+		return "NBD_CMD_FLUSH";
+	case NBD_CMD_TRIM:
+		return "NBD_CMD_TRIM";
+	default:
+		return "UNKNOWN";
+	}
+}
+
+/**
+ * Print a block of a version 2 log, whose magic has been read already.
+ *
+ * @param start the time of the first record in the log, or 0 if we have
+ * not seen any yet
+ **/
+static void dump_block(int readfd, uint64_t *start) {
+	TRLOG_BLOCK hdr;
+	TRLOG_RECORD rec;
+	char skip[256];
+	uint32_t connid, exportid, nrecords, reclen, i;
+	uint16_t hdrlen;
+	uint64_t dropped, t, handle;
+	time_t wall;
+	char when[64];
+
+	doread(readfd, sizeof(hdr.magic)+(char *)(&hdr), sizeof(hdr)-sizeof(hdr.magic));
+	if (ntohs(hdr.version) != TRLOG_VERSION) {
+		fprintf(stderr, "E: unknown transaction log version %d\n", ntohs(hdr.version));
+		exit(1);
+	}
+	/* later versions may grow the header and records; skip what we
+	 * don't know about */
+	hdrlen = ntohs(hdr.hdrlen);
+	reclen = ntohl(hdr.reclen);
+	if (hdrlen < sizeof(hdr) || reclen < sizeof(rec)
+	    || hdrlen - sizeof(hdr) > sizeof(skip) || reclen - sizeof(rec) > sizeof(skip)) {
+		fprintf(stderr, "E: corrupt transaction log block\n");
+		exit(1);
+	}
+	doread(readfd, skip, hdrlen - sizeof(hdr));
+	connid = ntohl(hdr.connid);
+	exportid = ntohl(hdr.exportid);
+	nrecords = ntohl(hdr.nrecords);
+	dropped = ntohll(hdr.dropped);
+	if (dropped)
+		printf("! %u: %llu records dropped\n", connid, (long long unsigned int) dropped);
+
+	for (i = 0; i < nrecords; i++) {
+		doread(readfd, &rec, sizeof(rec));
+		doread(readfd, skip, reclen - sizeof(rec));
+		t = ntohll(rec.time);
+		if (!*start)
+			*start = t;
+		t -= *start;
+		handle = ntohll(*((long long int *)(rec.handle)));
+		switch (rec.type) {
+		case TRLOG_CONNECT:
+			wall = ntohll(rec.offset) / 1000000;
+			strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&wall));
+			printf("+ %u: T=%llu.%09llu connected to export %08x at %s\n",
+			       connid, (long long unsigned int) t / 1000000000,
+			       (long long unsigned int) t % 1000000000, exportid, when);
+			break;
+		case TRLOG_REQUEST:
+			printf("> %u: T=%llu.%09llu H=%016llx C=0x%08x (%13s+%4s) O=%016llx L=%08x\n",
+			       connid, (long long unsigned int) t / 1000000000,
+			       (long long unsigned int) t % 1000000000,
+			       (long long unsigned int) handle,
+			       ntohl(rec.command), getcommandname(ntohl(rec.command)),
+			       (ntohl(rec.command) & NBD_CMD_FLAG_FUA)?"FUA":"NONE",
+			       (long long unsigned int) ntohll(rec.offset),
+			       ntohl(rec.len));
+			break;
+		case TRLOG_REPLY:
+			printf("< %u: T=%llu.%09llu H=%016llx E=0x%08x\n",
+			       connid, (long long unsigned int) t / 1000000000,
+			       (long long unsigned int) t % 1000000000,
+			       (long long unsigned int) handle, ntohl(rec.command));
+			break;
+		case TRLOG_PAYLOAD:
+			printf("= %u: T=%llu.%09llu H=%016llx P=%08x L=%08x %s=%016llx\n",
+			       connid, (long long unsigned int) t / 1000000000,
+			       (long long unsigned int) t % 1000000000,
+			       (long long unsigned int) handle, ntohl(rec.aux),
+			       ntohl(rec.len),
+			       ntohl(rec.command) == TRLOG_PAYLOAD_FULL ? "D" : "#",
+			       (long long unsigned int) ntohll(rec.offset));
+			break;
+		default:
+			printf("? %u: Unknown record type %d\n", connid, rec.type);
+			break;
+		}
+	}
+}
+
+static guint pending_hash(gconstpointer key) {
+	const struct pending *p = key;
+
+	return p->connid ^ (guint)p->handle ^ (guint)(p->handle >> 32);
+}
+
+static gboolean pending_equal(gconstpointer a, gconstpointer b) {
+	const struct pending *x = a, *y = b;
+
+	return x->connid == y->connid && x->handle == y->handle;
+}
+
+static int lat_bucket(uint64_t v) {
+	int e;
+
+	if(v < LAT_SUB)
+		return v;
+	e = 63 - __builtin_clzll(v);
+	return (e - 3) * LAT_SUB + ((v >> (e - 4)) & (LAT_SUB - 1));
+}
+
+/**
+ * The lowest latency that goes in a bucket
+ **/
+static uint64_t lat_value(int bucket) {
+	int e;
+
+	if(bucket < LAT_SUB)
+		return bucket;
+	e = bucket / LAT_SUB + 3;
+	return (uint64_t)(LAT_SUB + bucket % LAT_SUB) << (e - 4);
+}
+
+static int size_bucket(uint32_t len) {
+	int b = 0;
+
+	while(b < SIZE_BUCKETS - 1 && ((uint64_t)1 << b) < len)
+		b++;
+	return b;
+}
+
+/**
+ * Take a request into account.
+ *
+ * @param pass 0 for the first pass over the log, which collects all
+ * but the heatmap; 1 for the second, which collects the heatmap, now
+ * that we know how large the export is
+ **/
+static void analyse_request(int pass, uint32_t connid, uint64_t time, const char *handle,
+			    uint32_t command, uint64_t offset, uint32_t len) {
+	int cmd = command & NBD_CMD_MASK_COMMAND;
+	struct cmdstats *cs;
+	struct pending *p;
+	struct connstate *c;
+	uint64_t row, last;
+
+	if(cmd >= CMDS)
+		return;
+	if(pass) {
+		if((cmd == NBD_CMD_READ || cmd == NBD_CMD_WRITE) && len) {
+			/* spread the request over the rows it touches */
+			last = MIN((offset + len - 1) / rowsize, HEAT_ROWS - 1);
+			for(row = offset / rowsize; row <= last; row++)
+				heat[row][cmd] += MIN(offset + len, (row + 1) * rowsize)
+						  - MAX(offset, row * rowsize);
+		}
+		return;
+	}
+	cs = &cmdstats[cmd];
+	cs->requests++;
+	if(cmd == NBD_CMD_READ || cmd == NBD_CMD_WRITE || cmd == NBD_CMD_TRIM) {
+		cs->bytes += len;
+		cs->size[size_bucket(len)]++;
+		if(offset + len > maxend)
+			maxend = offset + len;
+		if(!(c = g_hash_table_lookup(conns, GUINT_TO_POINTER(connid)))) {
+			c = g_new0(struct connstate, 1);
+			g_hash_table_insert(conns, GUINT_TO_POINTER(connid), c);
+		} else if(c->next[cmd] == offset) {
+			cs->sequential++;
+		}
+		c->next[cmd] = offset + len;
+	}
+	/* the server does not reply to a disconnect */
+	if(cmd == NBD_CMD_DISC)
+		return;
+	p = g_new(struct pending, 1);
+	p->connid = connid;
+	memcpy(&p->handle, handle, sizeof(p->handle));
+	p->time = time;
+	p->cmd = cmd;
+	/* a handle that is reused before it is replied to replaces the
+	 * earlier request */
+	g_hash_table_replace(pending, p, p);
+}
+
+static void analyse_reply(int pass, uint32_t connid, uint64_t time, const char *handle, uint32_t error) {
+	struct pending key, *p;
+
+	if(pass)
+		return;
+	key.connid = connid;
+	memcpy(&key.handle, handle, sizeof(key.handle));
+	if(!(p = g_hash_table_lookup(pending, &key))) {
+		unpaired++;
+		return;
+	}
+	cmdstats[p->cmd].replies++;
+	if(error)
+		cmdstats[p->cmd].errors++;
+	if(p->time && time >= p->time)
+		cmdstats[p->cmd].latency[lat_bucket(time - p->time)]++;
+	g_hash_table_remove(pending, p);
+}
+
+/**
+ * Go over a log in memory, and analyse the requests and replies.
+ **/
+static void analyse_pass(int pass, const char *map, size_t size) {
+	const char *p = map, *end = map + size;
+	struct nbd_request req;
+	struct nbd_reply rep;
+	TRLOG_BLOCK hdr;
+	TRLOG_RECORD rec;
+	uint32_t magic, n, reclen, i;
+
+	while(p + sizeof(magic) <= end) {
+		memcpy(&magic, p, sizeof(magic));
+		switch(ntohl(magic)) {
+		case NBD_REQUEST_MAGIC:
+			if(p + sizeof(req) > end)
+				goto truncated;
+			memcpy(&req, p, sizeof(req));
+			p += sizeof(req);
+			if(!pass)
+				nrecords++;
+			analyse_request(pass, 0, 0, req.handle, ntohl(req.type),
+					ntohll(req.from), ntohl(req.len));
+			break;
+		case NBD_REPLY_MAGIC:
+			if(p + sizeof(rep) > end)
+				goto truncated;
+			memcpy(&rep, p, sizeof(rep));
+			p += sizeof(rep);
+			if(!pass)
+				nrecords++;
+			analyse_reply(pass, 0, 0, rep.handle, ntohl(rep.error));
+			break;
+		case TRLOG_MAGIC:
+			if(p + sizeof(hdr) > end)
+				goto truncated;
+			memcpy(&hdr, p, sizeof(hdr));
+			reclen = ntohl(hdr.reclen);
+			n = ntohl(hdr.nrecords);
+			if(ntohs(hdr.version) != TRLOG_VERSION
+			   || ntohs(hdr.hdrlen) < sizeof(hdr) || reclen < sizeof(rec)) {
+				fprintf(stderr, "E: corrupt transaction log block\n");
+				exit(1);
+			}
+			p += ntohs(hdr.hdrlen);
+			if((uint64_t)n * reclen > (uint64_t)(end - p))
+				goto truncated;
+			if(!pass) {
+				nrecords += n;
+				dropped += ntohll(hdr.dropped);
+			}
+			for(i = 0; i < n; i++, p += reclen) {
+				memcpy(&rec, p, sizeof(rec));
+				if(rec.type == TRLOG_REQUEST)
+					analyse_request(pass, ntohl(hdr.connid), ntohll(rec.time),
+							rec.handle, ntohl(rec.command),
+							ntohll(rec.offset), ntohl(rec.len));
+				else if(rec.type == TRLOG_REPLY)
+					analyse_reply(pass, ntohl(hdr.connid), ntohll(rec.time),
+						      rec.handle, ntohl(rec.command));
+			}
+			break;
+		default:
+			fprintf(stderr, "E: unknown transaction type %08x\n", ntohl(magic));
+			exit(1);
+		}
+	}
+	return;
+truncated:
+	fprintf(stderr, "W: transaction log is truncated\n");
+}
+
+static uint64_t lat_percentile(struct cmdstats *cs, uint64_t n, double pct) {
+	uint64_t want = (uint64_t)(pct * n / 100.0), seen = 0;
+	int b;
+
+	for(b = 0; b < LAT_BUCKETS; b++) {
+		seen += cs->latency[b];
+		if(seen > want)
+			return lat_value(b);
+	}
+	return lat_value(LAT_BUCKETS - 1);
+}
+
+static void print_report(void) {
+	struct cmdstats *cs;
+	uint64_t n, top = 0;
+	int cmd, b, r, i;
+
+	printf("%llu records, %llu dropped; %llu replies without a request, %u requests without a reply\n",
+	       (long long unsigned int) nrecords, (long long unsigned int) dropped,
+	       (long long unsigned int) unpaired, g_hash_table_size(pending));
+
+	printf("\n%-13s %10s %14s %6s %10s %10s %10s %10s %10s\n",
+	       "command", "requests", "bytes", "seq%", "p50 (us)", "p90", "p99", "p99.9", "max");
+	for(cmd = 0; cmd < CMDS; cmd++) {
+		cs = &cmdstats[cmd];
+		if(!cs->requests)
+			continue;
+		for(n = 0, b = 0; b < LAT_BUCKETS; b++)
+			n += cs->latency[b];
+		printf("%-13s %10llu %14llu %6.1f", getcommandname(cmd),
+		       (long long unsigned int) cs->requests,
+		       (long long unsigned int) cs->bytes,
+		       100.0 * cs->sequential / cs->requests);
+		if(n) {
+			for(b = LAT_BUCKETS - 1; !cs->latency[b]; b--)
+				;
+			printf(" %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+			       lat_percentile(cs, n, 50) / 1000.0, lat_percentile(cs, n, 90) / 1000.0,
+			       lat_percentile(cs, n, 99) / 1000.0, lat_percentile(cs, n, 99.9) / 1000.0,
+			       lat_value(b) / 1000.0);
+		} else {
+			printf(" %10s %10s %10s %10s %10s\n", "-", "-", "-", "-", "-");
+		}
+	}
+
+	printf("\n%12s %10s %10s %10s\n", "size", "reads", "writes", "trims");
+	for(b = 0; b < SIZE_BUCKETS; b++) {
+		if(!cmdstats[NBD_CMD_READ].size[b] && !cmdstats[NBD_CMD_WRITE].size[b]
+		   && !cmdstats[NBD_CMD_TRIM].size[b])
+			continue;
+		printf("%12llu %10llu %10llu %10llu\n", 1ULL << b,
+		       (long long unsigned int) cmdstats[NBD_CMD_READ].size[b],
+		       (long long unsigned int) cmdstats[NBD_CMD_WRITE].size[b],
+		       (long long unsigned int) cmdstats[NBD_CMD_TRIM].size[b]);
+	}
+
+	if(!maxend)
+		return;
+	for(r = 0; r < HEAT_ROWS; r++)
+		top = MAX(top, heat[r][NBD_CMD_READ] + heat[r][NBD_CMD_WRITE]);
+	printf("\n%16s %14s %14s  (r = read, w = written)\n", "offset", "read", "written");
+	for(r = 0; r < HEAT_ROWS; r++) {
+		int rw = top ? heat[r][NBD_CMD_READ] * HEAT_WIDTH / top : 0;
+		int ww = top ? heat[r][NBD_CMD_WRITE] * HEAT_WIDTH / top : 0;
+
+		printf("%016llx %14llu %14llu  ",
+		       (long long unsigned int) (r * rowsize),
+		       (long long unsigned int) heat[r][NBD_CMD_READ],
+		       (long long unsigned int) heat[r][NBD_CMD_WRITE]);
+		for(i = 0; i < rw; i++)
+			putchar('r');
+		for(i = 0; i < ww; i++)
+			putchar('w');
+		putchar('\n');
+	}
+}
+
+/**
+ * Summarize a log, which must be a file rather than a pipe, so that we
+ * can map it and go over it twice.
+ **/
+static int analyse(int fd) {
+	struct stat st;
+	char *map;
+
+	if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "E: the transaction log must be a regular file for -a\n");
+		return 1;
+	}
+	if(!st.st_size)
+		return 0;
+	if((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		perror("Could not map the transaction log");
+		return 1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	pending = g_hash_table_new_full(pending_hash, pending_equal, g_free, NULL);
+	conns = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	analyse_pass(0, map, st.st_size);
+	if(maxend) {
+		rowsize = (maxend + HEAT_ROWS - 1) / HEAT_ROWS;
+		analyse_pass(1, map, st.st_size);
+	}
+	print_report();
+	munmap(map, st.st_size);
+	return 0;
+}
+
 int main(int argc, char**argv) {
 	struct nbd_request req;
 	struct nbd_reply rep;
@@ -44,15 +502,18 @@ int main(int argc, char**argv) {
 	uint64_t offset;
 	char * ctext;
 	int readfd = 0; /* stdin */
+	uint64_t start = 0;
 
 	if(argc > 1) {
 		int retval=0;
+		if(!strcmp(argv[1], "-a") && argc == 2)
+			return analyse(readfd);
 		if(strcmp(argv[1], "--help") && strcmp(argv[1], "-h")) {
 			printf("E: unknown option %s.\n", argv[1]);
 			retval=1;
 		}
 		printf("This is nbd-trdump, part of nbd %s.\n", PACKAGE_VERSION);
-		printf("Use: %s < transactionlog\n", argv[0]);
+		printf("Use: %s [-a] < transactionlog\n", argv[0]);
 		return retval;
 	}
 
@@ -67,24 +528,7 @@ int main(int argc, char**argv) {
 			offset = ntohll(req.from);
 			len = ntohl(req.len);
 			command = ntohl(req.type);
-			
-			switch (command & NBD_CMD_MASK_COMMAND) {
-			case NBD_CMD_READ:
-				ctext="NBD_CMD_READ";
-				break;
-			case NBD_CMD_WRITE:
-				ctext="NBD_CMD_WRITE";
-				break;
-			case NBD_CMD_DISC:
-				ctext="NBD_CMD_DISC";
-				break;
-			case NBD_CMD_FLUSH:
-				ctext="NBD_CMD_FLUSH";
-				break;
-			default:
-				ctext="UNKNOWN";
-				break;
-			}
+			ctext = getcommandname(command);
 			printf("> H=%016llx C=0x%08x (%13s+%4s) O=%016llx L=%08x\n",
 			       (long long unsigned int) handle,
 			       command,
@@ -103,6 +547,10 @@ int main(int argc, char**argv) {
 			       (long long unsigned int) handle,
 			       error);
 			break;
+
+		case TRLOG_MAGIC:
+			dump_block(readfd, &start);
+			break;
 			
 		default:
 			printf("? Unknown transaction type %08x\n",magic);
@@ -0,0 +1,896 @@
+#include "config.h"
+
+#include <nbdclient.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Values from the protocol; see doc/proto.txt */
+#define INIT_PASSWD	"NBDMAGIC"
+#define OLDSTYLE_MAGIC	0x00420281861253ULL
+#define OPTS_MAGIC	0x49484156454F5054ULL
+#define REP_MAGIC	0x3e889045565a9ULL
+#define REQUEST_MAGIC	0x25609513
+#define REPLY_MAGIC	0x67446698
+
+#define OPT_EXPORT_NAME	1
+#define OPT_ABORT	2
+#define OPT_LIST	3
+
+#define REP_ACK		1
+#define REP_SERVER	2
+#define REP_FLAG_ERROR	(1U << 31)
+#define REP_ERR_UNSUP	(1 | REP_FLAG_ERROR)
+#define REP_ERR_POLICY	(2 | REP_FLAG_ERROR)
+#define REP_ERR_PLATFORM (4 | REP_FLAG_ERROR)
+
+#define FLAG_FIXED_NEWSTYLE	(1 << 0)
+#define FLAG_NO_ZEROES		(1 << 1)
+
+#define CMD_READ	0
+#define CMD_WRITE	1
+#define CMD_DISC	2
+#define CMD_FLUSH	3
+#define CMD_TRIM	4
+#define CMD_FLAG_FUA	(1 << 0)
+
+#define REQ_HEADER	28	/**< magic, type, handle, offset, length */
+#define REPLY_HEADER	16	/**< magic, error, handle */
+#define REP_HEADER	20	/**< magic, option, type, length */
+
+#define RBUF_SIZE	(64*1024)	/**< what we read at once when we
+					  don't know yet what comes */
+#define MAX_IOV		64		/**< what we send at once */
+
+/**
+ * A request, from when it is submitted until its reply arrived
+ **/
+struct request {
+	char hdr[REQ_HEADER];	/**< as it goes on the wire */
+	uint16_t command;
+	char *buf;		/**< where the data of a read goes, or where
+				  the data of a write comes from */
+	uint32_t len;		/**< the length of buf */
+	NBDC_DONE done;
+	void *opaque;
+	struct request *next;	/**< in the send queue, or the free list */
+};
+
+/**
+ * A connection
+ **/
+struct conn {
+	int sock;
+	int dead;		/**< why the connection failed, if it did */
+	int inflight;		/**< requests submitted but not done */
+
+	struct request *sendq;	/**< requests not sent completely */
+	struct request *sendtail;
+	size_t sendoff;		/**< how much of the first one was sent */
+
+	struct request **slots;	/**< requests by handle */
+	uint32_t nslots;	/**< the size of slots */
+	uint32_t *freeslots;	/**< handles that are not in use */
+	uint32_t nfree;		/**< their number */
+
+	char rbuf[RBUF_SIZE];	/**< what was read but not parsed yet */
+	size_t rstart;
+	size_t rend;
+	struct request *reading;/**< the read whose data comes in now */
+	uint32_t readslot;	/**< its handle */
+	uint32_t readdone;	/**< how much of its data is in */
+};
+
+struct nbdc {
+	struct conn *conns;
+	int nconn;
+	struct pollfd *pfds;	/**< for nbdc_poll() */
+	uint64_t size;
+	uint16_t flags;
+	int inflight;		/**< requests submitted but not done */
+	uint64_t completed;	/**< requests done so far */
+	struct request *pool;	/**< requests to reuse */
+};
+
+/**
+ * Bookkeeping of a flush that goes out on every connection
+ **/
+struct flush {
+	int left;		/**< connections that did not reply yet */
+	int error;		/**< the first error, if any */
+	NBDC_DONE done;
+	void *opaque;
+};
+
+static void put16(char *p, uint16_t v) {
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put32(char *p, uint32_t v) {
+	put16(p, v >> 16);
+	put16(p + 2, v);
+}
+
+static void put64(char *p, uint64_t v) {
+	put32(p, v >> 32);
+	put32(p + 4, v);
+}
+
+static uint16_t get16(const char *p) {
+	const unsigned char *u = (const unsigned char *)p;
+
+	return (u[0] << 8) | u[1];
+}
+
+static uint32_t get32(const char *p) {
+	return ((uint32_t)get16(p) << 16) | get16(p + 2);
+}
+
+static uint64_t get64(const char *p) {
+	return ((uint64_t)get32(p) << 32) | get32(p + 4);
+}
+
+const char* nbdc_strerror(int error) {
+	if(error > 0)
+		return strerror(error);
+	switch(error) {
+	case 0:
+		return "Success";
+	case NBDC_E_SYS:
+		return strerror(errno);
+	case NBDC_E_CLOSED:
+		return "The server closed the connection";
+	case NBDC_E_MAGIC:
+		return "Not an NBD server";
+	case NBDC_E_OLDSTYLE:
+		return "The server only supports oldstyle negotiation; it can't serve a named export";
+	case NBDC_E_NEWSTYLE:
+		return "The server wants newstyle negotiation; give the name of an export";
+	case NBDC_E_POLICY:
+		return "Not allowed by the server";
+	case NBDC_E_UNSUP:
+		return "Not supported by the server";
+	case NBDC_E_PROTO:
+		return "The server broke the protocol";
+	case NBDC_E_MISMATCH:
+		return "The connections reached different exports";
+	default:
+		return "Unknown error";
+	}
+}
+
+/* Negotiation */
+
+static int read_all(int sock, void *buf, size_t len) {
+	char *p = buf;
+	ssize_t res;
+
+	while(len > 0) {
+		if((res = read(sock, p, len)) < 0) {
+			if(errno == EINTR)
+				continue;
+			return NBDC_E_SYS;
+		}
+		if(!res)
+			return NBDC_E_CLOSED;
+		p += res;
+		len -= res;
+	}
+	return 0;
+}
+
+static int write_all(int sock, const void *buf, size_t len) {
+	const char *p = buf;
+	ssize_t res;
+
+	while(len > 0) {
+		if((res = send(sock, p, len, MSG_NOSIGNAL)) < 0) {
+			if(errno == EINTR)
+				continue;
+			return NBDC_E_SYS;
+		}
+		p += res;
+		len -= res;
+	}
+	return 0;
+}
+
+/**
+ * Read the greeting of the server.
+ *
+ * @param magic [out] OLDSTYLE_MAGIC or OPTS_MAGIC
+ **/
+static int greeting(int sock, uint64_t *magic) {
+	char buf[16];
+	int ret;
+
+	if((ret = read_all(sock, buf, sizeof(buf))))
+		return ret;
+	if(memcmp(buf, INIT_PASSWD, 8))
+		return NBDC_E_MAGIC;
+	*magic = get64(buf + 8);
+	if(*magic != OLDSTYLE_MAGIC && *magic != OPTS_MAGIC)
+		return NBDC_E_MAGIC;
+	return 0;
+}
+
+/**
+ * The rest of the greeting of a newstyle server, and our flags.
+ *
+ * @param cflags [out] the flags we sent
+ **/
+static int handshake_flags(int sock, uint16_t *hflags, uint32_t *cflags) {
+	char buf[4];
+	int ret;
+
+	if((ret = read_all(sock, buf, 2)))
+		return ret;
+	*hflags = get16(buf);
+	*cflags = *hflags & (FLAG_FIXED_NEWSTYLE | FLAG_NO_ZEROES);
+	put32(buf, *cflags);
+	return write_all(sock, buf, 4);
+}
+
+static int send_option(int sock, uint32_t opt, const char *data, uint32_t len) {
+	char hdr[16];
+	int ret;
+
+	put64(hdr, OPTS_MAGIC);
+	put32(hdr + 8, opt);
+	put32(hdr + 12, len);
+	if((ret = write_all(sock, hdr, sizeof(hdr))))
+		return ret;
+	return write_all(sock, data, len);
+}
+
+int nbdc_negotiate(int sock, const char *name, uint64_t *size, uint16_t *flags) {
+	char buf[8 + 4 + 124];
+	uint64_t magic;
+	uint16_t hflags;
+	uint32_t cflags;
+	int ret;
+
+	if((ret = greeting(sock, &magic)))
+		return ret;
+	if(!name) {
+		if(magic != OLDSTYLE_MAGIC)
+			return NBDC_E_NEWSTYLE;
+		if((ret = read_all(sock, buf, sizeof(buf))))
+			return ret;
+		*size = get64(buf);
+		*flags = get32(buf + 8);
+		return 0;
+	}
+	if(magic != OPTS_MAGIC)
+		return NBDC_E_OLDSTYLE;
+	if((ret = handshake_flags(sock, &hflags, &cflags))
+	   || (ret = send_option(sock, OPT_EXPORT_NAME, name, strlen(name))))
+		return ret;
+	/* a server that doesn't have the export closes the connection */
+	if((ret = read_all(sock, buf, (cflags & FLAG_NO_ZEROES) ? 10 : 10 + 124)))
+		return ret;
+	*size = get64(buf);
+	*flags = get16(buf + 8);
+	return 0;
+}
+
+int nbdc_list(int sock, void (*found)(const char *name, void *opaque), void *opaque) {
+	char hdr[REP_HEADER];
+	uint64_t magic;
+	uint16_t hflags;
+	uint32_t cflags;
+	uint32_t type;
+	uint32_t len;
+	uint32_t namelen;
+	char *data;
+	int ret;
+
+	if((ret = greeting(sock, &magic)))
+		return ret;
+	if(magic != OPTS_MAGIC)
+		return NBDC_E_OLDSTYLE;
+	if((ret = handshake_flags(sock, &hflags, &cflags)))
+		return ret;
+	if(!(hflags & FLAG_FIXED_NEWSTYLE))
+		/* the server may not reply to an option it doesn't know */
+		return NBDC_E_UNSUP;
+	if((ret = send_option(sock, OPT_LIST, NULL, 0)))
+		return ret;
+	do {
+		if((ret = read_all(sock, hdr, sizeof(hdr))))
+			return ret;
+		if(get64(hdr) != REP_MAGIC || get32(hdr + 8) != OPT_LIST)
+			return NBDC_E_PROTO;
+		type = get32(hdr + 12);
+		len = get32(hdr + 16);
+		if(len > 65536)
+			return NBDC_E_PROTO;
+		if(!(data = malloc(len + 1)))
+			return NBDC_E_SYS;
+		if((ret = read_all(sock, data, len))) {
+			free(data);
+			return ret;
+		}
+		if(type == REP_SERVER) {
+			namelen = len >= 4 ? get32(data) : (uint32_t)-1;
+			if(namelen > len - 4) {
+				free(data);
+				return NBDC_E_PROTO;
+			}
+			memmove(data, data + 4, namelen);
+			data[namelen] = '\0';
+			found(data, opaque);
+		}
+		free(data);
+		switch(type) {
+		case REP_ACK:
+		case REP_SERVER:
+			break;
+		case REP_ERR_POLICY:
+			return NBDC_E_POLICY;
+		case REP_ERR_UNSUP:
+		case REP_ERR_PLATFORM:
+			return NBDC_E_UNSUP;
+		default:
+			return NBDC_E_PROTO;
+		}
+	} while(type != REP_ACK);
+	return send_option(sock, OPT_ABORT, NULL, 0);
+}
+
+/* Requests */
+
+/**
+ * Finish a request: free its handle, and call its callback.
+ **/
+static void complete(NBDC *nbdc, struct conn *c, uint32_t slot, int error) {
+	struct request *r = c->slots[slot];
+	NBDC_DONE done = r->done;
+	void *opaque = r->opaque;
+
+	c->slots[slot] = NULL;
+	c->freeslots[c->nfree++] = slot;
+	c->inflight--;
+	nbdc->inflight--;
+	nbdc->completed++;
+	/* the callback may submit a request, and reuse this one */
+	r->next = nbdc->pool;
+	nbdc->pool = r;
+	if(done)
+		done(opaque, error);
+}
+
+/**
+ * Give up on a connection: every request on it is done with the error.
+ **/
+static int conn_fail(NBDC *nbdc, struct conn *c, int error) {
+	uint32_t i;
+
+	if(c->dead)
+		return c->dead;
+	if(error == NBDC_E_SYS)
+		/* errno won't last until the caller sees it */
+		error = errno;
+	c->dead = error;
+	c->sendq = c->sendtail = NULL;
+	c->reading = NULL;
+	c->rstart = c->rend = 0;
+	for(i = 0; i < c->nslots; i++)
+		if(c->slots[i])
+			complete(nbdc, c, i, error);
+	return error;
+}
+
+/**
+ * Queue a request on a connection.
+ **/
+static int submit_on(NBDC *nbdc, struct conn *c, uint16_t command, uint16_t flags, uint64_t offset, uint32_t len, char *buf, NBDC_DONE done, void *opaque) {
+	struct request *r;
+	uint32_t slot;
+
+	if(c->dead)
+		return NBDC_E_CLOSED;
+	if(!c->nfree) {
+		uint32_t size = c->nslots ? c->nslots * 2 : 64;
+		struct request **slots = realloc(c->slots, size * sizeof(*slots));
+		uint32_t *freeslots;
+
+		if(!slots)
+			return NBDC_E_SYS;
+		c->slots = slots;
+		if(!(freeslots = realloc(c->freeslots, size * sizeof(*freeslots))))
+			return NBDC_E_SYS;
+		c->freeslots = freeslots;
+		for(slot = size; slot > c->nslots; slot--) {
+			c->slots[slot - 1] = NULL;
+			c->freeslots[c->nfree++] = slot - 1;
+		}
+		c->nslots = size;
+	}
+	if((r = nbdc->pool)) {
+		nbdc->pool = r->next;
+	} else if(!(r = malloc(sizeof(*r)))) {
+		return NBDC_E_SYS;
+	}
+	slot = c->freeslots[--c->nfree];
+	c->slots[slot] = r;
+	put32(r->hdr, REQUEST_MAGIC);
+	put32(r->hdr + 4, command | ((uint32_t)flags << 16));
+	/* the handle is ours; the server sends it back as is */
+	put64(r->hdr + 8, slot);
+	put64(r->hdr + 16, offset);
+	put32(r->hdr + 24, len);
+	r->command = command;
+	r->buf = buf;
+	r->len = len;
+	r->done = done;
+	r->opaque = opaque;
+	r->next = NULL;
+	if(c->sendtail)
+		c->sendtail->next = r;
+	else
+		c->sendq = r;
+	c->sendtail = r;
+	c->inflight++;
+	nbdc->inflight++;
+	return 0;
+}
+
+/**
+ * Queue a request on the connection with the fewest in flight.
+ **/
+static int submit(NBDC *nbdc, uint16_t command, uint16_t flags, uint64_t offset, uint32_t len, char *buf, NBDC_DONE done, void *opaque) {
+	struct conn *best = NULL;
+	int i;
+
+	for(i = 0; i < nbdc->nconn; i++) {
+		struct conn *c = &nbdc->conns[i];
+
+		if(!c->dead && (!best || c->inflight < best->inflight))
+			best = c;
+	}
+	if(!best)
+		return NBDC_E_CLOSED;
+	return submit_on(nbdc, best, command, flags, offset, len, buf, done, opaque);
+}
+
+int nbdc_aio_read(NBDC *nbdc, void *buf, uint64_t offset, uint32_t len, NBDC_DONE done, void *opaque) {
+	return submit(nbdc, CMD_READ, 0, offset, len, buf, done, opaque);
+}
+
+int nbdc_aio_write(NBDC *nbdc, const void *buf, uint64_t offset, uint32_t len, int fua, NBDC_DONE done, void *opaque) {
+	return submit(nbdc, CMD_WRITE, fua ? CMD_FLAG_FUA : 0, offset, len, (char *)buf, done, opaque);
+}
+
+int nbdc_aio_trim(NBDC *nbdc, uint64_t offset, uint32_t len, NBDC_DONE done, void *opaque) {
+	return submit(nbdc, CMD_TRIM, 0, offset, len, NULL, done, opaque);
+}
+
+static void flush_done(void *opaque, int error) {
+	struct flush *f = opaque;
+
+	if(!f->error)
+		f->error = error;
+	if(--f->left)
+		return;
+	f->done(f->opaque, f->error);
+	free(f);
+}
+
+int nbdc_aio_flush(NBDC *nbdc, NBDC_DONE done, void *opaque) {
+	struct flush *f = calloc(1, sizeof(*f));
+	int ret = NBDC_E_CLOSED;
+	int i;
+
+	if(!f)
+		return NBDC_E_SYS;
+	f->done = done;
+	f->opaque = opaque;
+	/* count the connections first, so that a reply can't finish the
+	 * flush before it went out on all of them */
+	for(i = 0; i < nbdc->nconn; i++)
+		if(!nbdc->conns[i].dead)
+			f->left++;
+	if(!f->left) {
+		free(f);
+		return ret;
+	}
+	for(i = 0; i < nbdc->nconn; i++) {
+		struct conn *c = &nbdc->conns[i];
+
+		if(c->dead)
+			continue;
+		if((ret = submit_on(nbdc, c, CMD_FLUSH, 0, 0, 0, NULL, flush_done, f))) {
+			/* nothing has been sent yet, so nothing can have
+			 * finished */
+			if(!--f->left) {
+				free(f);
+				return ret;
+			}
+			if(!f->error)
+				f->error = ret;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Send what is queued on a connection, as far as the socket takes it.
+ **/
+static int conn_send(NBDC *nbdc, struct conn *c) {
+	struct iovec iov[MAX_IOV];
+	struct msghdr msg;
+	struct request *r;
+	size_t off;
+	size_t total;
+	ssize_t res;
+	int n;
+
+	while(c->sendq) {
+		n = 0;
+		off = c->sendoff;
+		for(r = c->sendq; r && n < MAX_IOV - 1; r = r->next) {
+			if(off < REQ_HEADER) {
+				iov[n].iov_base = r->hdr + off;
+				iov[n++].iov_len = REQ_HEADER - off;
+				off = REQ_HEADER;
+			}
+			if(r->command == CMD_WRITE && r->len) {
+				iov[n].iov_base = r->buf + (off - REQ_HEADER);
+				iov[n++].iov_len = r->len - (off - REQ_HEADER);
+			}
+			off = 0;
+		}
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+		if((res = sendmsg(c->sock, &msg, MSG_NOSIGNAL)) < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return conn_fail(nbdc, c, NBDC_E_SYS);
+		}
+		/* the requests that went out completely leave the queue;
+		 * they stay in slots until their reply is there */
+		while(c->sendq) {
+			r = c->sendq;
+			total = REQ_HEADER + (r->command == CMD_WRITE ? r->len : 0);
+			if(c->sendoff + res < total) {
+				c->sendoff += res;
+				break;
+			}
+			res -= total - c->sendoff;
+			c->sendoff = 0;
+			if(!(c->sendq = r->next))
+				c->sendtail = NULL;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Handle the replies that were read.
+ **/
+static int conn_parse(NBDC *nbdc, struct conn *c) {
+	const char *p;
+	size_t avail;
+	size_t n;
+	uint32_t error;
+	uint64_t handle;
+	struct request *r;
+
+	for(;;) {
+		avail = c->rend - c->rstart;
+		p = c->rbuf + c->rstart;
+		if((r = c->reading)) {
+			n = r->len - c->readdone;
+			if(n > avail)
+				n = avail;
+			memcpy(r->buf + c->readdone, p, n);
+			c->rstart += n;
+			c->readdone += n;
+			if(c->readdone < r->len)
+				return 0;
+			c->reading = NULL;
+			complete(nbdc, c, c->readslot, 0);
+			continue;
+		}
+		if(avail < REPLY_HEADER)
+			return 0;
+		if(get32(p) != REPLY_MAGIC)
+			return conn_fail(nbdc, c, NBDC_E_PROTO);
+		error = get32(p + 4);
+		handle = get64(p + 8);
+		if(handle >= c->nslots || !(r = c->slots[handle]))
+			return conn_fail(nbdc, c, NBDC_E_PROTO);
+		c->rstart += REPLY_HEADER;
+		if(r->command == CMD_READ && !error && r->len) {
+			c->reading = r;
+			c->readslot = handle;
+			c->readdone = 0;
+			continue;
+		}
+		complete(nbdc, c, handle, error);
+	}
+}
+
+/**
+ * Read what the socket has, and handle it.
+ **/
+static int conn_recv(NBDC *nbdc, struct conn *c) {
+	struct request *r = c->reading;
+	ssize_t res;
+
+	if(r && c->rstart == c->rend) {
+		/* the data of a read goes straight to where it belongs */
+		res = read(c->sock, r->buf + c->readdone, r->len - c->readdone);
+		if(res > 0) {
+			c->readdone += res;
+			if(c->readdone == r->len) {
+				c->reading = NULL;
+				complete(nbdc, c, c->readslot, 0);
+			}
+			return 0;
+		}
+	} else {
+		if(c->rstart == c->rend) {
+			c->rstart = c->rend = 0;
+		} else if(c->rend > RBUF_SIZE - REPLY_HEADER) {
+			memmove(c->rbuf, c->rbuf + c->rstart, c->rend - c->rstart);
+			c->rend -= c->rstart;
+			c->rstart = 0;
+		}
+		res = read(c->sock, c->rbuf + c->rend, RBUF_SIZE - c->rend);
+		if(res > 0) {
+			c->rend += res;
+			return conn_parse(nbdc, c);
+		}
+	}
+	if(!res)
+		return conn_fail(nbdc, c, NBDC_E_CLOSED);
+	if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+		return 0;
+	return conn_fail(nbdc, c, NBDC_E_SYS);
+}
+
+int nbdc_fds(NBDC *nbdc, struct pollfd *fds, int nfds) {
+	int i;
+
+	for(i = 0; i < nbdc->nconn && i < nfds; i++) {
+		struct conn *c = &nbdc->conns[i];
+
+		fds[i].fd = c->dead ? -1 : c->sock;
+		fds[i].events = POLLIN | (c->sendq ? POLLOUT : 0);
+		fds[i].revents = 0;
+	}
+	return i;
+}
+
+int nbdc_process(NBDC *nbdc, const struct pollfd *fds, int nfds) {
+	int ret = 0;
+	int err;
+	int i;
+
+	for(i = 0; i < nbdc->nconn && i < nfds; i++) {
+		struct conn *c = &nbdc->conns[i];
+
+		if(c->dead || fds[i].fd != c->sock)
+			continue;
+		err = 0;
+		if(fds[i].revents & POLLOUT)
+			err = conn_send(nbdc, c);
+		if(!err && (fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+			err = conn_recv(nbdc, c);
+		if(err && !ret)
+			ret = err;
+	}
+	return ret;
+}
+
+int nbdc_poll(NBDC *nbdc, int timeout) {
+	uint64_t before = nbdc->completed;
+	int ret = 0;
+	int n;
+	int i;
+
+	do {
+		/* most of the time the socket takes it right away, so
+		 * don't wait for poll() to say so */
+		for(i = 0; i < nbdc->nconn && !ret; i++)
+			if(!nbdc->conns[i].dead && nbdc->conns[i].sendq)
+				ret = conn_send(nbdc, &nbdc->conns[i]);
+		if(ret || !nbdc->inflight)
+			break;
+		n = nbdc_fds(nbdc, nbdc->pfds, nbdc->nconn);
+		if(poll(nbdc->pfds, n, timeout) < 0) {
+			if(errno == EINTR)
+				continue;
+			return NBDC_E_SYS;
+		}
+		ret = nbdc_process(nbdc, nbdc->pfds, n);
+	} while(!ret && timeout < 0 && nbdc->completed == before);
+	return ret;
+}
+
+/* Connections */
+
+static void nbdc_free(NBDC *nbdc) {
+	struct request *r;
+	int i;
+
+	for(i = 0; i < nbdc->nconn; i++) {
+		if(nbdc->conns[i].sock >= 0)
+			close(nbdc->conns[i].sock);
+		free(nbdc->conns[i].slots);
+		free(nbdc->conns[i].freeslots);
+	}
+	while((r = nbdc->pool)) {
+		nbdc->pool = r->next;
+		free(r);
+	}
+	free(nbdc->conns);
+	free(nbdc->pfds);
+	free(nbdc);
+}
+
+NBDC* nbdc_open_socks(const int *socks, int nsocks, const char *name, int *error) {
+	NBDC *nbdc = calloc(1, sizeof(NBDC));
+	uint64_t size;
+	uint16_t flags;
+	int ret = NBDC_E_SYS;
+	int fl;
+	int i;
+
+	if(nbdc && nsocks > 0) {
+		nbdc->conns = calloc(nsocks, sizeof(struct conn));
+		nbdc->pfds = calloc(nsocks, sizeof(struct pollfd));
+	} else if(nsocks <= 0) {
+		errno = EINVAL;
+	}
+	if(!nbdc || !nbdc->conns || !nbdc->pfds) {
+		for(i = 0; i < nsocks; i++)
+			close(socks[i]);
+		if(nbdc) {
+			free(nbdc->conns);
+			free(nbdc->pfds);
+			free(nbdc);
+		}
+		goto fail;
+	}
+	nbdc->nconn = nsocks;
+	for(i = 0; i < nsocks; i++)
+		nbdc->conns[i].sock = socks[i];
+	for(i = 0; i < nsocks; i++) {
+		if((ret = nbdc_negotiate(socks[i], name, &size, &flags)))
+			goto fail_free;
+		if(!i) {
+			nbdc->size = size;
+			nbdc->flags = flags;
+		} else if(size != nbdc->size || flags != nbdc->flags) {
+			ret = NBDC_E_MISMATCH;
+			goto fail_free;
+		}
+		if((fl = fcntl(socks[i], F_GETFL)) < 0
+		   || fcntl(socks[i], F_SETFL, fl | O_NONBLOCK) < 0) {
+			ret = NBDC_E_SYS;
+			goto fail_free;
+		}
+	}
+	return nbdc;
+fail_free:
+	fl = errno;
+	nbdc_free(nbdc);
+	errno = fl;
+fail:
+	if(error)
+		*error = ret;
+	return NULL;
+}
+
+NBDC* nbdc_open(const char *host, const char *port, const char *name, int nconn, int *error) {
+	struct addrinfo hints;
+	struct addrinfo *ai = NULL;
+	struct addrinfo *rp;
+	int *socks;
+	int one = 1;
+	int saved;
+	int i;
+
+	if(nconn <= 0 || !(socks = calloc(nconn, sizeof(int)))) {
+		if(nconn <= 0)
+			errno = EINVAL;
+		if(error)
+			*error = NBDC_E_SYS;
+		return NULL;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+	hints.ai_protocol = IPPROTO_TCP;
+	if(getaddrinfo(host, port, &hints, &ai)) {
+		errno = EHOSTUNREACH;
+		i = 0;
+		goto fail;
+	}
+	for(i = 0; i < nconn; i++) {
+		for(rp = ai; rp; rp = rp->ai_next) {
+			if((socks[i] = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) < 0)
+				continue;
+			if(!connect(socks[i], rp->ai_addr, rp->ai_addrlen))
+				break;
+			saved = errno;
+			close(socks[i]);
+			errno = saved;
+		}
+		if(!rp)
+			goto fail;
+		setsockopt(socks[i], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	freeaddrinfo(ai);
+	{
+		NBDC *nbdc = nbdc_open_socks(socks, nconn, name, error);
+
+		free(socks);
+		return nbdc;
+	}
+fail:
+	saved = errno;
+	while(i-- > 0)
+		close(socks[i]);
+	free(socks);
+	if(ai)
+		freeaddrinfo(ai);
+	errno = saved;
+	if(error)
+		*error = NBDC_E_SYS;
+	return NULL;
+}
+
+void nbdc_close(NBDC *nbdc) {
+	char hdr[REQ_HEADER];
+	int i;
+
+	if(!nbdc)
+		return;
+	while(nbdc->inflight)
+		/* a connection that fails finishes its requests */
+		nbdc_poll(nbdc, -1);
+	memset(hdr, 0, sizeof(hdr));
+	put32(hdr, REQUEST_MAGIC);
+	put32(hdr + 4, CMD_DISC);
+	for(i = 0; i < nbdc->nconn; i++)
+		if(!nbdc->conns[i].dead)
+			/* the socket has room for this; nothing else is
+			 * queued */
+			send(nbdc->conns[i].sock, hdr, sizeof(hdr), MSG_NOSIGNAL);
+	nbdc_free(nbdc);
+}
+
+uint64_t nbdc_size(NBDC *nbdc) {
+	return nbdc->size;
+}
+
+uint16_t nbdc_flags(NBDC *nbdc) {
+	return nbdc->flags;
+}
+
+int nbdc_connections(NBDC *nbdc) {
+	return nbdc->nconn;
+}
+
+int nbdc_in_flight(NBDC *nbdc) {
+	return nbdc->inflight;
+}
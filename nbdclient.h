@@ -0,0 +1,188 @@
+#ifndef NBDCLIENT_H
+#define NBDCLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <poll.h>
+
+/**
+ * libnbdclient: the client side of the NBD protocol, in userspace.
+ *
+ * There are two parts to it. The negotiation functions work on a
+ * socket the caller connected, and block until they are done; they are
+ * what nbd-client needs before it hands the socket to the kernel.
+ *
+ * The rest keeps any number of requests in flight on one or more
+ * connections to the same export, without blocking. A request is
+ * submitted with one of the nbdc_aio_*() functions, which only queue it;
+ * nbdc_poll() sends what was queued and waits for replies, and when the
+ * reply to a request arrives, the callback that was given with it is
+ * called. Replies are matched to requests by their handle, so the
+ * server may answer in any order. Requests are spread over the
+ * connections, to whichever has the fewest in flight.
+ *
+ * A program with an event loop of its own uses nbdc_fds() and
+ * nbdc_process() instead of nbdc_poll(). The sockets don't change
+ * while an NBDC is open, so they can as well be added to an epoll set
+ * once.
+ *
+ * An NBDC is not thread-safe. Callbacks are only called from
+ * nbdc_poll(), nbdc_process() and nbdc_close(), and may submit new
+ * requests.
+ *
+ * Functions that return int return 0 on success, or one of the errors
+ * below.
+ **/
+
+/** Errors */
+#define NBDC_E_SYS	-1	/**< a system call failed; errno says why */
+#define NBDC_E_CLOSED	-2	/**< the server closed the connection */
+#define NBDC_E_MAGIC	-3	/**< the other end is not an NBD server */
+#define NBDC_E_OLDSTYLE	-4	/**< an export name was given, but the server
+				  only does oldstyle negotiation */
+#define NBDC_E_NEWSTYLE	-5	/**< no export name was given, but the server
+				  wants one */
+#define NBDC_E_POLICY	-6	/**< the server does not allow that */
+#define NBDC_E_UNSUP	-7	/**< the server does not support that */
+#define NBDC_E_PROTO	-8	/**< the server broke the protocol */
+#define NBDC_E_MISMATCH	-9	/**< the connections of an NBDC do not all
+				  reach the same export */
+
+/** Flags of an export */
+#define NBDC_FLAG_READ_ONLY	(1 << 1)
+#define NBDC_FLAG_SEND_FLUSH	(1 << 2)
+#define NBDC_FLAG_SEND_FUA	(1 << 3)
+#define NBDC_FLAG_ROTATIONAL	(1 << 4)
+#define NBDC_FLAG_SEND_TRIM	(1 << 5)
+
+/**
+ * Describe an error.
+ *
+ * @param error an NBDC_E_* value, or an errno value that the server
+ * returned for a request
+ **/
+const char* nbdc_strerror(int error);
+
+/**
+ * Negotiate an export on a connected socket. Requests can be sent once
+ * this returns successfully.
+ *
+ * @param sock the socket
+ * @param name the name of the export, or NULL for an oldstyle server
+ * @param size [out] the size of the export
+ * @param flags [out] NBDC_FLAG_* of the export
+ **/
+int nbdc_negotiate(int sock, const char* name, uint64_t* size, uint16_t* flags);
+
+/**
+ * Ask a newstyle server for the names of its exports, and end the
+ * connection.
+ *
+ * @param found called for every export
+ **/
+int nbdc_list(int sock, void (*found)(const char* name, void* opaque), void* opaque);
+
+typedef struct nbdc NBDC;
+
+/**
+ * Called when a request is done.
+ *
+ * @param opaque as given with the request
+ * @param error 0, the errno value the server returned, or an NBDC_E_*
+ * value if the connection failed before the reply arrived
+ **/
+typedef void (*NBDC_DONE)(void* opaque, int error);
+
+/**
+ * Connect to an export.
+ *
+ * @param host the name or address of the server
+ * @param port its port
+ * @param name the name of the export, or NULL for an oldstyle server
+ * @param nconn how many connections to open
+ * @param error [out] why it failed, if it did
+ * @return the NBDC, or NULL on failure
+ **/
+NBDC* nbdc_open(const char* host, const char* port, const char* name, int nconn, int* error);
+
+/**
+ * Negotiate an export on sockets the caller connected. The NBDC takes
+ * them over, also if this fails.
+ *
+ * @param socks the sockets
+ * @param nsocks their number
+ **/
+NBDC* nbdc_open_socks(const int* socks, int nsocks, const char* name, int* error);
+
+/**
+ * Wait for the requests in flight, disconnect, and free the NBDC.
+ **/
+void nbdc_close(NBDC* nbdc);
+
+/** The size of the export */
+uint64_t nbdc_size(NBDC* nbdc);
+
+/** NBDC_FLAG_* of the export */
+uint16_t nbdc_flags(NBDC* nbdc);
+
+/** The number of connections */
+int nbdc_connections(NBDC* nbdc);
+
+/** The number of requests submitted that are not done yet */
+int nbdc_in_flight(NBDC* nbdc);
+
+/**
+ * Read len bytes at offset into buf, which must stay valid until the
+ * request is done.
+ **/
+int nbdc_aio_read(NBDC* nbdc, void* buf, uint64_t offset, uint32_t len, NBDC_DONE done, void* opaque);
+
+/**
+ * Write len bytes from buf at offset. buf must not change until the
+ * request is done.
+ *
+ * @param fua whether the data must be on stable storage before the
+ * request is done; only if the export has NBDC_FLAG_SEND_FUA
+ **/
+int nbdc_aio_write(NBDC* nbdc, const void* buf, uint64_t offset, uint32_t len, int fua, NBDC_DONE done, void* opaque);
+
+/**
+ * Make the writes that are done stable. This is sent on every
+ * connection, and is done when it is done on all of them.
+ **/
+int nbdc_aio_flush(NBDC* nbdc, NBDC_DONE done, void* opaque);
+
+/**
+ * Discard a range; only if the export has NBDC_FLAG_SEND_TRIM.
+ **/
+int nbdc_aio_trim(NBDC* nbdc, uint64_t offset, uint32_t len, NBDC_DONE done, void* opaque);
+
+/**
+ * Send what was submitted, and wait for replies, calling the callbacks
+ * of the requests that are done.
+ *
+ * @param timeout as for poll(): in milliseconds, -1 to wait until at
+ * least one request is done or a connection fails, or 0 not to wait
+ * @return 0, or the error if a connection failed; its requests are done
+ * with that error
+ **/
+int nbdc_poll(NBDC* nbdc, int timeout);
+
+/**
+ * Get what to poll for, for an event loop of the caller's.
+ *
+ * @param fds [out] one entry for every connection
+ * @param nfds the number of entries in fds
+ * @return the number of entries filled in
+ **/
+int nbdc_fds(NBDC* nbdc, struct pollfd* fds, int nfds);
+
+/**
+ * Handle what poll() returned for the entries nbdc_fds() filled in.
+ *
+ * @return as nbdc_poll()
+ **/
+int nbdc_process(NBDC* nbdc, const struct pollfd* fds, int nfds);
+
+#endif //NBDCLIENT_H
@@ -0,0 +1,617 @@
+#include "config.h"
+
+#include <nbdserver.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Values from the protocol; see doc/proto.txt */
+#define INIT_PASSWD	"NBDMAGIC"
+#define OLDSTYLE_MAGIC	0x00420281861253ULL
+#define OPTS_MAGIC	0x49484156454F5054ULL
+#define REP_MAGIC	0x3e889045565a9ULL
+#define REQUEST_MAGIC	0x25609513
+#define REPLY_MAGIC	0x67446698
+
+#define OPT_EXPORT_NAME	1
+#define OPT_ABORT	2
+#define OPT_LIST	3
+
+#define REP_ACK		1
+#define REP_SERVER	2
+#define REP_ERR_UNSUP	(1 | (1U << 31))
+#define REP_ERR_INVALID	(3 | (1U << 31))
+
+#define FLAG_HAS_FLAGS		(1 << 0)
+#define FLAG_FIXED_NEWSTYLE	(1 << 0)
+#define FLAG_NO_ZEROES		(1 << 1)
+
+#define OPT_HEADER	16	/**< magic, option, length */
+#define REQ_HEADER	28	/**< magic, type, handle, offset, length */
+#define REPLY_HEADER	16	/**< magic, error, handle */
+
+#define RBUF_SIZE	(16*1024)	/**< what we read at once when we
+					  don't know yet what comes */
+#define MAX_OPTLEN	4096		/**< longest option we take; export
+					  names are shorter than that */
+#define INLINE_SIZE	24		/**< what we keep in a segment of
+					  output itself */
+
+/** Where the input is at */
+typedef enum {
+	ST_CFLAGS,	/**< the client's flags */
+	ST_OPT,		/**< the header of an option */
+	ST_OPTDATA,	/**< the data of an option */
+	ST_ANSWER,	/**< waiting for the caller to answer an option */
+	ST_REQ,		/**< the header of a request */
+	ST_DATA,	/**< the data of a write */
+	ST_DONE,	/**< nothing more comes */
+} STATE;
+
+/**
+ * A piece of output. Small ones are copied into the segment, other
+ * ones that the library makes are allocated, and data of the caller is
+ * referred to.
+ **/
+struct segment {
+	const char *ptr;	/**< the data, unless it is inline */
+	size_t len;		/**< its length */
+	char *heap;		/**< allocated copy, freed when sent */
+	void *cookie;		/**< for NBDS_EV_SENT, if not NULL */
+	int inl;		/**< whether the data is in buf */
+	char buf[INLINE_SIZE];
+};
+
+struct nbds_conn {
+	STATE state;
+	const char *error;	/**< what went wrong, if anything */
+	int error_pending;	/**< whether NBDS_EV_ERROR is still to come */
+	uint32_t cflags;	/**< the client's flags */
+
+	char rbuf[RBUF_SIZE];	/**< what was read but not parsed yet */
+	size_t rstart;		/**< where the unparsed part starts */
+	size_t rend;		/**< where it ends */
+	int rdirect;		/**< whether nbds_want_read() handed out the
+				  caller's data buffer */
+
+	uint32_t opt;		/**< the option being read */
+	uint32_t optlen;	/**< the length of its data */
+	char *optbuf;		/**< its data, 0-terminated */
+
+	uint64_t dataoff;	/**< where the next data of a write goes */
+	uint64_t remaining;	/**< how much data of the write is to come */
+	char *databuf;		/**< the caller's buffer for it */
+	size_t datalen;		/**< the size of that buffer */
+	size_t datafill;	/**< how much of it is filled */
+	int discard;		/**< whether to skip the data */
+
+	struct segment *out;	/**< queue of output */
+	size_t outhead;		/**< first segment not sent completely */
+	size_t outtail;		/**< where the next segment goes */
+	size_t outsize;		/**< the number of segments out has room for */
+	size_t outdone;		/**< how much of the first one was sent */
+
+	void **sent;		/**< cookies of sent buffers to report */
+	size_t nsent;		/**< their number */
+	size_t sentsize;	/**< the room in sent */
+};
+
+static void put16(char *p, uint16_t v) {
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put32(char *p, uint32_t v) {
+	put16(p, v >> 16);
+	put16(p + 2, v);
+}
+
+static void put64(char *p, uint64_t v) {
+	put32(p, v >> 32);
+	put32(p + 4, v);
+}
+
+static uint32_t get32(const char *p) {
+	const unsigned char *u = (const unsigned char *)p;
+
+	return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | u[3];
+}
+
+static uint64_t get64(const char *p) {
+	return ((uint64_t)get32(p) << 32) | get32(p + 4);
+}
+
+/**
+ * Add a segment to the output queue.
+ *
+ * @param copy whether to copy the data, or refer to it
+ * @return 0 on success, -1 if out of memory
+ **/
+static int queue(NBDS_CONN *conn, const void *data, size_t len, int copy, void *cookie) {
+	struct segment *seg;
+
+	if(!len && !cookie)
+		return 0;
+	if(conn->outtail == conn->outsize) {
+		if(conn->outhead) {
+			/* make room at the end by moving what is left
+			 * to the front */
+			memmove(conn->out, conn->out + conn->outhead,
+				(conn->outtail - conn->outhead) * sizeof(*conn->out));
+			conn->outtail -= conn->outhead;
+			conn->outhead = 0;
+		} else {
+			size_t size = conn->outsize ? conn->outsize * 2 : 16;
+			struct segment *out = realloc(conn->out, size * sizeof(*out));
+
+			if(!out)
+				return -1;
+			conn->out = out;
+			conn->outsize = size;
+		}
+	}
+	seg = &conn->out[conn->outtail];
+	memset(seg, 0, sizeof(*seg) - INLINE_SIZE);
+	seg->len = len;
+	seg->cookie = cookie;
+	if(!copy) {
+		seg->ptr = data;
+	} else if(len <= INLINE_SIZE) {
+		memcpy(seg->buf, data, len);
+		seg->inl = 1;
+	} else {
+		if(!(seg->heap = malloc(len)))
+			return -1;
+		memcpy(seg->heap, data, len);
+		seg->ptr = seg->heap;
+	}
+	conn->outtail++;
+	return 0;
+}
+
+/**
+ * Queue a reply to an option.
+ **/
+static int option_reply(NBDS_CONN *conn, uint32_t reply, const char *data, size_t len) {
+	char hdr[20];
+
+	put64(hdr, REP_MAGIC);
+	put32(hdr + 8, conn->opt);
+	put32(hdr + 12, reply);
+	put32(hdr + 16, len);
+	if(queue(conn, hdr, sizeof(hdr), 1, NULL) < 0)
+		return -1;
+	return queue(conn, data, len, 1, NULL);
+}
+
+static void fail(NBDS_CONN *conn, const char *why) {
+	conn->state = ST_DONE;
+	conn->error = why;
+	conn->error_pending = 1;
+}
+
+/**
+ * Queue the size and flags of the export; the last part of the
+ * negotiation.
+ **/
+static int send_export(NBDS_CONN *conn, uint64_t size, uint16_t flags, int oldstyle) {
+	char info[8 + 4 + 124];
+	size_t len;
+
+	memset(info, 0, sizeof(info));
+	put64(info, size);
+	flags |= FLAG_HAS_FLAGS;
+	if(oldstyle) {
+		put32(info + 8, flags);
+		len = 8 + 4 + 124;
+	} else {
+		put16(info + 8, flags);
+		len = 8 + 2;
+		if(!(conn->cflags & FLAG_NO_ZEROES))
+			len += 124;
+	}
+	return queue(conn, info, len, 1, NULL);
+}
+
+NBDS_CONN* nbds_new(NBDS_STYLE style, uint64_t size, uint16_t flags) {
+	NBDS_CONN *conn = calloc(1, sizeof(NBDS_CONN));
+	char hello[8 + 8 + 2];
+
+	if(!conn)
+		return NULL;
+	memcpy(hello, INIT_PASSWD, 8);
+	if(style == NBDS_OLDSTYLE) {
+		put64(hello + 8, OLDSTYLE_MAGIC);
+		if(queue(conn, hello, 16, 1, NULL) < 0
+		   || send_export(conn, size, flags, 1) < 0)
+			goto fail;
+		conn->state = ST_REQ;
+	} else {
+		put64(hello + 8, OPTS_MAGIC);
+		put16(hello + 16, FLAG_FIXED_NEWSTYLE | FLAG_NO_ZEROES);
+		if(queue(conn, hello, sizeof(hello), 1, NULL) < 0)
+			goto fail;
+		conn->state = ST_CFLAGS;
+	}
+	return conn;
+fail:
+	nbds_free(conn);
+	return NULL;
+}
+
+void nbds_free(NBDS_CONN *conn) {
+	size_t i;
+
+	if(!conn)
+		return;
+	for(i = conn->outhead; i < conn->outtail; i++)
+		free(conn->out[i].heap);
+	free(conn->out);
+	free(conn->sent);
+	free(conn->optbuf);
+	free(conn);
+}
+
+size_t nbds_want_read(NBDS_CONN *conn, void **buf) {
+	conn->rdirect = 0;
+	switch(conn->state) {
+	case ST_ANSWER:
+	case ST_DONE:
+		return 0;
+	case ST_DATA:
+		if(conn->discard)
+			break;
+		if(!conn->databuf)
+			return 0;
+		if(conn->rstart < conn->rend)
+			/* what we have must go in first */
+			return 0;
+		if(conn->datafill == conn->datalen)
+			/* full; what comes now is for later */
+			break;
+		/* read straight into the caller's buffer */
+		conn->rdirect = 1;
+		*buf = conn->databuf + conn->datafill;
+		return conn->datalen - conn->datafill;
+	default:
+		break;
+	}
+	if(conn->rstart == conn->rend) {
+		conn->rstart = conn->rend = 0;
+	} else if(conn->rend == RBUF_SIZE) {
+		memmove(conn->rbuf, conn->rbuf + conn->rstart, conn->rend - conn->rstart);
+		conn->rend -= conn->rstart;
+		conn->rstart = 0;
+	}
+	*buf = conn->rbuf + conn->rend;
+	return RBUF_SIZE - conn->rend;
+}
+
+void nbds_read_done(NBDS_CONN *conn, size_t len) {
+	if(!len) {
+		if(conn->state != ST_DONE)
+			fail(conn, "The client closed the connection");
+		return;
+	}
+	if(conn->rdirect)
+		conn->datafill += len;
+	else
+		conn->rend += len;
+	conn->rdirect = 0;
+}
+
+int nbds_want_write(NBDS_CONN *conn, struct iovec *iov, int iovcnt) {
+	size_t i;
+	int n = 0;
+
+	for(i = conn->outhead; i < conn->outtail && n < iovcnt; i++) {
+		struct segment *seg = &conn->out[i];
+		const char *p = seg->inl ? seg->buf : seg->ptr;
+		size_t skip = (i == conn->outhead) ? conn->outdone : 0;
+
+		if(seg->len == skip)
+			continue;
+		iov[n].iov_base = (char *)p + skip;
+		iov[n].iov_len = seg->len - skip;
+		n++;
+	}
+	return n;
+}
+
+/**
+ * Remember the cookie of a buffer that was sent, for NBDS_EV_SENT.
+ **/
+static void sent(NBDS_CONN *conn, void *cookie) {
+	if(conn->nsent == conn->sentsize) {
+		size_t size = conn->sentsize ? conn->sentsize * 2 : 16;
+		void **s = realloc(conn->sent, size * sizeof(*s));
+
+		if(!s)
+			/* the event is lost; the data did go out */
+			return;
+		conn->sent = s;
+		conn->sentsize = size;
+	}
+	conn->sent[conn->nsent++] = cookie;
+}
+
+void nbds_wrote(NBDS_CONN *conn, size_t len) {
+	while(conn->outhead < conn->outtail) {
+		struct segment *seg = &conn->out[conn->outhead];
+		size_t left = seg->len - conn->outdone;
+
+		if(len < left) {
+			conn->outdone += len;
+			return;
+		}
+		len -= left;
+		free(seg->heap);
+		if(seg->cookie)
+			sent(conn, seg->cookie);
+		conn->outhead++;
+		conn->outdone = 0;
+	}
+	conn->outhead = conn->outtail = 0;
+}
+
+int nbds_pending(NBDS_CONN *conn) {
+	return conn->outhead < conn->outtail;
+}
+
+const char* nbds_error(NBDS_CONN *conn) {
+	return conn->error ? conn->error : "No error";
+}
+
+/**
+ * Take the option that was read, and see whether the caller has to
+ * answer it.
+ **/
+static NBDS_EVENT_TYPE handle_option(NBDS_CONN *conn, NBDS_EVENT *ev) {
+	switch(conn->opt) {
+	case OPT_EXPORT_NAME:
+		conn->state = ST_ANSWER;
+		ev->name = conn->optbuf;
+		return NBDS_EV_EXPORT;
+	case OPT_LIST:
+		if(conn->optlen) {
+			option_reply(conn, REP_ERR_INVALID, NULL, 0);
+			conn->state = ST_OPT;
+			return NBDS_EV_NONE;
+		}
+		conn->state = ST_ANSWER;
+		return NBDS_EV_LIST;
+	case OPT_ABORT:
+		conn->state = ST_DONE;
+		return NBDS_EV_DISCONNECT;
+	default:
+		option_reply(conn, REP_ERR_UNSUP, NULL, 0);
+		conn->state = ST_OPT;
+		return NBDS_EV_NONE;
+	}
+}
+
+/**
+ * Move data of a write that was read with the headers into the
+ * caller's buffer, or skip it.
+ **/
+static void take_data(NBDS_CONN *conn) {
+	size_t avail = conn->rend - conn->rstart;
+	size_t len;
+
+	if(conn->discard) {
+		len = avail < conn->remaining ? avail : conn->remaining;
+		conn->remaining -= len;
+	} else {
+		len = conn->datalen - conn->datafill;
+		if(len > avail)
+			len = avail;
+		memcpy(conn->databuf + conn->datafill, conn->rbuf + conn->rstart, len);
+		conn->datafill += len;
+	}
+	conn->rstart += len;
+}
+
+NBDS_EVENT_TYPE nbds_next_event(NBDS_CONN *conn, NBDS_EVENT *ev) {
+	NBDS_EVENT_TYPE type;
+	const char *p;
+	size_t avail;
+	uint32_t type32;
+
+	memset(ev, 0, sizeof(*ev));
+	if(conn->nsent) {
+		ev->cookie = conn->sent[0];
+		memmove(conn->sent, conn->sent + 1, --conn->nsent * sizeof(*conn->sent));
+		return ev->type = NBDS_EV_SENT;
+	}
+	if(conn->error_pending) {
+		conn->error_pending = 0;
+		return ev->type = NBDS_EV_ERROR;
+	}
+	for(;;) {
+		avail = conn->rend - conn->rstart;
+		p = conn->rbuf + conn->rstart;
+		switch(conn->state) {
+		case ST_CFLAGS:
+			if(avail < 4)
+				return NBDS_EV_NONE;
+			conn->cflags = get32(p);
+			conn->rstart += 4;
+			conn->state = ST_OPT;
+			break;
+		case ST_OPT:
+			if(avail < OPT_HEADER)
+				return NBDS_EV_NONE;
+			if(get64(p) != OPTS_MAGIC) {
+				fail(conn, "Bad magic in option");
+				continue;
+			}
+			conn->opt = get32(p + 8);
+			conn->optlen = get32(p + 12);
+			conn->rstart += OPT_HEADER;
+			if(conn->optlen > MAX_OPTLEN) {
+				fail(conn, "Option too long");
+				continue;
+			}
+			conn->state = ST_OPTDATA;
+			break;
+		case ST_OPTDATA:
+			if(avail < conn->optlen)
+				return NBDS_EV_NONE;
+			free(conn->optbuf);
+			if(!(conn->optbuf = malloc(conn->optlen + 1))) {
+				fail(conn, "Out of memory");
+				continue;
+			}
+			memcpy(conn->optbuf, p, conn->optlen);
+			conn->optbuf[conn->optlen] = '\0';
+			conn->rstart += conn->optlen;
+			if((type = handle_option(conn, ev)) != NBDS_EV_NONE)
+				return ev->type = type;
+			break;
+		case ST_REQ:
+			if(avail < REQ_HEADER)
+				return NBDS_EV_NONE;
+			if(get32(p) != REQUEST_MAGIC) {
+				fail(conn, "Bad magic in request");
+				continue;
+			}
+			type32 = get32(p + 4);
+			ev->command = type32 & 0xffff;
+			ev->flags = type32 >> 16;
+			memcpy(&ev->handle, p + 8, 8);
+			ev->offset = get64(p + 16);
+			ev->length = get32(p + 24);
+			conn->rstart += REQ_HEADER;
+			if(ev->command == NBDS_CMD_WRITE && ev->length) {
+				conn->state = ST_DATA;
+				conn->dataoff = ev->offset;
+				conn->remaining = ev->length;
+				conn->databuf = NULL;
+				conn->discard = 0;
+			} else if(ev->command == NBDS_CMD_DISC) {
+				conn->state = ST_DONE;
+			}
+			return ev->type = NBDS_EV_REQUEST;
+		case ST_DATA:
+			if(!conn->databuf && !conn->discard)
+				return NBDS_EV_NONE;
+			take_data(conn);
+			if(conn->discard) {
+				if(conn->remaining)
+					return NBDS_EV_NONE;
+				conn->state = ST_REQ;
+				break;
+			}
+			if(conn->datafill < conn->datalen)
+				return NBDS_EV_NONE;
+			ev->data = conn->databuf;
+			ev->offset = conn->dataoff;
+			ev->length = conn->datafill;
+			conn->dataoff += conn->datafill;
+			conn->remaining -= conn->datafill;
+			conn->databuf = NULL;
+			if(!conn->remaining)
+				conn->state = ST_REQ;
+			return ev->type = NBDS_EV_DATA;
+		case ST_ANSWER:
+			return NBDS_EV_NONE;
+		case ST_DONE:
+			if(conn->error_pending) {
+				conn->error_pending = 0;
+				return ev->type = NBDS_EV_ERROR;
+			}
+			return NBDS_EV_NONE;
+		}
+	}
+}
+
+int nbds_list_export(NBDS_CONN *conn, const char *name) {
+	size_t len = strlen(name);
+	char *data;
+	int ret;
+
+	if(conn->state != ST_ANSWER || conn->opt != OPT_LIST) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(!(data = malloc(4 + len))) {
+		errno = ENOMEM;
+		return -1;
+	}
+	put32(data, len);
+	memcpy(data + 4, name, len);
+	ret = option_reply(conn, REP_SERVER, data, 4 + len);
+	free(data);
+	return ret;
+}
+
+int nbds_option_done(NBDS_CONN *conn, uint32_t error) {
+	if(conn->state != ST_ANSWER || conn->opt != OPT_LIST) {
+		errno = EINVAL;
+		return -1;
+	}
+	conn->state = ST_OPT;
+	return option_reply(conn, error ? error : REP_ACK, NULL, 0);
+}
+
+int nbds_accept(NBDS_CONN *conn, uint64_t size, uint16_t flags) {
+	if(conn->state != ST_ANSWER || conn->opt != OPT_EXPORT_NAME) {
+		errno = EINVAL;
+		return -1;
+	}
+	conn->state = ST_REQ;
+	return send_export(conn, size, flags, 0);
+}
+
+int nbds_reject(NBDS_CONN *conn) {
+	if(conn->state != ST_ANSWER || conn->opt != OPT_EXPORT_NAME) {
+		errno = EINVAL;
+		return -1;
+	}
+	conn->state = ST_DONE;
+	return 0;
+}
+
+int nbds_data_buffer(NBDS_CONN *conn, char *buf, size_t len) {
+	if(conn->state != ST_DATA || conn->databuf || conn->discard || !len) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(len > conn->remaining)
+		len = conn->remaining;
+	conn->databuf = buf;
+	conn->datalen = len;
+	conn->datafill = 0;
+	return 0;
+}
+
+int nbds_discard(NBDS_CONN *conn) {
+	if(conn->state != ST_DATA || conn->databuf) {
+		errno = EINVAL;
+		return -1;
+	}
+	conn->discard = 1;
+	return 0;
+}
+
+int nbds_reply(NBDS_CONN *conn, uint64_t handle, uint32_t error) {
+	char hdr[REPLY_HEADER];
+
+	put32(hdr, REPLY_MAGIC);
+	put32(hdr + 4, error);
+	memcpy(hdr + 8, &handle, 8);
+	if(queue(conn, hdr, sizeof(hdr), 1, NULL) < 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+int nbds_send(NBDS_CONN *conn, const void *buf, size_t len, void *cookie) {
+	if(queue(conn, buf, len, 0, cookie) < 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
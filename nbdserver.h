@@ -0,0 +1,241 @@
+#ifndef NBDSERVER_H
+#define NBDSERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/uio.h>
+
+/**
+ * libnbdserver: the server side of the NBD protocol, for embedding an
+ * NBD server in another program.
+ *
+ * The library does no I/O of its own, and takes no decisions about
+ * exports: it turns the bytes the client sends into events, and what
+ * the caller answers into the bytes that go back. The caller owns the
+ * socket, and reads and writes it whenever it likes (typically from
+ * its own poll() or epoll loop, on a non-blocking socket):
+ *
+ * - nbds_want_read() says where the next bytes from the client should
+ *   go, and nbds_read_done() how many were put there;
+ * - nbds_want_write() hands out what should be sent, as an iovec, and
+ *   nbds_wrote() says how much of it was;
+ * - nbds_next_event() returns what happened, until it returns
+ *   NBDS_EV_NONE. It should be called until then after every read.
+ *
+ * Data is not copied where that can be avoided. The data of a write
+ * request goes straight into buffers the caller gives with
+ * nbds_data_buffer(), and the data of a read reply is sent from the
+ * caller's buffer, which is handed to nbds_send() and stays the
+ * caller's; an NBDS_EV_SENT event says when it has gone out. Only
+ * what the client sends in the same read as a request header is copied
+ * once.
+ *
+ * Requests may be answered in any order, and the caller does not need
+ * to answer one before it reads the next, so a connection can have any
+ * number of requests in flight.
+ *
+ * A connection is not thread-safe; every connection is independent.
+ * All functions that return int return 0 on success, or -1 with errno
+ * set if they are called when the protocol does not allow it.
+ **/
+
+/** Requests (NBDS_EVENT.command) */
+#define NBDS_CMD_READ	0
+#define NBDS_CMD_WRITE	1
+#define NBDS_CMD_DISC	2	/**< the client disconnects; nothing follows */
+#define NBDS_CMD_FLUSH	3
+#define NBDS_CMD_TRIM	4
+
+/** Flags of a request (NBDS_EVENT.flags) */
+#define NBDS_CMD_FLAG_FUA	(1 << 0)
+
+/** Flags of an export, for nbds_accept() and nbds_new() */
+#define NBDS_FLAG_READ_ONLY	(1 << 1)
+#define NBDS_FLAG_SEND_FLUSH	(1 << 2)
+#define NBDS_FLAG_SEND_FUA	(1 << 3)
+#define NBDS_FLAG_ROTATIONAL	(1 << 4)
+#define NBDS_FLAG_SEND_TRIM	(1 << 5)
+
+/** Errors for nbds_option_done() */
+#define NBDS_REP_ERR_POLICY	(2 | (1U << 31))	/**< not allowed here */
+#define NBDS_REP_ERR_PLATFORM	(4 | (1U << 31))	/**< not supported here */
+
+/**
+ * How a connection starts
+ **/
+typedef enum {
+	NBDS_NEWSTYLE,	/**< the client picks an export by name, after it
+			  may have asked for the list of exports */
+	NBDS_OLDSTYLE,	/**< the export is known before the client says
+			  anything, and is sent right away */
+} NBDS_STYLE;
+
+/**
+ * What nbds_next_event() can return
+ **/
+typedef enum {
+	NBDS_EV_NONE = 0,	/**< nothing until more is read or written */
+	NBDS_EV_LIST,		/**< the client asks for the list of exports:
+				  answer with nbds_list_export() for every
+				  one, then nbds_option_done() */
+	NBDS_EV_EXPORT,		/**< the client picks the export in name:
+				  answer with nbds_accept() or nbds_reject() */
+	NBDS_EV_REQUEST,	/**< a request: command, flags, handle, offset
+				  and length. The data of a write follows in
+				  NBDS_EV_DATA events */
+	NBDS_EV_DATA,		/**< a buffer given to nbds_data_buffer() is
+				  full: data, offset and length */
+	NBDS_EV_SENT,		/**< the buffer given to nbds_send() with
+				  cookie has been sent */
+	NBDS_EV_DISCONNECT,	/**< the client aborted the negotiation */
+	NBDS_EV_ERROR,		/**< the client broke the protocol, or closed
+				  the connection; nbds_error() says which.
+				  Nothing more will be read */
+} NBDS_EVENT_TYPE;
+
+/**
+ * An event. Only the members that the type of event mentions are set.
+ **/
+typedef struct {
+	NBDS_EVENT_TYPE type;
+	uint16_t command;	/**< NBDS_CMD_* */
+	uint16_t flags;		/**< NBDS_CMD_FLAG_* */
+	uint64_t handle;	/**< the client's handle of the request; pass it
+				  back to nbds_reply() as is */
+	uint64_t offset;	/**< where the request, or the data, starts */
+	uint32_t length;	/**< the length of the request, or the data */
+	char *data;		/**< the buffer the data is in */
+	const char *name;	/**< valid until the next nbds_next_event() */
+	void *cookie;		/**< as given to nbds_send() */
+} NBDS_EVENT;
+
+typedef struct nbds_conn NBDS_CONN;
+
+/**
+ * Start a connection. The greeting is queued for sending right away.
+ *
+ * @param style how the connection starts
+ * @param size for NBDS_OLDSTYLE, the size of the export; else ignored
+ * @param flags for NBDS_OLDSTYLE, NBDS_FLAG_* of the export
+ * @return the connection, or NULL if out of memory
+ **/
+NBDS_CONN* nbds_new(NBDS_STYLE style, uint64_t size, uint16_t flags);
+
+/**
+ * Free a connection. Buffers the caller gave to it are not touched.
+ **/
+void nbds_free(NBDS_CONN* conn);
+
+/**
+ * Get where the next bytes from the client should be read to.
+ *
+ * @param buf [out] the buffer
+ * @return how many bytes may be read into buf; 0 if nothing should be
+ * read now, because the library waits for an answer from the caller,
+ * or for a buffer for the data of a write, or the connection is over
+ **/
+size_t nbds_want_read(NBDS_CONN* conn, void** buf);
+
+/**
+ * Tell how many bytes were read into the buffer nbds_want_read() gave.
+ * 0 means that the client closed the connection.
+ **/
+void nbds_read_done(NBDS_CONN* conn, size_t len);
+
+/**
+ * Get what should be sent to the client next.
+ *
+ * @param iov [out] the buffers to send, in order
+ * @param iovcnt the number of entries in iov
+ * @return the number of entries filled in; 0 if there is nothing to
+ * send
+ **/
+int nbds_want_write(NBDS_CONN* conn, struct iovec* iov, int iovcnt);
+
+/**
+ * Tell how many bytes of what nbds_want_write() gave were sent.
+ **/
+void nbds_wrote(NBDS_CONN* conn, size_t len);
+
+/**
+ * Check whether anything is waiting to be sent.
+ **/
+int nbds_pending(NBDS_CONN* conn);
+
+/**
+ * Get the next event.
+ *
+ * @param ev [out] the event
+ * @return its type; NBDS_EV_NONE if there is none
+ **/
+NBDS_EVENT_TYPE nbds_next_event(NBDS_CONN* conn, NBDS_EVENT* ev);
+
+/**
+ * Get what went wrong, after NBDS_EV_ERROR.
+ **/
+const char* nbds_error(NBDS_CONN* conn);
+
+/**
+ * Add an export to the answer to NBDS_EV_LIST.
+ **/
+int nbds_list_export(NBDS_CONN* conn, const char* name);
+
+/**
+ * Finish the answer to NBDS_EV_LIST.
+ *
+ * @param error 0 if the list is complete, or an NBDS_REP_ERR_* to
+ * refuse it
+ **/
+int nbds_option_done(NBDS_CONN* conn, uint32_t error);
+
+/**
+ * Answer NBDS_EV_EXPORT: serve the export. Requests follow.
+ *
+ * @param size the size of the export
+ * @param flags NBDS_FLAG_* of the export
+ **/
+int nbds_accept(NBDS_CONN* conn, uint64_t size, uint16_t flags);
+
+/**
+ * Answer NBDS_EV_EXPORT: there is no such export. The protocol has no
+ * way to say so, other than closing the connection; the connection is
+ * over.
+ **/
+int nbds_reject(NBDS_CONN* conn);
+
+/**
+ * Give the buffer that the next part of the data of a write goes into,
+ * after NBDS_EV_REQUEST or NBDS_EV_DATA. When it is full, or holds the
+ * rest of the data, an NBDS_EV_DATA event hands it back.
+ *
+ * @param len the size of buf; the data may be taken in as many parts
+ * as the caller likes
+ **/
+int nbds_data_buffer(NBDS_CONN* conn, char* buf, size_t len);
+
+/**
+ * Skip the rest of the data of a write, e.g. because the request is
+ * refused.
+ **/
+int nbds_discard(NBDS_CONN* conn);
+
+/**
+ * Queue the reply to a request. For a read that succeeds, its data
+ * must follow with nbds_send() before the next reply.
+ *
+ * @param handle the handle of the request
+ * @param error 0, or an errno value
+ **/
+int nbds_reply(NBDS_CONN* conn, uint64_t handle, uint32_t error);
+
+/**
+ * Queue data for sending, without copying it: buf must not change
+ * until it has been sent.
+ *
+ * @param cookie if not NULL, an NBDS_EV_SENT event with it says when
+ * buf has been sent
+ **/
+int nbds_send(NBDS_CONN* conn, const void* buf, size_t len, void* cookie);
+
+#endif //NBDSERVER_H
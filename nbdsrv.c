@@ -179,12 +179,32 @@ SERVER* dup_serve(const SERVER *const s) {
 
 	if(s->transactionlog)
 		serve->transactionlog = g_strdup(s->transactionlog);
+
+	serve->trpayload = s->trpayload;
+
+	if(s->journal)
+		serve->journal = g_strdup(s->journal);
+
+	if(s->slowlog)
+		serve->slowlog = g_strdup(s->slowlog);
+
+	serve->slowthreshold = s->slowthreshold;
+
+	serve->cachesize = s->cachesize;
+	serve->cache = s->cache;
+	serve->stats = s->stats;
 	
 	if(s->servename)
 		serve->servename = g_strdup(s->servename);
 
 	serve->max_connections = s->max_connections;
 
+	serve->stripesize = s->stripesize;
+
+	if(s->backendname)
+		serve->backendname = g_strdup(s->backendname);
+	serve->backend = s->backend;
+
 	return serve;
 }
 
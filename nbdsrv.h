@@ -2,6 +2,11 @@
 #define NBDSRV_H
 
 #include "lfs.h"
+#include "journal.h"
+#include "blockcache.h"
+#include "stats.h"
+#include "trlog.h"
+#include "nbdserver.h"
 
 #include <glib.h>
 #include <stdbool.h>
@@ -46,9 +51,56 @@ typedef struct {
 	gchar* servename;    /**< name of the export as selected by nbd-client */
 	int max_connections; /**< maximum number of opened connections */
 	gchar* transactionlog;/**< filename for transaction log */
+	TRLOG_PAYLOAD_MODE trpayload; /**< what the transaction log captures of
+				       the data of writes */
 	gchar* cowdir;	     /**< directory for copy-on-write diff files. */
+	uint64_t stripesize; /**< size of a stripe when the files of a multifile
+			       export are striped rather than concatenated,
+			       or 0 */
+	gchar* journal;	     /**< base name of the write-back journal files,
+			       if any */
+	uint64_t cachesize;  /**< size of the shared block cache, or 0 */
+	BLOCKCACHE* cache;   /**< the shared block cache, if any; created
+			       by the parent, so shared with all children */
+	EXPORT_STATS* stats; /**< statistics in shared memory, if there is a
+			       control socket to report them on */
+	gchar* slowlog;	     /**< filename of the slow request log, if any */
+	int slowthreshold;   /**< requests that take longer than this many
+			       milliseconds go to the slow log; -1 for the
+			       default */
+	gchar* backendname;  /**< the backend option, if it was given */
+	const struct _backend* backend; /**< where the data of the export lives
+			       (see backend.h); NULL for files */
 } SERVER;
 
+/**
+  * State of the read-ahead stream detector of a client connection
+  */
+typedef struct {
+	off_t last;	     /**< offset of the previous read request */
+	off_t next;	     /**< offset right after the previous read request */
+	off_t stride;	     /**< distance between the previous two read requests */
+	unsigned int run;    /**< number of reads that followed the pattern */
+	size_t window;	     /**< how far ahead of the client we prefetch */
+	off_t pfstart;	     /**< start of the range prefetched for this stream */
+	off_t pfend;	     /**< end of the range prefetched for this stream */
+	uint64_t reads;	     /**< number of read requests seen */
+	uint64_t hits;	     /**< number of read requests that had been prefetched */
+	uint64_t pfops;	     /**< number of prefetches issued */
+	uint64_t pfbytes;    /**< number of bytes prefetched */
+} READAHEAD;
+
+/**
+ * Variables associated with an open file
+ **/
+typedef struct {
+	int fhandle;      /**< file descriptor */
+	off_t startoff;   /**< starting offset of this file */
+	gboolean dirty;   /**< whether this file was written to since it was
+			       last synced to disk; accessed atomically,
+			       as several threads may write */
+} FILE_INFO;
+
 /**
   * Variables associated with a client connection
   */
@@ -57,9 +109,9 @@ typedef struct {
 	char *clientname;    /**< peer, in human-readable format */
 	struct sockaddr_storage clientaddr; /**< peer, in binary format, network byte order */
 	char *exportname;    /**< (processed) filename of the file we're exporting */
-	GArray *export;    /**< array of FILE_INFO of exported files;
-			       array size is always 1 unless we're
-			       doing the multiple file option */
+	GArray *export;    /**< array of FILE_INFO of exported files, for
+			       the file backend; array size is always 1
+			       unless we're doing the multiple file option */
 	int net;	     /**< The actual client socket */
 	SERVER *server;	     /**< The server this client is getting data from */
 	char* difffilename;  /**< filename of the copy-on-write file, if any */
@@ -69,12 +121,34 @@ typedef struct {
 	uint32_t difffilelen;     /**< number of pages in difffile */
 	uint32_t *difmap;	     /**< see comment on the global difmap for this one */
 	gboolean modern;     /**< client was negotiated using modern negotiation protocol */
-	int transactionlogfd;/**< fd for transaction log */
-	int clientfeats;     /**< Features supported by this client */
+	TRLOG *transactionlog;/**< the transaction log, if any */
+	NBDS_CONN *proto;    /**< the protocol state of the connection */
+	READAHEAD ra;	     /**< read-ahead state, if enabled */
+	JOURNAL *journal;    /**< write-back journal, if any */
+	STATS_CONN *stats;   /**< statistics of this connection, if any */
+	gpointer backend_data; /**< what the backend keeps for this connection */
 } CLIENT;
 
 /* Constants and macros */
 
+/** Per-export flags: */
+#define F_READONLY 1      /**< flag to tell us a file is readonly */
+#define F_MULTIFILE 2	  /**< flag to tell us a file is exported using -m */
+#define F_COPYONWRITE 4	  /**< flag to tell us a file is exported using
+			    copyonwrite */
+#define F_AUTOREADONLY 8  /**< flag to tell us a file is set to autoreadonly */
+#define F_SPARSE 16	  /**< flag to tell us copyronwrite should use a sparse file */
+#define F_SDP 32	  /**< flag to tell us the export should be done using the Socket Direct Protocol for RDMA */
+#define F_SYNC 64	  /**< Whether to fsync() after a write */
+#define F_FLUSH 128	  /**< Whether server wants FLUSH to be sent by the client */
+#define F_FUA 256	  /**< Whether server wants FUA to be sent by the client */
+#define F_ROTATIONAL 512  /**< Whether server wants the client to implement the elevator algorithm */
+#define F_TEMPORARY 1024  /**< Whether the backing file is temporary and should be created then unlinked */
+#define F_TRIM 2048       /**< Whether server wants TRIM (discard) to be sent by the client */
+#define F_FIXED 4096	  /**< Client supports fixed new-style protocol (and can thus send us extra options */
+#define F_READAHEAD 8192  /**< Whether to detect sequential reads and prefetch ahead of them */
+#define F_COMPRESSED 16384 /**< Whether the export is a compressed image (see cimage.h) */
+
 /**
  * Error domain common for all NBD server errors.
  **/
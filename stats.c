@@ -0,0 +1,438 @@
+#include "config.h"
+#include "nbd-debug.h"
+
+#include <stats.h>
+#include <nbdsrv.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/types.h>
+
+static const char *cmdnames[STATS_CMDS] = { "read", "write", "disc", "flush", "trim" };
+
+/** The percentiles we report */
+static const struct {
+	const char *name;
+	double fraction;
+} percentiles[] = {
+	{ "p50", 0.5 },
+	{ "p90", 0.9 },
+	{ "p99", 0.99 },
+	{ "p99.9", 0.999 },
+};
+
+/** The powers of two of microseconds that bound the histogram buckets
+ * we report in the metrics */
+#define METRICS_MINBUCKET 2
+#define METRICS_MAXBUCKET 25
+
+static void *shared_alloc(size_t size, GError** err) {
+	void *mem;
+
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(mem == MAP_FAILED) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "Could not allocate shared memory for statistics: %s",
+			    strerror(errno));
+		return NULL;
+	}
+	return mem;
+}
+
+EXPORT_STATS* stats_new(GError** err) {
+	return shared_alloc(sizeof(EXPORT_STATS), err);
+}
+
+SERVER_STATS* stats_server_new(GError** err) {
+	return shared_alloc(sizeof(SERVER_STATS), err);
+}
+
+STATS_CONN* stats_connect(EXPORT_STATS* stats, const char* peer) {
+	STATS_CONN *conn;
+	int i;
+
+	__sync_fetch_and_add(&stats->connections, 1);
+	for(i = 0; i < STATS_CONNS; i++) {
+		conn = &stats->conn[i];
+		if(g_atomic_int_compare_and_exchange(&conn->pid, 0, getpid())) {
+			memset(&conn->c, 0, sizeof(conn->c));
+			conn->cowbytes = 0;
+			g_strlcpy(conn->peer, peer, sizeof(conn->peer));
+			conn->since = g_get_real_time() / G_TIME_SPAN_SECOND;
+			return conn;
+		}
+	}
+	return NULL;
+}
+
+void stats_disconnect(STATS_CONN* conn) {
+	if(conn)
+		g_atomic_int_set(&conn->pid, 0);
+}
+
+void stats_start(EXPORT_STATS* stats, STATS_CONN* conn) {
+	g_atomic_int_inc(&stats->c.inflight);
+	if(conn)
+		g_atomic_int_inc(&conn->c.inflight);
+}
+
+/**
+ * Find the histogram bucket for a latency: four buckets per power of
+ * two.
+ **/
+static int latency_bucket(uint64_t usec) {
+	int msb;
+	int bucket;
+
+	if(usec < 4)
+		return usec;
+	msb = 63 - __builtin_clzll(usec);
+	bucket = (msb - 1) * 4 + ((usec >> (msb - 2)) & 3);
+	return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+/**
+ * The smallest latency that falls in a bucket
+ **/
+static uint64_t bucket_start(int bucket) {
+	if(bucket < 4)
+		return bucket;
+	return (uint64_t)(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+static void count(STATS_COUNTERS *c, int cmd, uint64_t bytes, gboolean error,
+		  uint64_t usec, int bucket) {
+	STATS_CMD *s = &c->cmd[cmd];
+
+	g_atomic_int_add(&c->inflight, -1);
+	__sync_fetch_and_add(&s->ops, 1);
+	if(bytes)
+		__sync_fetch_and_add(&s->bytes, bytes);
+	if(error)
+		__sync_fetch_and_add(&s->errors, 1);
+	__sync_fetch_and_add(&s->latency_sum, usec);
+	__sync_fetch_and_add(&s->latency[bucket], 1);
+}
+
+void stats_done(EXPORT_STATS* stats, STATS_CONN* conn, int cmd,
+		uint64_t bytes, gboolean error, gint64 usec) {
+	int bucket;
+
+	if(cmd < 0 || cmd >= STATS_CMDS)
+		return;
+	if(usec < 0)
+		usec = 0;
+	bucket = latency_bucket(usec);
+	count(&stats->c, cmd, bytes, error, usec, bucket);
+	if(conn)
+		count(&conn->c, cmd, bytes, error, usec, bucket);
+}
+
+/**
+ * Get the latency below which a fraction of the requests in a histogram
+ * fall; we report the end of the bucket it is in.
+ **/
+static uint64_t percentile(const uint64_t *latency, uint64_t total, double fraction) {
+	uint64_t seen = 0;
+	int i;
+
+	for(i = 0; i < STATS_BUCKETS; i++) {
+		seen += latency[i];
+		if(seen && seen >= fraction * total)
+			return (i + 1 < STATS_BUCKETS) ? bucket_start(i + 1) : bucket_start(i);
+	}
+	return 0;
+}
+
+static void format_counters(GString *out, STATS_COUNTERS *c, gboolean json, const char *indent) {
+	uint64_t latency[STATS_BUCKETS];
+	STATS_CMD *s;
+	uint64_t total;
+	int cmd, i;
+	gboolean first = TRUE;
+	gboolean firstbucket;
+
+	if(json)
+		g_string_append_printf(out, "\"inflight\":%d,\"commands\":{", g_atomic_int_get(&c->inflight));
+	else
+		g_string_append_printf(out, "%sinflight %d\n", indent, g_atomic_int_get(&c->inflight));
+	for(cmd = 0; cmd < STATS_CMDS; cmd++) {
+		s = &c->cmd[cmd];
+		if(!s->ops)
+			continue;
+		/* take a copy, so that the percentiles add up */
+		total = 0;
+		for(i = 0; i < STATS_BUCKETS; i++) {
+			latency[i] = s->latency[i];
+			total += latency[i];
+		}
+		if(json) {
+			g_string_append_printf(out, "%s\"%s\":{\"ops\":%llu,\"bytes\":%llu,\"errors\":%llu,\"latency_us\":{",
+					       first ? "" : ",", cmdnames[cmd],
+					       (unsigned long long)s->ops, (unsigned long long)s->bytes,
+					       (unsigned long long)s->errors);
+			for(i = 0; i < G_N_ELEMENTS(percentiles); i++) {
+				g_string_append_printf(out, "\"%s\":%llu,", percentiles[i].name,
+						       (unsigned long long)percentile(latency, total, percentiles[i].fraction));
+			}
+			g_string_append(out, "\"histogram\":[");
+			firstbucket = TRUE;
+			for(i = 0; i < STATS_BUCKETS; i++) {
+				if(!latency[i])
+					continue;
+				g_string_append_printf(out, "%s[%llu,%llu]", firstbucket ? "" : ",",
+						       (unsigned long long)bucket_start(i),
+						       (unsigned long long)latency[i]);
+				firstbucket = FALSE;
+			}
+			g_string_append(out, "]}}");
+		} else {
+			g_string_append_printf(out, "%s%s: ops %llu bytes %llu errors %llu latency(us)",
+					       indent, cmdnames[cmd],
+					       (unsigned long long)s->ops, (unsigned long long)s->bytes,
+					       (unsigned long long)s->errors);
+			for(i = 0; i < G_N_ELEMENTS(percentiles); i++) {
+				g_string_append_printf(out, " %s %llu", percentiles[i].name,
+						       (unsigned long long)percentile(latency, total, percentiles[i].fraction));
+			}
+			g_string_append_c(out, '\n');
+		}
+		first = FALSE;
+	}
+	if(json)
+		g_string_append_c(out, '}');
+}
+
+/**
+ * Free the slots of children that died without saying goodbye.
+ *
+ * @return the number of connections that are still active
+ **/
+static int reclaim(EXPORT_STATS *stats) {
+	int active = 0;
+	int i;
+	gint pid;
+
+	for(i = 0; i < STATS_CONNS; i++) {
+		pid = g_atomic_int_get(&stats->conn[i].pid);
+		if(pid && kill(pid, 0) < 0 && errno == ESRCH) {
+			g_atomic_int_compare_and_exchange(&stats->conn[i].pid, pid, 0);
+		}
+		if(g_atomic_int_get(&stats->conn[i].pid))
+			active++;
+	}
+	return active;
+}
+
+/**
+ * Append a string to JSON output, quoted. UTF-8 is passed through;
+ * double quote, backslash and control characters are escaped, and a
+ * byte that is not part of valid UTF-8 becomes U+FFFD, so that the
+ * output stays valid JSON whatever the name of an export is.
+ **/
+static void json_append_string(GString *out, const gchar *value) {
+	const gchar *end;
+
+	g_string_append_c(out, '"');
+	while(*value) {
+		if(!g_utf8_validate(value, -1, &end) && end == value) {
+			g_string_append(out, "\\ufffd");
+			value++;
+			continue;
+		}
+		for(; value < end; value++) {
+			switch(*value) {
+			case '\\':
+				g_string_append(out, "\\\\");
+				break;
+			case '"':
+				g_string_append(out, "\\\"");
+				break;
+			default:
+				if((unsigned char)*value < 0x20)
+					g_string_append_printf(out, "\\u%04x", (unsigned char)*value);
+				else
+					g_string_append_c(out, *value);
+			}
+		}
+	}
+	g_string_append_c(out, '"');
+}
+
+void stats_format(GString* out, const gchar* name, EXPORT_STATS* stats, gboolean json) {
+	STATS_CONN *conn;
+	gboolean first = TRUE;
+	int active;
+	int i;
+
+	active = reclaim(stats);
+
+	if(json) {
+		g_string_append(out, "{\"name\":");
+		json_append_string(out, name);
+		g_string_append_printf(out, ",\"connections\":%d,\"total_connections\":%llu,",
+				       active, (unsigned long long)stats->connections);
+	} else {
+		g_string_append_printf(out, "export %s: %d connections, %llu in total\n",
+				       name, active, (unsigned long long)stats->connections);
+	}
+	format_counters(out, &stats->c, json, "  ");
+	if(json)
+		g_string_append(out, ",\"clients\":[");
+	for(i = 0; i < STATS_CONNS; i++) {
+		conn = &stats->conn[i];
+		if(!g_atomic_int_get(&conn->pid))
+			continue;
+		if(json) {
+			g_string_append_printf(out, "%s{\"peer\":", first ? "" : ",");
+			json_append_string(out, conn->peer);
+			g_string_append_printf(out, ",\"pid\":%d,\"since\":%lld,",
+					       conn->pid, (long long)conn->since);
+		} else {
+			g_string_append_printf(out, "  client %s (pid %d, since %lld)\n",
+					       conn->peer, conn->pid, (long long)conn->since);
+		}
+		format_counters(out, &conn->c, json, "    ");
+		if(json)
+			g_string_append_c(out, '}');
+		first = FALSE;
+	}
+	if(json)
+		g_string_append(out, "]}");
+}
+
+/**
+ * Escape a label value for the metrics: backslash, double quote and
+ * newline need a backslash.
+ **/
+static gchar *label_escape(const gchar *value) {
+	GString *out = g_string_new("");
+
+	for(; *value; value++) {
+		switch(*value) {
+		case '\\':
+			g_string_append(out, "\\\\");
+			break;
+		case '"':
+			g_string_append(out, "\\\"");
+			break;
+		case '\n':
+			g_string_append(out, "\\n");
+			break;
+		default:
+			g_string_append_c(out, *value);
+		}
+	}
+	return g_string_free(out, FALSE);
+}
+
+static void metrics_family(GString *out, const char *name, const char *type, const char *help) {
+	g_string_append_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * Append one counter per request type for every export
+ *
+ * @param offset where the counter is in a STATS_CMD
+ **/
+static void metrics_cmd_counter(GString *out, const char *name, const char *help,
+				gchar **labels, EXPORT_STATS **stats, int n, size_t offset) {
+	int i, cmd;
+
+	metrics_family(out, name, "counter", help);
+	for(i = 0; i < n; i++) {
+		for(cmd = 0; cmd < STATS_CMDS; cmd++) {
+			uint64_t *val = (uint64_t *)((char *)&stats[i]->c.cmd[cmd] + offset);
+
+			g_string_append_printf(out, "%s{export=\"%s\",command=\"%s\"} %llu\n",
+					       name, labels[i], cmdnames[cmd],
+					       (unsigned long long)*val);
+		}
+	}
+}
+
+void stats_format_metrics(GString* out, const gchar** names, EXPORT_STATS** stats, int n) {
+	gchar **labels = g_new0(gchar *, n + 1);
+	int *active = g_new0(int, n);
+	STATS_CMD *s;
+	uint64_t cum, cow;
+	int i, j, cmd, b;
+
+	for(i = 0; i < n; i++) {
+		labels[i] = label_escape(names[i]);
+		active[i] = reclaim(stats[i]);
+	}
+
+	metrics_family(out, "nbd_export_connections", "gauge",
+		       "Connections to the export that are being served.");
+	for(i = 0; i < n; i++)
+		g_string_append_printf(out, "nbd_export_connections{export=\"%s\"} %d\n",
+				       labels[i], active[i]);
+	metrics_family(out, "nbd_export_connections_total", "counter",
+		       "Connections to the export that were served.");
+	for(i = 0; i < n; i++)
+		g_string_append_printf(out, "nbd_export_connections_total{export=\"%s\"} %llu\n",
+				       labels[i], (unsigned long long)stats[i]->connections);
+	metrics_family(out, "nbd_requests_in_flight", "gauge",
+		       "Requests that are being handled.");
+	for(i = 0; i < n; i++)
+		g_string_append_printf(out, "nbd_requests_in_flight{export=\"%s\"} %d\n",
+				       labels[i], g_atomic_int_get(&stats[i]->c.inflight));
+	metrics_cmd_counter(out, "nbd_requests_total", "Requests handled.",
+			    labels, stats, n, G_STRUCT_OFFSET(STATS_CMD, ops));
+	metrics_cmd_counter(out, "nbd_request_bytes_total", "Bytes read or written.",
+			    labels, stats, n, G_STRUCT_OFFSET(STATS_CMD, bytes));
+	metrics_cmd_counter(out, "nbd_request_errors_total", "Requests that failed.",
+			    labels, stats, n, G_STRUCT_OFFSET(STATS_CMD, errors));
+
+	metrics_family(out, "nbd_request_duration_seconds", "histogram",
+		       "Time from reading a request to sending its reply.");
+	for(i = 0; i < n; i++) {
+		for(cmd = 0; cmd < STATS_CMDS; cmd++) {
+			s = &stats[i]->c.cmd[cmd];
+			cum = 0;
+			b = 0;
+			/* the buckets of a power of two start at bucket
+			 * 4 * (power - 1), see bucket_start(). What is
+			 * below 2^j us is at most 2^j - 1 us, since we
+			 * count whole microseconds, and le is inclusive */
+			for(j = METRICS_MINBUCKET; j <= METRICS_MAXBUCKET; j++) {
+				for(; b < 4 * (j - 1); b++)
+					cum += s->latency[b];
+				g_string_append_printf(out, "nbd_request_duration_seconds_bucket{export=\"%s\",command=\"%s\",le=\"%.6f\"} %llu\n",
+						       labels[i], cmdnames[cmd],
+						       (double)((1ULL << j) - 1) / 1000000,
+						       (unsigned long long)cum);
+			}
+			for(; b < STATS_BUCKETS; b++)
+				cum += s->latency[b];
+			g_string_append_printf(out, "nbd_request_duration_seconds_bucket{export=\"%s\",command=\"%s\",le=\"+Inf\"} %llu\n",
+					       labels[i], cmdnames[cmd], (unsigned long long)cum);
+			g_string_append_printf(out, "nbd_request_duration_seconds_sum{export=\"%s\",command=\"%s\"} %.6f\n",
+					       labels[i], cmdnames[cmd],
+					       (double)s->latency_sum / 1000000);
+			g_string_append_printf(out, "nbd_request_duration_seconds_count{export=\"%s\",command=\"%s\"} %llu\n",
+					       labels[i], cmdnames[cmd], (unsigned long long)cum);
+		}
+	}
+
+	metrics_family(out, "nbd_cow_overlay_bytes", "gauge",
+		       "Size of the copy-on-write overlays of the connections that are being served.");
+	for(i = 0; i < n; i++) {
+		cow = 0;
+		for(j = 0; j < STATS_CONNS; j++) {
+			if(g_atomic_int_get(&stats[i]->conn[j].pid))
+				cow += stats[i]->conn[j].cowbytes;
+		}
+		g_string_append_printf(out, "nbd_cow_overlay_bytes{export=\"%s\"} %llu\n",
+				       labels[i], (unsigned long long)cow);
+	}
+
+	g_strfreev(labels);
+	g_free(active);
+}
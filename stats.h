@@ -0,0 +1,130 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <glib.h>
+#include <stdint.h>
+
+#define STATS_CMDS 5	   /**< number of request types we count;
+			        NBD_CMD_READ up to NBD_CMD_TRIM */
+#define STATS_BUCKETS 128  /**< number of buckets in a latency histogram */
+#define STATS_CONNS 64	   /**< number of connections to an export of which
+			        we keep statistics separately */
+
+/**
+ * Counters for one type of request. The latency histogram has four
+ * buckets for every power of two of microseconds, so that any latency
+ * is known to within 25%.
+ **/
+typedef struct {
+	uint64_t ops;			  /**< number of requests */
+	uint64_t bytes;			  /**< bytes read or written */
+	uint64_t errors;		  /**< number of requests that failed */
+	uint64_t latency_sum;		  /**< sum of latencies, in microseconds */
+	uint64_t latency[STATS_BUCKETS];  /**< histogram of latencies */
+} STATS_CMD;
+
+/**
+ * Counters for an export, or a connection to one
+ **/
+typedef struct {
+	gint inflight;			  /**< requests being handled now */
+	STATS_CMD cmd[STATS_CMDS];	  /**< counters per request type */
+} STATS_COUNTERS;
+
+/**
+ * Statistics of one connection to an export
+ **/
+typedef struct {
+	gint pid;		/**< the child serving it, or 0 if the slot is free */
+	gint64 since;		/**< when it was made, in seconds since the epoch */
+	char peer[64];		/**< address of the client */
+	uint64_t cowbytes;	/**< size of its copy-on-write overlay */
+	STATS_COUNTERS c;	/**< its counters */
+} STATS_CONN;
+
+/**
+ * Statistics of an export, in shared memory. The parent allocates it
+ * before it forks, the children update it with atomic operations, and
+ * the parent reports it on the control socket.
+ **/
+typedef struct {
+	uint64_t connections;	       /**< number of connections so far */
+	STATS_COUNTERS c;	       /**< counters for all connections */
+	STATS_CONN conn[STATS_CONNS];  /**< counters per connection */
+} EXPORT_STATS;
+
+/**
+ * Counters of the server as a whole, in shared memory, since
+ * negotiation happens in the children
+ **/
+typedef struct {
+	uint64_t accepted;	       /**< connections accepted */
+	uint64_t negfailures;	       /**< connections dropped before they
+					    were served, because negotiation
+					    or authorization failed */
+} SERVER_STATS;
+
+/**
+ * Allocate the statistics of an export in shared memory.
+ *
+ * @return the statistics, or NULL on failure (with err set)
+ **/
+EXPORT_STATS* stats_new(GError** err);
+
+/**
+ * Claim a slot for a new connection.
+ *
+ * @param peer the address of the client
+ * @return the slot, or NULL if all are taken (in which case only the
+ * export's counters are updated)
+ **/
+STATS_CONN* stats_connect(EXPORT_STATS* stats, const char* peer);
+
+/**
+ * Free a connection's slot.
+ **/
+void stats_disconnect(STATS_CONN* conn);
+
+/**
+ * Count a request as in flight.
+ **/
+void stats_start(EXPORT_STATS* stats, STATS_CONN* conn);
+
+/**
+ * Count a request as done.
+ *
+ * @param cmd the type of request
+ * @param bytes how much was read or written
+ * @param error whether the request failed
+ * @param usec how long it took, in microseconds
+ **/
+void stats_done(EXPORT_STATS* stats, STATS_CONN* conn, int cmd,
+		uint64_t bytes, gboolean error, gint64 usec);
+
+/**
+ * Append a report of an export's statistics to a string.
+ *
+ * @param name the name of the export
+ * @param json if TRUE, report as a JSON object; otherwise, as text
+ **/
+void stats_format(GString* out, const gchar* name, EXPORT_STATS* stats, gboolean json);
+
+/**
+ * Allocate the server-wide counters in shared memory.
+ *
+ * @return the counters, or NULL on failure (with err set)
+ **/
+SERVER_STATS* stats_server_new(GError** err);
+
+/**
+ * Append the statistics of a number of exports to a string, in the
+ * Prometheus text exposition format. The latency histograms are
+ * reported with one bucket per power of two.
+ *
+ * @param names the names of the exports
+ * @param stats their statistics
+ * @param n the number of exports
+ **/
+void stats_format_metrics(GString* out, const gchar** names, EXPORT_STATS** stats, int n);
+
+#endif //STATS_H
@@ -0,0 +1,173 @@
+#include <nbdclient.h>
+#include <nbdserver.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "macro.h"
+
+/* libnbdclient with two connections, against a server made of
+ * libnbdserver in a child process per connection. The export is memory
+ * that the children share. */
+
+#define SIZE	(1024*1024)
+#define BLOCK	4096
+#define NBLOCKS	64
+
+static NBDS_EVENT_TYPE next(int sock, NBDS_CONN *conn, NBDS_EVENT *ev) {
+	NBDS_EVENT_TYPE type;
+	struct iovec iov[8];
+	ssize_t res;
+	size_t len;
+	void *buf;
+	int n;
+
+	while((type = nbds_next_event(conn, ev)) == NBDS_EV_NONE) {
+		while((n = nbds_want_write(conn, iov, 8)) > 0) {
+			if((res = writev(sock, iov, n)) < 0)
+				return NBDS_EV_ERROR;
+			nbds_wrote(conn, res);
+		}
+		if(!(len = nbds_want_read(conn, &buf)))
+			break;
+		if((res = read(sock, buf, len)) < 0)
+			return NBDS_EV_ERROR;
+		nbds_read_done(conn, res);
+	}
+	return type;
+}
+
+static void serve(int sock, char *mem) {
+	NBDS_CONN *conn = nbds_new(NBDS_NEWSTYLE, 0, 0);
+	NBDS_EVENT ev;
+	uint64_t whandle = 0;
+
+	for(;;) {
+		switch(next(sock, conn, &ev)) {
+		case NBDS_EV_EXPORT:
+			if(strcmp(ev.name, "mem"))
+				exit(EXIT_FAILURE);
+			nbds_accept(conn, SIZE, NBDS_FLAG_SEND_FLUSH);
+			break;
+		case NBDS_EV_REQUEST:
+			if(ev.offset + ev.length > SIZE) {
+				if(ev.command == NBDS_CMD_WRITE && ev.length)
+					nbds_discard(conn);
+				nbds_reply(conn, ev.handle, EINVAL);
+				break;
+			}
+			switch(ev.command) {
+			case NBDS_CMD_READ:
+				nbds_reply(conn, ev.handle, 0);
+				nbds_send(conn, mem + ev.offset, ev.length, NULL);
+				break;
+			case NBDS_CMD_WRITE:
+				whandle = ev.handle;
+				if(ev.length) {
+					nbds_data_buffer(conn, mem + ev.offset, ev.length);
+					break;
+				}
+				/* fall through */
+			case NBDS_CMD_FLUSH:
+				nbds_reply(conn, ev.handle, 0);
+				break;
+			case NBDS_CMD_DISC:
+				exit(EXIT_SUCCESS);
+			}
+			break;
+		case NBDS_EV_DATA:
+			nbds_reply(conn, whandle, 0);
+			break;
+		default:
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static int ndone;
+static int nerrors;
+static int lasterror;
+
+static void done(void *opaque, int error) {
+	ndone++;
+	if(error) {
+		nerrors++;
+		lasterror = error;
+	}
+}
+
+int main(void) {
+	char *mem = mmap(NULL, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	static char out[NBLOCKS][BLOCK];
+	static char in[NBLOCKS][BLOCK];
+	int socks[2];
+	int pair[2];
+	int status;
+	int error;
+	NBDC *nbdc;
+	int i;
+
+	for(i = 0; i < 2; i++) {
+		socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+		if(!fork()) {
+			close(pair[0]);
+			serve(pair[1], mem);
+		}
+		close(pair[1]);
+		socks[i] = pair[0];
+	}
+	nbdc = nbdc_open_socks(socks, 2, "mem", &error);
+	count_assert(nbdc != NULL);
+	count_assert(nbdc_size(nbdc) == SIZE);
+	count_assert(nbdc_flags(nbdc) & NBDC_FLAG_SEND_FLUSH);
+
+	/* all writes in flight at once, spread over both connections */
+	for(i = 0; i < NBLOCKS; i++) {
+		memset(out[i], 'a' + i % 26, BLOCK);
+		count_assert(nbdc_aio_write(nbdc, out[i], (uint64_t)i * 2 * BLOCK, BLOCK, 0, done, NULL) == 0);
+	}
+	count_assert(nbdc_in_flight(nbdc) == NBLOCKS);
+	while(nbdc_in_flight(nbdc))
+		count_assert(nbdc_poll(nbdc, -1) == 0);
+	count_assert(ndone == NBLOCKS && !nerrors);
+	count_assert(!memcmp(mem + 2 * BLOCK, out[1], BLOCK));
+
+	/* a flush goes out on both, and is done once */
+	count_assert(nbdc_aio_flush(nbdc, done, NULL) == 0);
+	count_assert(nbdc_in_flight(nbdc) == 2);
+	while(nbdc_in_flight(nbdc))
+		nbdc_poll(nbdc, -1);
+	count_assert(ndone == NBLOCKS + 1);
+
+	/* read it all back, plus a read past the end */
+	for(i = 0; i < NBLOCKS; i++)
+		nbdc_aio_read(nbdc, in[i], (uint64_t)i * 2 * BLOCK, BLOCK, done, NULL);
+	nbdc_aio_read(nbdc, in[0], SIZE, BLOCK, done, NULL);
+	while(nbdc_in_flight(nbdc))
+		nbdc_poll(nbdc, -1);
+	count_assert(ndone == 2 * NBLOCKS + 2);
+	count_assert(nerrors == 1 && lasterror == EINVAL);
+	count_assert(!memcmp(in[1], out[1], BLOCK));
+	count_assert(!memcmp(in[NBLOCKS - 1], out[NBLOCKS - 1], BLOCK));
+
+	nbdc_close(nbdc);
+	for(i = 0; i < 2; i++) {
+		wait(&status);
+		count_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+
+	/* an export that isn't there */
+	socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+	if(!fork()) {
+		close(pair[0]);
+		serve(pair[1], mem);
+	}
+	close(pair[1]);
+	count_assert(nbdc_open_socks(&pair[0], 1, "nothere", &error) == NULL);
+	count_assert(error == NBDC_E_CLOSED);
+	wait(&status);
+	return 0;
+}
@@ -0,0 +1,418 @@
+/*
+ * Benchmark of the data path of nbd-server, without a network in the
+ * way: expread(), expwrite(), exptrim() and get_filepos() are called
+ * directly, on exports made of files in one or more directories (by
+ * default /dev/shm, which is tmpfs, and the current directory), with
+ * several request sizes and alignments. For every combination, the
+ * time per operation and the throughput are reported.
+ *
+ * Usage: iobench [-d dir]... [-s size] [-t ms] [-c]
+ *
+ *  -d dir   create the export files in dir; may be given more than once
+ *  -s size  size of the export, in bytes (K, M and G suffixes allowed)
+ *  -t ms    how long to run every combination
+ *  -c       print comma-separated values rather than a table
+ */
+#include "config.h"
+
+#include <cliserv.h>
+#include <nbdsrv.h>
+#include <expio.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#define NFILES 4		/**< number of files of a multifile export */
+#define STRIPESIZE (64*1024)	/**< stripe size of the striped export */
+#define MAXLEN (1024*1024)	/**< largest request */
+#define BATCH 16		/**< operations between looks at the clock */
+
+/** The ways in which an export can be set up */
+typedef enum {
+	SETUP_PLAIN,	/**< a single file */
+	SETUP_MULTI,	/**< NFILES files, concatenated */
+	SETUP_STRIPE,	/**< NFILES files, striped */
+	SETUP_COW,	/**< a single file, with copy-on-write */
+	SETUP_CACHE,	/**< a single file, with a block cache */
+	SETUP_COUNT,
+} SETUP;
+
+static const char *setupnames[SETUP_COUNT] = { "plain", "multifile", "stripe", "cow", "cache" };
+
+/** The operations we time */
+typedef enum {
+	OP_READ,	/**< expread() at random offsets */
+	OP_COWCOPY,	/**< expwrite() to pages that are not in the diff
+			     file yet, so that they are copied there */
+	OP_WRITE,	/**< expwrite() at random offsets; with copy-on-write,
+			     to pages that are in the diff file already */
+	OP_COWREAD,	/**< expread() of pages that are in the diff file */
+	OP_TRIM,	/**< exptrim() at random offsets */
+	OP_FILEPOS,	/**< get_filepos() at random offsets */
+	OP_COUNT,
+} OP;
+
+static const char *opnames[OP_COUNT] = { "read", "cowcopy", "write", "cowread", "trim", "filepos" };
+
+static const size_t sizes[] = { 512, 4096, 65536, MAXLEN };
+static const size_t aligns[] = { 4096, 512, 1 };
+
+static uint64_t exportsize = 64*1024*1024;
+static gint64 duration = 100000000;	/**< per combination, in ns */
+static gboolean csv = FALSE;
+static char *buf;
+
+static gint64 now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * xorshift64*, so that every run does the same requests
+ **/
+static uint64_t next_random(uint64_t *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * Create a file of the given size in dir, full of non-zero data so
+ * that reads don't just hit holes. It is unlinked right away.
+ **/
+static int make_file(const char *dir, uint64_t size) {
+	gchar *name = g_strdup_printf("%s/iobench.XXXXXX", dir);
+	uint64_t done;
+	int fd;
+
+	if((fd = mkstemp(name)) < 0) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+	unlink(name);
+	g_free(name);
+	memset(buf, 0xa5, MAXLEN);
+	for(done = 0; done < size; done += MAXLEN) {
+		size_t len = (size - done < MAXLEN) ? size - done : MAXLEN;
+
+		if(pwrite(fd, buf, len, done) != len) {
+			perror("pwrite");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return fd;
+}
+
+/**
+ * Forget everything that was copied to the diff file of a
+ * copy-on-write export.
+ **/
+static void cow_reset(CLIENT *client) {
+	uint64_t i;
+
+	for(i = 0; i < client->exportsize / DIFFPAGESIZE; i++)
+		client->difmap[i] = (uint32_t)-1;
+	client->difffilelen = 0;
+	if(ftruncate(client->difffile, 0) < 0) {
+		perror("ftruncate");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * Set up a client with an export as nbd-server would after
+ * negotiation, with its files in dir.
+ **/
+static CLIENT *open_client(const char *dir, SETUP setup) {
+	SERVER *server = g_new0(SERVER, 1);
+	CLIENT *client = g_new0(CLIENT, 1);
+	int nfiles = (setup == SETUP_MULTI || setup == SETUP_STRIPE) ? NFILES : 1;
+	GError *gerror = NULL;
+	int i;
+
+	client->server = server;
+	client->exportsize = exportsize;
+	client->export = g_array_new(FALSE, TRUE, sizeof(FILE_INFO));
+	for(i = 0; i < nfiles; i++) {
+		FILE_INFO fi;
+
+		fi.fhandle = make_file(dir, exportsize / nfiles);
+		fi.startoff = i * (exportsize / nfiles);
+		fi.dirty = FALSE;
+		g_array_append_val(client->export, fi);
+	}
+	switch(setup) {
+	case SETUP_MULTI:
+		server->flags |= F_MULTIFILE;
+		break;
+	case SETUP_STRIPE:
+		server->flags |= F_MULTIFILE;
+		server->stripesize = STRIPESIZE;
+		break;
+	case SETUP_COW:
+		server->flags |= F_COPYONWRITE;
+		client->difffile = make_file(dir, 0);
+		client->difmap = g_new(uint32_t, exportsize / DIFFPAGESIZE);
+		cow_reset(client);
+		break;
+	case SETUP_CACHE:
+		server->cachesize = exportsize / 4;
+		if(!(server->cache = cache_new(server->cachesize, &gerror))) {
+			fprintf(stderr, "Could not create block cache: %s\n", gerror->message);
+			exit(EXIT_FAILURE);
+		}
+		break;
+	default:
+		break;
+	}
+	return client;
+}
+
+static void close_client(CLIENT *client) {
+	int i;
+
+	for(i = 0; i < client->export->len; i++)
+		close(g_array_index(client->export, FILE_INFO, i).fhandle);
+	g_array_free(client->export, TRUE);
+	if(client->difmap) {
+		close(client->difffile);
+		g_free(client->difmap);
+	}
+	/* the block cache is in shared memory, and is never freed; the
+	 * server doesn't need to */
+	g_free(client->server);
+	g_free(client);
+}
+
+static void report(const char *dir, SETUP setup, OP op, size_t len, size_t align,
+		   uint64_t ops, gint64 elapsed) {
+	double nsop = (double)elapsed / ops;
+	double mibs = op == OP_FILEPOS ? 0 :
+		(double)ops * len / (1024.0 * 1024.0) / (elapsed / 1e9);
+
+	if(csv) {
+		printf("%s,%s,%s,%zu,%zu,%llu,%.1f,%.1f\n", dir, setupnames[setup],
+		       opnames[op], len, align, (unsigned long long)ops, nsop, mibs);
+	} else {
+		printf("%-16s %-10s %-8s %8zu %6zu %10llu %12.1f %10.1f\n", dir,
+		       setupnames[setup], opnames[op], len, align,
+		       (unsigned long long)ops, nsop, mibs);
+	}
+	fflush(stdout);
+}
+
+/**
+ * Do one operation. Returns nonzero on failure.
+ *
+ * @param cowpos for OP_COWCOPY: where the next page that was not
+ * copied yet starts
+ **/
+static int do_op(CLIENT *client, OP op, size_t len, size_t align, uint64_t *rnd,
+		 uint64_t *cowpos) {
+	struct nbd_request req;
+	int fhandle;
+	off_t foffset;
+	size_t maxbytes;
+	off_t a;
+
+	if(op == OP_COWCOPY) {
+		/* start in the first page that was not copied yet, at
+		 * an offset into it that has the requested alignment */
+		a = *cowpos + (DIFFPAGESIZE - align) % DIFFPAGESIZE;
+		*cowpos = (a + len + DIFFPAGESIZE - 1) / DIFFPAGESIZE * DIFFPAGESIZE;
+		return expwrite(a, buf, len, client, 0);
+	}
+	a = next_random(rnd) % ((exportsize - len) / align + 1) * align;
+	switch(op) {
+	case OP_READ:
+	case OP_COWREAD:
+		return expread(a, buf, len, client);
+	case OP_WRITE:
+		return expwrite(a, buf, len, client, 0);
+	case OP_TRIM:
+		req.from = a;
+		req.len = htonl(len);
+		return exptrim(&req, client);
+	case OP_FILEPOS:
+		return get_filepos(client, a, &fhandle, &foffset, &maxbytes) < 0;
+	default:
+		return -1;
+	}
+}
+
+/**
+ * Run one operation with one request size and alignment for as long as
+ * we were asked to.
+ **/
+static void run(const char *dir, CLIENT *client, SETUP setup, OP op, size_t len, size_t align) {
+	uint64_t rnd = 0x9e3779b97f4a7c15ULL ^ (len * 31 + align);
+	uint64_t cowpos = 0;
+	uint64_t ops = 0;
+	gint64 start, elapsed = 0, paused;
+	int i;
+
+	if(op == OP_COWCOPY)
+		cow_reset(client);
+	start = now_ns();
+	while(elapsed < duration) {
+		for(i = 0; i < BATCH; i++) {
+			if(op == OP_COWCOPY && cowpos + DIFFPAGESIZE + len > exportsize) {
+				/* every page was copied; start over, but
+				 * don't count the time that takes */
+				paused = now_ns();
+				cow_reset(client);
+				cowpos = 0;
+				start += now_ns() - paused;
+			}
+			if(do_op(client, op, len, align, &rnd, &cowpos)) {
+				fprintf(stderr, "%s %s of %zu bytes failed\n",
+					setupnames[setup], opnames[op], len);
+				exit(EXIT_FAILURE);
+			}
+			ops++;
+		}
+		elapsed = now_ns() - start;
+	}
+	report(dir, setup, op, len, align, ops, elapsed);
+}
+
+/**
+ * Check whether an operation makes sense on an export
+ **/
+static gboolean applies(SETUP setup, OP op) {
+	switch(op) {
+	case OP_COWCOPY:
+	case OP_COWREAD:
+		return setup == SETUP_COW;
+	case OP_TRIM:
+		/* exptrim() punches holes in the files of the export,
+		 * which would defeat the purpose of copy-on-write */
+		return setup != SETUP_COW;
+	default:
+		return TRUE;
+	}
+}
+
+static void bench(const char *dir) {
+	SETUP setup;
+	OP op;
+	CLIENT *client;
+	char *fill;
+	int s, a;
+
+	for(setup = 0; setup < SETUP_COUNT; setup++) {
+		client = open_client(dir, setup);
+		for(op = 0; op < OP_COUNT; op++) {
+			if(!applies(setup, op))
+				continue;
+			if(op == OP_FILEPOS) {
+				run(dir, client, setup, op, 1, 1);
+				continue;
+			}
+			if(op == OP_WRITE && setup == SETUP_COW) {
+				/* copy every page first, so that we time
+				 * the writes to the diff file only */
+				cow_reset(client);
+				fill = g_malloc0(exportsize);
+				if(expwrite(0, fill, exportsize, client, 0)) {
+					fprintf(stderr, "Could not fill the diff file\n");
+					exit(EXIT_FAILURE);
+				}
+				g_free(fill);
+			}
+			for(s = 0; s < G_N_ELEMENTS(sizes); s++) {
+				for(a = 0; a < G_N_ELEMENTS(aligns); a++) {
+					run(dir, client, setup, op, sizes[s], aligns[a]);
+				}
+			}
+		}
+		close_client(client);
+	}
+}
+
+static uint64_t parse_size(const char *arg) {
+	char *end;
+	uint64_t val = strtoull(arg, &end, 0);
+
+	switch(*end) {
+	case 'G': case 'g':
+		val *= 1024;
+		/* fall through */
+	case 'M': case 'm':
+		val *= 1024;
+		/* fall through */
+	case 'K': case 'k':
+		val *= 1024;
+		break;
+	case '\0':
+		break;
+	default:
+		fprintf(stderr, "Invalid size: %s\n", arg);
+		exit(EXIT_FAILURE);
+	}
+	return val;
+}
+
+int main(int argc, char **argv) {
+	const char **dirs = g_new0(const char *, argc + 2);
+	int ndirs = 0;
+	struct stat st;
+	int c, i;
+
+	while((c = getopt(argc, argv, "d:s:t:c")) >= 0) {
+		switch(c) {
+		case 'd':
+			dirs[ndirs++] = optarg;
+			break;
+		case 's':
+			exportsize = parse_size(optarg);
+			break;
+		case 't':
+			duration = strtoll(optarg, NULL, 0) * 1000000;
+			break;
+		case 'c':
+			csv = TRUE;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-d dir]... [-s size] [-t ms] [-c]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	exportsize -= exportsize % (NFILES * STRIPESIZE);
+	if(exportsize < 2 * MAXLEN) {
+		fprintf(stderr, "The export must be at least %d bytes\n", 2 * MAXLEN);
+		exit(EXIT_FAILURE);
+	}
+	if(!ndirs) {
+		if(!stat("/dev/shm", &st) && S_ISDIR(st.st_mode))
+			dirs[ndirs++] = "/dev/shm";
+		dirs[ndirs++] = ".";
+	}
+	if(posix_memalign((void **)&buf, 4096, MAXLEN)) {
+		perror("posix_memalign");
+		exit(EXIT_FAILURE);
+	}
+
+	if(csv) {
+		printf("dir,setup,op,size,align,ops,ns_per_op,mib_per_s\n");
+	} else {
+		printf("%-16s %-10s %-8s %8s %6s %10s %12s %10s\n", "dir", "setup",
+		       "op", "size", "align", "ops", "ns/op", "MiB/s");
+	}
+	for(i = 0; i < ndirs; i++) {
+		bench(dirs[i]);
+	}
+	g_free(dirs);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,153 @@
+#include <nbdserver.h>
+#include <stdlib.h>
+#include <string.h>
+#include "macro.h"
+
+/* What a client sends, and what it gets back, for the state machine of
+ * libnbdserver. Nothing goes over a socket. */
+
+static void feed(NBDS_CONN *conn, const char *data, size_t len) {
+	void *buf;
+	size_t room;
+
+	while(len > 0) {
+		room = nbds_want_read(conn, &buf);
+		assert(room > 0);
+		if(room > len)
+			room = len;
+		memcpy(buf, data, room);
+		nbds_read_done(conn, room);
+		data += room;
+		len -= room;
+	}
+}
+
+static size_t drain(NBDS_CONN *conn, char *out, size_t size) {
+	struct iovec iov[8];
+	size_t total = 0;
+	int i, n;
+
+	while((n = nbds_want_write(conn, iov, 8)) > 0) {
+		for(i = 0; i < n; i++) {
+			assert(total + iov[i].iov_len <= size);
+			memcpy(out + total, iov[i].iov_base, iov[i].iov_len);
+			total += iov[i].iov_len;
+			nbds_wrote(conn, iov[i].iov_len);
+		}
+	}
+	return total;
+}
+
+static void put32(char *p, uint32_t v) {
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static void put64(char *p, uint64_t v) {
+	put32(p, v >> 32);
+	put32(p + 4, v);
+}
+
+static size_t option(char *p, uint32_t opt, const char *data) {
+	size_t len = data ? strlen(data) : 0;
+
+	put64(p, 0x49484156454F5054ULL);
+	put32(p + 8, opt);
+	put32(p + 12, len);
+	memcpy(p + 16, data, len);
+	return 16 + len;
+}
+
+static size_t request(char *p, uint32_t type, uint64_t handle, uint64_t from, uint32_t len) {
+	put32(p, 0x25609513);
+	put32(p + 4, type);
+	memcpy(p + 8, &handle, 8);
+	put64(p + 16, from);
+	put32(p + 24, len);
+	return 28;
+}
+
+int main(void) {
+	NBDS_CONN *conn = nbds_new(NBDS_NEWSTYLE, 0, 0);
+	NBDS_EVENT ev;
+	char in[256];
+	char out[1024];
+	char data[8];
+	char cookie;
+	size_t len;
+
+	/* greeting: NBDMAGIC, IHAVEOPT, fixed newstyle and no zeroes */
+	count_assert(drain(conn, out, sizeof(out)) == 18);
+	count_assert(!memcmp(out, "NBDMAGIC", 8));
+	count_assert(out[17] == 3);
+	count_assert(nbds_next_event(conn, &ev) == NBDS_EV_NONE);
+
+	/* client flags (no zeroes), an unknown option, list, export */
+	put32(in, 2);
+	len = 4;
+	len += option(in + len, 42, NULL);
+	len += option(in + len, 3, NULL);
+	len += option(in + len, 1, "foo");
+	feed(conn, in, len);
+
+	count_assert(nbds_next_event(conn, &ev) == NBDS_EV_LIST);
+	count_assert(nbds_accept(conn, 4096, 0) == -1);
+	count_assert(nbds_list_export(conn, "foo") == 0);
+	count_assert(nbds_option_done(conn, 0) == 0);
+	count_assert(nbds_next_event(conn, &ev) == NBDS_EV_EXPORT);
+	count_assert(!strcmp(ev.name, "foo"));
+	count_assert(nbds_accept(conn, 4096, NBDS_FLAG_SEND_FLUSH) == 0);
+	/* unsupported (20), server (20 + 4 + 3), ack (20), export (8 + 2) */
+	count_assert(drain(conn, out, sizeof(out)) == 20 + 27 + 20 + 10);
+	count_assert(!memcmp(out + 20 + 24, "foo", 3));
+	count_assert(out[67 + 9] == (NBDS_FLAG_SEND_FLUSH | 1));
+
+	/* a write whose data comes in two parts, then a read */
+	len = request(in, 1 | (1 << 16), 7, 512, 8);
+	memcpy(in + len, "abcd", 4);
+	feed(conn, in, len + 4);
+	count_assert(nbds_next_event(conn, &ev) == NBDS_EV_REQUEST);
+	count_assert(ev.command == NBDS_CMD_WRITE && ev.flags == NBDS_CMD_FLAG_FUA);
+	count_assert(ev.handle == 7 && ev.offset == 512 && ev.length == 8);
+	count_assert(nbds_data_buffer(conn, data, sizeof(data)) == 0);
+	count_assert(nbds_next_event(conn, &ev) == NBDS_EV_NONE);
+	len = request(in + 4, 0, 8, 0, 8);
+	memcpy(in, "efgh", 4);
+	feed(conn, in, len + 4);
+	count_assert(nbds_next_event(conn, &ev) == NBDS_EV_DATA);
+	count_assert(ev.data == data && ev.offset == 512 && ev.length == 8);
+	count_assert(!memcmp(data, "abcdefgh", 8));
+	count_assert(nbds_next_event(conn, &ev) == NBDS_EV_REQUEST);
+	count_assert(ev.command == NBDS_CMD_READ && ev.handle == 8);
+
+	/* answer them the other way round; the read data is sent from our
+	 * buffer */
+	count_assert(nbds_reply(conn, 8, 0) == 0);
+	count_assert(nbds_send(conn, data, sizeof(data), &cookie) == 0);
+	count_assert(nbds_reply(conn, 7, 0) == 0);
+	count_assert(drain(conn, out, sizeof(out)) == 16 + 8 + 16);
+	count_assert(!memcmp(out + 16, "abcdefgh", 8));
+	count_assert(nbds_next_event(conn, &ev) == NBDS_EV_SENT && ev.cookie == &cookie);
+
+	/* a write that is refused, then disconnect */
+	len = request(in, 1, 9, 0, 8);
+	memcpy(in + len, "ijklmnop", 8);
+	len += 8;
+	len += request(in + len, 2, 10, 0, 0);
+	feed(conn, in, len);
+	count_assert(nbds_next_event(conn, &ev) == NBDS_EV_REQUEST && ev.handle == 9);
+	count_assert(nbds_discard(conn) == 0);
+	count_assert(nbds_next_event(conn, &ev) == NBDS_EV_REQUEST);
+	count_assert(ev.command == NBDS_CMD_DISC);
+	count_assert(nbds_next_event(conn, &ev) == NBDS_EV_NONE);
+	nbds_free(conn);
+
+	/* bad magic */
+	conn = nbds_new(NBDS_OLDSTYLE, 4096, 0);
+	count_assert(drain(conn, out, sizeof(out)) == 8 + 8 + 8 + 4 + 124);
+	memset(in, 0, 28);
+	feed(conn, in, 28);
+	count_assert(nbds_next_event(conn, &ev) == NBDS_EV_ERROR);
+	count_assert(nbds_next_event(conn, &ev) == NBDS_EV_NONE);
+	nbds_free(conn);
+	return 0;
+}
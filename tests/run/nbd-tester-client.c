@@ -26,6 +26,8 @@
 #include <stdbool.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
+#include <math.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -40,6 +42,7 @@
 
 #define MY_NAME "nbd-tester-client"
 #include "cliserv.h"
+#include "nbdclient.h"
 
 static gchar errstr[1024];
 const static int errstr_len=1023;
@@ -53,8 +56,6 @@ static gchar * transactionlog = "nbd-tester-client.tr";
 typedef enum {
 	CONNECTION_TYPE_NONE,
 	CONNECTION_TYPE_CONNECT,
-	CONNECTION_TYPE_INIT_PASSWD,
-	CONNECTION_TYPE_CLISERV,
 	CONNECTION_TYPE_FULL,
 } CONNECTION_TYPE;
 
@@ -340,10 +341,8 @@ int setup_connection(gchar *hostname, int port, gchar* name, CONNECTION_TYPE cty
 	int sock;
 	struct hostent *host;
 	struct sockaddr_in addr;
-	char buf[256];
-	uint64_t mymagic = (name ? opts_magic : cliserv_magic);
-	u64 tmp64;
-	uint32_t tmp32 = 0;
+	uint16_t flags;
+	int ret;
 
 	sock=0;
 	if(ctype<CONNECTION_TYPE_CONNECT)
@@ -364,53 +363,13 @@ int setup_connection(gchar *hostname, int port, gchar* name, CONNECTION_TYPE cty
 		strncpy(errstr, strerror(errno), errstr_len);
 		goto err_open;
 	}
-	if(ctype<CONNECTION_TYPE_INIT_PASSWD)
-		goto end;
-	READ_ALL_ERRCHK(sock, buf, strlen(INIT_PASSWD), err_open, "Could not read INIT_PASSWD: %s", strerror(errno));
-	if(strlen(buf)==0) {
-		snprintf(errstr, errstr_len, "Server closed connection");
-		goto err_open;
-	}
-	if(strncmp(buf, INIT_PASSWD, strlen(INIT_PASSWD))) {
-		snprintf(errstr, errstr_len, "INIT_PASSWD does not match");
-		goto err_open;
-	}
-	if(ctype<CONNECTION_TYPE_CLISERV)
-		goto end;
-	READ_ALL_ERRCHK(sock, &tmp64, sizeof(tmp64), err_open, "Could not read cliserv_magic: %s", strerror(errno));
-	tmp64=ntohll(tmp64);
-	if(tmp64 != mymagic) {
-		strncpy(errstr, "mymagic does not match", errstr_len);
-		goto err_open;
-	}
 	if(ctype<CONNECTION_TYPE_FULL)
 		goto end;
-	if(!name) {
-		READ_ALL_ERRCHK(sock, &size, sizeof(size), err_open, "Could not read size: %s", strerror(errno));
-		size=ntohll(size);
-		READ_ALL_ERRCHK(sock, buf, 128, err_open, "Could not read data: %s", strerror(errno));
-		goto end;
+	if((ret = nbdc_negotiate(sock, name, &size, &flags))) {
+		snprintf(errstr, errstr_len, "Negotiation failed: %s", nbdc_strerror(ret));
+		goto err_open;
 	}
-	/* flags */
-	READ_ALL_ERRCHK(sock, buf, sizeof(uint16_t), err_open, "Could not read reserved field: %s", strerror(errno));
-	/* reserved field */
-	WRITE_ALL_ERRCHK(sock, &tmp32, sizeof(tmp32), err_open, "Could not write reserved field: %s", strerror(errno));
-	/* magic */
-	tmp64 = htonll(opts_magic);
-	WRITE_ALL_ERRCHK(sock, &tmp64, sizeof(tmp64), err_open, "Could not write magic: %s", strerror(errno));
-	/* name */
-	tmp32 = htonl(NBD_OPT_EXPORT_NAME);
-	WRITE_ALL_ERRCHK(sock, &tmp32, sizeof(tmp32), err_open, "Could not write option: %s", strerror(errno));
-	tmp32 = htonl((uint32_t)strlen(name));
-	WRITE_ALL_ERRCHK(sock, &tmp32, sizeof(tmp32), err_open, "Could not write name length: %s", strerror(errno));
-	WRITE_ALL_ERRCHK(sock, name, strlen(name), err_open, "Could not write name:: %s", strerror(errno));
-	READ_ALL_ERRCHK(sock, &size, sizeof(size), err_open, "Could not read size: %s", strerror(errno));
-	size = ntohll(size);
-	uint16_t flags;
-	READ_ALL_ERRCHK(sock, &flags, sizeof(uint16_t), err_open, "Could not read flags: %s", strerror(errno));
-	flags = ntohs(flags);
 	*serverflags = flags;
-	READ_ALL_ERRCHK(sock, buf, 124, err_open, "Could not read reserved zeroes: %s", strerror(errno));
 	goto end;
 err_open:
 	close(sock);
@@ -710,6 +669,572 @@ err:
 	return retval;
 }
 
+#define BENCH_LAT_SUB 16	/**< latency buckets per power of two */
+#define BENCH_LAT_BUCKETS (61 * BENCH_LAT_SUB)
+#define BENCH_ZIPF_THETA 0.99	/**< skew of the zipfian distribution */
+
+typedef enum {
+	BENCH_SEQUENTIAL,
+	BENCH_RANDOM,
+	BENCH_ZIPF,
+} BENCH_PATTERN;
+
+static uint32_t bench_blocksize = 4096;
+static int bench_depth = 16;
+static int bench_conns = 1;
+static int bench_readpct = -1;	/**< -1: all reads, or all writes with -w */
+static BENCH_PATTERN bench_pattern = BENCH_RANDOM;
+static int bench_duration = 10;
+static gboolean bench_fua = FALSE;	/**< whether writes carry NBD_CMD_FLAG_FUA */
+
+/** constants of the zipfian distribution, see zipf_next() */
+static double zipf_zetan, zipf_alpha, zipf_eta;
+
+struct bench_slot {
+	uint64_t start;		/**< when the request was sent */
+	uint32_t type;
+};
+
+/**
+ * One connection of the benchmark. A sender and a receiver thread share
+ * it; the handle of a request is the number of its slot.
+ **/
+struct bench_conn {
+	int sock;
+	int n;
+	uint64_t nblocks;
+	uint64_t rng;
+	uint64_t next;		/**< next block, for sequential access */
+	struct bench_slot *slots;
+	int *freeslots;		/**< stack of free slots */
+	int nfree;
+	gboolean done;		/**< the sender has sent its last request */
+	gboolean failed;	/**< the receiver gave up */
+	uint64_t sent;
+	GMutex lock;		/**< protects freeslots, nfree, done, failed
+				  and sent */
+	GCond cond;		/**< signalled when a slot is freed, or when
+				  the receiver gives up */
+	uint64_t received;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t lat[BENCH_LAT_BUCKETS];
+	GThread *sender;
+	GThread *receiver;
+};
+
+static uint64_t bench_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64* */
+static inline uint64_t bench_rand(struct bench_conn *c) {
+	c->rng ^= c->rng >> 12;
+	c->rng ^= c->rng << 25;
+	c->rng ^= c->rng >> 27;
+	return c->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static void zipf_init(uint64_t n) {
+	double zeta2 = 1.0 + pow(0.5, BENCH_ZIPF_THETA);
+	uint64_t i;
+
+	zipf_zetan = 0;
+	for(i = 1; i <= n; i++)
+		zipf_zetan += 1.0 / pow((double)i, BENCH_ZIPF_THETA);
+	zipf_alpha = 1.0 / (1.0 - BENCH_ZIPF_THETA);
+	zipf_eta = (1.0 - pow(2.0 / n, 1.0 - BENCH_ZIPF_THETA)) / (1.0 - zeta2 / zipf_zetan);
+}
+
+/**
+ * Pick a block with a zipfian distribution, as in Gray et al., "Quickly
+ * generating billion-record synthetic databases". The popular blocks are
+ * scattered over the export rather than all at its start.
+ **/
+static uint64_t zipf_next(struct bench_conn *c) {
+	double u = (bench_rand(c) >> 11) * (1.0 / 9007199254740992.0);
+	double uz = u * zipf_zetan;
+	uint64_t rank;
+
+	if(uz < 1.0)
+		rank = 0;
+	else if(uz < 1.0 + pow(0.5, BENCH_ZIPF_THETA))
+		rank = 1;
+	else
+		rank = (uint64_t)(c->nblocks * pow(zipf_eta * u - zipf_eta + 1.0, zipf_alpha));
+	if(rank >= c->nblocks)
+		rank = c->nblocks - 1;
+	return (rank * 0x9e3779b97f4a7c15ULL) % c->nblocks;
+}
+
+static int bench_lat_bucket(uint64_t v) {
+	int e;
+
+	if(v < BENCH_LAT_SUB)
+		return v;
+	e = 63 - __builtin_clzll(v);
+	return (e - 3) * BENCH_LAT_SUB + ((v >> (e - 4)) & (BENCH_LAT_SUB - 1));
+}
+
+static uint64_t bench_lat_value(int bucket) {
+	int e;
+
+	if(bucket < BENCH_LAT_SUB)
+		return bucket;
+	e = bucket / BENCH_LAT_SUB + 3;
+	return (uint64_t)(BENCH_LAT_SUB + bucket % BENCH_LAT_SUB) << (e - 4);
+}
+
+static uint64_t bench_percentile(uint64_t *lat, uint64_t n, double pct) {
+	uint64_t want = (uint64_t)(pct * n / 100.0), seen = 0;
+	int b;
+
+	for(b = 0; b < BENCH_LAT_BUCKETS; b++) {
+		seen += lat[b];
+		if(seen > want)
+			return bench_lat_value(b);
+	}
+	return bench_lat_value(BENCH_LAT_BUCKETS - 1);
+}
+
+static gpointer bench_sender(gpointer data) {
+	struct bench_conn *c = data;
+	struct nbd_request req;
+	char *writebuf = g_malloc(bench_blocksize);
+	uint64_t end = bench_now() + (uint64_t)bench_duration * 1000000000ULL;
+	uint64_t block, slot;
+
+	memset(writebuf, 'X', bench_blocksize);
+	req.magic = htonl(NBD_REQUEST_MAGIC);
+	req.len = htonl(bench_blocksize);
+	while(bench_now() < end) {
+		g_mutex_lock(&c->lock);
+		while(!c->nfree && !c->failed)
+			g_cond_wait(&c->cond, &c->lock);
+		if(c->failed) {
+			g_mutex_unlock(&c->lock);
+			break;
+		}
+		slot = c->freeslots[--c->nfree];
+		g_mutex_unlock(&c->lock);
+
+		switch(bench_pattern) {
+		case BENCH_SEQUENTIAL:
+			block = c->next;
+			c->next = (c->next + 1) % c->nblocks;
+			break;
+		case BENCH_RANDOM:
+			block = bench_rand(c) % c->nblocks;
+			break;
+		default:
+			block = zipf_next(c);
+			break;
+		}
+		c->slots[slot].type = ((int)(bench_rand(c) % 100) < bench_readpct) ?
+			NBD_CMD_READ : NBD_CMD_WRITE;
+		req.type = c->slots[slot].type;
+		if(req.type == NBD_CMD_WRITE && bench_fua)
+			req.type |= NBD_CMD_FLAG_FUA;
+		req.type = htonl(req.type);
+		req.from = htonll(block * bench_blocksize);
+		memcpy(&(req.handle), &slot, sizeof(slot));
+		c->slots[slot].start = bench_now();
+		if(write_all(c->sock, &req, sizeof(req)) < 0
+		   || (c->slots[slot].type == NBD_CMD_WRITE
+		       && write_all(c->sock, writebuf, bench_blocksize) < 0)) {
+			/* wake up the receiver, which would otherwise
+			 * wait for replies that never come */
+			shutdown(c->sock, SHUT_RDWR);
+			break;
+		}
+		g_mutex_lock(&c->lock);
+		c->sent++;
+		g_mutex_unlock(&c->lock);
+	}
+	g_mutex_lock(&c->lock);
+	c->done = TRUE;
+	g_mutex_unlock(&c->lock);
+	/* the server closes the connection once it has replied to
+	 * everything, which wakes up the receiver if it is still waiting */
+	req.type = htonl(NBD_CMD_DISC);
+	req.from = 0;
+	req.len = 0;
+	write_all(c->sock, &req, sizeof(req));
+	g_free(writebuf);
+	return NULL;
+}
+
+static gpointer bench_receiver(gpointer data) {
+	struct bench_conn *c = data;
+	struct nbd_reply rep;
+	char *readbuf = g_malloc(bench_blocksize);
+	uint64_t slot, now;
+
+	for(;;) {
+		g_mutex_lock(&c->lock);
+		if(c->done && c->received == c->sent) {
+			g_mutex_unlock(&c->lock);
+			break;
+		}
+		g_mutex_unlock(&c->lock);
+		if(read_all(c->sock, &rep, sizeof(rep)) < 0)
+			goto fail;
+		memcpy(&slot, rep.handle, sizeof(slot));
+		if(ntohl(rep.magic) != NBD_REPLY_MAGIC || slot >= (uint64_t)bench_depth) {
+			snprintf(errstr, errstr_len, "Received a bad reply");
+			c->errors++;
+			goto fail;
+		}
+		if(rep.error)
+			c->errors++;
+		else if(c->slots[slot].type == NBD_CMD_READ
+			&& read_all(c->sock, readbuf, bench_blocksize) < 0)
+			goto fail;
+		now = bench_now();
+		c->lat[bench_lat_bucket(now - c->slots[slot].start)]++;
+		c->bytes += bench_blocksize;
+		c->received++;
+		g_mutex_lock(&c->lock);
+		c->freeslots[c->nfree++] = slot;
+		g_cond_signal(&c->cond);
+		g_mutex_unlock(&c->lock);
+	}
+	g_free(readbuf);
+	return NULL;
+fail:
+	/* no more slots come back; don't leave the sender waiting for one,
+	 * or blocked writing to a server that no longer reads */
+	shutdown(c->sock, SHUT_RDWR);
+	g_mutex_lock(&c->lock);
+	c->failed = TRUE;
+	g_cond_broadcast(&c->cond);
+	g_mutex_unlock(&c->lock);
+	g_free(readbuf);
+	return NULL;
+}
+
+int benchmark_test(gchar* hostname, int port, char* name, int sock,
+		   char sock_is_open, char close_sock, int testflags) {
+	struct bench_conn *conns = g_new0(struct bench_conn, bench_conns);
+	uint64_t lat[BENCH_LAT_BUCKETS];
+	uint64_t received = 0, bytes = 0, errors = 0, start, stop;
+	int serverflags = 0;
+	int retval = 0;
+	int i, j, b;
+	double timespan;
+
+	if(bench_readpct < 0)
+		bench_readpct = (testflags & TEST_WRITE) ? 0 : 100;
+	for(i = 0; i < bench_conns; i++)
+		conns[i].sock = -1;
+	for(i = 0; i < bench_conns; i++) {
+		if((conns[i].sock = setup_connection(hostname, port, name, CONNECTION_TYPE_FULL, &serverflags)) < 0) {
+			g_warning("Could not open socket: %s", errstr);
+			retval = -1;
+			goto err;
+		}
+	}
+	if(bench_readpct < 100 && (serverflags & NBD_FLAG_READ_ONLY)) {
+		snprintf(errstr, errstr_len, "Export is read-only, but the benchmark writes");
+		retval = -1;
+		goto err;
+	}
+	if(bench_fua && !(serverflags & NBD_FLAG_SEND_FUA)) {
+		snprintf(errstr, errstr_len, "Export does not support FUA");
+		retval = -1;
+		goto err;
+	}
+	if(size < bench_blocksize) {
+		snprintf(errstr, errstr_len, "Export is smaller than a block");
+		retval = -1;
+		goto err;
+	}
+	if(bench_pattern == BENCH_ZIPF)
+		zipf_init(size / bench_blocksize);
+	for(i = 0; i < bench_conns; i++) {
+		conns[i].n = i;
+		conns[i].nblocks = size / bench_blocksize;
+		conns[i].next = conns[i].nblocks * i / bench_conns;
+		conns[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+		conns[i].slots = g_new0(struct bench_slot, bench_depth);
+		conns[i].freeslots = g_new(int, bench_depth);
+		for(j = 0; j < bench_depth; j++)
+			conns[i].freeslots[j] = j;
+		conns[i].nfree = bench_depth;
+		g_mutex_init(&conns[i].lock);
+		g_cond_init(&conns[i].cond);
+	}
+
+	start = bench_now();
+	for(i = 0; i < bench_conns; i++) {
+		conns[i].receiver = g_thread_new("receiver", bench_receiver, &conns[i]);
+		conns[i].sender = g_thread_new("sender", bench_sender, &conns[i]);
+	}
+	for(i = 0; i < bench_conns; i++) {
+		g_thread_join(conns[i].sender);
+		g_thread_join(conns[i].receiver);
+	}
+	stop = bench_now();
+
+	memset(lat, 0, sizeof(lat));
+	for(i = 0; i < bench_conns; i++) {
+		received += conns[i].received;
+		bytes += conns[i].bytes;
+		errors += conns[i].errors;
+		if(conns[i].received != conns[i].sent)
+			errors++;
+		for(b = 0; b < BENCH_LAT_BUCKETS; b++)
+			lat[b] += conns[i].lat[b];
+	}
+	timespan = (stop - start) / 1e9;
+	g_message("%d: Benchmark of %d connection(s), depth %d, %u-byte blocks, %d%% reads, %s offsets: %llu requests in %.3f seconds, %.0f IOPS, %.3f MiB/s, latency p50 %.1f us, p99 %.1f us, p99.9 %.1f us",
+		  (int)getpid(), bench_conns, bench_depth, bench_blocksize, bench_readpct,
+		  bench_pattern == BENCH_SEQUENTIAL ? "sequential" : bench_pattern == BENCH_RANDOM ? "random" : "zipfian",
+		  (unsigned long long)received, timespan, received / timespan,
+		  bytes / timespan / (1024 * 1024),
+		  received ? bench_percentile(lat, received, 50) / 1000.0 : 0.0,
+		  received ? bench_percentile(lat, received, 99) / 1000.0 : 0.0,
+		  received ? bench_percentile(lat, received, 99.9) / 1000.0 : 0.0);
+	if(errors) {
+		snprintf(errstr, errstr_len, "%llu requests failed", (unsigned long long)errors);
+		retval = -1;
+	}
+
+err:
+	for(i = 0; i < bench_conns; i++) {
+		if(conns[i].sock >= 0)
+			close_connection(conns[i].sock, CONNECTION_CLOSE_FAST);
+		g_free(conns[i].slots);
+		g_free(conns[i].freeslots);
+	}
+	g_free(conns);
+	return retval;
+}
+
+/**
+ * The phases of setting up a connection that the connection benchmark
+ * times
+ **/
+typedef enum {
+	CONN_PHASE_TCP,		/**< the TCP connect() */
+	CONN_PHASE_GREETING,	/**< INIT_PASSWD, the magic and, for newstyle,
+				     the handshake flags */
+	CONN_PHASE_EXPORT,	/**< selecting the export (newstyle), and
+				     reading its size and flags */
+	CONN_PHASE_FIRSTREAD,	/**< the first read request */
+	CONN_PHASE_TOTAL,	/**< all of the above */
+	CONN_PHASE_COUNT,
+} CONN_PHASE;
+
+static const char *conn_phasenames[CONN_PHASE_COUNT] = { "connect", "greeting", "export", "first read", "total" };
+
+/**
+ * One thread of the connection benchmark, which sets up connections one
+ * after the other.
+ **/
+struct conn_worker {
+	struct sockaddr_in *addr;
+	char *name;		/**< the export, or NULL for oldstyle */
+	uint64_t end;		/**< when to stop */
+	uint64_t connects;	/**< number of connections that were set up */
+	uint64_t failures;	/**< number of connections that failed */
+	uint64_t lat[CONN_PHASE_COUNT][BENCH_LAT_BUCKETS];
+	uint64_t max[CONN_PHASE_COUNT];
+	GThread *thread;
+};
+
+/**
+ * Set up one connection, do a read on it, and disconnect.
+ *
+ * @param t [out] when each phase ended; t[0] is when we started
+ * @return 0 on success, -1 on failure
+ **/
+static int connect_once(struct conn_worker *w, uint64_t *t) {
+	char buf[256];
+	char *readbuf;
+	uint32_t len = bench_blocksize;
+	uint64_t magic = (w->name ? opts_magic : cliserv_magic);
+	uint64_t tmp64, exportsize;
+	uint32_t tmp32;
+	uint16_t tmp16;
+	size_t namelen;
+	struct nbd_request req;
+	struct nbd_reply rep;
+	int sock;
+	int retval = -1;
+
+	t[0] = bench_now();
+	if((sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+		return -1;
+	setmysockopt(sock);
+	if(connect(sock, (struct sockaddr *)w->addr, sizeof(*w->addr)) < 0)
+		goto out;
+	t[1] = bench_now();
+
+	if(read_all(sock, buf, strlen(INIT_PASSWD)) < 0
+	   || strncmp(buf, INIT_PASSWD, strlen(INIT_PASSWD)))
+		goto out;
+	if(read_all(sock, &tmp64, sizeof(tmp64)) < 0 || ntohll(tmp64) != magic)
+		goto out;
+	if(w->name && read_all(sock, &tmp16, sizeof(tmp16)) < 0)
+		goto out;
+	t[2] = bench_now();
+
+	if(w->name) {
+		/* our flags, and the option that selects the export, in
+		 * one go */
+		namelen = strlen(w->name);
+		if(namelen > sizeof(buf) - 20)
+			goto out;
+		tmp32 = 0;
+		memcpy(buf, &tmp32, sizeof(tmp32));
+		tmp64 = htonll(opts_magic);
+		memcpy(buf + 4, &tmp64, sizeof(tmp64));
+		tmp32 = htonl(NBD_OPT_EXPORT_NAME);
+		memcpy(buf + 12, &tmp32, sizeof(tmp32));
+		tmp32 = htonl((uint32_t)namelen);
+		memcpy(buf + 16, &tmp32, sizeof(tmp32));
+		memcpy(buf + 20, w->name, namelen);
+		if(write_all(sock, buf, 20 + namelen) < 0)
+			goto out;
+	}
+	if(read_all(sock, &exportsize, sizeof(exportsize)) < 0)
+		goto out;
+	exportsize = ntohll(exportsize);
+	/* flags and zeroes */
+	if(read_all(sock, buf, w->name ? 126 : 128) < 0)
+		goto out;
+	t[3] = bench_now();
+
+	if(exportsize < len)
+		len = exportsize;
+	readbuf = g_malloc(len);
+	req.magic = htonl(NBD_REQUEST_MAGIC);
+	req.type = htonl(NBD_CMD_READ);
+	memset(req.handle, 0, sizeof(req.handle));
+	req.from = 0;
+	req.len = htonl(len);
+	if(write_all(sock, &req, sizeof(req)) >= 0
+	   && read_all(sock, &rep, sizeof(rep)) >= 0
+	   && ntohl(rep.magic) == NBD_REPLY_MAGIC && !rep.error
+	   && read_all(sock, readbuf, len) >= 0) {
+		t[4] = bench_now();
+		retval = 0;
+	}
+	g_free(readbuf);
+	if(!retval) {
+		req.type = htonl(NBD_CMD_DISC);
+		req.len = 0;
+		write_all(sock, &req, sizeof(req));
+	}
+out:
+	close(sock);
+	return retval;
+}
+
+static gpointer conn_worker(gpointer data) {
+	struct conn_worker *w = data;
+	uint64_t t[CONN_PHASE_COUNT];
+	uint64_t lat;
+	int i;
+
+	while(bench_now() < w->end) {
+		if(connect_once(w, t) < 0) {
+			w->failures++;
+			continue;
+		}
+		for(i = 0; i < CONN_PHASE_COUNT; i++) {
+			if(i == CONN_PHASE_TOTAL)
+				lat = t[CONN_PHASE_TOTAL] - t[0];
+			else
+				lat = t[i + 1] - t[i];
+			w->lat[i][bench_lat_bucket(lat)]++;
+			if(lat > w->max[i])
+				w->max[i] = lat;
+		}
+		w->connects++;
+	}
+	return NULL;
+}
+
+/**
+ * Benchmark the setup of connections: as many connections as possible
+ * are set up in bench_duration seconds, bench_conns at a time, and
+ * every one of them does a single read of bench_blocksize bytes. With
+ * an export name, the newstyle handshake is used; without one,
+ * oldstyle.
+ **/
+int connect_test(gchar* hostname, int port, char* name, int sock,
+		 char sock_is_open, char close_sock, int testflags) {
+	struct conn_worker *workers = g_new0(struct conn_worker, bench_conns);
+	struct sockaddr_in addr;
+	struct hostent *host;
+	uint64_t lat[BENCH_LAT_BUCKETS];
+	uint64_t connects = 0, failures = 0, max, start, stop;
+	double timespan;
+	int retval = 0;
+	int i, p, b;
+
+	if(!(host = gethostbyname(hostname))) {
+		strncpy(errstr, hstrerror(h_errno), errstr_len);
+		g_free(workers);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = *((int *) host->h_addr);
+
+	start = bench_now();
+	for(i = 0; i < bench_conns; i++) {
+		workers[i].addr = &addr;
+		workers[i].name = name;
+		workers[i].end = start + (uint64_t)bench_duration * 1000000000ULL;
+		workers[i].thread = g_thread_new("connector", conn_worker, &workers[i]);
+	}
+	for(i = 0; i < bench_conns; i++) {
+		g_thread_join(workers[i].thread);
+		connects += workers[i].connects;
+		failures += workers[i].failures;
+	}
+	stop = bench_now();
+
+	timespan = (stop - start) / 1e9;
+	g_message("%d: Connection benchmark, %s, %d at a time: %llu connections in %.3f seconds, %.0f connects/s, %llu failed",
+		  (int)getpid(), name ? "newstyle" : "oldstyle", bench_conns,
+		  (unsigned long long)connects, timespan, connects / timespan,
+		  (unsigned long long)failures);
+	for(p = 0; p < CONN_PHASE_COUNT && connects; p++) {
+		memset(lat, 0, sizeof(lat));
+		max = 0;
+		for(i = 0; i < bench_conns; i++) {
+			for(b = 0; b < BENCH_LAT_BUCKETS; b++)
+				lat[b] += workers[i].lat[p][b];
+			if(workers[i].max[p] > max)
+				max = workers[i].max[p];
+		}
+		g_message("%d:   %-10s p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us",
+			  (int)getpid(), conn_phasenames[p],
+			  bench_percentile(lat, connects, 50) / 1000.0,
+			  bench_percentile(lat, connects, 90) / 1000.0,
+			  bench_percentile(lat, connects, 99) / 1000.0,
+			  bench_percentile(lat, connects, 99.9) / 1000.0,
+			  max / 1000.0);
+	}
+	if(!connects) {
+		snprintf(errstr, errstr_len, "No connection could be set up");
+		retval = -1;
+	} else if(failures) {
+		snprintf(errstr, errstr_len, "%llu connections failed", (unsigned long long)failures);
+		retval = -1;
+	}
+	g_free(workers);
+	return retval;
+}
+
 /*
  * fill 512 byte buffer 'buf' with a hashed selection of interesting data based
  * only on handle and blknum. The first word is blknum, and the second handle, for ease
@@ -1302,10 +1827,12 @@ int main(int argc, char**argv) {
 		g_message("%d: Not enough arguments", (int)getpid());
 		g_message("%d: Usage: %s <hostname> <port>", (int)getpid(), argv[0]);
 		g_message("%d: Or: %s <hostname> -N <exportname> [<port>]", (int)getpid(), argv[0]);
+		g_message("%d: Benchmark: %s -b [-B blocksize] [-Q depth] [-C connections] [-m readpercent] [-P sequential|random|zipf] [-D seconds] [-U] <hostname> ...", (int)getpid(), argv[0]);
+		g_message("%d: Connection benchmark: %s -c [-B blocksize] [-C concurrency] [-D seconds] <hostname> ...", (int)getpid(), argv[0]);
 		exit(EXIT_FAILURE);
 	}
 	logging();
-	while((c=getopt(argc, argv, "-N:Ft:owfil"))>=0) {
+	while((c=getopt(argc, argv, "-N:Ft:owfilbcB:Q:C:m:P:D:U"))>=0) {
 		switch(c) {
 			case 1:
 				handle_nonopt(optarg, &hostname, &p);
@@ -1337,12 +1864,53 @@ int main(int argc, char**argv) {
 			case 'i':
 				test=integrity_test;
 				break;
+			case 'b':
+				test=benchmark_test;
+				break;
+			case 'c':
+				test=connect_test;
+				break;
+			case 'B':
+				bench_blocksize=strtoul(optarg, NULL, 0);
+				break;
+			case 'Q':
+				bench_depth=strtol(optarg, NULL, 0);
+				break;
+			case 'C':
+				bench_conns=strtol(optarg, NULL, 0);
+				break;
+			case 'm':
+				bench_readpct=strtol(optarg, NULL, 0);
+				break;
+			case 'P':
+				if(!strcmp(optarg, "sequential")) {
+					bench_pattern=BENCH_SEQUENTIAL;
+				} else if(!strcmp(optarg, "random")) {
+					bench_pattern=BENCH_RANDOM;
+				} else if(!strcmp(optarg, "zipf")) {
+					bench_pattern=BENCH_ZIPF;
+				} else {
+					g_critical("Unknown access pattern %s", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'D':
+				bench_duration=strtol(optarg, NULL, 0);
+				break;
+			case 'U':
+				bench_fua=TRUE;
+				break;
 		}
 	}
 
 	while(optind < argc) {
 		handle_nonopt(argv[optind++], &hostname, &p);
 	}
+	if(bench_blocksize < 1 || bench_depth < 1 || bench_conns < 1
+	   || bench_readpct > 100 || bench_duration < 1) {
+		g_critical("Invalid benchmark parameters");
+		exit(EXIT_FAILURE);
+	}
 
 	if(test(hostname, (int)p, name, sock, FALSE, TRUE, testflags)<0) {
 		g_warning("Could not run test: %s", errstr);
@@ -0,0 +1,92 @@
+#include "config.h"
+
+#include <backend.h>
+#include <nbdsrv.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* A backend that nbd-server loads from a shared object: a single file,
+ * with pread() and pwrite(). Built with TEST_ABI set to something else
+ * than BACKEND_ABI, it is one that nbd-server must refuse to load. */
+
+#ifndef TEST_ABI
+#define TEST_ABI BACKEND_ABI
+#endif
+
+static int test_open(CLIENT *client, GError **err) {
+	struct stat st;
+	int fd;
+
+	if((fd = open(client->exportname, O_RDWR)) < 0 || fstat(fd, &st) < 0) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "Could not open exported file %s: %s",
+			    client->exportname, strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
+	client->exportsize = st.st_size;
+	client->backend_data = GINT_TO_POINTER(fd);
+	return 0;
+}
+
+static int test_read(CLIENT *client, off_t a, char *buf, size_t len) {
+	int fd = GPOINTER_TO_INT(client->backend_data);
+	ssize_t res;
+
+	while(len > 0) {
+		if((res = pread(fd, buf, len, a)) <= 0) {
+			if(!res)
+				errno = EIO;
+			return -1;
+		}
+		a += res;
+		buf += res;
+		len -= res;
+	}
+	return 0;
+}
+
+static int test_write(CLIENT *client, off_t a, char *buf, size_t len, int fua) {
+	int fd = GPOINTER_TO_INT(client->backend_data);
+	ssize_t res;
+
+	while(len > 0) {
+		if((res = pwrite(fd, buf, len, a)) < 0)
+			return -1;
+		a += res;
+		buf += res;
+		len -= res;
+	}
+	if(fua || (client->server->flags & F_SYNC))
+		return fdatasync(fd);
+	return 0;
+}
+
+static int test_flush(CLIENT *client) {
+	return fsync(GPOINTER_TO_INT(client->backend_data));
+}
+
+static void test_close(CLIENT *client) {
+	close(GPOINTER_TO_INT(client->backend_data));
+	client->backend_data = NULL;
+}
+
+const BACKEND nbd_backend = {
+	TEST_ABI,
+	"test",
+	TRUE,
+	test_open,
+	test_read,
+	test_write,
+	test_flush,
+	NULL,
+	NULL,
+	test_close,
+};
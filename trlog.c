@@ -0,0 +1,379 @@
+#include "config.h"
+#include "nbd-debug.h"
+
+#include <trlog.h>
+#include <nbdsrv.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define TRLOG_RING 16384	/**< number of records the ring buffer holds */
+#define TRLOG_FLUSH 1		/**< seconds after which the writer writes out
+				     what it has, even if that is not much */
+#define TRLOG_DATARING (16*1024*1024) /**< size of the ring buffer for
+					   payloads that are captured in
+					   full */
+
+struct _trlog {
+	int fd;			/**< the log file */
+	uint32_t connid;	/**< ID of the connection */
+	uint32_t exportid;	/**< ID of the export */
+	TRLOG_RECORD *ring;	/**< the ring buffer */
+	gint head;		/**< where the next record goes; only the
+				     connection's thread changes it */
+	gint tail;		/**< the oldest record that was not written
+				     yet; only the writer changes it */
+	uint64_t dropped;	/**< records dropped since the writer last
+				     looked */
+	uint64_t totaldropped;	/**< records dropped in total; the writer's */
+	GMutex lock;		/**< protects stop, and goes with cond */
+	GCond cond;		/**< signalled when the ring buffer is half
+				     full, or when we stop */
+	gboolean stop;		/**< tells the writer to exit */
+	GThread *writer;	/**< the writer thread */
+	TRLOG_PAYLOAD_MODE payload; /**< what we capture of writes */
+	int datafd;		/**< the data file, if we capture payloads in
+				     full */
+	char *data;		/**< the ring buffer for payloads */
+	uint64_t dhead;		/**< how much has been put in the ring
+				     buffer for payloads; only the
+				     connection's thread changes it */
+	uint64_t dtail;		/**< how much of that has been written to the
+				     data file; only the writer changes it */
+};
+
+uint32_t trlog_exportid(const gchar* name) {
+	uint32_t hash = 2166136261U;
+
+	for(; *name; name++) {
+		hash ^= (unsigned char)*name;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static uint64_t fnv1a64(const char *buf, size_t len) {
+	const unsigned char *p = (const unsigned char *)buf;
+	uint64_t hash = 14695981039346656037ULL;
+
+	while(len--) {
+		hash ^= *p++;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Write the payloads of the records between tail and head to the data
+ * file, and fill in where they went.
+ **/
+static void write_data(TRLOG *log, guint tail, guint n) {
+	struct iovec iov[2];
+	int niov = 0;
+	TRLOG_RECORD *rec;
+	uint64_t dtail = log->dtail;
+	uint64_t dend = dtail;
+	uint64_t first, wrap;
+	off_t base;
+	guint i;
+
+	/* the data file is shared with the other connections to the
+	 * export, so we need to know where our data ends up */
+	flock(log->datafd, LOCK_EX);
+	base = lseek(log->datafd, 0, SEEK_END);
+	for(i = 0; i < n; i++) {
+		rec = &log->ring[(tail + i) % TRLOG_RING];
+		if(rec->type != TRLOG_PAYLOAD)
+			continue;
+		/* until now, offset is where the data is in the ring
+		 * buffer, in host byte order */
+		dend = rec->offset + GUINT32_FROM_BE(rec->len);
+		rec->offset = GUINT64_TO_BE(base + (rec->offset - dtail));
+	}
+	if(dend != dtail) {
+		first = dtail % TRLOG_DATARING;
+		wrap = (first + (dend - dtail) > TRLOG_DATARING) ?
+			first + (dend - dtail) - TRLOG_DATARING : 0;
+		iov[niov].iov_base = log->data + first;
+		iov[niov++].iov_len = (dend - dtail) - wrap;
+		if(wrap) {
+			iov[niov].iov_base = log->data;
+			iov[niov++].iov_len = wrap;
+		}
+		if(writev(log->datafd, iov, niov) < 0)
+			DEBUG("Could not write transaction log data: %m");
+	}
+	flock(log->datafd, LOCK_UN);
+	__sync_fetch_and_add(&log->dtail, dend - dtail);
+}
+
+/**
+ * Write the records between tail and head as one block, after the
+ * payloads they refer to, if any.
+ *
+ * @return the number of records written
+ **/
+static int write_block(TRLOG *log) {
+	TRLOG_BLOCK hdr;
+	struct iovec iov[3];
+	int niov = 1;
+	guint head = g_atomic_int_get(&log->head);
+	guint tail = log->tail;
+	guint n = head - tail;
+	guint first, wrap;
+	uint64_t dropped;
+
+	dropped = __sync_fetch_and_add(&log->dropped, 0);
+	if(!n && !dropped)
+		return 0;
+	__sync_fetch_and_sub(&log->dropped, dropped);
+	log->totaldropped += dropped;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = GUINT32_TO_BE(TRLOG_MAGIC);
+	hdr.version = GUINT16_TO_BE(TRLOG_VERSION);
+	hdr.hdrlen = GUINT16_TO_BE(sizeof(hdr));
+	hdr.connid = GUINT32_TO_BE(log->connid);
+	hdr.exportid = GUINT32_TO_BE(log->exportid);
+	hdr.nrecords = GUINT32_TO_BE(n);
+	hdr.reclen = GUINT32_TO_BE(sizeof(TRLOG_RECORD));
+	hdr.dropped = GUINT64_TO_BE(dropped);
+	if(log->payload == TRLOG_PAYLOAD_FULL && n)
+		write_data(log, tail, n);
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+
+	first = tail % TRLOG_RING;
+	wrap = (first + n > TRLOG_RING) ? first + n - TRLOG_RING : 0;
+	if(n) {
+		iov[niov].iov_base = &log->ring[first];
+		iov[niov++].iov_len = (n - wrap) * sizeof(TRLOG_RECORD);
+	}
+	if(wrap) {
+		iov[niov].iov_base = log->ring;
+		iov[niov++].iov_len = wrap * sizeof(TRLOG_RECORD);
+	}
+	if(writev(log->fd, iov, niov) < 0)
+		DEBUG("Could not write transaction log: %m");
+	g_atomic_int_set(&log->tail, head);
+	return n;
+}
+
+static gpointer writer(gpointer data) {
+	TRLOG *log = data;
+	gboolean stop;
+	gint64 deadline;
+
+	for(;;) {
+		g_mutex_lock(&log->lock);
+		deadline = g_get_monotonic_time() + TRLOG_FLUSH * G_TIME_SPAN_SECOND;
+		while(!log->stop && (guint)(g_atomic_int_get(&log->head) - log->tail) < TRLOG_RING / 2
+		      && __sync_fetch_and_add(&log->dhead, 0) - log->dtail < TRLOG_DATARING / 2) {
+			if(!g_cond_wait_until(&log->cond, &log->lock, deadline))
+				break;
+		}
+		stop = log->stop;
+		g_mutex_unlock(&log->lock);
+		write_block(log);
+		if(stop) {
+			/* the connection has stopped adding records, so
+			 * this got all of them */
+			return NULL;
+		}
+	}
+}
+
+/**
+ * Claim the next slot of the ring buffer.
+ *
+ * @return the slot, or NULL if the ring buffer is full
+ **/
+static TRLOG_RECORD *next_record(TRLOG *log) {
+	guint head = log->head;
+
+	if(head - (guint)g_atomic_int_get(&log->tail) >= TRLOG_RING) {
+		__sync_fetch_and_add(&log->dropped, 1);
+		return NULL;
+	}
+	return &log->ring[head % TRLOG_RING];
+}
+
+static void wake_writer(TRLOG *log) {
+	g_mutex_lock(&log->lock);
+	g_cond_signal(&log->cond);
+	g_mutex_unlock(&log->lock);
+}
+
+/**
+ * Hand the slot that next_record() returned to the writer.
+ **/
+static void commit_record(TRLOG *log) {
+	guint head = log->head + 1;
+
+	g_atomic_int_set(&log->head, head);
+	/* only wake the writer once per half buffer, so that we don't
+	 * take the lock for every record */
+	if(head - (guint)g_atomic_int_get(&log->tail) == TRLOG_RING / 2)
+		wake_writer(log);
+}
+
+void trlog_request(TRLOG* log, uint32_t command, const char* handle, uint64_t offset, uint32_t len) {
+	TRLOG_RECORD *rec = next_record(log);
+
+	if(!rec)
+		return;
+	memset(rec, 0, sizeof(*rec));
+	rec->type = TRLOG_REQUEST;
+	rec->command = GUINT32_TO_BE(command);
+	rec->time = GUINT64_TO_BE(now_ns());
+	memcpy(rec->handle, handle, sizeof(rec->handle));
+	rec->offset = GUINT64_TO_BE(offset);
+	rec->len = GUINT32_TO_BE(len);
+	commit_record(log);
+}
+
+void trlog_payload(TRLOG* log, const char* handle, uint32_t pos, const char* buf, uint32_t len) {
+	TRLOG_RECORD *rec;
+	uint64_t dhead = log->dhead;
+	uint64_t dtail = __sync_fetch_and_add(&log->dtail, 0);
+	uint64_t first, part;
+
+	if(log->payload == TRLOG_PAYLOAD_NONE)
+		return;
+	if(log->payload == TRLOG_PAYLOAD_FULL && dhead + len - dtail > TRLOG_DATARING) {
+		__sync_fetch_and_add(&log->dropped, 1);
+		return;
+	}
+	if(!(rec = next_record(log)))
+		return;
+	memset(rec, 0, sizeof(*rec));
+	rec->type = TRLOG_PAYLOAD;
+	rec->command = GUINT32_TO_BE(log->payload);
+	rec->time = GUINT64_TO_BE(now_ns());
+	memcpy(rec->handle, handle, sizeof(rec->handle));
+	rec->len = GUINT32_TO_BE(len);
+	rec->aux = GUINT32_TO_BE(pos);
+	if(log->payload == TRLOG_PAYLOAD_FULL) {
+		first = dhead % TRLOG_DATARING;
+		part = (first + len > TRLOG_DATARING) ? TRLOG_DATARING - first : len;
+		memcpy(log->data + first, buf, part);
+		memcpy(log->data, buf + part, len - part);
+		/* the writer turns this into the offset in the data file */
+		rec->offset = dhead;
+		__sync_fetch_and_add(&log->dhead, len);
+	} else {
+		rec->offset = GUINT64_TO_BE(fnv1a64(buf, len));
+	}
+	commit_record(log);
+	if(dhead - dtail < TRLOG_DATARING / 2 && dhead + len - dtail >= TRLOG_DATARING / 2)
+		wake_writer(log);
+}
+
+void trlog_reply(TRLOG* log, const char* handle, uint32_t error) {
+	TRLOG_RECORD *rec = next_record(log);
+
+	if(!rec)
+		return;
+	memset(rec, 0, sizeof(*rec));
+	rec->type = TRLOG_REPLY;
+	rec->command = GUINT32_TO_BE(error);
+	rec->time = GUINT64_TO_BE(now_ns());
+	memcpy(rec->handle, handle, sizeof(rec->handle));
+	commit_record(log);
+}
+
+/**
+ * Log the start of the connection.
+ **/
+static void trlog_connect(TRLOG* log) {
+	TRLOG_RECORD *rec = next_record(log);
+
+	if(!rec)
+		return;
+	memset(rec, 0, sizeof(*rec));
+	rec->type = TRLOG_CONNECT;
+	rec->time = GUINT64_TO_BE(now_ns());
+	rec->offset = GUINT64_TO_BE(g_get_real_time());
+	commit_record(log);
+}
+
+TRLOG* trlog_open(const gchar* path, uint32_t connid, uint32_t exportid,
+		  TRLOG_PAYLOAD_MODE payload, GError** err) {
+	TRLOG *log = g_new0(TRLOG, 1);
+	gchar *datapath;
+
+	log->datafd = -1;
+	if((log->fd = open(path, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR)) < 0) {
+		g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+			    "Could not open transaction log %s: %s",
+			    path, strerror(errno));
+		goto err;
+	}
+	log->payload = payload;
+	if(payload == TRLOG_PAYLOAD_FULL) {
+		datapath = g_strdup_printf("%s.data", path);
+		log->datafd = open(datapath, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+		if(log->datafd < 0) {
+			g_set_error(err, NBDS_ERR, NBDS_ERR_SYS,
+				    "Could not open transaction log data file %s: %s",
+				    datapath, strerror(errno));
+			g_free(datapath);
+			goto err;
+		}
+		g_free(datapath);
+		log->data = g_malloc(TRLOG_DATARING);
+	}
+	log->connid = connid;
+	log->exportid = exportid;
+	log->ring = g_new0(TRLOG_RECORD, TRLOG_RING);
+	g_mutex_init(&log->lock);
+	g_cond_init(&log->cond);
+	if(!(log->writer = g_thread_try_new("trlog", writer, log, err)))
+		goto err;
+	trlog_connect(log);
+	return log;
+err:
+	if(log->fd >= 0)
+		close(log->fd);
+	if(log->datafd >= 0)
+		close(log->datafd);
+	g_free(log->ring);
+	g_free(log->data);
+	g_free(log);
+	return NULL;
+}
+
+uint64_t trlog_close(TRLOG* log) {
+	uint64_t dropped;
+
+	g_mutex_lock(&log->lock);
+	log->stop = TRUE;
+	g_cond_signal(&log->cond);
+	g_mutex_unlock(&log->lock);
+	g_thread_join(log->writer);
+	dropped = log->totaldropped;
+	close(log->fd);
+	if(log->datafd >= 0)
+		close(log->datafd);
+	g_free(log->data);
+	g_mutex_clear(&log->lock);
+	g_cond_clear(&log->cond);
+	g_free(log->ring);
+	g_free(log);
+	return dropped;
+}
@@ -0,0 +1,147 @@
+#ifndef TRLOG_H
+#define TRLOG_H
+
+#include <glib.h>
+#include <stdint.h>
+
+/**
+ * The format of the transaction log.
+ *
+ * A version 1 log holds the request and reply headers exactly as they
+ * went over the wire, so it starts with the request magic.
+ *
+ * A version 2 log is a sequence of blocks, each of which is a
+ * TRLOG_BLOCK followed by records. Every block is written with a single
+ * write to a file opened for appending, so that all connections to an
+ * export can share one log. All fields are in network byte order, as
+ * in the protocol; handles are copied verbatim.
+ *
+ * If write payloads are captured in full, they go to a separate data
+ * file, whose name is that of the log with ".data" appended. It holds
+ * nothing but payloads; the payload records in the log say where.
+ **/
+#define TRLOG_MAGIC 0x4e42544c	/**< "NBTL", at the start of every block */
+#define TRLOG_VERSION 2
+
+/**
+ * The header of a block of records
+ **/
+typedef struct {
+	uint32_t magic;		/**< TRLOG_MAGIC */
+	uint16_t version;	/**< TRLOG_VERSION */
+	uint16_t hdrlen;	/**< size of this header; the records follow it */
+	uint32_t connid;	/**< the connection the records are about */
+	uint32_t exportid;	/**< the export, see trlog_exportid() */
+	uint32_t nrecords;	/**< number of records in the block */
+	uint32_t reclen;	/**< size of a record */
+	uint64_t dropped;	/**< records of this connection that were
+				     dropped since the previous block, because
+				     the log could not keep up */
+} TRLOG_BLOCK;
+
+/** Types of records */
+typedef enum {
+	TRLOG_CONNECT = 1,	/**< a client connected; offset holds the wall
+				     clock time, in microseconds since the
+				     epoch, so that the monotonic times of the
+				     other records can be related to it */
+	TRLOG_REQUEST = 2,	/**< a request was received */
+	TRLOG_REPLY = 3,	/**< a request was done and replied to */
+	TRLOG_PAYLOAD = 4,	/**< (part of) the data of a write; follows
+				     the request */
+} TRLOG_TYPE;
+
+/** What is captured of the data of writes */
+typedef enum {
+	TRLOG_PAYLOAD_NONE = 0,	/**< nothing */
+	TRLOG_PAYLOAD_HASH = 1,	/**< its length and FNV-1a-64 hash */
+	TRLOG_PAYLOAD_FULL = 2,	/**< all of it, in the data file */
+} TRLOG_PAYLOAD_MODE;
+
+/**
+ * One record
+ **/
+typedef struct {
+	uint8_t type;		/**< a TRLOG_TYPE */
+	uint8_t reserved[3];
+	uint32_t command;	/**< request: the command with its flags;
+				     reply: the error; payload: the
+				     TRLOG_PAYLOAD_MODE */
+	uint64_t time;		/**< when it happened; CLOCK_MONOTONIC, in
+				     nanoseconds */
+	char handle[8];		/**< the handle of the request */
+	uint64_t offset;	/**< request: the offset; payload: the hash,
+				     or where the data is in the data file */
+	uint32_t len;		/**< request: the length; payload: the
+				     length of this part */
+	uint32_t aux;		/**< payload: where this part starts in
+				     the data of the request */
+} TRLOG_RECORD;
+
+typedef struct _trlog TRLOG;
+
+/**
+ * Get the ID under which an export appears in the log: a hash of its
+ * name, so that it is the same across restarts.
+ **/
+uint32_t trlog_exportid(const gchar* name);
+
+/**
+ * Open a transaction log, and start the thread that writes it.
+ *
+ * Records are put in a ring buffer in memory, which the writer thread
+ * empties into the file in large blocks. If the writer falls behind and
+ * the ring buffer fills up, records are dropped and counted rather than
+ * holding up the connection.
+ *
+ * Captured payloads get a ring buffer of their own, which the writer
+ * writes to the data file, in one go, before the block of records that
+ * refers to them. A payload that does not fit is dropped, and so is
+ * its record.
+ *
+ * @param path the file to append to
+ * @param connid the ID of the connection
+ * @param exportid the ID of the export
+ * @param payload what to capture of the data of writes
+ * @param err set if the log could not be opened
+ * @return the log, or NULL on failure
+ **/
+TRLOG* trlog_open(const gchar* path, uint32_t connid, uint32_t exportid,
+		  TRLOG_PAYLOAD_MODE payload, GError** err);
+
+/**
+ * Log a request.
+ *
+ * @param command the command with its flags
+ * @param handle the handle of the request
+ **/
+void trlog_request(TRLOG* log, uint32_t command, const char* handle, uint64_t offset, uint32_t len);
+
+/**
+ * Log (part of) the data of a write, if payloads are captured; call
+ * this after trlog_request().
+ *
+ * @param handle the handle of the request
+ * @param pos where this part starts in the data of the request
+ * @param buf the data
+ * @param len the length of this part
+ **/
+void trlog_payload(TRLOG* log, const char* handle, uint32_t pos, const char* buf, uint32_t len);
+
+/**
+ * Log a reply.
+ *
+ * @param handle the handle of the request
+ * @param error the error, in host byte order
+ **/
+void trlog_reply(TRLOG* log, const char* handle, uint32_t error);
+
+/**
+ * Write out what is still in the ring buffer, stop the writer thread,
+ * and close the log.
+ *
+ * @return the number of records that were dropped
+ **/
+uint64_t trlog_close(TRLOG* log);
+
+#endif //TRLOG_H